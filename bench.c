@@ -0,0 +1,442 @@
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "include/client.h"
+#include "include/protocol.h"
+
+/* Пауза между проверками состояния клиента, мс */
+#define BENCH_POLL                     (1)
+/* Пути номера точки трассировки входа в системный вызов */
+#define BENCH_TRACEPOINT "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id"
+#define BENCH_DEBUGFS "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+/* Шаблон личного каталога файлов кэша прогона */
+#define BENCH_RUNTIME "/tmp/psmd-bench.XXXXXX"
+
+/* Итог клиента, который процесс узла пишет в канал отчета */
+struct bench_record_t
+{
+    /* Клиент занял место до истечения срока */
+    int placed;
+    /* Время от создания клиента до IN_PROCESS, мкс */
+    unsigned long join;
+    /* Системные вызовы процесса, -1 - счетчик недоступен */
+    long syscalls;
+    /* Процессорное время процесса, мкс */
+    unsigned long cpu;
+};
+
+/* Узел - клиент в отдельном процессе, соседи и диспетчер
+    соединяются с ним настоящими сокетами через петлю */
+struct bench_node_t
+{
+    pid_t pid;
+    /* Канал отчета от узла и канал управления к узлу:
+        закрытие управления останавливает клиент */
+    int report, control;
+};
+
+/* Параметры и итоги прогона */
+struct bench_t
+{
+    unsigned int count, rounds;
+    /* Срок занятия места, мс */
+    unsigned int timeout;
+    /* Узлы работают на движке io_uring */
+    int uring;
+    struct bench_node_t *nodes;
+    /* Итоги подключений сценария */
+    unsigned long *joins;
+    unsigned int placed, failed;
+    /* Подключения, обслуженные нынешним диспетчером */
+    unsigned int served;
+    long syscalls;
+    unsigned long cpu;
+    /* Процессорное время диспетчера к его остановке */
+    unsigned long dispatchercpu;
+    /* Системные вызовы считаются во всех сценариях */
+    int counted;
+    /* Личный каталог кэша мест и адреса диспетчера: узлы получают
+        его через XDG_RUNTIME_DIR, поэтому чистка между сценариями
+        не трогает места других клиентов компьютера */
+    char runtime[sizeof(BENCH_RUNTIME)];
+};
+
+/* Открывает счетчик системных вызовов процесса и всех его
+    будущих нитей, возвращает -1, если точка трассировки
+    недоступна (нужны tracefs и права на perf) */
+static int bench_counter_open(void)
+{
+    struct perf_event_attr attr;
+    FILE *file;
+    int id;
+    if((file = fopen(BENCH_TRACEPOINT, "r")) == NULL &&
+        (file = fopen(BENCH_DEBUGFS, "r")) == NULL)
+            return -1;
+    if(fscanf(file, "%d", &id) != 1)
+        id = -1;
+    fclose(file);
+    if(id < 0)
+        return -1;
+    memset(&attr, 0, sizeof(struct perf_event_attr));
+    attr.size = sizeof(struct perf_event_attr);
+    attr.type = PERF_TYPE_TRACEPOINT;
+    attr.config = id;
+    attr.inherit = 1;
+    return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* Читает счетчик системных вызовов */
+static long bench_counter_read(int counter)
+{
+    long value;
+    if(counter < 0 || read(counter, &value, sizeof(long)) != sizeof(long))
+        return -1;
+    return value;
+}
+
+/* Процессорное время процесса, мкс */
+static unsigned long bench_cpu(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec)*1000000UL +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/* Тело процесса узла: создает клиент, ждет IN_PROCESS и пишет
+    итог, по закрытию канала управления пишет итог еще раз (для
+    диспетчера - за все время работы) и уничтожает клиент */
+static void bench_node(struct bench_t *bench, int report, int control)
+{
+    struct bench_record_t record;
+    struct client_t *client;
+    struct timespec pause;
+    unsigned long cpu, polls = 0;
+    long syscalls;
+    int counter;
+    char byte;
+    signal(SIGPIPE, SIG_IGN);
+    if(bench->uring)
+        engine_start(1);
+    pause.tv_sec = 0;
+    pause.tv_nsec = BENCH_POLL*1000000L;
+    memset(&record, 0, sizeof(struct bench_record_t));
+    counter = bench_counter_open();
+    syscalls = bench_counter_read(counter);
+    cpu = bench_cpu();
+    client = client_create();
+    while(client->state.state != IN_PROCESS &&
+        polls*BENCH_POLL < bench->timeout)
+    {
+        nanosleep(&pause, NULL);
+        polls++;
+    }
+    record.placed = client->state.state == IN_PROCESS;
+    record.join = client->stats.entered[IN_PROCESS];
+    record.cpu = bench_cpu() - cpu;
+    /* Свои паузы и чтение счетчика не относятся к подключению */
+    record.syscalls = syscalls < 0 ? -1 :
+        bench_counter_read(counter) - syscalls - (long)polls - 2;
+    if(write(report, &record, sizeof(record)) < 0)
+        _exit(EXIT_FAILURE);
+    while(read(control, &byte, 1) > 0);
+    record.cpu = bench_cpu() - cpu;
+    if(write(report, &record, sizeof(record)) < 0)
+        _exit(EXIT_FAILURE);
+    client_destroy(client);
+    engine_stop();
+    log_stop();
+    _exit(EXIT_SUCCESS);
+}
+
+/* Запускает узел i */
+static int bench_spawn(struct bench_t *bench, unsigned int i)
+{
+    int report[2], control[2], null;
+    struct bench_node_t *node = bench->nodes + i;
+    if(pipe(report) < 0)
+        return -1;
+    if(pipe(control) < 0)
+    {
+        close(report[0]);
+        close(report[1]);
+        return -1;
+    }
+    /* Недописанный отчет не должен повториться в ребенке */
+    fflush(stdout);
+    node->pid = fork();
+    if(node->pid == 0)
+    {
+        close(report[0]);
+        close(control[1]);
+        /* Журнал клиента не должен смешиваться с отчетом */
+        if((null = open("/dev/null", O_WRONLY)) >= 0)
+        {
+            dup2(null, STDOUT_FILENO);
+            close(null);
+        }
+        /* Каналы других узлов ребенку не нужны: иначе он
+            держал бы их управление открытым */
+        for(null=0; (unsigned int)null<bench->count; null++)
+            if((unsigned int)null != i && bench->nodes[null].pid > 0)
+            {
+                close(bench->nodes[null].report);
+                close(bench->nodes[null].control);
+            }
+        bench_node(bench, report[1], control[0]);
+    }
+    close(report[1]);
+    close(control[0]);
+    node->report = report[0];
+    node->control = control[1];
+    if(node->pid < 0)
+    {
+        close(node->report);
+        close(node->control);
+        return -1;
+    }
+    return 0;
+}
+
+/* Забирает итог подключения узла i */
+static void bench_collect(struct bench_t *bench, unsigned int i)
+{
+    struct bench_record_t record;
+    if(read(bench->nodes[i].report, &record, sizeof(record)) !=
+        sizeof(record) || !record.placed)
+    {
+        bench->failed++;
+        return;
+    }
+    bench->joins[bench->placed++] = record.join;
+    bench->served++;
+    bench->cpu += record.cpu;
+    if(record.syscalls < 0 || bench->syscalls < 0)
+        bench->syscalls = -1;
+    else
+        bench->syscalls += record.syscalls;
+}
+
+/* Останавливает узел i и ждет завершения его процесса */
+static void bench_stop(struct bench_t *bench, unsigned int i)
+{
+    struct bench_record_t record;
+    struct bench_node_t *node = bench->nodes + i;
+    if(node->pid <= 0)
+        return;
+    close(node->control);
+    /* Итог за все время работы нужен только от диспетчера */
+    if(read(node->report, &record, sizeof(record)) == sizeof(record) &&
+        i == 0)
+            bench->dispatchercpu = record.cpu;
+    close(node->report);
+    waitpid(node->pid, NULL, 0);
+    node->pid = 0;
+}
+
+/* Запускает клиенты с from до последнего залпом */
+static void bench_burst(struct bench_t *bench, unsigned int from)
+{
+    unsigned int i;
+    for(i=from; i<bench->count; i++)
+        bench_spawn(bench, i);
+    for(i=from; i<bench->count; i++)
+        if(bench->nodes[i].pid > 0)
+            bench_collect(bench, i);
+        else
+            bench->failed++;
+}
+
+/* Обнуляет итоги: подготовка сценария в них не входит */
+static void bench_reset(struct bench_t *bench)
+{
+    bench->placed = bench->failed = 0;
+    bench->syscalls = 0;
+    bench->cpu = 0;
+}
+
+/* Запускает диспетчер: он занимает место раньше всех, поэтому
+    в итог подключений не входит, а его время делится на все
+    подключения, которые он обслужил */
+static void bench_dispatcher(struct bench_t *bench)
+{
+    bench_spawn(bench, 0);
+    bench_collect(bench, 0);
+    bench_reset(bench);
+    bench->served = 0;
+}
+
+static int bench_order(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a;
+    unsigned long y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Значение, не меньше которого permille промилле подключений */
+static unsigned long bench_percentile(struct bench_t *bench,
+    unsigned int permille)
+{
+    unsigned long rank;
+    if(!bench->placed)
+        return 0;
+    rank = ((unsigned long)bench->placed*permille + 999)/1000;
+    return bench->joins[rank ? rank-1 : 0];
+}
+
+/* Выполняет сценарий name и печатает его итог объектом JSON */
+static void bench_scenario(struct bench_t *bench, const char *name,
+    int first)
+{
+    struct timespec started, finished;
+    unsigned int i, j;
+    /* Сценарий начинается без мест, оставшихся от прошлого
+        сценария; кэш в личном каталоге прогона */
+    place_cache_purge();
+    bench->dispatchercpu = 0;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    bench_dispatcher(bench);
+    if(strcmp(name, "sequential") == 0)
+        for(i=1; i<bench->count; i++)
+        {
+            if(bench_spawn(bench, i) == 0)
+                bench_collect(bench, i);
+            else
+                bench->failed++;
+        }
+    else if(strcmp(name, "burst") == 0)
+        bench_burst(bench, 1);
+    else if(strcmp(name, "churn") == 0)
+    {
+        /* Матрица собирается без учета, считаются только
+            возвраты: случайный клиент уходит и сразу
+            подключается заново, обычно возвращая место из кэша */
+        bench_burst(bench, 1);
+        bench_reset(bench);
+        for(j=0; j<bench->rounds; j++)
+        {
+            i = 1 + rand()%(bench->count-1);
+            bench_stop(bench, i);
+            if(bench_spawn(bench, i) == 0)
+                bench_collect(bench, i);
+            else
+                bench->failed++;
+        }
+    }
+    else
+    {
+        /* Диспетчер перезапускается, после чего вся матрица
+            собирается заново вокруг нового, а клиенты при этом
+            пробуют вернуть места из кэша */
+        bench_burst(bench, 1);
+        for(i=0; i<bench->count; i++)
+            bench_stop(bench, i);
+        bench_dispatcher(bench);
+        bench_burst(bench, 1);
+    }
+    for(i=0; i<bench->count; i++)
+        bench_stop(bench, i);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    qsort(bench->joins, bench->placed, sizeof(unsigned long), bench_order);
+    if(bench->syscalls < 0)
+        bench->counted = 0;
+    printf("%s    {\"name\": \"%s\", \"joins\": %u, \"failed\": %u, "
+        "\"p50_us\": %lu, \"p99_us\": %lu, \"p999_us\": %lu, "
+        "\"max_us\": %lu, ", first ? "" : ",\n", name,
+        bench->placed, bench->failed,
+        bench_percentile(bench, 500), bench_percentile(bench, 990),
+        bench_percentile(bench, 999), bench_percentile(bench, 1000));
+    if(bench->syscalls >= 0 && bench->placed)
+        printf("\"syscalls_per_join\": %.1f, ",
+            (double)bench->syscalls/bench->placed);
+    else
+        printf("\"syscalls_per_join\": null, ");
+    printf("\"cpu_us_per_node\": %.1f, \"dispatcher_cpu_us_per_join\": %.1f, "
+        "\"wall_us\": %ld}",
+        bench->placed ? (double)bench->cpu/bench->placed : 0.0,
+        bench->served ? (double)bench->dispatchercpu/bench->served : 0.0,
+        (finished.tv_sec - started.tv_sec)*1000000L +
+        (finished.tv_nsec - started.tv_nsec)/1000);
+    fflush(stdout);
+}
+
+/* Удаляет кэш прогона вместе с его каталогом, узлы уже завершены */
+static void bench_cleanup(struct bench_t *bench)
+{
+    char path[PLACE_PATH_SIZE];
+    place_cache_purge();
+    if(place_file_path(path, sizeof(path), DISCOVERY_CACHE) == 0)
+        unlink(path);
+    rmdir(bench->runtime);
+}
+
+int main(int argc, char *argv[])
+{
+    /* Нагрузочные сценарии подключения на настоящих сокетах
+        петли, каждый клиент в своем процессе:
+        ключ -n N задает количество клиентов (первый - диспетчер),
+        ключ -r N - количество уходов и возвратов в сценарии churn,
+        ключ -t мс - срок занятия места одним клиентом,
+        ключ -u переводит клиенты на движок io_uring,
+        ключ -s список через запятую выбирает сценарии из
+        sequential, burst, churn и restart (по умолчанию все);
+        итог печатается в JSON, задержки в микросекундах */
+    static const char *all[] = {"sequential", "burst", "churn", "restart"};
+    struct bench_t bench;
+    const char *only = NULL;
+    unsigned int i, first = 1;
+    int opt;
+    memset(&bench, 0, sizeof(struct bench_t));
+    bench.count = 32;
+    bench.rounds = 0;
+    bench.timeout = 10000;
+    bench.counted = 1;
+    while((opt = getopt(argc, argv, "n:r:t:us:")) != -1)
+    {
+        if(opt == 'n')
+            bench.count = atoi(optarg);
+        else if(opt == 'r')
+            bench.rounds = atoi(optarg);
+        else if(opt == 't')
+            bench.timeout = atoi(optarg);
+        else if(opt == 'u')
+            bench.uring = 1;
+        else if(opt == 's')
+            only = optarg;
+    }
+    if(bench.count < 2)
+        bench.count = 2;
+    if(!bench.rounds)
+        bench.rounds = bench.count;
+    /* Порядок уходов в churn повторяется от запуска к запуску */
+    srand(1);
+    strcpy(bench.runtime, BENCH_RUNTIME);
+    if(mkdtemp(bench.runtime) == NULL ||
+        setenv("XDG_RUNTIME_DIR", bench.runtime, 1) < 0)
+    {
+        fprintf(stderr, "Нет каталога для кэша мест: %s\n",
+            strerror(errno));
+        return EXIT_FAILURE;
+    }
+    bench.nodes = (struct bench_node_t *)calloc(bench.count,
+        sizeof(struct bench_node_t));
+    bench.joins = (unsigned long *)calloc(bench.count > bench.rounds ?
+        bench.count : bench.rounds, sizeof(unsigned long));
+    printf("{\n  \"nodes\": %u, \"uring\": %s, \"scenarios\": [\n",
+        bench.count, bench.uring ? "true" : "false");
+    for(i=0; i<sizeof(all)/sizeof(all[0]); i++)
+        if(only == NULL || strstr(only, all[i]) != NULL)
+        {
+            bench_scenario(&bench, all[i], first);
+            first = 0;
+        }
+    printf("\n  ],\n  \"syscalls_counted\": %s\n}\n",
+        bench.counted ? "true" : "false");
+    bench_cleanup(&bench);
+    free(bench.nodes);
+    free(bench.joins);
+    return EXIT_SUCCESS;
+}
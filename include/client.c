@@ -15,10 +15,13 @@
 
 struct client_t *client_create(void)
 {
-    int i;
-    struct client_t *client;
+    int i, enable = 1, simulated;
+    unsigned short port;
+    struct client_t *client, *local;
     struct sockaddr_in sa;
+    struct epoll_event ev;
     addr_data_t dispatcher_addr;
+    int pair[2];
     client = (struct client_t *)malloc(sizeof(struct client_t));
     /* Обнуляем структуру адреса */
     memset(&sa, 0, sizeof(struct sockaddr_in));
@@ -27,74 +30,202 @@ struct client_t *client_create(void)
     {
         client->slots[i].socket = -1;
         client->slots[i].status = SLOT_STATUS_FREE;
+        client->slots[i].op = NULL;
+        client->slots[i].connecting = 0;
+        client->slots[i].handshake = NO_HANDSHAKE;
+        client->slots[i].connop = NULL;
+        client->slots[i].link = NULL;
+        client->slots[i].parked = 0;
     }
+    pthread_mutex_init(&client->slotlock, NULL);
+    /* Если в процессе запущен движок io_uring, клиент
+        обслуживается одной из его нитей, а не собственными */
+    client->engine = engine_attach();
+    /* В симуляторе нет ни сети, ни собственных нитей клиента:
+        диспетчер и соседи соединяются только парами сокетов */
+    simulated = engine_simulated(client->engine);
+    client->acceptop = client->dialogop = NULL;
+    STREAM_RESET(&client->dialogstream);
+    /* Реактор соседей, слоты регистрируются в нем по мере занятия,
+        слотам на движке он не нужен */
+    client->epollfd = simulated ? -1 : epoll_create1(0);
+    /* Остановка будит нити клиента и диспетчера, в симуляторе их нет */
+    client->wakefd = simulated ? -1 : eventfd(0, EFD_CLOEXEC);
     /* Удаление от диспетчера отсутствует, т.к. клиент не занял
         слот в распределении */
     client->distance = INVALID_DISTANCE;
+    client->ring = 0;
+    client->anchor = INVALID_SLOT;
+    client->ipaddr = 0;
+    client->dispatcheraddr = 0;
+    /* Наследник диспетчера станет известен из диалога */
+    client->heiraddr = client->heirnet = 0;
+    client->heirport = 0;
+    client->standby = NULL;
+    client->failop = NULL;
+    client->failsock = -1;
+    client->reclaiming = 0;
+    client->receiver = NULL;
+    client->receiverctx = NULL;
+    client->collective = collective_create(client);
     client->netsdata = NULL;
     client->dispatcher = NULL;
-    /* Состояние выполнения протокола сброшено в начало */
+    /* Состояние выполнения протокола сброшено в начало,
+        отсюда же отсчитывается время рукопожатия */
+    stats_init(&client->stats);
     client->state.state = PROTOCOL_STARTED;
     client->state.attr = 0;
-    srand(time(NULL));
+    /* Прогон симулятора должен повторяться от запуска к запуску */
+    if(!simulated)
+        srand(time(NULL));
 
     /* Адрес клиента в сетях, в том числе localhost, и широковещательные адреса сетей */
     client->netsdata = client_prepare_netsdata(&client->netscount);
 
     /* Перед подключением к диспетчеру инициализируем сокет слушатель для TCP,
-        который будет собирать участок матрицы соединений для этого клиента */
-    client->listenerTCP = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    sa.sin_family = PF_INET;
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    do /* Выбираем порт, пока не наткнемся на свободный */
+        который будет собирать участок матрицы соединений для этого клиента;
+        в симуляторе порт только называется соседям, а кэша места нет,
+        чтобы каждый прогон начинался с чистого листа */
+    if(simulated)
+    {
+        client->listenerTCP = -1;
+        client->cache = NULL;
+        client->cachefd = -1;
+        client->portTCP = sim_port(client->engine->sim);
+    }
+    else
     {
-        client->portTCP = 10000+rand()%5000;
-        sa.sin_port = htons(client->portTCP);
-    }  /* Связываем сокет с портом, при неудаче генерируем порт заново */
-    while(bind(client->listenerTCP,
-        (struct sockaddr *)&sa, sizeof(struct sockaddr))<0);
-    /* Очередь ожидания на подключение */
-    listen(client->listenerTCP, 1);
+        client->listenerTCP = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sa.sin_family = PF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        /* Кэш места клиента в распределении, прежний порт слушателя
+            известен бывшим соседям, поэтому сначала пробуем его */
+        client->cache = place_cache_open(&client->cachefd);
+        port = client->cache != NULL ? client->cache->port : 0;
+        if(port)
+            setsockopt(client->listenerTCP, SOL_SOCKET, SO_REUSEADDR,
+                &enable, sizeof(int));
+        do /* Выбираем порт, пока не наткнемся на свободный */
+        {
+            client->portTCP = port ? port : 10000+rand()%5000;
+            port = 0;
+            sa.sin_port = htons(client->portTCP);
+        }  /* Связываем сокет с портом, при неудаче генерируем порт заново */
+        while(bind(client->listenerTCP,
+            (struct sockaddr *)&sa, sizeof(struct sockaddr))<0);
+        /* Очередь ожидания на подключение: при одновременном
+            подключении соседей лишние соединения иначе ждали бы
+            повтора SYN-ACK не меньше секунды */
+        listen(client->listenerTCP, SOMAXCONN);
+    }
 
     /* Подключаемся к диспетчеру */
     /* Инициализируем сокет для отправки сообщений диспетчеру по UDP */
-    client->sockUDP = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    client->sockUDP = simulated ? -1 :
+        socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
-    /* Ищем диспетчер в сети, если его нет, то либо он на этом
-        компьютере, либо его вообще нет, поэтому клиент пробует
-        инициализироваться, как диспетчер */
-    dispatcher_addr = client_wait_dispatcher_discover_anwer(client);
-    if(!dispatcher_addr)
-        client_dispatchering_init(client);
+    /* Если диспетчер работает в этом же процессе, то широковещательный
+        поиск не нужен. Иначе ищем диспетчер в сети, если его нет, то либо
+        он на этом компьютере, либо его вообще нет, поэтому клиент пробует
+        инициализироваться, как диспетчер; в симуляторе им без поиска
+        становится первый клиент */
+    dispatcher_addr = 0;
+    local = host_find_dispatcher();
+    if(local == NULL)
+    {
+        client->dispatcheraddr = dispatcher_addr = simulated ? 0 :
+            client_wait_dispatcher_discover_anwer(client);
+        if(!dispatcher_addr)
+            client_dispatchering_init(client);
+        /* Удаление диспетчера известно сразу: подтверждение от самого
+            себя может прийти раньше, чем клиент сообщит его ниже, и
+            тогда диспетчер искал бы место сам у себя */
+        if(client->dispatcher != NULL)
+        {
+            client->distance = 0;
+            local = client;
+        }
+    }
 
-    /* Инициализируем сокет для отправки сообщений диспетчеру по TCP */
-    client->sockTCP = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    sa.sin_family = PF_INET;
-    /* Используем адрес, который определен по UDP ответу от диспетчера
-        или, если ответ не был получен, используем LOOPBACK */
-    sa.sin_addr.s_addr = htonl(dispatcher_addr?dispatcher_addr:INADDR_LOOPBACK);
-    sa.sin_port = htons(DISPATCHER_PORT);
-    /* Соединяемся с диспетчером, даже если этот клиент и есть диспетчер */
-    connect(client->sockTCP, (struct sockaddr*)&sa, sizeof(struct sockaddr_in));
+    /* Диспетчер этого процесса на движке получает свой конец пары
+        сокетов прямо в своей нити, минуя стек TCP; чужой диспетчер
+        ищется заново под блокировкой реестра при постановке вызова,
+        так как найденный выше мог с тех пор начать уничтожаться */
+    client->sockTCP = -1;
+    if(client->engine != NULL && local != NULL &&
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0)
+    {
+        if(local == client)
+        {
+            engine_call(client->engine, client_dispatcher_engine_on_local,
+                client, NULL, pair[1]);
+            client->sockTCP = pair[0];
+        }
+        else if(host_call(0, 1, client_dispatcher_engine_on_local, NULL,
+            pair[1]) == 0)
+                client->sockTCP = pair[0];
+        else
+        {
+            close(pair[0]);
+            close(pair[1]);
+        }
+    }
+    /* Симулятор не выходит в настоящую сеть: без пары сокетов
+        клиент остается без диспетчера */
+    if(client->sockTCP < 0 && !simulated)
+    {
+        /* Инициализируем сокет для отправки сообщений диспетчеру по TCP */
+        client->sockTCP = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sa.sin_family = PF_INET;
+        /* Используем адрес, который определен по UDP ответу от диспетчера
+            или, если ответ не был получен, используем LOOPBACK */
+        sa.sin_addr.s_addr =
+            htonl(dispatcher_addr?dispatcher_addr:INADDR_LOOPBACK);
+        sa.sin_port = htons(DISPATCHER_PORT);
+        /* Соединяемся с диспетчером, даже если этот клиент и есть диспетчер */
+        connect(client->sockTCP, (struct sockaddr*)&sa,
+            sizeof(struct sockaddr_in));
+        client_set_keepalive(client->sockTCP);
+    }
 
-    /* Для одновременного запуска используем классическую схему n+1
-        Каждая нить проходит барьер синхронизации тогда, когда его
-        проходит главная нить */
-    pthread_barrier_init(&(client->starter), 0, 4);
-    /* Создаем нити чтения из сетевых сокетов */
-    pthread_create(&client->thrdTCP, NULL,
-        client_tcp_handler, client);
-    pthread_create(&client->thrdacceptor, NULL,
-        client_tcp_acceptor, client);
-    pthread_create(&client->thrddialog, NULL,
-        client_tcp_dialog, client);
-    /* Спускаем барьер старта всех нитей клиента */
-    pthread_barrier_wait(&(client->starter));
+    if(client->engine != NULL)
+    {
+        /* Прием соседей и диалог с диспетчером ставятся
+            многоразовыми операциями в очередь движка */
+        client->acceptop = engine_accept(client->engine, client->listenerTCP,
+            client_engine_on_accept, client);
+        client->dialogop = engine_recv(client->engine, client->sockTCP,
+            client_on_dialog_data, client, NULL);
+    }
+    else
+    {
+        /* Для одновременного запуска используем классическую схему n+1
+            Каждая нить проходит барьер синхронизации тогда, когда его
+            проходит главная нить */
+        pthread_barrier_init(&(client->starter), 0, 4);
+        /* Остановка приходит в реактор соседей событием
+            с нулевым контекстом */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(client->epollfd, EPOLL_CTL_ADD, client->wakefd, &ev);
+        /* Создаем нити чтения из сетевых сокетов */
+        pthread_create(&client->thrdTCP, NULL,
+            client_tcp_handler, client);
+        pthread_create(&client->thrdacceptor, NULL,
+            client_tcp_acceptor, client);
+        pthread_create(&client->thrddialog, NULL,
+            client_tcp_dialog, client);
+        /* Спускаем барьер старта всех нитей клиента */
+        pthread_barrier_wait(&(client->starter));
+    }
 
     /* Отправляем сообщение о том, что удаление 0, если клиент
         инициализовал себя, как диспетчер */
     if(client->dispatcher != NULL)
-        msg_connection_distance(client, client->distance = 0);
+        msg_connection_distance(client, client->distance);
+
+    /* Клиент доступен соседям из этого процесса */
+    host_register(client);
 
     return client;
 }
@@ -104,13 +235,127 @@ void client_destroy(struct client_t * client)
 {
     if(client == NULL)
         return;
+    /* На движке клиент исключается из реестра в своей нити: обработчик,
+        успевший застать его зарегистрированным и принять
+        диспетчеризацию, завершится раньше, чем client_stop
+        станет останавливать нити диспетчера */
+    if(client->engine != NULL)
+        engine_run(client->engine, client_engine_on_unregister, client,
+            NULL, -1);
+    else
+        host_unregister(client);
+    client_stop(client);
+    /* Обработчики клиента на движке выполняются в его нити,
+        поэтому и освобождение идет там, между ними */
+    if(client->engine != NULL)
+        engine_run(client->engine, client_engine_on_release, client,
+            NULL, -1);
+    else
+        client_release(client);
     close(client->listenerTCP);
-    client_dispatcher_release(client);
+    close(client->sockUDP);
+    close(client->epollfd);
+    close(client->wakefd);
+    collective_destroy(client->collective);
+    pthread_mutex_destroy(&client->slotlock);
     if(client->netsdata!=NULL)
         free(client->netsdata);
     free(client);
 }
 
+void client_stop(struct client_t *client)
+{
+    static const char one[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+    if(client->wakefd < 0)
+        return;
+    /* Счетчик eventfd никто не читает, поэтому каждая нить
+        увидит его при следующем ожидании */
+    if(write(client->wakefd, one, sizeof(one)) < 0)
+        return;
+    if(client->engine == NULL)
+    {
+        pthread_join(client->thrdTCP, NULL);
+        pthread_join(client->thrdacceptor, NULL);
+        pthread_join(client->thrddialog, NULL);
+        pthread_barrier_destroy(&client->starter);
+    }
+    /* У диспетчера в симуляторе нитей нет, с движком
+        остается только нить UDP */
+    if(client->dispatcher == NULL || client->dispatcher->sdUDP < 0)
+        return;
+    if(client->engine == NULL)
+    {
+        pthread_join(client->dispatcher->thrdTCP, NULL);
+        pthread_join(client->dispatcher->thrdacceptor, NULL);
+    }
+    pthread_join(client->dispatcher->thrdUDP, NULL);
+    pthread_barrier_destroy(&client->dispatcher->starter);
+}
+
+void client_release(struct client_t *client)
+{
+    unsigned int i;
+    /* Место остается в кэше для быстрого перезапуска, поэтому
+        кэш закрывается раньше, чем освобождение слотов его сотрет */
+    if(client->cache != NULL)
+    {
+        place_cache_touch(client->cache);
+        place_cache_close(client->cache, client->cachefd);
+        client->cache = NULL;
+    }
+    /* Снимаем операции движка до закрытия их сокетов */
+    engine_cancel(client->acceptop);
+    client->acceptop = NULL;
+    engine_cancel(client->dialogop);
+    client->dialogop = NULL;
+    engine_cancel(client->failop);
+    client->failop = NULL;
+    if(client->failsock >= 0)
+        close(client->failsock);
+    client->failsock = -1;
+    standby_destroy(client->standby);
+    client->standby = NULL;
+    /* Диалог закрывается первым: уходящий клиент не сообщает
+        диспетчеру о слотах, которые освобождает ниже */
+    close(client->sockTCP);
+    client->sockTCP = -1;
+    for(i=0; i<NUMBER_SLOTS; i++)
+        if(client->slots[i].status != SLOT_STATUS_FREE)
+            client_release_slot(client, i);
+    client_dispatcher_release(client);
+}
+
+int client_wait(struct client_t *client, int socket)
+{
+    struct pollfd fds[2];
+    int count;
+    fds[0].fd = socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = client->wakefd;
+    fds[1].events = POLLIN;
+    do
+        count = poll(fds, 2, -1);
+    while(count < 0 && errno == EINTR);
+    /* Остановка важнее данных: разбирать их уже некому */
+    if(count < 0 || fds[1].revents)
+        return -1;
+    return 0;
+}
+
+void client_set_state(struct client_t *client, unsigned int state)
+{
+    client->state.state = state;
+    stats_transition(&client->stats, state);
+    client_cache_sync(client);
+}
+
+void client_get_stats(struct client_t *client, struct client_stats_t *stats)
+{
+    memcpy(&stats->handshake, &client->stats, sizeof(struct stats_t));
+    stats_get_process(&stats->process);
+    outq_get_stats(&stats->queues);
+}
+
 addr_data_t client_get_ipaddr_by_netaddr(struct client_t *client,
     addr_data_t netaddr)
 {
@@ -137,7 +382,7 @@ addr_data_t client_get_netaddr_by_ipaddr(struct client_t *client,
             в результате получим 0 */
         if(((client->netsdata[i].ipaddr ^ ipaddr) &
             client->netsdata[i].netmask) == 0)
-                return client->netsdata[i].ipaddr;
+                return ipaddr & client->netsdata[i].netmask;
         i++;
     }
     return 0;
@@ -145,14 +390,16 @@ addr_data_t client_get_netaddr_by_ipaddr(struct client_t *client,
 
 addr_data_t client_wait_dispatcher_discover_anwer(struct client_t *client)
 {
-    int sdUDP;
+    int sdUDP, enable = 1;
+    unsigned int i;
+    long timeout, left, spent;
+    ssize_t size;
     dg_code_t code;
     struct sockaddr_in sa;
-    socklen_t *address_len=NULL;
-    fd_set rfds;
-    struct timeval tv;
-    /* Устанавливаем сообщение в 0, чтобы потом проверить */
-    code = 0;
+    socklen_t salen;
+    struct pollfd pfd;
+    struct timespec start, begin;
+    addr_data_t found = 0, cached;
     /* Инициализируем сокет, на который будем ждать ответ */
     sdUDP = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
     sa.sin_family = PF_INET;
@@ -168,92 +415,212 @@ addr_data_t client_wait_dispatcher_discover_anwer(struct client_t *client)
             диспетчер есть на этом компьютере */
         return 0;
     }
-    /* Инициализируем множество ожидания,
-        в данном случае только порт ответа */
-    FD_ZERO(&rfds);
-    FD_SET(sdUDP, &rfds);
-    /* Устанавливаем время ожидания ответа в микросекундах */
-    tv.tv_sec = 0;
-    tv.tv_usec = 50000;
-    /* Отсылаем широковещательное сообщение DISPATCHER_DISCOVER */
-    dg_dispatcher_discover(client);
-    /* Ждем ответ DISPATCHER_IM указанное время */
-    select(sdUDP+1, &rfds, NULL, NULL, &tv);
-    if(FD_ISSET(sdUDP, &rfds))
-    {
-        /* Ответ был получен */
-        recvfrom(sdUDP, &code, sizeof(dg_code_t), 0,
-            (struct sockaddr *)&sa, address_len);
+    cached = client_load_dispatcher_addr();
+    /* Спрашивать некого: сетей кроме lo: нет, а диспетчер на этом
+        компьютере уже нашелся бы по занятому порту */
+    if(!client->netscount && !cached)
+    {
+        close(sdUDP);
+        return 0;
+    }
+    /* Без этого флага ядро не выпускает широковещательные датаграммы */
+    setsockopt(client->sockUDP, SOL_SOCKET, SO_BROADCAST,
+        &enable, sizeof(int));
+    pfd.fd = sdUDP;
+    pfd.events = POLLIN;
+    /* Каждая попытка опрашивает последний известный диспетчер и
+        все сети компьютера, ожидание между попытками удваивается,
+        пока не выйдет общий срок, первый же DISPATCHER_IM
+        завершает поиск */
+    stats_now(&begin);
+    timeout = DISCOVERY_TIMEOUT;
+    while(!found &&
+        (spent = (long)stats_elapsed(&begin)/1000) < DISCOVERY_DEADLINE)
+    {
+        if(timeout > DISCOVERY_DEADLINE - spent)
+            timeout = DISCOVERY_DEADLINE - spent;
+        if(cached)
+            dg_dispatcher_discover(client, cached);
+        for(i=0; i<client->netscount; i++)
+            dg_dispatcher_discover(client, client->netsdata[i].broadaddr);
+        stats_now(&start);
+        while((left = timeout - (long)stats_elapsed(&start)/1000) > 0)
+        {
+            if((size = poll(&pfd, 1, left)) < 0 && errno == EINTR)
+                continue;
+            if(size <= 0)
+                break;
+            salen = sizeof(struct sockaddr_in);
+            size = recvfrom(sdUDP, &code, sizeof(dg_code_t), 0,
+                (struct sockaddr *)&sa, &salen);
+            code = (dg_code_t)msg_get((char *)&code, sizeof(dg_code_t));
+            /* Свои и чужие DISPATCHER_DISCOVER тоже приходят на этот
+                порт, их пропускаем и ждем дальше */
+            if(size == sizeof(dg_code_t) && code == DISPATCHER_IM)
+            {
+                /* Адрес диспетчера, представленный в обычном порядке */
+                found = ntohl(sa.sin_addr.s_addr);
+                break;
+            }
+        }
+        timeout *= 2;
     }
     close(sdUDP);
-    /* Проверяем является ли ответ сообщением DISPATCHER_IM */
-    if(code == DISPATCHER_IM)
-        /* Возвращаем адрес диспетчера, представленный в обычном порядке */
-        return ntohl(sa.sin_addr.s_addr);
-    /* Во всех прочих случаях считаем что ответа нет */
-    return 0;
+    if(found && found != cached)
+        client_store_dispatcher_addr(found);
+    return found;
+}
+
+addr_data_t client_load_dispatcher_addr(void)
+{
+    FILE *file;
+    char line[INET_ADDRSTRLEN], path[PLACE_PATH_SIZE];
+    struct in_addr addr;
+    addr_data_t retval = 0;
+    int fd;
+    if(place_file_path(path, sizeof(path), DISCOVERY_CACHE) < 0 ||
+        (fd = place_file_open(path, O_RDONLY)) < 0)
+            return 0;
+    if((file = fdopen(fd, "r")) == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+    if(fgets(line, sizeof(line), file) != NULL)
+    {
+        line[strcspn(line, "\n")] = '\0';
+        if(inet_aton(line, &addr))
+            retval = ntohl(addr.s_addr);
+    }
+    fclose(file);
+    return retval;
+}
+
+void client_store_dispatcher_addr(addr_data_t ipaddr)
+{
+    FILE *file;
+    char path[PLACE_PATH_SIZE];
+    struct in_addr addr;
+    int fd;
+    if(place_file_path(path, sizeof(path), DISCOVERY_CACHE) < 0 ||
+        (fd = place_file_open(path, O_WRONLY|O_CREAT)) < 0)
+            return;
+    /* Обрезаем только после проверки владельца */
+    if(ftruncate(fd, 0) < 0 || (file = fdopen(fd, "w")) == NULL)
+    {
+        close(fd);
+        return;
+    }
+    addr.s_addr = htonl(ipaddr);
+    fprintf(file, "%s\n", inet_ntoa(addr));
+    fclose(file);
 }
 
 void client_dispatchering_init(struct client_t *client)
 {
-    int bound;
+    int bound, enable = 1;
     int sdUDP, sdTCP;
     struct sockaddr_in sa;
+    struct epoll_event ev;
     if(client == NULL)
         return;
     client->dispatcher = NULL;
 
-    /* Инициализируем сокет диспетчера, чтобы слушать TCP */
-    sdTCP = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    sa.sin_family = PF_INET;
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    sa.sin_port = htons(DISPATCHER_PORT);
-    bound = bind(sdTCP, (struct sockaddr *)&sa, sizeof(struct sockaddr));
-    if(bound<0)
+    /* В симуляторе участники приходят парами сокетов, портов
+        диспетчера и поиска по UDP нет */
+    if(engine_simulated(client->engine))
+        sdTCP = sdUDP = -1;
+    else
     {
-        /* Порт диспетчера занят, значит он уже существует 
-            и располагается на этом компьютере */
-        close(sdTCP);
-        return;
-    }
-    /* Очередь ожидания на подключение */
-    listen(sdTCP, 1);
+        /* Инициализируем сокет диспетчера, чтобы слушать TCP */
+        sdTCP = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+        /* Соединения прежнего диспетчера могут ждать в TIME_WAIT,
+            перезапущенному диспетчеру они не мешают; живой
+            слушатель порт все равно не отдаст */
+        setsockopt(sdTCP, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+        sa.sin_family = PF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        sa.sin_port = htons(DISPATCHER_PORT);
+        bound = bind(sdTCP, (struct sockaddr *)&sa, sizeof(struct sockaddr));
+        if(bound<0)
+        {
+            /* Порт диспетчера занят, значит он уже существует 
+                и располагается на этом компьютере */
+            close(sdTCP);
+            return;
+        }
+        /* Очередь ожидания на подключение: клиенты залпа
+            подключаются к диспетчеру все сразу */
+        listen(sdTCP, SOMAXCONN);
 
-    /* Инициализируем сокет диспетчера, чтобы слушать UDP */
-    sdUDP = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    sa.sin_family = PF_INET;
-    sa.sin_addr.s_addr = htonl(INADDR_ANY);
-    sa.sin_port = htons(DISPATCHER_PORT);
-    /* Связываем сокет с портом */
-    bound = bind(sdUDP, (struct sockaddr *)&sa, sizeof(struct sockaddr));
-    if(bound<0)
-    {
-        /* Порт диспетчера занят, значит он уже существует 
-            и располагается на этом компьютере */
-        close(sdUDP);
-        return;
+        /* Инициализируем сокет диспетчера, чтобы слушать UDP */
+        sdUDP = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        sa.sin_family = PF_INET;
+        sa.sin_addr.s_addr = htonl(INADDR_ANY);
+        sa.sin_port = htons(DISPATCHER_PORT);
+        /* Связываем сокет с портом */
+        bound = bind(sdUDP, (struct sockaddr *)&sa, sizeof(struct sockaddr));
+        if(bound<0)
+        {
+            /* Порт диспетчера занят, значит он уже существует 
+                и располагается на этом компьютере */
+            close(sdUDP);
+            close(sdTCP);
+            return;
+        }
     }
 
     /* Создаем структуру диспетчера */
     client->dispatcher =
         (struct dispatcher_t *)malloc(sizeof(struct dispatcher_t));
-    /* Указываем, что список диспетчеризации пуст */
-    client->dispatcher->units = NULL;
-    FD_ZERO(&client->dispatcher->fds);
+    /* Указываем, что реестр диспетчеризации пуст */
+    registry_init(&client->dispatcher->units);
+    memset(client->dispatcher->rings, 0, sizeof(client->dispatcher->rings));
+    client->dispatcher->waiting = client->dispatcher->waitingtail = NULL;
+    client->dispatcher->waitingcount = client->dispatcher->waitingpeak = 0;
+    /* Очередь массовой рассылки, без io_uring рассылка
+        выполняется последовательными send */
+    uring_init(&client->dispatcher->fanout, URING_ENTRIES);
+    pthread_mutex_init(&client->dispatcher->fanoutlock, NULL);
+    /* Реактор участников диспетчеризации */
+    client->dispatcher->epollfd = epoll_create1(0);
     /* Инициализируем дескриптор отправки */
-    client->dispatcher->socketUDP = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    client->dispatcher->socketUDP = sdUDP < 0 ? -1 :
+        socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
     /* Регистрируем дескрипторы приема */
     client->dispatcher->sdTCP = sdTCP;
     client->dispatcher->sdUDP = sdUDP;
+    client->dispatcher->acceptop = NULL;
+    /* Наследника нет, пока кольцо 1 пусто */
+    client->dispatcher->heir = NULL;
+    client->dispatcher->heiraddr = 0;
+    client->dispatcher->heirport = 0;
+    client->dispatcher->mirror = NULL;
+    /* Принимать и искать в симуляторе нечего, нити не нужны */
+    if(sdUDP < 0)
+        return;
     /* Для одновременного запуска используем классическую схему n+1
         Каждая нить проходит барьер синхронизации тогда, когда его
-        проходит главная нить */
-    pthread_barrier_init(&(client->dispatcher->starter), 0, 4);
+        проходит главная нить, с движком io_uring остается только UDP */
+    pthread_barrier_init(&(client->dispatcher->starter), 0,
+        client->engine != NULL ? 2 : 4);
     /* Создаем нити чтения из сетевых сокетов */
-    pthread_create(&client->dispatcher->thrdTCP, NULL,
-        client_dispatcher_tcp_handler, client);
-    pthread_create(&client->dispatcher->thrdacceptor, NULL,
-        client_dispatcher_tcp_acceptor, client);
+    if(client->engine != NULL)
+        client->dispatcher->acceptop = engine_accept(client->engine, sdTCP,
+            client_dispatcher_engine_on_accept, client);
+    else
+    {
+        /* Остановка приходит в реактор диспетчера событием
+            с нулевым контекстом */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        epoll_ctl(client->dispatcher->epollfd, EPOLL_CTL_ADD, client->wakefd,
+            &ev);
+        pthread_create(&client->dispatcher->thrdTCP, NULL,
+            client_dispatcher_tcp_handler, client);
+        pthread_create(&client->dispatcher->thrdacceptor, NULL,
+            client_dispatcher_tcp_acceptor, client);
+    }
     pthread_create(&client->dispatcher->thrdUDP, NULL,
         client_dispatcher_udp_handler, client);
     /* Спускаем барьер старта всех нитей клиента */
@@ -262,20 +629,251 @@ void client_dispatchering_init(struct client_t *client)
 
 void client_dispatcher_release(struct client_t *client)
 {
+    struct unit_t *unit;
+    unsigned int epoch;
+    int socket;
     if(client->dispatcher != NULL)
     {
-        /* Остановка нитей */
+        /* Нити диспетчера уже остановлены client_stop,
+            остается снять прием движка */
+        engine_cancel(client->dispatcher->acceptop);
+        client->dispatcher->acceptop = NULL;
+        /* Отключаем всех участников; удаление меняет реестр,
+            поэтому каждый раз берем первую запись заново */
+        do
+        {
+            epoch = registry_read_lock(&client->dispatcher->units);
+            unit = registry_next(&client->dispatcher->units, NULL);
+            socket = unit != NULL ? unit->socket : -1;
+            registry_read_unlock(&client->dispatcher->units, epoch);
+            if(socket >= 0)
+                client_dispatcher_remove_unit(client, socket);
+        }
+        while(socket >= 0);
         /* Закрытие сокета отправки */
         close(client->dispatcher->socketUDP);
         /* Освобождение портов диспетчирезации и закрытие
             сокетов приема */
         close(client->dispatcher->sdUDP);
         close(client->dispatcher->sdTCP);
+        close(client->dispatcher->epollfd);
+        registry_destroy(&client->dispatcher->units);
+        standby_destroy(client->dispatcher->mirror);
+        uring_release(&client->dispatcher->fanout);
+        pthread_mutex_destroy(&client->dispatcher->fanoutlock);
     }
     free(client->dispatcher);
     client->dispatcher = NULL;
 }
 
+int client_dispatcher_takeover(struct client_t *client)
+{
+    client_dispatchering_init(client);
+    if(client->dispatcher == NULL)
+        return -1;
+    /* Сеть диспетчеризации наследуется, иначе участники с других
+        компьютеров получили бы от наследника адрес петли */
+    client->dispatcher->netaddr = client->heirnet;
+    /* Зеркало становится списком участников, которые должны вернуться */
+    client->dispatcher->mirror = client->standby;
+    client->standby = NULL;
+    client->dispatcheraddr = 0;
+    host_promote(client);
+    LOG_DEBUG(("call: client_dispatcher_takeover(%p, expected:%d)\n",
+        (void *)client, client->dispatcher->mirror != NULL ?
+            client->dispatcher->mirror->count : 0));
+    return 0;
+}
+
+int client_failover(struct client_t *client)
+{
+    struct pollfd pfd;
+    /* Соединение с прежним диспетчером больше не нужно */
+    engine_cancel(client->dialogop);
+    client->dialogop = NULL;
+    close(client->sockTCP);
+    client->sockTCP = -1;
+    /* Незавершенная попытка прежнего переподключения снимается */
+    engine_cancel(client->failop);
+    client->failop = NULL;
+    if(client->failsock >= 0)
+        close(client->failsock);
+    client->failsock = -1;
+    if(!client->heirport)
+        return -1;
+    LOG_DEBUG(("call: client_failover(%p, heir port:%d)\n", (void *)client,
+        client->heirport));
+    stats_now(&client->failstarted);
+    if(client->engine != NULL)
+    {
+        /* Первая попытка сразу, следующие - по таймеру движка */
+        client_failover_next(client);
+        return 0;
+    }
+    /* Нить диалога сама выжидает промежуток между попытками,
+        остановка клиента прерывает ожидание */
+    pfd.fd = client->wakefd;
+    pfd.events = POLLIN;
+    while(client_failover_attempt(client) < 0)
+        if(stats_elapsed(&client->failstarted)/1000 >= FAILOVER_TIMEOUT ||
+            poll(&pfd, 1, FAILOVER_RETRY) != 0)
+                return -1;
+    return 0;
+}
+
+int client_failover_attempt(struct client_t *client)
+{
+    int sd, pair[2];
+    /* Уничтожаемый клиент уже исключен из реестра процесса: его
+        освобождение стоит в очереди движка, и принимать
+        диспетчеризацию или переподключаться ему нельзя */
+    if(host_find_client(client->portTCP) != client)
+        return -1;
+    /* Наследник сначала сам принимает диспетчеризацию: порт
+        прежнего диспетчера из этого же процесса может еще
+        не освободиться */
+    if(client_is_heir(client) && client->dispatcher == NULL &&
+        client_dispatcher_takeover(client) < 0)
+            return -1;
+    sd = -1;
+    if(client_is_host_addr(client, client->heiraddr) &&
+        host_find_client(client->heirport) != NULL)
+    {
+        /* Наследник из этого процесса принимает участников только
+            после того, как занял место диспетчера, на движке - свой
+            конец пары сокетов прямо в своей нити, как и при создании */
+        if(host_find_dispatcher() != host_find_client(client->heirport))
+            return -1;
+        if(client->engine != NULL &&
+            socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0)
+        {
+            if(host_call(client->heirport, 1,
+                client_dispatcher_engine_on_local, NULL, pair[1]) == 0)
+                    sd = pair[0];
+            else
+            {
+                close(pair[0]);
+                close(pair[1]);
+            }
+        }
+    }
+    if(sd < 0 && engine_simulated(client->engine))
+        return -1;
+    /* Нить движка подключения не ждет: сокет остается в
+        failsock, исход придет готовностью к записи */
+    if(sd < 0 && client->engine != NULL)
+    {
+        client->failsock = client_dialog_connect_start(client->heiraddr);
+        return client->failsock < 0 ? -1 : 1;
+    }
+    if(sd < 0 && (sd = client_dialog_connect(client->heiraddr)) < 0)
+        return -1;
+    client_failover_attach(client, sd);
+    return 0;
+}
+
+void client_failover_next(struct client_t *client)
+{
+    int result = client_failover_attempt(client);
+    if(result > 0)
+        client->failop = engine_poll_timeout(client->engine,
+            client->failsock, client_engine_on_failover_connect, client,
+            FAILOVER_RETRY);
+    else if(result < 0 &&
+        stats_elapsed(&client->failstarted)/1000 < FAILOVER_TIMEOUT)
+            client->failop = engine_timer(client->engine,
+                client_engine_on_failover, client, FAILOVER_RETRY);
+}
+
+void client_failover_attach(struct client_t *client, int sd)
+{
+    client->sockTCP = sd;
+    STREAM_RESET(&client->dialogstream);
+    client_set_keepalive(sd);
+    if(client->engine != NULL)
+        client->dialogop = engine_recv(client->engine, sd,
+            client_on_dialog_data, client, NULL);
+    LOG_DEBUG(("call: client_failover_attempt(%p, reattached:%ld us)\n",
+        (void *)client, stats_elapsed(&client->failstarted)));
+    /* Наследник узнает участника по сообщению удаления; поиск
+        места не повторяется: прежний диспетчер мог успеть передать
+        его якорю, и второй якорь поставил бы клиента дважды */
+    if(client->state.state == IN_PROCESS)
+        msg_connection_distance(client, client->distance);
+}
+
+int client_dialog_connect(addr_data_t ipaddr)
+{
+    struct pollfd pfd;
+    int sd;
+    sd = client_dialog_connect_start(ipaddr);
+    if(sd < 0)
+        return -1;
+    /* Нить диалога ждет не дольше промежутка между попытками */
+    pfd.fd = sd;
+    pfd.events = POLLOUT;
+    if(poll(&pfd, 1, FAILOVER_RETRY) <= 0 ||
+        client_dialog_connect_finish(sd) < 0)
+    {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+int client_dialog_connect_start(addr_data_t ipaddr)
+{
+    struct sockaddr_in sa;
+    int sd;
+    sd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(sd < 0)
+        return -1;
+    memset(&sa, 0, sizeof(struct sockaddr_in));
+    sa.sin_family = PF_INET;
+    sa.sin_addr.s_addr = htonl(ipaddr ? ipaddr : INADDR_LOOPBACK);
+    sa.sin_port = htons(DISPATCHER_PORT);
+    if(connect(sd, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0 &&
+        errno != EINPROGRESS)
+    {
+        close(sd);
+        return -1;
+    }
+    return sd;
+}
+
+int client_dialog_connect_finish(int sd)
+{
+    struct sockaddr_in sa;
+    int error = 0, off = 0;
+    socklen_t len = sizeof(int);
+    /* Есть адрес диспетчера - соединение установлено */
+    if(getsockopt(sd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error)
+        return -1;
+    len = sizeof(struct sockaddr_in);
+    if(getpeername(sd, (struct sockaddr *)&sa, &len) < 0)
+        return -1;
+    /* Диалог, как и при создании клиента, ведется блокирующим сокетом */
+    ioctl(sd, FIONBIO, &off);
+    return 0;
+}
+
+int client_is_heir(struct client_t *client)
+{
+    return client->heirport && client->heirport == client->portTCP &&
+        client_is_host_addr(client, client->heiraddr);
+}
+
+void client_set_keepalive(int socket)
+{
+    int enable = 1, idle = FAILOVER_KEEPIDLE, interval = FAILOVER_KEEPINTVL,
+        count = FAILOVER_KEEPCNT;
+    /* Для пары сокетов параметров нет, ошибку не проверяем */
+    setsockopt(socket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(int));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(int));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(int));
+    setsockopt(socket, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(int));
+}
+
 struct net_data_t *client_prepare_netsdata(unsigned char * count)
 {
     int i, idx, n, sock;
@@ -321,7 +919,7 @@ struct net_data_t *client_prepare_netsdata(unsigned char * count)
         ioctl(sock, SIOCGIFADDR, &ifr[i]);
         sa = (struct sockaddr_in*)&ifr[i].ifr_addr;
         /* Если текущий интерфейс не lo: */
-        if(sa->sin_addr.s_addr != IPADDR_LOCALHOST)
+        if(ntohl(sa->sin_addr.s_addr) != IPADDR_LOCALHOST)
         {
             /* Записываем адрес компьютера в не локальной сети */
             result[idx].ipaddr = ntohl(sa->sin_addr.s_addr);
@@ -360,207 +958,909 @@ unsigned int client_has_free_slot(struct client_t *client)
     return retval;
 }
 
-void client_connect_to_client(struct client_t *client, unsigned int slotid,
-    addr_data_t ipaddr, unsigned short port)
+int client_slot_owned(struct client_t *client, unsigned int slotid)
+{
+    unsigned int outward;
+    /* Диспетчер в центре дает места во всех слотах */
+    if(!client->distance)
+        return 1;
+    if(client->anchor >= NUMBER_SLOTS)
+        return 0;
+    /* Середина кольца дает место только напротив якоря, угол -
+        еще и в двух соседних с этим слотах */
+    outward = OPPOSITE_POSITION(client->anchor);
+    if(slotid == outward)
+        return 1;
+    return (client->anchor & 1) && (slotid == (outward + 1) % NUMBER_SLOTS ||
+        slotid == (outward + NUMBER_SLOTS - 1) % NUMBER_SLOTS);
+}
+
+unsigned int client_has_place_slot(struct client_t *client)
+{
+    unsigned int i;
+    for(i=0; i<NUMBER_SLOTS; i++)
+        if(client->slots[i].status == SLOT_STATUS_FREE &&
+            client_slot_owned(client, i))
+                return i;
+    return INVALID_SLOT;
+}
+
+int client_slot_unpark(struct client_t *client, unsigned int position)
+{
+    unsigned int slotid;
+    if(client->slots[position].status == SLOT_STATUS_FREE)
+        return 1;
+    if(!client->slots[position].parked ||
+        (slotid = client_has_free_slot(client)) == INVALID_SLOT)
+            return 0;
+    client_slots_swap(client, position, slotid);
+    return 1;
+}
+
+unsigned int client_place_slots(struct client_t *client)
 {
-    int sock;
+    unsigned int i, count = 0;
+    for(i=0; i<NUMBER_SLOTS; i++)
+        if(client->slots[i].status == SLOT_STATUS_FREE &&
+            client_slot_owned(client, i))
+                count++;
+    return count;
+}
+
+int client_connect_to_client(struct client_t *client, unsigned int slotid,
+    addr_data_t ipaddr, unsigned short port, int handshake)
+{
+    int sock, pair[2];
     struct sockaddr_in sa;
+    struct slot_t *slot = client->slots + slotid;
+    struct local_peer_t *peer;
+    /* Сосед из этого же процесса на движке получает свой конец
+        пары сокетов прямо в своей нити, минуя стек TCP; вызов
+        ставится через реестр процесса, иначе сосед, который
+        как раз уничтожается, получил бы его после освобождения */
+    if(client->engine != NULL && client_is_host_addr(client, ipaddr) &&
+        host_find_client(port) != NULL &&
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0)
+    {
+        peer = (struct local_peer_t *)malloc(sizeof(struct local_peer_t));
+        if(peer != NULL)
+        {
+            peer->ipaddr = client->ipaddr;
+            peer->port = client->portTCP;
+            if(host_call(port, 0, client_engine_on_local, peer,
+                pair[1]) == 0)
+            {
+                pthread_mutex_lock(&client->slotlock);
+                slot->connecting = 0;
+                slot->handshake = handshake;
+                pthread_mutex_unlock(&client->slotlock);
+                client_use_slot(client, slotid, pair[0], ipaddr, port);
+                if(handshake != NO_HANDSHAKE)
+                    msg_connection_handsnake(client, pair[0], handshake);
+                return 0;
+            }
+            free(peer);
+        }
+        close(pair[0]);
+        close(pair[1]);
+    }
     /* Обнуляем структуру адреса */
     memset(&sa, 0, sizeof(struct sockaddr_in));
     /* Заполняем адрес и порт в структуре адреса */
     sa.sin_family = PF_INET;
     sa.sin_port = htons(port);
     sa.sin_addr.s_addr = htonl(ipaddr ? ipaddr : INADDR_LOOPBACK);
-    /* Создаем сокет и запоминаем дескриптор */
-    sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    /* Выполняем соединение по адрес:порт */
-    connect(sock, (struct sockaddr *)&sa, sizeof(struct sockaddr_in));
+    /* Создаем неблокирующий сокет, чтобы подключения к нескольким
+        соседям шли одновременно, а не друг за другом */
+    sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+    if(sock < 0)
+        return -1;
+    /* Начинаем соединение по адрес:порт */
+    if(connect(sock, (struct sockaddr *)&sa, sizeof(struct sockaddr_in)) < 0)
+    {
+        if(errno != EINPROGRESS)
+        {
+            close(sock);
+            return -1;
+        }
+        /* Слот занимается сразу, исход придет через реактор
+            или движок, там же отправится рукопожатие */
+        pthread_mutex_lock(&client->slotlock);
+        slot->connecting = 1;
+        stats_now(&slot->started);
+        slot->handshake = handshake;
+        pthread_mutex_unlock(&client->slotlock);
+        client_use_slot(client, slotid, sock, ipaddr, port);
+        return 0;
+    }
+    /* Локальное соединение может установиться сразу */
+    pthread_mutex_lock(&client->slotlock);
+    slot->connecting = 0;
+    slot->handshake = handshake;
+    pthread_mutex_unlock(&client->slotlock);
     client_use_slot(client, slotid, sock, ipaddr, port);
+    if(handshake != NO_HANDSHAKE)
+        msg_connection_handsnake(client, sock, handshake);
+    return 0;
 }
 
-int client_gettopsock(struct client_t *client)
+void client_connect_check(struct client_t *client, unsigned int slotid,
+    int closed)
 {
-    int i, max = -1;
-    /* Ищем максимальный дескриптор */
+    struct slot_t *slot = client->slots + slotid;
+    struct sockaddr_in sa;
+    socklen_t len;
+    struct timespec started;
+    int error = 0, handshake, connected = 0;
+    /* Исход подключения забирает тот, кто первым снял признак
+        под блокировкой, нить диалога могла начать его только что */
+    pthread_mutex_lock(&client->slotlock);
+    if(slot->status == SLOT_STATUS_FREE || !slot->connecting)
+    {
+        pthread_mutex_unlock(&client->slotlock);
+        return;
+    }
+    started = slot->started;
+    handshake = slot->handshake;
+    if(!closed)
+    {
+        len = sizeof(int);
+        getsockopt(slot->socket, SOL_SOCKET, SO_ERROR, &error, &len);
+        len = sizeof(struct sockaddr_in);
+        /* Есть адрес соседа - соединение установлено */
+        connected = !error &&
+            getpeername(slot->socket, (struct sockaddr *)&sa, &len) == 0;
+        /* Соединение еще устанавливается и срок не истек */
+        if(!connected && !error && stats_elapsed(&started) <
+            CONNECT_TIMEOUT*1000UL)
+        {
+            pthread_mutex_unlock(&client->slotlock);
+            return;
+        }
+    }
+    slot->connecting = 0;
+    pthread_mutex_unlock(&client->slotlock);
+    if(connected)
+    {
+        if(slot->connop != NULL)
+        {
+            engine_cancel(slot->connop);
+            slot->connop = NULL;
+        }
+        LOG_DEBUG(("connect: slot %u in %lu us\n", slotid,
+            stats_elapsed(&started)));
+        if(handshake != NO_HANDSHAKE)
+            msg_connection_handsnake(client, slot->socket, handshake);
+        return;
+    }
+    LOG_DEBUG(("connect: slot %u failed, error=%d\n", slotid, error));
+    client_release_slot(client, slotid);
+    /* Соседу, который дал место, рукопожатие не нужно, его
+        отказ протокол обработает сам по закрытию соединения */
+    if(handshake != NO_HANDSHAKE)
+        on_connection_failed(client);
+}
+
+int client_slot_connecting(struct client_t *client, unsigned int slotid)
+{
+    int connecting;
+    pthread_mutex_lock(&client->slotlock);
+    connecting = client->slots[slotid].connecting;
+    pthread_mutex_unlock(&client->slotlock);
+    return connecting;
+}
+
+int client_connect_expire(struct client_t *client)
+{
+    unsigned long elapsed, wait = CONNECT_TIMEOUT;
+    unsigned int i;
+    struct slot_t *slot;
+    for(i=0; i<NUMBER_SLOTS; i++)
+    {
+        /* Свободные и подключенные слоты проверка пропустит сама */
+        client_connect_check(client, i, 0);
+        slot = client->slots + i;
+        pthread_mutex_lock(&client->slotlock);
+        if(slot->status != SLOT_STATUS_FREE && slot->connecting)
+        {
+            elapsed = stats_elapsed(&slot->started)/1000;
+            if(CONNECT_TIMEOUT - elapsed < wait)
+                wait = CONNECT_TIMEOUT - elapsed;
+        }
+        pthread_mutex_unlock(&client->slotlock);
+    }
+    /* Подключения могут начинаться и из нити диалога с диспетчером,
+        поэтому реактор просыпается не реже раза за срок */
+    return wait + 1;
+}
+
+int client_reclaim_place(struct client_t *client)
+{
+    struct place_neighbor_t neighbors[PLACE_CACHE_SLOTS];
+    unsigned int i, count = 0;
+    if(!place_cache_valid(client->cache, client->dispatcheraddr))
+        return 0;
+    /* Переходы состояний обновляют кэш, поэтому сначала копируем
+        соседей, затем ждем подтверждения от каждого из них */
+    memcpy(neighbors, client->cache->slots, sizeof(neighbors));
+    for(i=0; i<NUMBER_SLOTS; i++)
+        count += neighbors[i].used;
+    client->distance = client->cache->distance;
+    client->anchor = client->cache->anchor;
+    client_set_state(client, WAIT_ALL_NEIGHBOR);
+    client->state.attr = count;
+    __atomic_store_n(&client->reclaiming, 1, __ATOMIC_RELEASE);
+    /* Отказ первого же соседа прерывает возврат в нити реактора,
+        пока эта еще подключается к остальным */
+    for(i=0; i<NUMBER_SLOTS &&
+        __atomic_load_n(&client->reclaiming, __ATOMIC_ACQUIRE); i++)
+    {
+        if(!neighbors[i].used)
+            continue;
+        /* Сосед примет соединение в любой свободный слот, а рукопожатие
+            переставит его на позицию, противоположную нашей; если сосед
+            ушел, место уже не вернуть целиком */
+        if(client_connect_to_client(client, i, neighbors[i].ipaddr,
+            neighbors[i].port, OPPOSITE_POSITION(i)) < 0)
+        {
+            client_reclaim_abort(client);
+            return 1;
+        }
+    }
+    return 1;
+}
+
+void client_reclaim_abort(struct client_t *client)
+{
+    /* Отказ может прийти одновременно из нити диалога и из реактора,
+        место ищется заново только тем, кто первым снял флаг */
+    if(!__atomic_exchange_n(&client->reclaiming, 0, __ATOMIC_ACQ_REL))
+        return;
+    client_place_restart(client);
+}
+
+void client_place_restart(struct client_t *client)
+{
+    unsigned int i;
+    /* Соседи, уже подтвердившие подключение, освободят свои слоты,
+        увидев закрытие соединения */
+    for(i=0; i<NUMBER_SLOTS; i++)
+        if(client->slots[i].status != SLOT_STATUS_FREE)
+            client_release_slot(client, i);
+    client->distance = INVALID_DISTANCE;
+    client->anchor = INVALID_SLOT;
+    client_set_state(client, WAIT_PLACE);
+    msg_place_discover(client, client->sockTCP, client->ipaddr,
+        client->portTCP, client->ring);
+}
+
+void client_cache_sync(struct client_t *client)
+{
+    struct place_cache_t *cache = client->cache;
+    unsigned int i;
+    if(cache == NULL)
+        return;
+    cache->dispatcher = client->dispatcheraddr;
+    cache->distance = client->distance;
+    cache->port = client->portTCP;
+    cache->anchor = client->anchor;
+    /* В кэш попадают только соседи, с которыми
+        соединение полностью установлено */
+    for(i=0; i<NUMBER_SLOTS; i++)
+    {
+        cache->slots[i].used =
+            client->slots[i].status == SLOT_STATUS_READY;
+        cache->slots[i].ipaddr = client->slots[i].ipaddr;
+        cache->slots[i].port = client->slots[i].port;
+    }
+    place_cache_touch(cache);
+}
+
+void client_accept_neighbor(struct client_t *client, int socket,
+    struct sockaddr_in *sa)
+{
+    unsigned int slotid;
+    /* Передаем управление обработчику подключений клиентов
+        к клиенту по протоколу, вернет слот для подключения */
+    slotid = msg_tcp_acceptor(client, socket);
+    if(slotid != INVALID_SLOT)
+    {
+        /* Запоминаются реквизиты входящих подключений,
+            в данном типе распределения - это тот клиент
+            которые предоставляют место в распределении
+            текущему клиенту */
+        client_use_slot(client, slotid, socket,
+            ntohl(sa->sin_addr.s_addr), ntohs(sa->sin_port));
+    }
+    else
+        close(socket);
+}
+
+int client_is_host_addr(struct client_t *client, addr_data_t ipaddr)
+{
+    int i;
+    /* Нулевой адрес протокол уже трактует как LOOPBACK */
+    if(ipaddr == 0 || ipaddr == IPADDR_LOCALHOST)
+        return 1;
+    for(i=0; i<client->netscount; i++)
+        if(client->netsdata[i].ipaddr == ipaddr)
+            return 1;
+    return 0;
+}
+
+int client_is_host_link(struct client_t *client, unsigned int slotid)
+{
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(struct sockaddr_in);
+    /* Пара сокетов соседа из этого же процесса адреса не имеет */
+    if(getpeername(client->slots[slotid].socket, (struct sockaddr *)&sa,
+        &len) < 0 || sa.sin_family != AF_INET)
+            return 0;
+    return client_is_host_addr(client, ntohl(sa.sin_addr.s_addr));
+}
+
+unsigned int client_find_slot(struct client_t *client, int socket)
+{
+    unsigned int i;
     for(i=0; i<NUMBER_SLOTS; i++)
         /* Проверяем только те слоты, которые заняты */
         if(client->slots[i].status != SLOT_STATUS_FREE &&
-            client->slots[i].socket>max)
-            /* Запоминаем его */
-            max = client->slots[i].socket;
-    /* Возвращаем максимальный дескриптор увеличенный на 1,
-        т.е. если нет дескрипторов, то вернется 0 */
-    return max+1;
+            client->slots[i].socket == socket)
+            return i;
+    return INVALID_SLOT;
 }
 
 void client_use_slot(struct client_t * client, unsigned int slotid,
     int socket, addr_data_t ipaddr, unsigned short port)
 {
     struct slot_t *slot = client->slots + slotid;
-    /* Занимаем слот */
+    struct epoll_event ev;
+    int connecting = client_slot_connecting(client, slotid);
+    /* Занимаем слот; отправитель проверяет его под той же блокировкой */
+    pthread_mutex_lock(&client->slotlock);
     slot->status = SLOT_STATUS_PREPARE;
     slot->socket = socket;
+    pthread_mutex_unlock(&client->slotlock);
     slot->ipaddr = ipaddr;
     slot->port = port;
-    /* Добавляем во множество дескрипторов соседей */
-    FD_SET(socket, &client->fds);
-    /* Корректируем границу обработки select */
-    if(client->topsock - socket < 1)
-        client->topsock = socket+1;
+    STREAM_RESET(&slot->stream);
+    client_set_nodelay(socket);
+    /* Отправка соседу идет через очередь соединения */
+    outq_attach(socket, client->epollfd, slot, client->engine);
+    /* С движком io_uring ставим многоразовый прием, слот
+        находится по сокету, поэтому перемещения ему не мешают */
+    if(client->engine != NULL)
+    {
+        slot->op = engine_recv(client->engine, socket, client_on_slot_data,
+            client, NULL);
+        /* Исход подключения - готовность к записи или срок */
+        if(connecting)
+            slot->connop = engine_poll_timeout(client->engine, socket,
+                client_engine_on_connect, client, CONNECT_TIMEOUT);
+        return;
+    }
+    /* Регистрируем сокет в реакторе соседей, событие
+        сразу указывает на слот, исход подключения
+        приходит готовностью к записи */
+    ev.events = EPOLLIN | EPOLLET | (connecting ? EPOLLOUT : 0);
+    ev.data.ptr = slot;
+    epoll_ctl(client->epollfd, EPOLL_CTL_ADD, socket, &ev);
+}
+
+void client_set_nodelay(int socket)
+{
+    int enable = 1;
+    /* Для пары сокетов параметра нет, ошибку не проверяем */
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
 }
 
 void client_release_slot(struct client_t *client, unsigned int slotid)
 {
     struct slot_t *slot = client->slots + slotid;
-    /* Помечаем слот, как свободный */
+    /* Помечаем слот, как свободный; отправитель проверяет его
+        под той же блокировкой */
+    pthread_mutex_lock(&client->slotlock);
     slot->status = SLOT_STATUS_FREE;
-    /* Корректируем границу дескрипторов для select */
-    client->topsock = client_gettopsock(client);
-    /* Удаляем из множества дескрипторов сокетов для
-        асинхронного чтения */
-    FD_CLR(slot->socket, &client->fds);
-    /* Закрываем сокет */
-    close(slot->socket);
+    slot->connecting = 0;
+    slot->handshake = NO_HANDSHAKE;
+    slot->parked = 0;
+    pthread_mutex_unlock(&client->slotlock);
+    /* Удаляем сокет из реактора соседей или отменяем прием
+        и ожидание подключения движка */
+    if(client->engine != NULL)
+    {
+        engine_cancel(slot->op);
+        slot->op = NULL;
+        engine_cancel(slot->connop);
+        slot->connop = NULL;
+    }
+    else
+        epoll_ctl(client->epollfd, EPOLL_CTL_DEL, slot->socket, NULL);
+    outq_detach(slot->socket);
+    /* Кольцо освобождается, когда из него вышла потоковая запись:
+        отсоединенная очередь прерывает ее на ближайшей проверке */
+    if(slot->link != NULL)
+    {
+        outq_stream_begin(slot->socket);
+        outq_stream_end(slot->socket);
+        shm_link_close(slot->link);
+        slot->link = NULL;
+    }
+    /* Закрываем сокет, если его не удерживает отправитель,
+        иначе его закроет последний из них */
+    outq_close(slot->socket);
+    slot->socket = -1;
+    collective_reset(client->collective, slotid);
+    client_cache_sync(client);
+    /* Диспетчер оговаривает места по свободным слотам участников,
+        уходящему клиенту сообщать уже некуда */
+    if(client->state.state == IN_PROCESS && client->sockTCP >= 0 &&
+        client_slot_owned(client, slotid))
+            msg_connection_distance(client, client->distance);
 }
 
 void client_slots_swap(struct client_t *client, unsigned int slotid,
     unsigned int newslotid)
 {
     struct slot_t slot;
+    struct epoll_event ev;
     /* Меняем местами через третью переменную */
+    pthread_mutex_lock(&client->slotlock);
     memcpy(&slot, client->slots+slotid, sizeof(struct slot_t));
     memcpy(client->slots+slotid, client->slots+newslotid, sizeof(struct slot_t));
     memcpy(client->slots+newslotid, &slot, sizeof(struct slot_t));
+    pthread_mutex_unlock(&client->slotlock);
+    if(client->engine != NULL)
+        return;
+    /* Контекст событий реактора указывает на слот, поэтому
+        перенаправляем его на новое место занятых слотов, очередь
+        отправки сама восстанавливает ожидание записи */
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = client->slots+slotid;
+    if(client->slots[slotid].status != SLOT_STATUS_FREE)
+    {
+        epoll_ctl(client->epollfd, EPOLL_CTL_MOD,
+            client->slots[slotid].socket, &ev);
+        outq_rebind(client->slots[slotid].socket, ev.data.ptr);
+    }
+    ev.data.ptr = client->slots+newslotid;
+    if(client->slots[newslotid].status != SLOT_STATUS_FREE)
+    {
+        epoll_ctl(client->epollfd, EPOLL_CTL_MOD,
+            client->slots[newslotid].socket, &ev);
+        outq_rebind(client->slots[newslotid].socket, ev.data.ptr);
+    }
 }
 
 void client_slot_ready(struct client_t *client, unsigned int slotid)
 {
+    /* Отправитель проверяет готовность слота под той же блокировкой */
+    pthread_mutex_lock(&client->slotlock);
     client->slots[slotid].status = SLOT_STATUS_READY;
+    pthread_mutex_unlock(&client->slotlock);
+    client_cache_sync(client);
 }
 
-void client_dispatcher_add_unit(struct client_t *client, int socket)
+int client_slot_is_ready(struct client_t *client, unsigned int slotid)
 {
-    /* Так как нам не важен порядок - используем самый простой алгоритм списка -
-        стек на односвязном списке */
-    struct unit_node_t *ptr;
-    /* Выделяем память на новый элемент списка */
-    ptr = (struct unit_node_t *)malloc(sizeof(struct unit_node_t));
-    /* Запоминаем дескриптор сокета соединения */
-    ptr->unit.socket = socket;
-    /* Указываем, что у нас нет данных о удалении клиента от диспетчера */
-    ptr->unit.distance = INVALID_DISTANCE;
-    /* Блокируем мьютекс работы со списком */
-    pthread_mutex_lock(&(client->dispatcher->listlocker));
-    /* Ссылаемся новым элементом на первый элемент списка */
-    ptr->next = client->dispatcher->units;
-    /* Делаем новый элемент первым элементом списка */
-    client->dispatcher->units = ptr;
-    /* Добавляем элемент в множество дескрипторов */
-    FD_SET(socket, &client->dispatcher->fds);
-    /* Если нужно - обновляем границу сокетов для select */
-    if(client->dispatcher->topsock - socket < 1)
-        client->dispatcher->topsock = socket + 1;
-    /* Снимаем блокировку мьютекса работы со списком */
-    pthread_mutex_unlock(&(client->dispatcher->listlocker));
+    int ready;
+    pthread_mutex_lock(&client->slotlock);
+    ready = client->slots[slotid].status == SLOT_STATUS_READY;
+    pthread_mutex_unlock(&client->slotlock);
+    return ready;
 }
 
-void client_dispatcher_remove_unit(struct client_t *client, int socket)
+void client_set_receiver(struct client_t *client, client_receiver_t receiver,
+    void *ctx)
+{
+    client->receiverctx = ctx;
+    client->receiver = receiver;
+}
+
+int client_send(struct client_t *client, unsigned int position,
+    const void *buffer, size_t size)
 {
-    struct unit_node_t *ptr, *prev;
-    ptr = NULL;
-    /* Ищем элемент, стоящий перед тем, который удаляем */
-    prev = client_dispatcher_prev_unit(client->dispatcher, socket);
-    /* Если адрес ноль - значит перед нами диспетчер или ничего не найдено */
-    if(prev == NULL) 
+    struct iovec iov;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = size;
+    return client_sendv(client, position, &iov, 1);
+}
+
+int client_sendv(struct client_t *client, unsigned int position,
+    const struct iovec *iov, int iovcnt)
+{
+    union msg_data_t data;
+    return client_send_stream(client, position, PAYLOAD, &data, iov, iovcnt);
+}
+
+int client_send_stream(struct client_t *client, unsigned int position,
+    unsigned int code, union msg_data_t *data, const struct iovec *iov,
+    int iovcnt)
+{
+    /* Записи в сокет: заголовки кадров вперемешку с кусками
+        частей сообщения, сами данные не копируются */
+    struct iovec frames[PAYLOAD_IOV];
+    char headers[PAYLOAD_BATCH][TCP_MSG_SIZE];
+    size_t left = 0, chunk, take, offset = 0;
+    int i, count = 0, headcount = 0, first = 1, retval = 0, socket = -1;
+    /* Запись ждет, пока очередь дошлет нить ввода-вывода клиента,
+        поэтому из нее самой (например, из получателя) вызывать
+        отправку нельзя - она ждала бы сама себя */
+    if(position >= NUMBER_SLOTS || client_on_io_thread(client))
+        return -1;
+    for(i=0; i<iovcnt; i++)
+        left += iov[i].iov_len;
+    if(left > PAYLOAD_MAX)
+        return -1;
+    /* Удерживаем сокет соседа: освобождение слота в другой нити
+        отложит его закрытие, пока сообщение не будет записано */
+    pthread_mutex_lock(&client->slotlock);
+    if(client->slots[position].status == SLOT_STATUS_READY &&
+        outq_hold(client->slots[position].socket) == 0)
+            socket = client->slots[position].socket;
+    pthread_mutex_unlock(&client->slotlock);
+    if(socket < 0)
+        return -1;
+    if(outq_stream_begin(socket) < 0)
+    {
+        outq_unhold(socket);
+        return -1;
+    }
+    i = 0;
+    /* Сообщение режется на кадры по PAYLOAD_CHUNK, пустое сообщение -
+        один пустой кадр; записи делаются, когда кончаются места под
+        элементы или заголовки, кадр может продолжиться в следующей */
+    while(!retval && (first || left))
     {
-        /* Проводим дополнительную проверку на то, что это
-            не отсутствие совпадений, и удаляется именно диспетчер */
-        if(client->dispatcher->units->unit.socket == socket)
+        first = 0;
+        chunk = left < PAYLOAD_CHUNK ? left : PAYLOAD_CHUNK;
+        left -= chunk;
+        if(count == PAYLOAD_IOV || headcount == PAYLOAD_BATCH)
         {
-            /* Запоминаем старый первый элемент */
-            ptr = client->dispatcher->units;
-            /* Первым элементом становится следующий
-                (или ничего, если следующего нет) */
-            client->dispatcher->units = client->dispatcher->units->next;
+            retval = outq_stream_write(socket, frames, count);
+            count = headcount = 0;
+        }
+        frames[count].iov_base = headers[headcount];
+        frames[count++].iov_len = pack_stream(headers[headcount++],
+            code, data, left, chunk);
+        while(!retval && chunk)
+        {
+            if(count == PAYLOAD_IOV)
+            {
+                retval = outq_stream_write(socket, frames, count);
+                count = headcount = 0;
+            }
+            take = iov[i].iov_len - offset;
+            if(take > chunk)
+                take = chunk;
+            if(take)
+            {
+                frames[count].iov_base = (char *)iov[i].iov_base + offset;
+                frames[count++].iov_len = take;
+                offset += take;
+                chunk -= take;
+            }
+            if(offset == iov[i].iov_len)
+            {
+                i++;
+                offset = 0;
+            }
         }
     }
-    else
+    if(!retval && count)
+        retval = outq_stream_write(socket, frames, count);
+    outq_stream_end(socket);
+    outq_unhold(socket);
+    return retval;
+}
+
+int client_on_io_thread(struct client_t *client)
+{
+    if(client->engine != NULL)
+        return engine_current(client->engine);
+    return pthread_equal(client->thrdTCP, pthread_self());
+}
+
+unsigned int client_broadcast(struct client_t *client, const void *buffer,
+    size_t size)
+{
+    unsigned int i, count = 0;
+    for(i=0; i<NUMBER_SLOTS; i++)
+        if(client->slots[i].status == SLOT_STATUS_READY &&
+            client_send(client, i, buffer, size) == 0)
+                count++;
+    return count;
+}
+
+void client_dispatcher_add_unit(struct client_t *client, int socket)
+{
+    struct unit_t *unit;
+    struct epoll_event ev;
+    /* Заносим участника в реестр, запись получает
+        неизвестное удаление от диспетчера */
+    unit = registry_add(&client->dispatcher->units, socket);
+    if(unit == NULL)
     {
-        /* Запоминаем указатель на следующий за предыдущим
-            (т.е. тот, который удаляем) */
-        ptr = prev->next;
-        /* Связываем список, исключая удаляемый элемент */
-        prev->next = ptr->next;
-    }
-    /* Если какое-то из условий удаления сработало,
-        и в ptr находится адрес удаляемого элемента */
-    if(ptr != NULL)
-    {
-        /* То убираем дескриптор сокета из множества */
-        FD_CLR(socket, &client->dispatcher->fds);
-        /* И освобождаем память */
-        free(ptr);
-        /* Если дескриптор сокета младше topsock на 1 */
-        if(client->dispatcher->topsock - socket == 1)
-            /* Это был старший сокет и теперь необходимо найти
-                старший из оставшихся */
-            client->dispatcher->topsock =
-                client_dispatcher_gettopsock(client->dispatcher);
+        /* Реестр переполнен */
+        close(socket);
+        return;
+    }
+    client_set_nodelay(socket);
+    /* Отправка участнику идет через очередь соединения */
+    outq_attach(socket, client->dispatcher->epollfd, unit, client->engine);
+    /* С движком io_uring ставим многоразовый прием,
+        аргумент обработчика - запись реестра */
+    if(client->engine != NULL)
+    {
+        unit->op = engine_recv(client->engine, socket,
+            client_dispatcher_on_unit_data, client, unit);
+        return;
+    }
+    /* Регистрируем сокет в реакторе диспетчера, событие
+        сразу указывает на запись реестра */
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = unit;
+    epoll_ctl(client->dispatcher->epollfd, EPOLL_CTL_ADD, socket, &ev);
+}
+
+void client_dispatcher_remove_unit(struct client_t *client, int socket)
+{
+    struct unit_t *unit;
+    unsigned int distance;
+    /* Исключаем участника из его кольца */
+    unit = registry_find(&client->dispatcher->units, socket);
+    if(unit != NULL)
+    {
+        client_dispatcher_unreserve(client, unit);
+        client_dispatcher_unwait(client, unit);
+        distance = unit->distance;
+        client_dispatcher_set_distance(client, unit, INVALID_DISTANCE);
+        /* Уходящий диспетчер уже закрыл свой диалог и резерв
+            не ведет: участники перейдут к названному раньше
+            наследнику */
+        if(client->sockTCP >= 0)
+            client_dispatcher_replicate(client, unit, distance);
+        /* Отменяем прием движка, запись реестра еще доступна */
+        engine_cancel(unit->op);
+        unit->op = NULL;
+    }
+    /* Удаляем запись из реестра за O(1), ее память остается
+        доступной читателям до окончания их эпохи */
+    if(registry_remove(&client->dispatcher->units, socket))
+    {
+        /* Убираем сокет из реактора */
+        if(client->engine == NULL)
+            epoll_ctl(client->dispatcher->epollfd, EPOLL_CTL_DEL, socket, NULL);
+        outq_detach(socket);
         /* После вывода дескриптора сокета из асинхронной обработки -
             его можно закрыть */
         close(socket);
     }
 }
 
-struct unit_node_t *client_dispatcher_prev_unit(struct dispatcher_t *dispatcher, int socket)
+void client_dispatcher_set_distance(struct client_t *client,
+    struct unit_t *unit, unsigned int distance)
 {
-    struct unit_node_t *ptr, *prev;
-    prev = NULL;
-    /* Блокируем мьютекс работы со списком */
-    pthread_mutex_lock(&(dispatcher->listlocker));
-    ptr = dispatcher->units;
-    while(ptr!=NULL)
+    struct ring_t *ring;
+    /* Исключаем участника из прежнего кольца за O(1) */
+    if(unit->distance < DISPATCHER_RINGS)
     {
-        /* Если дескриптор совпадает, то завершаем цикл, чтобы
-            перейти к освобождению мьютекса */
-        if(ptr->unit.socket == socket)
-            break;
-        /* Переходим к следующему элементу */
-        prev = ptr;
-        ptr = ptr->next;
+        ring = client->dispatcher->rings + unit->distance;
+        if(unit->ringprev != NULL)
+            unit->ringprev->ringnext = unit->ringnext;
+        else
+            ring->units = unit->ringnext;
+        if(unit->ringnext != NULL)
+            unit->ringnext->ringprev = unit->ringprev;
+        __atomic_sub_fetch(&ring->count, 1, __ATOMIC_RELAXED);
+    }
+    unit->ringprev = unit->ringnext = NULL;
+    unit->distance = distance;
+    /* Добавляем в начало нового кольца, дальние кольца
+        и неизвестное удаление не ведутся */
+    if(distance < DISPATCHER_RINGS)
+    {
+        ring = client->dispatcher->rings + distance;
+        unit->ringnext = ring->units;
+        if(ring->units != NULL)
+            ring->units->ringprev = unit;
+        ring->units = unit;
+        __atomic_add_fetch(&ring->count, 1, __ATOMIC_RELAXED);
     }
-    /* Снимаем блокировку мьютекса работы со списком */
-    pthread_mutex_unlock(&(dispatcher->listlocker));
-    return prev;
 }
 
-int client_dispatcher_gettopsock(struct dispatcher_t *dispatcher)
+void client_dispatcher_replicate(struct client_t *client,
+    struct unit_t *unit, unsigned int previous)
 {
-    struct unit_node_t *ptr;
-    int max;
-    /* Блокируем мьютекс работы со списком */
-    pthread_mutex_lock(&(dispatcher->listlocker));
-    ptr = dispatcher->units;
-    max = -1;
-    while(ptr!=NULL)
+    /* Участник, еще не назвавший адрес, и сам диспетчер
+        в зеркала не попадают */
+    if(unit->port && !client_dispatcher_is_self(client, unit))
     {
-        /* Если дескриптор больше большего - теперь он больший */
-        if(ptr->unit.socket > max)
-            max = ptr->unit.socket;
-        /* Переходим к следующему элементу */
-        ptr = ptr->next;
+        msg_standby_unit(client, unit->ipaddr, unit->port, unit->distance,
+            unit->free);
+        if(unit->distance == 1 && previous != 1)
+            msg_standby_snapshot(client, unit);
     }
-    /* Снимаем блокировку мьютекса работы со списком */
-    pthread_mutex_unlock(&(dispatcher->listlocker));
-    /* Возвращаем старший сокет + 1 для select */
-    return max+1;
+    if(unit->distance == 1 || previous == 1)
+        client_dispatcher_elect(client);
+}
+
+/* Пригодность участника в наследники: 0 - не годится, 1 - из этого
+    процесса, 2 - с этого компьютера, 3 - с другого компьютера */
+static unsigned int client_dispatcher_heir_rank(struct client_t *client,
+    struct unit_t *unit)
+{
+    if(unit->distance != 1 || !unit->port ||
+        client_dispatcher_is_self(client, unit))
+            return 0;
+    if(!client_is_host_addr(client, unit->ipaddr))
+        return 3;
+    return host_find_client(unit->port) == NULL ? 2 : 1;
+}
+
+void client_dispatcher_elect(struct client_t *client)
+{
+    struct dispatcher_t *dispatcher = client->dispatcher;
+    struct unit_t *unit, *heir;
+    unsigned int rank, best;
+    /* Прежний наследник остается, пока лучшего нет */
+    heir = dispatcher->heir;
+    best = heir != NULL ? client_dispatcher_heir_rank(client, heir) : 0;
+    if(!best)
+        heir = NULL;
+    for(unit = dispatcher->rings[1].units; unit != NULL; unit = unit->ringnext)
+        if((rank = client_dispatcher_heir_rank(client, unit)) > best)
+        {
+            best = rank;
+            heir = unit;
+        }
+    dispatcher->heir = heir;
+    if(heir != NULL && heir->ipaddr == dispatcher->heiraddr &&
+        heir->port == dispatcher->heirport)
+            return;
+    if(heir == NULL && !dispatcher->heirport)
+        return;
+    dispatcher->heiraddr = heir != NULL ? heir->ipaddr : 0;
+    dispatcher->heirport = heir != NULL ? heir->port : 0;
+    on_heir_changed(client);
+}
+
+int client_dispatcher_is_self(struct client_t *client, struct unit_t *unit)
+{
+    return unit->port == client->portTCP &&
+        client_is_host_addr(client, unit->ipaddr);
+}
+
+unsigned int client_dispatcher_ring_count(struct client_t *client,
+    unsigned int distance)
+{
+    if(client->dispatcher == NULL || distance >= DISPATCHER_RINGS)
+        return 0;
+    return __atomic_load_n(&client->dispatcher->rings[distance].count,
+        __ATOMIC_RELAXED);
+}
+
+struct unit_t *client_dispatcher_ring_anchor(struct client_t *client,
+    unsigned int distance)
+{
+    struct unit_t *unit, *anchor = NULL;
+    /* Разводим одновременных новых клиентов по разным участникам,
+        каждый раз выбирая участника с наибольшим запасом */
+    for(unit = client->dispatcher->rings[distance].units; unit != NULL;
+        unit = unit->ringnext)
+            if(unit->free > unit->reserved && (anchor == NULL ||
+                unit->free - unit->reserved > anchor->free - anchor->reserved))
+                    anchor = unit;
+    return anchor;
+}
+
+struct unit_t *client_dispatcher_reserve(struct client_t *client,
+    struct unit_t *joiner, unsigned int distance)
+{
+    struct unit_t *anchor = NULL;
+    unsigned int i;
+    client_dispatcher_unreserve(client, joiner);
+    if(distance < DISPATCHER_RINGS)
+        anchor = client_dispatcher_ring_anchor(client, distance);
+    /* Кольцо выбиралось по числу участников, а не по их слотам,
+        поэтому место может найтись и в другом кольце */
+    for(i=0; anchor == NULL && i<DISPATCHER_RINGS; i++)
+        if(i != distance && client->dispatcher->rings[i].units != NULL)
+            anchor = client_dispatcher_ring_anchor(client, i);
+    if(anchor != NULL)
+    {
+        anchor->reserved++;
+        joiner->anchor = anchor;
+        joiner->anchorepoch = anchor->epoch;
+    }
+    return anchor;
+}
+
+void client_dispatcher_unreserve(struct client_t *client,
+    struct unit_t *joiner)
+{
+    struct unit_t *anchor = joiner->anchor;
+    (void)client;
+    if(anchor == NULL)
+        return;
+    /* Участник мог уже уйти - тогда и оговорка ушла вместе с ним,
+        а его запись могла достаться другому; страницы слаба живут
+        до уничтожения реестра, поэтому запись можно читать */
+    if(__atomic_load_n(&anchor->alive, __ATOMIC_ACQUIRE) &&
+        anchor->epoch == joiner->anchorepoch && anchor->reserved)
+            anchor->reserved--;
+    joiner->anchor = NULL;
+}
+
+void client_dispatcher_wait(struct client_t *client, struct unit_t *joiner)
+{
+    if(joiner->waiting)
+        return;
+    joiner->waiting = 1;
+    joiner->waitnext = NULL;
+    if(client->dispatcher->waitingtail != NULL)
+        client->dispatcher->waitingtail->waitnext = joiner;
+    else
+        client->dispatcher->waiting = joiner;
+    client->dispatcher->waitingtail = joiner;
+    if(++client->dispatcher->waitingcount > client->dispatcher->waitingpeak)
+        client->dispatcher->waitingpeak = client->dispatcher->waitingcount;
+}
+
+void client_dispatcher_unwait(struct client_t *client, struct unit_t *joiner)
+{
+    struct unit_t *unit, *prev = NULL;
+    if(!joiner->waiting)
+        return;
+    /* Очередь короткая и обычно снимается с головы */
+    for(unit = client->dispatcher->waiting; unit != joiner;
+        unit = unit->waitnext)
+            prev = unit;
+    if(prev != NULL)
+        prev->waitnext = joiner->waitnext;
+    else
+        client->dispatcher->waiting = joiner->waitnext;
+    if(client->dispatcher->waitingtail == joiner)
+        client->dispatcher->waitingtail = prev;
+    client->dispatcher->waitingcount--;
+    joiner->waiting = 0;
+    joiner->waitnext = NULL;
+}
+
+struct unit_t *client_dispatcher_find_joiner(struct client_t *client,
+    struct unit_t *anchor, addr_data_t ipaddr, unsigned short port)
+{
+    struct unit_t *unit;
+    unsigned int epoch;
+    /* Возврат поиска случается только при устаревших сведениях
+        о слотах, поэтому обход реестра здесь допустим */
+    epoch = registry_read_lock(&client->dispatcher->units);
+    unit = registry_next(&client->dispatcher->units, NULL);
+    while(unit != NULL && (unit->anchor != anchor ||
+        unit->anchorepoch != anchor->epoch ||
+        unit->joinaddr != ipaddr || unit->joinport != port))
+            unit = registry_next(&client->dispatcher->units, unit);
+    registry_read_unlock(&client->dispatcher->units, epoch);
+    return unit;
+}
+
+unsigned int client_dispatcher_pick_ring(struct client_t *client)
+{
+    unsigned int distance;
+    /* Слоты свободны у кольца, следующее за которым не заполнено */
+    for(distance=0; distance+1<DISPATCHER_RINGS; distance++)
+        if(client_dispatcher_ring_count(client, distance+1) <
+            RING_CAPACITY(distance+1))
+                return distance;
+    return DISPATCHER_RINGS-1;
 }
 
 void *client_dispatcher_udp_handler(void *arg)
 {
     struct client_t *client = (struct client_t *)arg;
-    struct sockaddr_in *sa;
-    socklen_t *address_len=NULL;
+    struct sockaddr_in sa;
+    socklen_t salen;
+    ssize_t size;
     dg_code_t code;
     addr_data_t netaddr;
     pthread_barrier_wait(&(client->dispatcher->starter));
@@ -571,9 +1871,18 @@ void *client_dispatcher_udp_handler(void *arg)
     {
         /* Так как у нас в нити только один описатель соединения,
             то нам не требуется асинхронное чтение */
-        recvfrom(client->dispatcher->sdUDP, &code, sizeof(dg_code_t), 0,
-            (struct sockaddr *)&sa, address_len);
-        netaddr = client_get_netaddr_by_ipaddr(client, sa->sin_addr.s_addr);
+        if(client_wait(client, client->dispatcher->sdUDP) < 0)
+            break;
+        salen = sizeof(struct sockaddr_in);
+        size = recvfrom(client->dispatcher->sdUDP, &code, sizeof(dg_code_t), 0,
+            (struct sockaddr *)&sa, &salen);
+        code = (dg_code_t)msg_get((char *)&code, sizeof(dg_code_t));
+        if(size < 0 && errno != EINTR)
+            break;
+        /* Датаграммы не по протоколу и из чужих сетей не обрабатываем */
+        if(size != sizeof(dg_code_t) || (netaddr =
+            client_get_netaddr_by_ipaddr(client, ntohl(sa.sin_addr.s_addr))) == 0)
+                continue;
         /* Адрес сети еще не выбран, то это первое соединение с внешним клиентом
             устанавливаем подходящий адрес */
         if(client->dispatcher->netaddr == 0)
@@ -583,11 +1892,12 @@ void *client_dispatcher_udp_handler(void *arg)
                 определения сетевого адреса, по протоколу */
             on_netaddr_setup(client);
         }
-        /* Если маска диспетчеризуемой сети подходит обратному адресу */
-        else if(client->dispatcher->netaddr == netaddr)
+        /* Если маска диспетчеризуемой сети подходит обратному адресу,
+            первому же клиенту отвечаем сразу после выбора сети */
+        if(client->dispatcher->netaddr == netaddr)
             /* Передаем управление обработчику UDP сообщений от клиентов
                 к диспетчеру по протоколу */
-            dg_dispatcher_udp_handler(client, sa->sin_addr.s_addr, code);
+            dg_dispatcher_udp_handler(client, sa.sin_addr.s_addr, code);
     }
     return NULL;
 }
@@ -605,8 +1915,12 @@ void *client_dispatcher_tcp_acceptor(void *arg)
     {
         /* Так как у нас в нити только один описатель соединения,
             то нам не требуется асинхронное чтение */
+        if(client_wait(client, client->dispatcher->sdTCP) < 0)
+            break;
         /* Принимаем входящее подключение из очереди ожидания */
         sdNew = accept(client->dispatcher->sdTCP, NULL, NULL);
+        if(sdNew < 0)
+            continue;
         /* Добавляем подключение в стек клиентов
             и множество дескрипторов */
         client_dispatcher_add_unit(client, sdNew);
@@ -620,58 +1934,51 @@ void *client_dispatcher_tcp_acceptor(void *arg)
 void *client_dispatcher_tcp_handler(void *arg)
 {
     struct client_t *client = (struct client_t *)arg;
-    fd_set rfds;
-    struct timeval tv;
-    struct unit_node_t *ptr;
-    char buffer[TCP_MSG_SIZE];
+    struct epoll_event events[REACTOR_EVENTS];
+    struct unit_t *unit;
+    char buffer[REACTOR_BUFSIZE];
     ssize_t recvsize;
-    unsigned int code;
-    ssize_t msgsize;
+    int i, count, socket;
 	pthread_barrier_wait(&(client->dispatcher->starter));
     /* Если клиент не инициализирован как диспетчер - уходим */
     if(client == NULL || client->dispatcher == NULL)
         return NULL;
-    /* Устанавливаем время ожидания ответа в микросекундах */
-    tv.tv_sec = 0;
-    tv.tv_usec = 50000;
     while(1)
     {
-        /* Клонируем содержимое множества дескрипторов диспетчера, так как
-            select изменяет множество, полученное в качестве аргумента */
-        memcpy(&rfds, &client->dispatcher->fds, sizeof(fd_set));
-        select(client->dispatcher->topsock, &rfds, NULL, NULL, &tv);
+        /* Ждем готовые дескрипторы, сложность не зависит
+            от количества участников диспетчеризации */
+        count = epoll_wait(client->dispatcher->epollfd, events,
+            REACTOR_EVENTS, -1);
         /* Обрабатываем все дескрипторы, принявшие данные */
-        ptr = client->dispatcher->units;
-        while(ptr != NULL)
+        for(i=0; i<count; i++)
         {
-            /* Если сокет элемента находится во множестве доступных для чтения */
-            if(FD_ISSET(ptr->unit.socket, &rfds))
+            /* Контекст события - участник диспетчеризации,
+                нулевой - остановка */
+            unit = (struct unit_t *)events[i].data.ptr;
+            if(unit == NULL)
+                return NULL;
+            socket = unit->socket;
+            /* Участник освободил буфер - досылаем его очередь */
+            if(events[i].events & EPOLLOUT)
+                outq_on_writable(socket);
+            if(!(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+                continue;
+            /* Реактор работает по фронту, поэтому читаем порции,
+                пока сокет не опустеет, каждая порция за один вызов
+                разбирается на все целые кадры */
+            do
             {
-                /* Принимаем код сообщения */
-                recvsize = recv(ptr->unit.socket, &code, sizeof(msg_code_t), MSG_WAITALL);
+                recvsize = recv(socket, buffer, REACTOR_BUFSIZE, MSG_DONTWAIT);
                 if(recvsize > 0)
-                {
-                    /* Узнаем размер данных, соответствующих этому сообщению */
-                    msgsize = size_of_msg_tcp_data(code);
-                    /* Если есть данные, которые соответствуют */
-                    if(msgsize)
-                        /* Принимаем их, считая, что у нас всегда правильный протокол
-                            это допущение позволяет использовать MSG_WAITALL, и значительно
-                            упрощает прием */
-                        recvsize += recv(ptr->unit.socket, buffer, msgsize, MSG_WAITALL);
-                    /* Передаем управление обработчику TCP сообщений от клиентов к диспетчеру
-                        по протоколу */
-                    msg_dispatcher_tcp_handler(client, &ptr->unit, code, buffer, 0);
-                }
-                /* Если вернуло 0 байт, значит соединение закрылось с той стороны */
-                if(!recvsize)
-                {
-                    /* Удаляем элемент из списка */
-                    /* (Можно удалить за O(1) передав адрес предыдущего) */
-                    client_dispatcher_remove_unit(client, ptr->unit.socket);
-                }
+                    client_dispatcher_on_unit_data(client, unit, socket,
+                        buffer, recvsize);
             }
-            ptr = ptr->next;
+            while(recvsize > 0 || (recvsize < 0 && errno == EINTR));
+            /* Прерванный сигналом прием повторяется, опустевшим сокет
+                считается только по EAGAIN; если вернуло 0 байт или
+                другую ошибку, значит соединение закрылось */
+            if(!recvsize || (recvsize < 0 && errno != EAGAIN))
+                client_dispatcher_on_unit_data(client, unit, socket, NULL, 0);
         }
     }
     return NULL;
@@ -683,36 +1990,28 @@ void *client_dispatcher_tcp_handler(void *arg)
 void *client_tcp_dialog(void *arg)
 {
     struct client_t *client = (struct client_t *)arg;
-    size_t msgsize;
-    char buffer[TCP_MSG_SIZE];
-    msg_code_t code;
-    int recvsize;
+    char buffer[REACTOR_BUFSIZE];
+    ssize_t recvsize;
     pthread_barrier_wait(&(client->starter));
     while(1)
     {
         /* Так как у нас в нити только один описатель соединения,
-            то нам не требуется асинхронное чтение */
-        /* Принимаем код сообщения */
-        recvsize = recv(client->sockTCP, &code, sizeof(msg_code_t), MSG_WAITALL);
+            то нам не требуется асинхронное чтение; забираем все
+            пришедшее одним вызовом */
+        if(client_wait(client, client->sockTCP) < 0)
+            break;
+        recvsize = recv(client->sockTCP, buffer, REACTOR_BUFSIZE, 0);
         if(recvsize > 0)
-        {
-            /* Узнаем размер данных, соответствующих этому сообщению */
-            msgsize = size_of_msg_tcp_data(code);
-            /* Если есть данные, которые соответствуют */
-            if(msgsize)
-                /* Принимаем их, считая, что у нас всегда правильный протокол
-                    это допущение позволяет использовать MSG_WAITALL, и значительно
-                    упрощает прием */
-                    recvsize += recv(client->sockTCP, buffer, msgsize, MSG_WAITALL);
-            /* Передаем управление обработчику TCP сообщений от диспетчера к клиенту
-                по протоколу */
-            msg_tcp_dialog(client, code, buffer, 0);
-        }
+            client_on_dialog_data(client, NULL, client->sockTCP,
+                buffer, recvsize);
         /* Если вернуло 0 байт, значит соединение закрылось с той стороны */
-        if(!recvsize)
+        else if(!recvsize || errno != EINTR)
         {
-            /* Вызываем остановку цикла */
-            break;
+            /* Переходим к наследнику диспетчера, без него
+                вызываем остановку цикла */
+            on_dispatcher_lost(client);
+            if(client->sockTCP < 0)
+                break;
         }
     }
     return NULL;
@@ -724,8 +2023,7 @@ void *client_tcp_acceptor(void *arg)
 {
     struct client_t *client = (struct client_t *)arg;
     struct sockaddr_in sa;
-    socklen_t sa_len = sizeof(struct sockaddr);
-    unsigned int slotid;
+    socklen_t sa_len;
     int sdNew;
     pthread_barrier_wait(&(client->starter));
     while(1)
@@ -733,21 +2031,13 @@ void *client_tcp_acceptor(void *arg)
         /* Так как у нас в нити только один описатель соединения,
             то нам не требуется асинхронное чтение, кроме того
             заполняем структуру sockaddr, чтобы узнать IP подключения */
+        if(client_wait(client, client->listenerTCP) < 0)
+            break;
+        sa_len = sizeof(struct sockaddr);
         sdNew = accept(client->listenerTCP, (struct sockaddr *)&sa, &sa_len);
-        /* Передаем управление обработчику подключений клиентов
-            к клиенту по протоколу, вернет слот для подключения */
-        slotid = msg_tcp_acceptor(client, sdNew);
-        if(slotid != INVALID_SLOT)
-        {
-            /* Запоминаются реквизиты входящих подключений,
-                в данном типе распределения - это тот клиент
-                которые предоставляют место в распределении
-                текущему клиенту */
-            client_use_slot(client, slotid, sdNew,
-                ntohl(sa.sin_addr.s_addr), ntohs(sa.sin_port));
-        }
-        else
-            close(sdNew);
+        if(sdNew < 0)
+            continue;
+        client_accept_neighbor(client, sdNew, &sa);
     }
     return NULL;
 }
@@ -757,52 +2047,312 @@ void *client_tcp_acceptor(void *arg)
 void *client_tcp_handler(void *arg)
 {
     struct client_t *client = (struct client_t *)arg;
-    fd_set rfds;
-    struct timeval tv;
-    char buffer[TCP_MSG_SIZE];
-    msg_code_t code;
-    size_t msgsize;
-    unsigned int i, recvsize;
+    struct epoll_event events[NUMBER_SLOTS];
+    struct slot_t *slot;
+    char buffer[REACTOR_BUFSIZE];
+    ssize_t recvsize;
+    int i, count, socket, timeout;
     pthread_barrier_wait(&(client->starter));
-    /* Устанавливаем время ожидания ответа в микросекундах */
-    tv.tv_sec = 0;
-    tv.tv_usec = 50000;
+    timeout = CONNECT_TIMEOUT;
     while(1)
     {
-        /* Клонируем содержимое множества дескрипторов диспетчера, так как
-            select изменяет множество, полученное в качестве аргумента */
-        memcpy(&rfds, &client->fds, sizeof(fd_set));
-        select(client->topsock, &rfds, NULL, NULL, &tv);
+        /* Ждем готовые дескрипторы соседей, но не дольше
+            ближайшего срока подключения */
+        count = epoll_wait(client->epollfd, events, NUMBER_SLOTS, timeout);
         /* Обрабатываем все дескрипторы, принявшие данные */
-        for(i=0; i<NUMBER_SLOTS; i++)
+        for(i=0; i<count; i++)
         {
-            /* Если сокет элемента находится во множестве доступных для чтения */
-            if(FD_ISSET(client->slots[i].socket, &rfds))
+            /* Контекст события - слот соседа, нулевой - остановка */
+            slot = (struct slot_t *)events[i].data.ptr;
+            if(slot == NULL)
+                return NULL;
+            socket = slot->socket;
+            /* Подключение завершилось успехом или ошибкой */
+            if(client_slot_connecting(client, slot - client->slots))
             {
-                /* Принимаем код сообщения */
-                recvsize = recv(client->slots[i].socket, &code, sizeof(msg_code_t), MSG_WAITALL);
+                client_connect_check(client, slot - client->slots, 0);
+                if(client_find_slot(client, socket) == INVALID_SLOT)
+                    continue;
+            }
+            /* Сосед освободил буфер - досылаем его очередь */
+            if(events[i].events & EPOLLOUT)
+                outq_on_writable(socket);
+            if(!(events[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)))
+                continue;
+            /* Реактор работает по фронту, поэтому читаем порции,
+                пока сокет не опустеет; медленный сосед задерживает
+                только свою порцию, а не остальные слоты */
+            do
+            {
+                recvsize = recv(socket, buffer, REACTOR_BUFSIZE, MSG_DONTWAIT);
                 if(recvsize > 0)
                 {
-                    /* Узнаем размер данных, соответствующих этому сообщению */
-                    msgsize = size_of_msg_tcp_data(code);
-                    /* Если есть данные, которые соответствуют */
-                    if(msgsize)
-                        /* Принимаем их, считая, что у нас всегда правильный протокол
-                            это допущение позволяет использовать MSG_WAITALL, и значительно
-                            упрощает прием */
-                        recvsize += recv(client->slots[i].socket, buffer, msgsize, MSG_WAITALL);
-                    /* Передаем данные обработчику сообщений по протоколу */
-                    msg_tcp_handler(client, i, code, buffer, 0);
-                }
-                /* Если вернуло 0 байт, значит соединение закрылось с той стороны */
-                if(!recvsize)
-                {
-                    client_release_slot(client, i);
+                    client_on_slot_data(client, NULL, socket, buffer, recvsize);
+                    /* Обработчик мог освободить слот */
+                    if(client_find_slot(client, socket) == INVALID_SLOT)
+                        break;
                 }
             }
+            while(recvsize > 0 || (recvsize < 0 && errno == EINTR));
+            /* Если вернуло 0 байт, значит соединение закрылось с той стороны */
+            if(!recvsize || (recvsize < 0 && errno != EAGAIN))
+                client_on_slot_data(client, NULL, socket, NULL, 0);
         }
+        timeout = client_connect_expire(client);
     }
     return NULL;
 }
 
+/* Обработчики движка io_uring и разбор порций данных */
+void client_engine_on_accept(void *ctx, int socket)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(struct sockaddr_in);
+    /* Многоразовый прием не заполняет адрес - узнаем его у сокета */
+    getpeername(socket, (struct sockaddr *)&sa, &sa_len);
+    client_accept_neighbor(client, socket, &sa);
+}
+
+void client_engine_on_unregister(void *ctx, void *arg, int socket)
+{
+    (void)arg;
+    (void)socket;
+    host_unregister((struct client_t *)ctx);
+}
+
+void client_engine_on_release(void *ctx, void *arg, int socket)
+{
+    (void)arg;
+    (void)socket;
+    client_release((struct client_t *)ctx);
+}
+
+void client_engine_on_connect(void *ctx, void *arg, int socket)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    unsigned int slotid;
+    (void)arg;
+    slotid = client_find_slot(client, socket);
+    if(slotid == INVALID_SLOT)
+        return;
+    client_connect_check(client, slotid, 0);
+    /* Срок еще не истек, а сокет не готов - ждем снова */
+    if(client_slot_connecting(client, slotid))
+        engine_repoll(client->slots[slotid].connop);
+}
+
+void client_engine_on_local(void *ctx, void *arg, int socket)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    struct local_peer_t *peer = (struct local_peer_t *)arg;
+    struct sockaddr_in sa;
+    /* У пары сокетов нет адреса, поэтому запоминаем адрес соседа
+        в сети и порт его слушателя - по ним к нему смогут
+        подключиться и другие соседи */
+    memset(&sa, 0, sizeof(struct sockaddr_in));
+    sa.sin_family = PF_INET;
+    sa.sin_addr.s_addr = htonl(peer->ipaddr ? peer->ipaddr : INADDR_LOOPBACK);
+    sa.sin_port = htons(peer->port);
+    free(peer);
+    client_accept_neighbor(client, socket, &sa);
+}
+
+void client_on_slot_data(void *ctx, void *arg, int socket,
+    char *data, size_t size)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    unsigned int slotid;
+    msg_code_t code;
+    char *msg;
+    size_t length;
+    (void)arg;
+    slotid = client_find_slot(client, socket);
+    if(slotid == INVALID_SLOT)
+        return;
+    /* Если пришло 0 байт, значит соединение закрылось с той стороны,
+        а незавершенное подключение - не удалось */
+    if(!size)
+    {
+        if(client_slot_connecting(client, slotid))
+            client_connect_check(client, slotid, 1);
+        /* Закрылось соединение, принятое в ожидании места: без
+            повторного поиска клиент остался бы в PLACE_SELECTED */
+        else if(client->state.state == PLACE_SELECTED)
+            on_place_lost(client, slotid);
+        else
+            client_release_slot(client, slotid);
+        return;
+    }
+    /* После перехода на общую память сокет приносит только звонки */
+    if(client->slots[slotid].link != NULL &&
+        client->slots[slotid].link->reading)
+    {
+        client_on_link_data(client, socket);
+        return;
+    }
+    /* Разбираем все целые кадры порции */
+    while(msg_stream_next(&client->slots[slotid].stream, &data, &size,
+        &code, &msg, &length))
+    {
+        /* Потоковые сообщения идут получателю порциями, остальное -
+            обработчику сообщений по протоколу */
+        if(MSG_STREAMED(code))
+            msg_tcp_stream(client, slotid, &client->slots[slotid].stream,
+                msg, length);
+        else
+            msg_tcp_handler(client, slotid, code, msg, length);
+        /* Обработчик мог переместить слот или освободить его */
+        slotid = client_find_slot(client, socket);
+        if(slotid == INVALID_SLOT)
+            return;
+        /* Метка перехода: остаток порции - звонки, кадры дальше
+            идут кольцом */
+        if(client->slots[slotid].link != NULL &&
+            client->slots[slotid].link->reading)
+        {
+            client_on_link_data(client, socket);
+            return;
+        }
+    }
+}
+
+void client_on_link_data(struct client_t *client, int socket)
+{
+    unsigned int slotid;
+    struct shm_link_t *link;
+    msg_code_t code;
+    char *data, *msg;
+    size_t size, chunk, length;
+    while((slotid = client_find_slot(client, socket)) != INVALID_SLOT)
+    {
+        link = client->slots[slotid].link;
+        data = shm_link_peek(link, &chunk);
+        /* Кольцо опустело - спим до следующего звонка */
+        if(!chunk)
+        {
+            if(shm_link_idle(link))
+                break;
+            continue;
+        }
+        /* Кадры разбираются прямо в кольце, место освобождается,
+            когда разобран весь кусок */
+        size = chunk;
+        while(msg_stream_next(&client->slots[slotid].stream, &data, &size,
+            &code, &msg, &length))
+        {
+            if(MSG_STREAMED(code))
+                msg_tcp_stream(client, slotid, &client->slots[slotid].stream,
+                    msg, length);
+            else
+                msg_tcp_handler(client, slotid, code, msg, length);
+            /* Освобожденный слот уже закрыл кольцо */
+            slotid = client_find_slot(client, socket);
+            if(slotid == INVALID_SLOT)
+                return;
+        }
+        /* Писатель соседа ждет места - звоним ему */
+        if(shm_link_consume(link, chunk))
+            outq_ring(socket);
+    }
+    if(slotid == INVALID_SLOT)
+        return;
+    /* Сосед мог освободить место в своем кольце: досылаем очередь,
+        а если запись еще на TCP - повторяем переход */
+    if(!client->slots[slotid].link->writing)
+        msg_link_switch(client, slotid);
+    outq_on_writable(socket);
+}
+
+void client_on_dialog_data(void *ctx, void *arg, int socket,
+    char *data, size_t size)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    msg_code_t code;
+    char *msg;
+    size_t length;
+    (void)arg;
+    (void)socket;
+    /* Закрытие соединения с диспетчером переводит диалог
+        к наследнику */
+    if(!size)
+    {
+        on_dispatcher_lost(client);
+        return;
+    }
+    while(msg_stream_next(&client->dialogstream, &data, &size, &code, &msg,
+        &length))
+        /* Передаем управление обработчику TCP сообщений от диспетчера
+            к клиенту по протоколу */
+        msg_tcp_dialog(client, code, msg, length);
+}
+
+void client_engine_on_failover(void *ctx, void *arg, int socket)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    (void)arg;
+    (void)socket;
+    /* Операция снимается из своего же обработчика,
+        память освободится после его возврата */
+    engine_cancel(client->failop);
+    client->failop = NULL;
+    client_failover_next(client);
+}
+
+void client_engine_on_failover_connect(void *ctx, void *arg, int socket)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    (void)arg;
+    engine_cancel(client->failop);
+    client->failop = NULL;
+    client->failsock = -1;
+    /* Сокет готов к записи или срок попытки истек */
+    if(client_dialog_connect_finish(socket) == 0)
+    {
+        client_failover_attach(client, socket);
+        return;
+    }
+    close(socket);
+    if(stats_elapsed(&client->failstarted)/1000 < FAILOVER_TIMEOUT)
+        client->failop = engine_timer(client->engine,
+            client_engine_on_failover, client, FAILOVER_RETRY);
+}
+
+void client_dispatcher_engine_on_accept(void *ctx, int socket)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    /* Добавляем подключение в реестр и движок */
+    client_dispatcher_add_unit(client, socket);
+    /* Передаем управление обработчику подключений клиентов
+        к диспетчеру по протоколу */
+    msg_dispatcher_tcp_acceptor(client, socket);
+}
+
+void client_dispatcher_engine_on_local(void *ctx, void *arg, int socket)
+{
+    (void)arg;
+    client_dispatcher_engine_on_accept(ctx, socket);
+}
+
+void client_dispatcher_on_unit_data(void *ctx, void *arg, int socket,
+    char *data, size_t size)
+{
+    struct client_t *client = (struct client_t *)ctx;
+    struct unit_t *unit = (struct unit_t *)arg;
+    msg_code_t code;
+    char *msg;
+    size_t length;
+    /* Если пришло 0 байт, значит соединение закрылось с той стороны */
+    if(!size)
+    {
+        client_dispatcher_remove_unit(client, socket);
+        return;
+    }
+    while(msg_stream_next(&unit->stream, &data, &size, &code, &msg,
+        &length))
+        /* Передаем управление обработчику TCP сообщений от клиентов к диспетчеру
+            по протоколу */
+        msg_dispatcher_tcp_handler(client, unit, code, msg, length);
+}
+
 #endif /* ifndef CLIENT_C */
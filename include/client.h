@@ -22,13 +22,32 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <sys/ioctl.h>
 #include <net/if.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <errno.h>
 
 #include <pthread.h>
 #include <semaphore.h>
 #include <time.h>
 
+#include "registry.h"
+#include "uring.h"
+#include "engine.h"
+#include "sim.h"
+#include "stream.h"
+#include "host.h"
+#include "outq.h"
+#include "log.h"
+#include "stats.h"
+#include "place.h"
+#include "collective.h"
+#include "standby.h"
+
 #define IPADDR_LOCALHOST      (0x7F000001)
 #define DISPATCHER_PORT             (7800)
 #define DEFAULT_NETADDRSCOUNT         (10)
@@ -36,29 +55,91 @@
 #define NUMBER_SLOTS                   (8)
 #define INVALID_SLOT          (0xFFFFFFFF)
 #define FREE_SLOT             INVALID_SLOT
+/* Количество колец удаления, которые диспетчер ведет отдельно,
+    участники дальних колец ищутся обходом реестра */
+#define DISPATCHER_RINGS            (1024)
+/* Вместимость кольца: в центре один диспетчер, далее 8*i клиентов */
+#define RING_CAPACITY(distance) \
+    ((distance) ? 8*(distance) : 1)
+/* Количество событий, забираемых из epoll за один вызов */
+#define REACTOR_EVENTS                (64)
+/* Размер порции, читаемой из сокета одним вызовом recv, полезная
+    нагрузка выдается получателю прямо из этого буфера */
+#define REACTOR_BUFSIZE            (65536)
+/* Ожидание ответа на первую попытку поиска диспетчера
+    в миллисекундах, каждая следующая ждет вдвое дольше */
+#define DISCOVERY_TIMEOUT              (4)
+/* Общий срок поиска диспетчера в миллисекундах: он должен покрывать
+    обмен по UDP в нагруженной сети, иначе живой диспетчер будет
+    пропущен и появится второй; но пока клиент ищет, он еще
+    не отвечает сам, и запущенный в это окно клиент тоже станет
+    диспетчером, поэтому срок не стоит делать больше нужного;
+    задается, например, как
+    bash makefile -DDISCOVERY_DEADLINE=1000 */
+#ifndef DISCOVERY_DEADLINE
+# define DISCOVERY_DEADLINE          (200)
+#endif /* DISCOVERY_DEADLINE */
+/* Имя файла с адресом последнего найденного диспетчера,
+    он лежит рядом с файлами кэша места */
+#define DISCOVERY_CACHE "psmd.dispatcher"
+/* Срок установления соединения с соседом в миллисекундах */
+#define CONNECT_TIMEOUT             (1000)
+/* Переподключение диалога к наследнику диспетчера: промежуток
+    между попытками и предельный срок в миллисекундах */
+#define FAILOVER_RETRY                (20)
+#define FAILOVER_TIMEOUT            (3000)
+/* Проверка живости диалога с диспетчером, если тот пропал без
+    закрытия соединения: простой и промежуток проб в секундах
+    и количество проб без ответа */
+#define FAILOVER_KEEPIDLE              (1)
+#define FAILOVER_KEEPINTVL             (1)
+#define FAILOVER_KEEPCNT               (3)
+/* Подключение без рукопожатия по завершении */
+#define NO_HANDSHAKE                  (-1)
+/* Элементов iovec и кадров полезной нагрузки
+    в одной записи в сокет */
+#define PAYLOAD_IOV                   (64)
+#define PAYLOAD_BATCH                 (16)
 
 /* Для наглядного отличия хранимых и отправляемых
     адресов от адресов записаных в сетевом порядке */
 typedef in_addr_t addr_data_t;
 
-struct unit_t
-{
-    int socket;
-    unsigned int distance;
-};
+struct client_t;
+union msg_data_t;
 
-struct unit_node_t
+/* Получатель полезной нагрузки: вызывается нитью чтения соседа
+    в позиции position для каждой пришедшей порции сообщения, порция
+    лежит в буфере приема и действительна только до возврата,
+    remain - сколько байт сообщения еще придет, 0 - конец сообщения */
+typedef void (*client_receiver_t)(void *ctx, struct client_t *client,
+    unsigned int position, const char *data, size_t size, size_t remain);
+
+/* Кольцо участников с одинаковым удалением от диспетчера */
+struct ring_t
 {
-    struct unit_t unit;
-    struct unit_node_t *next;
+    /* Первый участник кольца */
+    struct unit_t *units;
+    /* Количество участников, читается без блокировки */
+    unsigned int count;
 };
 
 struct dispatcher_t
 {
-    /* Список клиентов для диспетчерезации */
-    struct unit_node_t *units;
-    /* Множество дескрипторов для асинхронного чтения */
-    fd_set fds;
+    /* Реестр клиентов для диспетчерезации */
+    struct unit_registry_t units;
+    /* Участники, сгруппированные по удалению, ведутся
+        нитью обработчика TCP диспетчера */
+    struct ring_t rings[DISPATCHER_RINGS];
+    /* Новые клиенты, которым пока негде оговорить место,
+        в порядке поступления их поиска */
+    struct unit_t *waiting, *waitingtail;
+    /* Длина очереди ожидания и наибольшая длина за время работы */
+    unsigned int waitingcount, waitingpeak;
+    /* Дескриптор epoll для асинхронного чтения, в контексте
+        каждого события хранится указатель на unit_t, нулевой
+        контекст у eventfd остановки клиента */
+    int epollfd;
     /* Адрес диспетчеризуемой сети */
     addr_data_t netaddr;
     /* Дескриптор сокета для отправки по UDP */
@@ -66,17 +147,26 @@ struct dispatcher_t
     /* Дескрипторы сокетов для приема */
     int sdTCP;
     int sdUDP;
-    /* Верхняя граница множества для асинхронного чтения -
-        старший дескриптор + 1 для select */
-    int topsock;
     /* Барьер синхронизации для одновременного старта */
     pthread_barrier_t starter;
     /* Дескрипторы нитей */
     pthread_t thrdUDP;
     pthread_t thrdTCP;
     pthread_t thrdacceptor;
-    /* Мьютекс для работы со списком */
-    pthread_mutex_t listlocker;
+    /* Многоразовый прием соединений движком io_uring */
+    struct engine_op_t *acceptop;
+    /* Очередь io_uring для массовой рассылки и ее мьютекс,
+        рассылка идет из нитей TCP и UDP */
+    struct uring_t fanout;
+    pthread_mutex_t fanoutlock;
+    /* Наследник среди участников кольца 1, ведется нитью обработчика
+        TCP, и копия его адреса и порта для нити приема соединений */
+    struct unit_t *heir;
+    addr_data_t heiraddr;
+    unsigned short heirport;
+    /* У наследника, принявшего диспетчеризацию: участники прежнего
+        диспетчера, которые еще не вернулись, или ничего */
+    struct standby_t *mirror;
 };
 
 /* Состояние протокола */
@@ -97,6 +187,15 @@ struct net_data_t
     addr_data_t broadaddr;
 };
 
+/* Реквизиты соседа из этого же процесса для вызова в нити движка
+    принимающего: передаются копией, потому что сам сосед к моменту
+    вызова может быть уже уничтожен, освобождает их получатель */
+struct local_peer_t
+{
+    addr_data_t ipaddr;
+    unsigned short port;
+};
+
 /* Статус слотов */
 enum
 {
@@ -117,16 +216,42 @@ struct slot_t
     int status;
     addr_data_t ipaddr;
     unsigned short port;
+    /* Сборка кадров и операция приема движка io_uring,
+        перемещаются вместе со слотом */
+    struct stream_t stream;
+    struct engine_op_t *op;
+    /* Неблокирующее подключение к соседу еще не завершено: момент
+        его начала, позиция для рукопожатия по завершении и ожидание
+        записи движка, по которому подключение завершается; первые
+        три поля меняются только под slotlock клиента, позиция
+        остается и после подключения - по ней подтверждение отличает
+        подключение к соседу от выдачи места новому клиенту */
+    int connecting;
+    struct timespec started;
+    int handshake;
+    struct engine_op_t *connop;
+    /* Связь через общую память с соседом на этом же компьютере
+        или ничего, перемещается вместе со слотом */
+    struct shm_link_t *link;
+    /* Принятое соединение ждет рукопожатия, а до него занимает
+        первый свободный слот, который можно отдать другому соседу */
+    int parked;
 };
 
 struct client_t
 {
     /* Дескрипторы сокетов и статус соединения для клиент-клиент */
     struct slot_t slots[NUMBER_SLOTS];
-    /* Множество дескрипторов для взаимодействия с соседями */
-    fd_set fds;
-    /* Граница для обработки множества дескрипторов select'ом */
-    int topsock;
+    /* Подключения слотов начинает нить диалога, а завершает
+        и снимает по сроку реактор или движок */
+    pthread_mutex_t slotlock;
+    /* Дескриптор epoll для взаимодействия с соседями, в контексте
+        каждого события хранится указатель на slot_t, нулевой
+        контекст у eventfd остановки */
+    int epollfd;
+    /* eventfd остановки: после записи в него остается читаемым,
+        поэтому будит все нити клиента и диспетчера разом */
+    int wakefd;
     /* Диспетчер, если ноль, то клиент не занимается диспетчеризацией
         подключений других клиентов */
     struct dispatcher_t *dispatcher;
@@ -137,6 +262,12 @@ struct client_t
     /* Нити для работы с TCP */
     pthread_t thrddialog;
     pthread_t thrdTCP, thrdacceptor;
+    /* Нить движка io_uring, которая обслуживает клиент вместо
+        его собственных нитей, или ничего */
+    struct engine_t *engine;
+    /* Операции движка: прием соседей и диалог с диспетчером */
+    struct engine_op_t *acceptop, *dialogop;
+    struct stream_t dialogstream;
     /* Сокет для отправки сообщений по UDP и TCP диспетчеру */
     int sockUDP, sockTCP;
     /* Адрес компьютера в диспетчеризуемой сети */
@@ -149,9 +280,53 @@ struct client_t
     unsigned char netscount;
     /* Состояние протокола */
     struct protocol_state_t state;
+    /* Время переходов состояний и принятые сообщения */
+    struct stats_t stats;
     /* Удаление от диспетчера используется для раскручивания построения
         сперва будут принимать те, кто ближе к центру */
     unsigned int distance;
+    /* Кольцо, в котором диспетчер советует искать слот */
+    unsigned int ring;
+    /* Позиция якоря, давшего клиенту место (INVALID_SLOT - места нет):
+        клиент сам дает места только в слотах напротив нее */
+    unsigned int anchor;
+    /* Адрес найденного диспетчера, 0 - диспетчер на этом компьютере */
+    addr_data_t dispatcheraddr;
+    /* Наследник диспетчера: адрес и порт его слушателя (0 - не
+        назначен) и сеть диспетчеризации, которую он унаследует */
+    addr_data_t heiraddr;
+    unsigned short heirport;
+    addr_data_t heirnet;
+    /* Зеркало реестра диспетчера у участника кольца 1 или ничего */
+    struct standby_t *standby;
+    /* Начало переподключения к наследнику, таймер следующей
+        попытки или ожидание подключения на движке и сокет
+        незавершенного подключения (-1 - его нет) */
+    struct timespec failstarted;
+    struct engine_op_t *failop;
+    int failsock;
+    /* Файловый кэш места в распределении и его дескриптор */
+    struct place_cache_t *cache;
+    int cachefd;
+    /* Клиент возвращает прежнее место напрямую у соседей, флаг
+        меняют нить диалога и реактор, только атомарно */
+    int reclaiming;
+    /* Получатель полезной нагрузки и его контекст */
+    client_receiver_t receiver;
+    void *receiverctx;
+    /* Коллективные операции по дереву колец удаления */
+    struct collective_t *collective;
+};
+
+/* Показатели клиента, возвращаемые client_get_stats */
+struct client_stats_t
+{
+    /* Рукопожатие этого клиента */
+    struct stats_t handshake;
+    /* Гистограммы фаз и счетчики сообщений всего процесса */
+    struct stats_process_t process;
+    /* Очереди отправки процесса */
+    struct outq_stats_t queues;
 };
 
 /* Создает клиент и возвращает
@@ -168,6 +343,44 @@ void client_destroy
     struct client_t *client
 );
 
+/* Будит нити клиента и диспетчера через wakefd
+    и дожидается их завершения */
+void client_stop
+(
+    struct client_t *client
+);
+
+/* Снимает операции движка, закрывает диалог с диспетчером,
+    освобождает все слоты и функции диспетчера; нити клиента
+    к этому моменту остановлены, с движком выполняется в его нити */
+void client_release
+(
+    struct client_t *client
+);
+
+/* Ждет, пока сокет socket станет читаемым, возвращает 0,
+    или -1, если клиент останавливается или ожидание сломалось */
+int client_wait
+(
+    struct client_t *client,
+    int socket
+);
+
+/* Переводит протокол клиента в состояние state
+    и отмечает время перехода */
+void client_set_state
+(
+    struct client_t *client,
+    unsigned int state
+);
+
+/* Заполняет показатели клиента и процесса */
+void client_get_stats
+(
+    struct client_t *client,
+    struct client_stats_t *stats
+);
+
 /* Ищет айпи-адрес, соответствующий
     адресу подсети */
 addr_data_t client_get_ipaddr_by_netaddr
@@ -184,14 +397,29 @@ addr_data_t client_get_netaddr_by_ipaddr
     addr_data_t ipaddr
 );
 
-/* Ждет ответ от диспетчера в течении 50мс
-    если ответ пришел - возвращает адрес
-    отправителя ответа, иначе 0 */
+/* Ищет диспетчер повторными запросами во всех сетях компьютера
+    и у последнего известного диспетчера, если ответ пришел -
+    возвращает адрес отправителя ответа, иначе 0 */
 addr_data_t client_wait_dispatcher_discover_anwer
 (
     struct client_t *client
 );
 
+/* Возвращает адрес последнего найденного диспетчера
+    из файла DISCOVERY_CACHE или 0; чужой файл или ссылка
+    на этом месте не читаются */
+addr_data_t client_load_dispatcher_addr
+(
+    void
+);
+
+/* Запоминает адрес найденного диспетчера в файле DISCOVERY_CACHE,
+    если он свой или его еще нет */
+void client_store_dispatcher_addr
+(
+    addr_data_t ipaddr
+);
+
 /* Инициализирует клиенту функции диспетчера */
 void client_dispatchering_init
 (
@@ -204,6 +432,77 @@ void client_dispatcher_release
     struct client_t *client
 );
 
+/* Наследник принимает диспетчеризацию: занимает порт диспетчера
+    и забирает зеркало как список участников, которые должны
+    вернуться; возвращает -1, если порт еще не освободился */
+int client_dispatcher_takeover
+(
+    struct client_t *client
+);
+
+/* Диалог с диспетчером закрылся: переподключает его к наследнику,
+    повторяя попытки не дольше FAILOVER_TIMEOUT, с движком -
+    по таймеру; возвращает -1, если наследника нет или срок вышел */
+int client_failover
+(
+    struct client_t *client
+);
+
+/* Одна попытка переподключения диалога к наследнику,
+    возвращает 0 при успехе, -1, если попытку надо повторить,
+    и 1, если на движке начато подключение через failsock */
+int client_failover_attempt
+(
+    struct client_t *client
+);
+
+/* Делает попытку на движке и ставит ожидание ее исхода или
+    таймер следующей, пока не вышел срок FAILOVER_TIMEOUT */
+void client_failover_next
+(
+    struct client_t *client
+);
+
+/* Ведет диалог с наследником через подключенный сокет sd */
+void client_failover_attach
+(
+    struct client_t *client,
+    int sd
+);
+
+/* Подключается к порту диспетчера на ipaddr, ожидая не дольше
+    FAILOVER_RETRY, возвращает сокет или -1 */
+int client_dialog_connect
+(
+    addr_data_t ipaddr
+);
+
+/* Начинает неблокирующее подключение к порту диспетчера
+    на ipaddr, возвращает сокет или -1 */
+int client_dialog_connect_start
+(
+    addr_data_t ipaddr
+);
+
+/* Проверяет исход подключения sd: 0 - установлено, и сокет
+    переведен в блокирующий режим, -1 - нет */
+int client_dialog_connect_finish
+(
+    int sd
+);
+
+/* Проверяет, назначен ли наследником сам клиент */
+int client_is_heir
+(
+    struct client_t *client
+);
+
+/* Включает проверку живости соединения с диспетчером */
+void client_set_keepalive
+(
+    int socket
+);
+
 /* Опрашивает ioctl для получения данных о
     сетевых интерфейсов, возвращает указатель
     на массив данных, по указателю count возвращает
@@ -222,24 +521,134 @@ unsigned int client_has_free_slot
     struct client_t *client
 );
 
-/* Выполняет подключение клиента к клиенту */
-void client_connect_to_client
+/* Проверяет, дает ли клиент место в слоте slotid: у каждой клетки
+    следующего кольца один хозяин - клетка, через которую идет путь к
+    центру (по стороне для середин, по диагонали для углов), поэтому
+    одну клетку не раздают двум новым клиентам разные участники */
+int client_slot_owned
+(
+    struct client_t *client,
+    unsigned int slotid
+);
+
+/* Возвращает свободный слот, в котором клиент дает место,
+    или некорректный слот, если такого нет */
+unsigned int client_has_place_slot
+(
+    struct client_t *client
+);
+
+/* Освобождает позицию position от соединения, ждущего рукопожатия,
+    перенося его в другой свободный слот; возвращает 1, если позиция
+    свободна */
+int client_slot_unpark
+(
+    struct client_t *client,
+    unsigned int position
+);
+
+/* Возвращает количество свободных слотов, в которых клиент дает место */
+unsigned int client_place_slots
+(
+    struct client_t *client
+);
+
+/* Начинает подключение клиента к клиенту без блокировки и занимает
+    слот, по завершении соседу уходит рукопожатие с позицией handshake
+    (NO_HANDSHAKE - без него); возвращает 0, или -1, если соединиться
+    не удалось сразу и слот остался свободным */
+int client_connect_to_client
 (
     struct client_t *client,
     unsigned int slotid,
     addr_data_t ipaddr,
-    unsigned short port
+    unsigned short port,
+    int handshake
 );
 
-/* Определяет старший из дескрипторов сокетов соседей,
-    возвращает его, увеличив на 1, для select, O(n),
-    используется только для поиска меньшего чем был,
-    иначе - переназначается за O(1) */
-int client_gettopsock
+/* Проверяет исход подключения слота: по успеху отправляет
+    рукопожатие, по ошибке или истечении срока освобождает слот
+    и сообщает протоколу; closed - сокет уже сообщил о разрыве */
+void client_connect_check
+(
+    struct client_t *client,
+    unsigned int slotid,
+    int closed
+);
+
+/* Возвращает 1, если подключение слота slotid еще не завершено */
+int client_slot_connecting
+(
+    struct client_t *client,
+    unsigned int slotid
+);
+
+/* Проверяет сроки всех подключений и возвращает, сколько
+    миллисекунд реактор может ждать до ближайшего из них */
+int client_connect_expire
+(
+    struct client_t *client
+);
+
+/* Пробует вернуть место из кэша: соединяется с прежними соседями
+    и рукопожатием занимает у них свои позиции, возвращает 1,
+    если возврат начат, и 0, если нужен полный протокол */
+int client_reclaim_place
+(
+    struct client_t *client
+);
+
+/* Отказывается от возврата места и начинает поиск слота; из
+    нескольких одновременных вызовов это делает только первый */
+void client_reclaim_abort
+(
+    struct client_t *client
+);
+
+/* Освобождает все слоты и начинает поиск слота заново */
+void client_place_restart
+(
+    struct client_t *client
+);
+
+/* Переносит место клиента и соседей в файловый кэш */
+void client_cache_sync
 (
     struct client_t *client
 );
 
+/* Проверяет, что адрес принадлежит этому компьютеру */
+int client_is_host_addr
+(
+    struct client_t *client,
+    addr_data_t ipaddr
+);
+
+/* Проверяет, что сосед в слоте работает на этом же компьютере
+    в другом процессе и соединен с ним по TCP */
+int client_is_host_link
+(
+    struct client_t *client,
+    unsigned int slotid
+);
+
+/* Ищет слот, занятый указанным сокетом, возвращает его
+    идентификатор или некорректный слот, если не найден */
+unsigned int client_find_slot
+(
+    struct client_t *client,
+    int socket
+);
+
+/* Занимает слот входящим соединением соседа, если протокол
+    готов его принять, иначе закрывает соединение */
+void client_accept_neighbor
+(
+    struct client_t *client,
+    int socket,
+    struct sockaddr_in *sa
+);
+
 /* Безопасное занятие слота */
 void client_use_slot
 (
@@ -250,6 +659,13 @@ void client_use_slot
     unsigned short port
 );
 
+/* Отключает задержку Нагла: сообщения протокола короткие и
+    пишутся целыми пакетами, копить их до полного сегмента незачем */
+void client_set_nodelay
+(
+    int socket
+);
+
 /* Безопасное освобождение слота */
 void client_release_slot
 (
@@ -273,36 +689,191 @@ void client_slot_ready
     unsigned int slotid
 );
 
-/* Список участников диспетчеризации */
-/* Добавление к списку */
+/* Возвращает 1, если сосед в слоте slotid готов; состояние слота
+    меняется под slotlock, поэтому его можно читать из любой нити */
+int client_slot_is_ready
+(
+    struct client_t *client,
+    unsigned int slotid
+);
+
+/* Полезная нагрузка между готовыми соседями */
+/* Задает получателя полезной нагрузки клиента */
+void client_set_receiver
+(
+    struct client_t *client,
+    client_receiver_t receiver,
+    void *ctx
+);
+
+/* Отправляет сообщение соседу в позиции position, данные уходят
+    ядру прямо из буфера без копирования, блокируется, пока сокет
+    не примет все; сокет соседа удерживается до конца записи, даже
+    если слот тем временем освободят; возвращает 0 или -1, если
+    сосед не готов, соединение разорвано или вызов сделан из нити
+    ввода-вывода клиента (из получателя или обработчика движка) -
+    там запись ждала бы сама себя */
+int client_send
+(
+    struct client_t *client,
+    unsigned int position,
+    const void *buffer,
+    size_t size
+);
+
+/* То же для сообщения, собранного из частей iov */
+int client_sendv
+(
+    struct client_t *client,
+    unsigned int position,
+    const struct iovec *iov,
+    int iovcnt
+);
+
+/* Отправляет соседу потоковое сообщение code с полями data,
+    тело собирается из частей iov и режется на кадры по
+    PAYLOAD_CHUNK, возвращает 0 или -1; ограничения те же,
+    что у client_send */
+int client_send_stream
+(
+    struct client_t *client,
+    unsigned int position,
+    unsigned int code,
+    union msg_data_t *data,
+    const struct iovec *iov,
+    int iovcnt
+);
+
+/* Отправляет сообщение всем готовым соседям, возвращает
+    количество соседей, которым оно ушло; из нити ввода-вывода
+    клиента не отправляет никому */
+unsigned int client_broadcast
+(
+    struct client_t *client,
+    const void *buffer,
+    size_t size
+);
+
+/* Возвращает 1, если вызов идет из нити, которая обслуживает
+    соединения соседей клиента: реактора или движка */
+int client_on_io_thread
+(
+    struct client_t *client
+);
+
+/* Реестр участников диспетчеризации */
+/* Добавление в реестр */
 void client_dispatcher_add_unit
 (
     struct client_t *client,
     int socket
 );
 
-/* Удаление из списка */
+/* Удаление из реестра за O(1) */
 void client_dispatcher_remove_unit
 (
     struct client_t *client,
     int socket
 );
 
-/* Операции над элементами списка диспетчера */
-/* Поиск элемента по заданному дескриптору сокета, вернет
-    указатель на предыдущий элемент или ничего, если не найдено */
-struct unit_node_t *client_dispatcher_prev_unit
+/* Кольца удаления */
+/* Переносит участника в кольцо с новым удалением */
+void client_dispatcher_set_distance
 (
-    struct dispatcher_t *dispatcher,
-    int socket
+    struct client_t *client,
+    struct unit_t *unit,
+    unsigned int distance
+);
+
+/* Ведет резерв после изменения участника unit, который раньше
+    был на удалении previous: сообщает изменение зеркалам кольца 1,
+    новому участнику кольца 1 передает весь реестр и при смене
+    состава кольца 1 заново выбирает наследника */
+void client_dispatcher_replicate
+(
+    struct client_t *client,
+    struct unit_t *unit,
+    unsigned int previous
+);
+
+/* Выбирает наследника среди участников кольца 1: сначала
+    с других компьютеров, затем из других процессов; при смене
+    сообщает его всем участникам */
+void client_dispatcher_elect
+(
+    struct client_t *client
+);
+
+/* Проверяет, описывает ли запись реестра самого диспетчера */
+int client_dispatcher_is_self
+(
+    struct client_t *client,
+    struct unit_t *unit
+);
+
+/* Возвращает количество участников в кольце */
+unsigned int client_dispatcher_ring_count
+(
+    struct client_t *client,
+    unsigned int distance
+);
+
+/* Выбирает ближайшее к центру кольцо, у которого
+    следующее кольцо еще не заполнено, т.е. у участников
+    которого есть свободные слоты */
+unsigned int client_dispatcher_pick_ring
+(
+    struct client_t *client
+);
+
+/* Возвращает участника кольца distance с наибольшим запасом
+    неоговоренных свободных слотов или ничего */
+struct unit_t *client_dispatcher_ring_anchor
+(
+    struct client_t *client,
+    unsigned int distance
+);
+
+/* Оговаривает новому клиенту joiner слот у участника кольца distance,
+    а если там слотов нет - любого другого кольца, прежняя оговорка
+    клиента снимается; возвращает участника или ничего, если
+    свободных слотов не осталось ни у кого */
+struct unit_t *client_dispatcher_reserve
+(
+    struct client_t *client,
+    struct unit_t *joiner,
+    unsigned int distance
+);
+
+/* Снимает оговорку слота нового клиента */
+void client_dispatcher_unreserve
+(
+    struct client_t *client,
+    struct unit_t *joiner
+);
+
+/* Ставит нового клиента в очередь ожидания свободных слотов */
+void client_dispatcher_wait
+(
+    struct client_t *client,
+    struct unit_t *joiner
 );
 
-/* Возвращает границу дескрипторов для select, O(n), 
-    нужна только при поиске меньшего чем был, в другом
-    случае используется переназначение за O(1) */
-int client_dispatcher_gettopsock
+/* Убирает нового клиента из очереди ожидания */
+void client_dispatcher_unwait
 (
-    struct dispatcher_t *dispatcher
+    struct client_t *client,
+    struct unit_t *joiner
+);
+
+/* Ищет нового клиента, которому оговорен слот у участника
+    anchor, по адресу и порту из его поиска слота */
+struct unit_t *client_dispatcher_find_joiner
+(
+    struct client_t *client,
+    struct unit_t *anchor,
+    addr_data_t ipaddr,
+    unsigned short port
 );
 
 /* Обработчики входящих сообщений для диспетчера */
@@ -349,6 +920,121 @@ void *client_tcp_handler
     void *arg
 );
 
-#define PROTO_PRINT printf
+/* Обработчики движка io_uring, вызываются в его нити
+    вместо нитей клиента и диспетчера */
+/* Прием соединения соседа */
+void client_engine_on_accept
+(
+    void *ctx,
+    int socket
+);
+
+/* Исключение клиента из реестра процесса в нити движка,
+    контекст - клиент */
+void client_engine_on_unregister
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Освобождение клиента в нити движка, контекст - клиент */
+void client_engine_on_release
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Разбор порций данных потока TCP, вызываются как движком,
+    так и нитями реакторов; нулевой размер - соединение закрыто */
+/* Порция данных от соседа */
+void client_on_slot_data
+(
+    void *ctx,
+    void *arg,
+    int socket,
+    char *data,
+    size_t size
+);
+
+/* Разбирает все, что сосед записал в кольцо общей памяти,
+    вызывается по звонку, пришедшему в сокет соседа */
+void client_on_link_data
+(
+    struct client_t *client,
+    int socket
+);
+
+/* Порция данных от диспетчера */
+void client_on_dialog_data
+(
+    void *ctx,
+    void *arg,
+    int socket,
+    char *data,
+    size_t size
+);
+
+/* Прием соединения участника диспетчеризации */
+void client_dispatcher_engine_on_accept
+(
+    void *ctx,
+    int socket
+);
+
+/* Завершение или истечение срока подключения к соседу */
+void client_engine_on_connect
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Прием соседа из этого же процесса, ctx - принимающий клиент,
+    arg - реквизиты подключающегося (struct local_peer_t),
+    socket - его конец пары сокетов */
+void client_engine_on_local
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Срок очередной попытки переподключения к наследнику */
+void client_engine_on_failover
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Исход подключения к наследнику: сокет готов к записи
+    или срок попытки истек */
+void client_engine_on_failover_connect
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Прием участника диспетчеризации из этого же процесса,
+    arg не используется */
+void client_dispatcher_engine_on_local
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Порция данных от участника диспетчеризации */
+void client_dispatcher_on_unit_data
+(
+    void *ctx,
+    void *arg,
+    int socket,
+    char *data,
+    size_t size
+);
 
 #endif /* ifndef CLIENT_H */
@@ -0,0 +1,518 @@
+/*
+ ============================================================================
+ Name        : collective.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация коллективных операций матрицы распределения
+ ============================================================================
+ */
+
+#ifndef COLLECTIVE_C
+#define COLLECTIVE_C
+
+#include "protocol.h"
+
+struct collective_t *collective_create(struct client_t *client)
+{
+    struct collective_t *collective;
+    collective = (struct collective_t *)calloc(1,
+        sizeof(struct collective_t));
+    if(collective == NULL)
+        return NULL;
+    collective->client = client;
+    collective->parent = COLLECTIVE_ROOT;
+    pthread_mutex_init(&collective->locker, NULL);
+    pthread_cond_init(&collective->changed, NULL);
+    return collective;
+}
+
+void collective_destroy(struct collective_t *collective)
+{
+    unsigned int i;
+    if(collective == NULL)
+        return;
+    for(i=0; i<COLLECTIVE_LINKS; i++)
+        collective_reset(collective, i);
+    pthread_cond_destroy(&collective->changed);
+    pthread_mutex_destroy(&collective->locker);
+    free(collective);
+}
+
+/* Освобождает сообщение вместе с телом */
+static void collective_free(struct collective_msg_t *msg)
+{
+    if(msg == NULL)
+        return;
+    free(msg->data);
+    free(msg);
+}
+
+void collective_reset(struct collective_t *collective, unsigned int slotid)
+{
+    struct collective_link_t *link;
+    struct collective_msg_t *msg;
+    if(collective == NULL || slotid >= COLLECTIVE_LINKS)
+        return;
+    pthread_mutex_lock(&collective->locker);
+    link = collective->links + slotid;
+    collective_free(link->current);
+    while((msg = link->ready) != NULL)
+    {
+        link->ready = msg->next;
+        collective_free(msg);
+    }
+    memset(link, 0, sizeof(struct collective_link_t));
+    /* Операции, ждущие этого соседа, проверят его слот */
+    pthread_cond_broadcast(&collective->changed);
+    pthread_mutex_unlock(&collective->locker);
+}
+
+void collective_on_data(struct collective_t *collective, unsigned int slotid,
+    unsigned char kind, unsigned int seq, const char *data, size_t size,
+    size_t remain)
+{
+    struct collective_link_t *link;
+    struct collective_msg_t *msg;
+    if(collective == NULL || slotid >= COLLECTIVE_LINKS)
+        return;
+    pthread_mutex_lock(&collective->locker);
+    link = collective->links + slotid;
+    switch(kind)
+    {
+    case COLLECTIVE_HELLO:
+        link->distance = seq;
+        link->known = 1;
+        break;
+    case COLLECTIVE_PARENT:
+        link->child = seq ? 1 : 0;
+        link->answered = 1;
+        break;
+    case COLLECTIVE_DOWN:
+    case COLLECTIVE_UP:
+        /* Первая порция знает размер всего сообщения; если памяти
+            не хватило, порции пропускаются, а ждущий получит
+            сообщение без тела */
+        if((msg = link->current) == NULL)
+        {
+            msg = (struct collective_msg_t *)calloc(1,
+                sizeof(struct collective_msg_t));
+            if(msg == NULL)
+                break;
+            msg->kind = kind;
+            msg->seq = seq;
+            msg->size = size + remain;
+            msg->data = (char *)malloc(msg->size ? msg->size : 1);
+            link->current = msg;
+        }
+        if(msg->data != NULL && size <= msg->size - msg->filled)
+        {
+            memcpy(msg->data + msg->filled, data, size);
+            msg->filled += size;
+        }
+        if(remain)
+            break;
+        link->current = NULL;
+        if(link->readytail != NULL)
+            link->readytail->next = msg;
+        else
+            link->ready = msg;
+        link->readytail = msg;
+        break;
+    default:
+        LOG_TRACE(("collective: unknown kind %d from slot %d\n", kind,
+            slotid));
+        break;
+    }
+    pthread_cond_broadcast(&collective->changed);
+    pthread_mutex_unlock(&collective->locker);
+}
+
+int collective_send(struct client_t *client, unsigned int slotid,
+    unsigned char kind, unsigned int seq, const void *buffer, size_t size)
+{
+    union msg_data_t data;
+    struct iovec iov;
+    memset(&data, 0, sizeof(union msg_data_t));
+    data.collective.kind = kind;
+    data.collective.seq = seq;
+    iov.iov_base = (void *)buffer;
+    iov.iov_len = size;
+    return client_send_stream(client, slotid, COLLECTIVE, &data, &iov, 1);
+}
+
+/* Ждет изменений от нитей чтения не дольше COLLECTIVE_WAIT,
+    вызывается под блокировкой */
+static void collective_sleep(struct collective_t *collective)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += COLLECTIVE_WAIT * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&collective->changed, &collective->locker,
+        &deadline);
+}
+
+/* Сосед в слоте еще готов, иначе его ответа не дождаться */
+static int collective_alive(struct collective_t *collective,
+    unsigned int slotid)
+{
+    return client_slot_is_ready(collective->client, slotid);
+}
+
+struct collective_msg_t *collective_wait(struct collective_t *collective,
+    unsigned int slotid, unsigned char kind, unsigned int seq)
+{
+    struct collective_link_t *link = collective->links + slotid;
+    struct collective_msg_t *msg, *prev;
+    pthread_mutex_lock(&collective->locker);
+    for(;;)
+    {
+        /* Сообщения следующих операций могут прийти раньше, поэтому
+            ищем по всей очереди, а не берем первое */
+        for(prev = NULL, msg = link->ready; msg != NULL;
+            prev = msg, msg = msg->next)
+                if(msg->kind == kind && msg->seq == seq)
+                    break;
+        if(msg != NULL)
+        {
+            if(prev != NULL)
+                prev->next = msg->next;
+            else
+                link->ready = msg->next;
+            if(link->readytail == msg)
+                link->readytail = prev;
+            msg->next = NULL;
+            break;
+        }
+        if(!collective_alive(collective, slotid))
+            break;
+        collective_sleep(collective);
+    }
+    pthread_mutex_unlock(&collective->locker);
+    return msg;
+}
+
+/* Срок построения дерева, отсчитанный от started, истек */
+static int collective_expired(struct timespec *started)
+{
+    return stats_elapsed(started) >= COLLECTIVE_SETUP_TIMEOUT*1000UL;
+}
+
+int collective_setup(struct client_t *client)
+{
+    struct collective_t *collective = client->collective;
+    struct collective_link_t *link;
+    struct timespec started;
+    unsigned int i, distance = client->distance;
+    int parent = COLLECTIVE_ROOT, pending;
+    if(collective == NULL || distance == INVALID_DISTANCE)
+        return -1;
+    stats_now(&started);
+    /* Ответы соседей не сбрасываются: они могли начать раньше
+        и уже прислать знакомство и выбор родителя */
+    collective->ready = 0;
+    /* Знакомимся со всеми готовыми соседями */
+    for(i=0; i<COLLECTIVE_LINKS; i++)
+        if(collective_alive(collective, i) &&
+            collective_send(client, i, COLLECTIVE_HELLO, distance, NULL, 0))
+                return -1;
+    pthread_mutex_lock(&collective->locker);
+    do
+    {
+        pending = 0;
+        for(i=0; i<COLLECTIVE_LINKS; i++)
+            if(collective_alive(collective, i) && !collective->links[i].known)
+                pending = 1;
+        if(pending && collective_expired(&started))
+        {
+            pthread_mutex_unlock(&collective->locker);
+            return -1;
+        }
+        if(pending)
+            collective_sleep(collective);
+    }
+    while(pending);
+    /* Родитель - сосед кольцом ближе к диспетчеру в младшем слоте,
+        так все клиенты выбирают одинаково при любом порядке ответов */
+    for(i=0; i<COLLECTIVE_LINKS && distance; i++)
+        if(collective_alive(collective, i) &&
+            collective->links[i].distance + 1 == distance)
+        {
+            parent = (int)i;
+            break;
+        }
+    pthread_mutex_unlock(&collective->locker);
+    if(distance && parent == COLLECTIVE_ROOT)
+        return -1;
+    collective->parent = parent;
+    /* Каждый сосед ближе к диспетчеру узнает, стал ли он родителем */
+    for(i=0; i<COLLECTIVE_LINKS && distance; i++)
+        if(collective_alive(collective, i) &&
+            collective->links[i].distance + 1 == distance &&
+            collective_send(client, i, COLLECTIVE_PARENT, (int)i == parent,
+                NULL, 0))
+                    return -1;
+    /* Ждем решения соседей дальше от диспетчера */
+    pthread_mutex_lock(&collective->locker);
+    do
+    {
+        pending = 0;
+        for(i=0; i<COLLECTIVE_LINKS; i++)
+        {
+            link = collective->links + i;
+            if(collective_alive(collective, i) &&
+                link->distance == distance + 1 && !link->answered)
+                    pending = 1;
+        }
+        if(pending && collective_expired(&started))
+        {
+            pthread_mutex_unlock(&collective->locker);
+            return -1;
+        }
+        if(pending)
+            collective_sleep(collective);
+    }
+    while(pending);
+    collective->ready = 1;
+    pthread_mutex_unlock(&collective->locker);
+    return 0;
+}
+
+/* Соседи, выбравшие этот клиент родителем */
+static int collective_is_child(struct collective_t *collective,
+    unsigned int slotid)
+{
+    return collective->links[slotid].answered &&
+        collective->links[slotid].child &&
+        collective_alive(collective, slotid);
+}
+
+int collective_broadcast(struct client_t *client, void *buffer, size_t size)
+{
+    struct collective_t *collective = client->collective;
+    struct collective_msg_t *msg;
+    unsigned int i, seq;
+    int retval = 0;
+    if(collective == NULL || !collective->ready)
+        return -1;
+    seq = collective->seq++;
+    if(collective->parent != COLLECTIVE_ROOT)
+    {
+        msg = collective_wait(collective, collective->parent,
+            COLLECTIVE_DOWN, seq);
+        if(msg == NULL)
+            return -1;
+        if(msg->data == NULL || msg->size != size)
+            retval = -1;
+        else
+            memcpy(buffer, msg->data, size);
+        collective_free(msg);
+    }
+    /* Волна идет дальше, даже если у этого клиента
+        размеры не сошлись, чтобы не держать поддерево */
+    for(i=0; i<COLLECTIVE_LINKS; i++)
+        if(collective_is_child(collective, i) &&
+            collective_send(client, i, COLLECTIVE_DOWN, seq, buffer, size))
+                retval = -1;
+    return retval;
+}
+
+int collective_reduce(struct client_t *client, void *buffer, size_t count,
+    int type, int op)
+{
+    struct collective_t *collective = client->collective;
+    struct collective_msg_t *msg;
+    size_t size = count*collective_width(type);
+    unsigned char *scratch;
+    unsigned int i, seq;
+    int retval = 0;
+    if(collective == NULL || !collective->ready || !collective_width(type))
+        return -1;
+    seq = collective->seq++;
+    /* Свертки детей раскладываются и своя собирается в порядке
+        передачи в одном буфере, элемент компьютера не шире */
+    scratch = (unsigned char *)malloc(count*COLLECTIVE_WIDTH_MAX + 1);
+    if(scratch == NULL)
+        return -1;
+    /* Сперва собираем поддерево: дети на внешнем кольце
+        присылают свои свертки */
+    for(i=0; i<COLLECTIVE_LINKS; i++)
+    {
+        if(!collective_is_child(collective, i))
+            continue;
+        msg = collective_wait(collective, i, COLLECTIVE_UP, seq);
+        if(msg == NULL)
+        {
+            retval = -1;
+            continue;
+        }
+        if(msg->data == NULL || msg->size != size)
+            retval = -1;
+        else
+        {
+            collective_decode(scratch, (unsigned char *)msg->data, count,
+                type);
+            collective_combine(buffer, scratch, count, type, op);
+        }
+        collective_free(msg);
+    }
+    if(collective->parent != COLLECTIVE_ROOT)
+    {
+        collective_encode(scratch, buffer, count, type);
+        if(collective_send(client, collective->parent, COLLECTIVE_UP, seq,
+            scratch, size))
+                retval = -1;
+    }
+    free(scratch);
+    return retval;
+}
+
+int collective_allreduce(struct client_t *client, void *buffer,
+    size_t count, int type, int op)
+{
+    unsigned char *scratch;
+    int retval;
+    retval = collective_reduce(client, buffer, count, type, op);
+    scratch = (unsigned char *)malloc(count*COLLECTIVE_WIDTH_MAX + 1);
+    if(scratch == NULL)
+        return -1;
+    /* Рассылка идет всегда, иначе соседи зависнут в ожидании */
+    collective_encode(scratch, buffer, count, type);
+    if(collective_broadcast(client, scratch,
+        count*collective_width(type)))
+            retval = -1;
+    else
+        collective_decode(buffer, scratch, count, type);
+    free(scratch);
+    return retval;
+}
+
+int collective_barrier(struct client_t *client)
+{
+    int dummy = 0;
+    return collective_allreduce(client, &dummy, 0, COLLECTIVE_INT,
+        COLLECTIVE_SUM);
+}
+
+size_t collective_width(int type)
+{
+    switch(type)
+    {
+    case COLLECTIVE_INT:
+        return 4;
+    case COLLECTIVE_LONG:
+    case COLLECTIVE_DOUBLE:
+        return 8;
+    }
+    return 0;
+}
+
+#define COLLECTIVE_APPLY(ctype, buffer, data, count, op) \
+    { \
+        ctype *to = (ctype *)(buffer); \
+        const ctype *from = (const ctype *)(data); \
+        size_t k; \
+        for(k=0; k<(count); k++) \
+            switch(op) \
+            { \
+            case COLLECTIVE_SUM: \
+                to[k] += from[k]; \
+                break; \
+            case COLLECTIVE_MIN: \
+                if(from[k] < to[k]) \
+                    to[k] = from[k]; \
+                break; \
+            case COLLECTIVE_MAX: \
+                if(from[k] > to[k]) \
+                    to[k] = from[k]; \
+                break; \
+            } \
+    }
+
+void collective_combine(void *buffer, const void *data, size_t count,
+    int type, int op)
+{
+    switch(type)
+    {
+    case COLLECTIVE_INT:
+        COLLECTIVE_APPLY(int, buffer, data, count, op);
+        break;
+    case COLLECTIVE_LONG:
+        COLLECTIVE_APPLY(long, buffer, data, count, op);
+        break;
+    case COLLECTIVE_DOUBLE:
+        COLLECTIVE_APPLY(double, buffer, data, count, op);
+        break;
+    }
+}
+
+/* Переставляет байты элементов шириной width, на little-endian
+    компьютере порядок уже совпадает с порядком передачи */
+static void collective_swap(unsigned char *bytes, size_t count,
+    size_t width)
+{
+    const unsigned int one = 1;
+    size_t k, j;
+    unsigned char tmp;
+    if(*(const unsigned char *)&one)
+        return;
+    for(k=0; k<count; k++, bytes += width)
+        for(j=0; j<width/2; j++)
+        {
+            tmp = bytes[j];
+            bytes[j] = bytes[width-1-j];
+            bytes[width-1-j] = tmp;
+        }
+}
+
+void collective_encode(unsigned char *wire, const void *buffer,
+    size_t count, int type)
+{
+    const long *values = (const long *)buffer;
+    size_t width = collective_width(type), k, j;
+    unsigned long value;
+    /* int и double компьютера совпадают по размеру с передачей */
+    if(type != COLLECTIVE_LONG)
+    {
+        memcpy(wire, buffer, count*width);
+        collective_swap(wire, count, width);
+        return;
+    }
+    /* Байты long пишутся сдвигами, поэтому порядок компьютера не
+        важен; недостающие старшие байты заполняются знаком */
+    for(k=0; k<count; k++, wire += width)
+    {
+        value = (unsigned long)values[k];
+        for(j=0; j<width; j++)
+            wire[j] = j < sizeof(long) ? (unsigned char)(value >> 8*j) :
+                (values[k] < 0 ? 0xff : 0);
+    }
+}
+
+void collective_decode(void *buffer, const unsigned char *wire,
+    size_t count, int type)
+{
+    long *values = (long *)buffer;
+    size_t width = collective_width(type), k, j;
+    unsigned long value;
+    if(type != COLLECTIVE_LONG)
+    {
+        memcpy(buffer, wire, count*width);
+        collective_swap((unsigned char *)buffer, count, width);
+        return;
+    }
+    /* Более узкий long компьютера получает младшие байты */
+    for(k=0; k<count; k++, wire += width)
+    {
+        value = 0;
+        for(j=0; j<width && j<sizeof(long); j++)
+            value |= (unsigned long)wire[j] << 8*j;
+        values[k] = (long)value;
+    }
+}
+
+#endif /* ifndef COLLECTIVE_C */
@@ -0,0 +1,245 @@
+/*
+ ============================================================================
+ Name        : collective.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок коллективных операций матрицы распределения
+ ============================================================================
+ */
+
+#ifndef COLLECTIVE_H
+#define COLLECTIVE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Слотов у клиента, совпадает с NUMBER_SLOTS */
+#define COLLECTIVE_LINKS               (8)
+/* Сколько миллисекунд операция ждет данные соседа
+    между проверками, не отключился ли он */
+#define COLLECTIVE_WAIT              (100)
+/* Сколько миллисекунд collective_setup ждет ответов соседей,
+    прежде чем вернуть ошибку: сосед, который не вызвал ее, иначе
+    держал бы клиент бесконечно */
+#define COLLECTIVE_SETUP_TIMEOUT    (5000)
+/* Наибольший размер элемента в порядке передачи */
+#define COLLECTIVE_WIDTH_MAX           (8)
+/* Нет соседа-родителя: корень дерева, диспетчер */
+#define COLLECTIVE_ROOT               (-1)
+
+/* Виды сообщений коллективных операций */
+enum
+{
+    /* Знакомство: удаление отправителя от диспетчера */
+    COLLECTIVE_HELLO,
+    /* Выбор родителя: 1 - получатель стал родителем */
+    COLLECTIVE_PARENT,
+    /* Волна от центра к краям: данные рассылки */
+    COLLECTIVE_DOWN,
+    /* Волна от краев к центру: частичная свертка поддерева */
+    COLLECTIVE_UP
+};
+
+/* Типы элементов свертки: в буфере вызова это int, long и double
+    компьютера, а между клиентами они передаются little-endian по 4,
+    8 и 8 байт, поэтому long сворачивается и между компьютерами с
+    разным его размером (на 32-битном значение обрезается) */
+enum
+{
+    COLLECTIVE_INT,
+    COLLECTIVE_LONG,
+    COLLECTIVE_DOUBLE
+};
+
+/* Операции свертки */
+enum
+{
+    COLLECTIVE_SUM,
+    COLLECTIVE_MIN,
+    COLLECTIVE_MAX
+};
+
+/* Принятое от соседа сообщение операции, тело собирается
+    по порциям нитью чтения */
+struct collective_msg_t
+{
+    unsigned char kind;
+    unsigned int seq;
+    char *data;
+    size_t size, filled;
+    struct collective_msg_t *next;
+};
+
+/* Связь с соседом в слоте */
+struct collective_link_t
+{
+    /* Удаление соседа от диспетчера, известно после знакомства */
+    unsigned int distance;
+    int known;
+    /* Сосед ответил на выбор родителя, и он выбрал этот клиент */
+    int answered;
+    int child;
+    /* Собираемое сообщение и очередь собранных */
+    struct collective_msg_t *current;
+    struct collective_msg_t *ready, *readytail;
+};
+
+/* Коллективные операции клиента: дерево строится по кольцам
+    удаления - у каждого клиента один родитель на кольце ближе
+    к диспетчеру и дети на кольце дальше, поэтому рассылка идет
+    волной от диспетчера к краям, свертка - обратной волной */
+struct collective_t
+{
+    struct client_t *client;
+    pthread_mutex_t locker;
+    pthread_cond_t changed;
+    struct collective_link_t links[COLLECTIVE_LINKS];
+    /* Слот родителя или COLLECTIVE_ROOT */
+    int parent;
+    /* Дерево построено */
+    int ready;
+    /* Номер очередной операции, одинаковый у всех клиентов,
+        если операции вызываются в одном порядке */
+    unsigned int seq;
+};
+
+/* Создает коллективные операции клиента */
+struct collective_t *collective_create
+(
+    struct client_t *client
+);
+
+/* Освобождает коллективные операции и принятые сообщения */
+void collective_destroy
+(
+    struct collective_t *collective
+);
+
+/* Строит дерево операций: знакомится с готовыми соседями и
+    выбирает родителя; вызывается всеми клиентами собранной
+    матрицы, возвращает 0 или -1, если сосед отключился, не
+    ответил за COLLECTIVE_SETUP_TIMEOUT или у клиента нет соседа
+    ближе к диспетчеру */
+int collective_setup
+(
+    struct client_t *client
+);
+
+/* Рассылает size байт buffer диспетчера всем клиентам,
+    возвращает 0 или -1 */
+int collective_broadcast
+(
+    struct client_t *client,
+    void *buffer,
+    size_t size
+);
+
+/* Сворачивает операцией op массивы buffer из count элементов
+    типа type всех клиентов, результат получает диспетчер,
+    у остальных в buffer остается свертка их поддерева */
+int collective_reduce
+(
+    struct client_t *client,
+    void *buffer,
+    size_t count,
+    int type,
+    int op
+);
+
+/* Сворачивает массивы и рассылает результат всем клиентам */
+int collective_allreduce
+(
+    struct client_t *client,
+    void *buffer,
+    size_t count,
+    int type,
+    int op
+);
+
+/* Ждет, пока все клиенты не войдут в барьер */
+int collective_barrier
+(
+    struct client_t *client
+);
+
+/* Порция сообщения вида kind операции seq от соседа в слоте slotid,
+    remain - сколько байт сообщения еще придет; вызывается нитью
+    чтения соседа */
+void collective_on_data
+(
+    struct collective_t *collective,
+    unsigned int slotid,
+    unsigned char kind,
+    unsigned int seq,
+    const char *data,
+    size_t size,
+    size_t remain
+);
+
+/* Забывает соседа в освобожденном слоте slotid: недособранное
+    сообщение и очередь собранных */
+void collective_reset
+(
+    struct collective_t *collective,
+    unsigned int slotid
+);
+
+/* Служебные процедуры */
+/* Отправляет соседу сообщение вида kind операции seq */
+int collective_send
+(
+    struct client_t *client,
+    unsigned int slotid,
+    unsigned char kind,
+    unsigned int seq,
+    const void *buffer,
+    size_t size
+);
+
+/* Ждет от соседа сообщение вида kind операции seq и забирает его,
+    возвращает ничего, если сосед отключился */
+struct collective_msg_t *collective_wait
+(
+    struct collective_t *collective,
+    unsigned int slotid,
+    unsigned char kind,
+    unsigned int seq
+);
+
+/* Сворачивает в buffer массив data операцией op */
+void collective_combine
+(
+    void *buffer,
+    const void *data,
+    size_t count,
+    int type,
+    int op
+);
+
+/* Размер элемента типа type в порядке передачи или 0 */
+size_t collective_width
+(
+    int type
+);
+
+/* Переводит count элементов buffer в порядок передачи wire */
+void collective_encode
+(
+    unsigned char *wire,
+    const void *buffer,
+    size_t count,
+    int type
+);
+
+/* Переводит count элементов из порядка передачи wire в buffer */
+void collective_decode
+(
+    void *buffer,
+    const unsigned char *wire,
+    size_t count,
+    int type
+);
+
+#endif /* ifndef COLLECTIVE_H */
@@ -0,0 +1,629 @@
+/*
+ ============================================================================
+ Name        : engine.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация движка ввода-вывода на io_uring
+ ============================================================================
+ */
+
+#ifndef ENGINE_C
+#define ENGINE_C
+
+/* Для pthread_setaffinity_np */
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "engine.h"
+#include "sim.h"
+
+/* Нити движка процесса */
+static struct engine_t engines[ENGINE_MAX_SHARDS];
+static unsigned int enginescount;
+/* Следующая нить для engine_attach */
+static unsigned int enginesnext;
+/* Операции io_uring, без которых движок не работает */
+static const unsigned char engineops[] =
+{
+    IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_READ, IORING_OP_POLL_ADD,
+    IORING_OP_LINK_TIMEOUT, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL,
+    IORING_OP_PROVIDE_BUFFERS
+};
+/* Ядро поддерживает многоразовые прием соединений и данных,
+    иначе операции перевзводятся после каждого завершения */
+static int enginemultishot;
+
+/* Проверяет многоразовый прием пробной операцией: флаги операций
+    запрос IORING_REGISTER_PROBE не описывает, а ядро без
+    IORING_RECV_MULTISHOT отвечает на него -EINVAL; многоразовый
+    прием соединений появился в ядре раньше, поэтому проверяется
+    вместе с ним */
+static int engine_probe_multishot(void)
+{
+    struct uring_t ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    char buffer[ENGINE_BUFSIZE];
+    int pair[2], retval = 0;
+    if(uring_init(&ring, 4) < 0)
+        return 0;
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+    {
+        uring_release(&ring);
+        return 0;
+    }
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = ENGINE_BUFSIZE;
+    sqe->buf_group = ENGINE_BGID;
+    sqe->user_data = 0;
+    sqe = uring_get_sqe(&ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ENGINE_BGID;
+    sqe->fd = pair[0];
+    sqe->user_data = 1;
+    /* Данные уже в сокете, поэтому прием завершается сразу */
+    if(write(pair[1], "", 1) == 1 && uring_submit(&ring, 2) == 2)
+        while((cqe = uring_peek_cqe(&ring)) != NULL)
+        {
+            if(cqe->user_data == 1)
+                retval = cqe->res > 0;
+            uring_cqe_seen(&ring);
+        }
+    close(pair[0]);
+    close(pair[1]);
+    uring_release(&ring);
+    return retval;
+}
+
+int engine_start(unsigned int shards)
+{
+    pthread_mutexattr_t attr;
+    struct engine_t *engine;
+    cpu_set_t cpus;
+    long cores;
+    unsigned int i, j;
+    if(enginescount)
+        return 0;
+    cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cores < 1)
+        cores = 1;
+    if(shards == 0)
+        shards = cores;
+    if(shards > ENGINE_MAX_SHARDS)
+        shards = ENGINE_MAX_SHARDS;
+    enginemultishot = engine_probe_multishot();
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    for(i=0; i<shards; i++)
+    {
+        engine = engines + i;
+        if(uring_init(&engine->ring, URING_ENTRIES) < 0)
+            break;
+        /* Старое ядро не знает нужных операций - вызывающий
+            останется на нитях */
+        if(!uring_supported(&engine->ring, engineops, sizeof(engineops)))
+        {
+            uring_release(&engine->ring);
+            break;
+        }
+        engine->wakefd = eventfd(0, EFD_CLOEXEC);
+        if(engine->wakefd < 0)
+        {
+            uring_release(&engine->ring);
+            break;
+        }
+        engine->shard = i;
+        pthread_mutex_init(&engine->locker, &attr);
+        pthread_mutex_init(&engine->maillocker, NULL);
+        engine->mailhead = engine->mailtail = NULL;
+        /* Отдаем ядру все буферы приема */
+        engine->buffers = (char *)malloc(ENGINE_BUFFERS*ENGINE_BUFSIZE);
+        pthread_mutex_lock(&engine->locker);
+        for(j=0; j<ENGINE_BUFFERS; j++)
+            engine_provide(engine, j);
+        /* Постоянное чтение eventfd для почтового ящика */
+        engine->wakeop = (struct engine_op_t *)calloc(1,
+            sizeof(struct engine_op_t));
+        engine->wakeop->type = ENGINE_OP_WAKE;
+        engine->wakeop->socket = engine->wakefd;
+        engine->wakeop->engine = engine;
+        engine_arm(engine->wakeop);
+        uring_submit(&engine->ring, 0);
+        pthread_mutex_unlock(&engine->locker);
+        engine->running = 1;
+        pthread_create(&engine->thread, NULL, engine_loop, engine);
+        /* Закрепляем нить за ядром, чтобы клиенты одной нити
+            не кочевали между кэшами процессоров */
+        CPU_ZERO(&cpus);
+        CPU_SET(i % cores, &cpus);
+        pthread_setaffinity_np(engine->thread, sizeof(cpu_set_t), &cpus);
+    }
+    pthread_mutexattr_destroy(&attr);
+    enginescount = i;
+    return enginescount ? 0 : -1;
+}
+
+void engine_stop(void)
+{
+    static const char one[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+    struct engine_t *engine;
+    struct engine_op_t *call;
+    unsigned int i;
+    for(i=0; i<enginescount; i++)
+    {
+        engine = engines + i;
+        if(engine->sim != NULL)
+            continue;
+        /* Нить проверяет флаг после каждого пробуждения, а eventfd
+            будит ее из ожидания завершений */
+        __atomic_store_n(&engine->running, 0, __ATOMIC_RELEASE);
+        if(write(engine->wakefd, one, sizeof(one)) < 0)
+            continue;
+        pthread_join(engine->thread, NULL);
+        /* Вызовы, оставшиеся в ящике, выполнять уже некому */
+        while((call = engine->mailhead) != NULL)
+        {
+            engine->mailhead = call->next;
+            free(call);
+        }
+        engine->mailtail = NULL;
+        /* Закрытие io_uring снимает все операции в ядре */
+        uring_release(&engine->ring);
+        close(engine->wakefd);
+        free(engine->wakeop);
+        free(engine->buffers);
+        pthread_mutex_destroy(&engine->locker);
+        pthread_mutex_destroy(&engine->maillocker);
+    }
+    memset(engines, 0, sizeof(struct engine_t)*enginescount);
+    enginescount = 0;
+    enginesnext = 0;
+}
+
+int engine_simulate(struct sim_t *sim)
+{
+    if(enginescount)
+        return -1;
+    memset(engines, 0, sizeof(struct engine_t));
+    engines->wakefd = -1;
+    engines->sim = sim;
+    enginescount = 1;
+    return 0;
+}
+
+int engine_simulated(struct engine_t *engine)
+{
+    return engine != NULL && engine->sim != NULL;
+}
+
+int engine_current(struct engine_t *engine)
+{
+    return engine->sim != NULL || pthread_equal(engine->thread, pthread_self());
+}
+
+int engine_running(void)
+{
+    return enginescount != 0;
+}
+
+struct engine_t *engine_attach(void)
+{
+    unsigned int shard;
+    if(enginescount == 0)
+        return NULL;
+    shard = __atomic_fetch_add(&enginesnext, 1, __ATOMIC_RELAXED);
+    return engines + shard % enginescount;
+}
+
+struct engine_op_t *engine_accept(struct engine_t *engine, int socket,
+    engine_accept_t on_accept, void *ctx)
+{
+    struct engine_op_t *op;
+    op = (struct engine_op_t *)calloc(1, sizeof(struct engine_op_t));
+    op->type = ENGINE_OP_ACCEPT;
+    op->socket = socket;
+    op->engine = engine;
+    op->ctx = ctx;
+    op->on_accept = on_accept;
+    if(engine->sim != NULL)
+        sim_arm(engine->sim, op);
+    else
+    {
+        pthread_mutex_lock(&engine->locker);
+        engine_arm(op);
+        uring_submit(&engine->ring, 0);
+        pthread_mutex_unlock(&engine->locker);
+    }
+    return op;
+}
+
+struct engine_op_t *engine_recv(struct engine_t *engine, int socket,
+    engine_recv_t on_recv, void *ctx, void *arg)
+{
+    struct engine_op_t *op;
+    op = (struct engine_op_t *)calloc(1, sizeof(struct engine_op_t));
+    op->type = ENGINE_OP_RECV;
+    op->socket = socket;
+    op->engine = engine;
+    op->ctx = ctx;
+    op->arg = arg;
+    op->on_recv = on_recv;
+    if(engine->sim != NULL)
+        sim_arm(engine->sim, op);
+    else
+    {
+        pthread_mutex_lock(&engine->locker);
+        engine_arm(op);
+        uring_submit(&engine->ring, 0);
+        pthread_mutex_unlock(&engine->locker);
+    }
+    return op;
+}
+
+struct engine_op_t *engine_poll(struct engine_t *engine, int socket,
+    engine_call_t on_call, void *ctx)
+{
+    return engine_poll_timeout(engine, socket, on_call, ctx, 0);
+}
+
+struct engine_op_t *engine_poll_timeout(struct engine_t *engine, int socket,
+    engine_call_t on_call, void *ctx, unsigned int timeout)
+{
+    struct engine_op_t *op;
+    op = (struct engine_op_t *)calloc(1, sizeof(struct engine_op_t));
+    op->type = ENGINE_OP_POLL;
+    op->socket = socket;
+    op->engine = engine;
+    op->ctx = ctx;
+    op->on_call = on_call;
+    op->timeout.tv_sec = timeout/1000;
+    op->timeout.tv_nsec = (timeout%1000)*1000000L;
+    if(engine->sim != NULL)
+        sim_arm(engine->sim, op);
+    else
+    {
+        pthread_mutex_lock(&engine->locker);
+        engine_arm(op);
+        uring_submit(&engine->ring, 0);
+        pthread_mutex_unlock(&engine->locker);
+    }
+    return op;
+}
+
+struct engine_op_t *engine_timer(struct engine_t *engine,
+    engine_call_t on_call, void *ctx, unsigned int timeout)
+{
+    struct engine_op_t *op;
+    op = (struct engine_op_t *)calloc(1, sizeof(struct engine_op_t));
+    op->type = ENGINE_OP_TIMER;
+    op->socket = -1;
+    op->engine = engine;
+    op->ctx = ctx;
+    op->on_call = on_call;
+    op->timeout.tv_sec = timeout/1000;
+    op->timeout.tv_nsec = (timeout%1000)*1000000L;
+    if(engine->sim != NULL)
+        sim_arm(engine->sim, op);
+    else
+    {
+        pthread_mutex_lock(&engine->locker);
+        engine_arm(op);
+        uring_submit(&engine->ring, 0);
+        pthread_mutex_unlock(&engine->locker);
+    }
+    return op;
+}
+
+void engine_repoll(struct engine_op_t *op)
+{
+    if(op->engine->sim != NULL)
+    {
+        if(!op->armed && !op->cancelled)
+        {
+            op->closed = 0;
+            sim_arm(op->engine->sim, op);
+        }
+        return;
+    }
+    pthread_mutex_lock(&op->engine->locker);
+    if(!op->armed && !op->cancelled)
+    {
+        op->closed = 0;
+        engine_arm(op);
+        uring_submit(&op->engine->ring, 0);
+    }
+    pthread_mutex_unlock(&op->engine->locker);
+}
+
+void engine_cancel(struct engine_op_t *op)
+{
+    struct engine_t *engine;
+    struct io_uring_sqe *sqe;
+    if(op == NULL)
+        return;
+    engine = op->engine;
+    if(engine->sim != NULL)
+    {
+        sim_cancel(engine->sim, op);
+        return;
+    }
+    pthread_mutex_lock(&engine->locker);
+    op->cancelled = 1;
+    if(op->armed)
+    {
+        /* Память освободится по последнему завершению операции */
+        sqe = engine_sqe(engine);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long)op;
+        sqe->user_data = 0;
+        uring_submit(&engine->ring, 0);
+    }
+    else if(!op->busy)
+        /* В ядре операции нет и обработчик не выполняется */
+        free(op);
+    pthread_mutex_unlock(&engine->locker);
+}
+
+void engine_call(struct engine_t *engine, engine_call_t on_call, void *ctx,
+    void *arg, int socket)
+{
+    struct engine_op_t *op;
+    static const char one[8] = {1, 0, 0, 0, 0, 0, 0, 0};
+    op = (struct engine_op_t *)calloc(1, sizeof(struct engine_op_t));
+    op->type = ENGINE_OP_CALL;
+    op->socket = socket;
+    op->engine = engine;
+    op->ctx = ctx;
+    op->arg = arg;
+    op->on_call = on_call;
+    /* В симуляторе почтовый ящик не нужен: все выполняется
+        в одной нити, вызов становится событием */
+    if(engine->sim != NULL)
+    {
+        sim_arm(engine->sim, op);
+        return;
+    }
+    pthread_mutex_lock(&engine->maillocker);
+    if(engine->mailtail == NULL)
+        engine->mailhead = op;
+    else
+        engine->mailtail->next = op;
+    engine->mailtail = op;
+    pthread_mutex_unlock(&engine->maillocker);
+    /* Будит любое ненулевое значение счетчика eventfd */
+    if(write(engine->wakefd, one, sizeof(one)) < 0)
+        return;
+}
+
+void engine_run(struct engine_t *engine, engine_call_t on_call, void *ctx,
+    void *arg, int socket)
+{
+    struct engine_run_t run;
+    int check;
+    if(engine->sim != NULL || pthread_equal(pthread_self(), engine->thread))
+    {
+        on_call(ctx, arg, socket);
+        return;
+    }
+    run.on_call = on_call;
+    run.ctx = ctx;
+    run.arg = arg;
+    run.socket = socket;
+    sem_init(&run.done, 0, 0);
+    engine_call(engine, engine_on_run, &run, NULL, socket);
+    do
+        check = sem_wait(&run.done);
+    while(check < 0 && errno == EINTR);
+    sem_destroy(&run.done);
+}
+
+void *engine_loop(void *arg)
+{
+    struct engine_t *engine;
+    struct io_uring_cqe *cqe;
+    struct engine_op_t *op;
+    unsigned int submit, flags;
+    int result;
+    engine = (struct engine_t *)arg;
+    while(__atomic_load_n(&engine->running, __ATOMIC_ACQUIRE))
+    {
+        /* Ожидаем завершения вне блокировки, чтобы другие нити
+            могли ставить операции */
+        pthread_mutex_lock(&engine->locker);
+        submit = uring_flush(&engine->ring);
+        pthread_mutex_unlock(&engine->locker);
+        uring_enter(&engine->ring, submit, 1);
+        pthread_mutex_lock(&engine->locker);
+        while((cqe = uring_peek_cqe(&engine->ring)) != NULL)
+        {
+            op = (struct engine_op_t *)(unsigned long)cqe->user_data;
+            result = cqe->res;
+            flags = cqe->flags;
+            uring_cqe_seen(&engine->ring);
+            /* Завершения отмены и возврата буферов без операции */
+            if(op != NULL)
+                engine_complete(op, result, flags);
+        }
+        pthread_mutex_unlock(&engine->locker);
+    }
+    return NULL;
+}
+
+struct io_uring_sqe *engine_sqe(struct engine_t *engine)
+{
+    struct io_uring_sqe *sqe;
+    while((sqe = uring_get_sqe(&engine->ring)) == NULL)
+        uring_submit(&engine->ring, 0);
+    return sqe;
+}
+
+void engine_arm(struct engine_op_t *op)
+{
+    struct io_uring_sqe *sqe, *link;
+    sqe = engine_sqe(op->engine);
+    sqe->fd = op->socket;
+    sqe->user_data = (unsigned long)op;
+    if(op->type == ENGINE_OP_ACCEPT)
+    {
+        sqe->opcode = IORING_OP_ACCEPT;
+        if(enginemultishot)
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    else if(op->type == ENGINE_OP_POLL)
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLOUT;
+        /* Срок ставится связанной операцией, которая отменяет
+            ожидание; если места для нее нет, ждем без срока */
+        if((op->timeout.tv_sec || op->timeout.tv_nsec) &&
+            (link = uring_get_sqe(&op->engine->ring)) != NULL)
+        {
+            sqe->flags |= IOSQE_IO_LINK;
+            link->opcode = IORING_OP_LINK_TIMEOUT;
+            link->fd = -1;
+            link->addr = (unsigned long)&op->timeout;
+            link->len = 1;
+            link->user_data = 0;
+        }
+    }
+    else if(op->type == ENGINE_OP_TIMER)
+    {
+        /* Без счетчика завершений срабатывает только по сроку */
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (unsigned long)&op->timeout;
+        sqe->len = 1;
+    }
+    else if(op->type == ENGINE_OP_WAKE)
+    {
+        sqe->opcode = IORING_OP_READ;
+        sqe->addr = (unsigned long)op->engine->wakebuf;
+        sqe->len = sizeof(op->engine->wakebuf);
+    }
+    else
+    {
+        /* Ядро само выбирает буфер из группы на каждую порцию */
+        sqe->opcode = IORING_OP_RECV;
+        if(enginemultishot)
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = ENGINE_BGID;
+    }
+    op->armed = 1;
+}
+
+void engine_provide(struct engine_t *engine, unsigned int bid)
+{
+    struct io_uring_sqe *sqe;
+    sqe = engine_sqe(engine);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = 1;
+    sqe->addr = (unsigned long)(engine->buffers + bid*ENGINE_BUFSIZE);
+    sqe->len = ENGINE_BUFSIZE;
+    sqe->off = bid;
+    sqe->buf_group = ENGINE_BGID;
+    sqe->user_data = 0;
+}
+
+void engine_complete(struct engine_op_t *op, int result, unsigned int flags)
+{
+    struct engine_t *engine;
+    struct engine_op_t *call;
+    unsigned int bid;
+    engine = op->engine;
+    /* Без F_MORE операция больше не находится в ядре */
+    if(!(flags & IORING_CQE_F_MORE))
+        op->armed = 0;
+    op->busy = 1;
+    if(op->type == ENGINE_OP_ACCEPT)
+    {
+        if(result >= 0)
+        {
+            if(op->cancelled)
+                close(result);
+            else
+                op->on_accept(op->ctx, result);
+        }
+        /* Слушатель закрыт или исчерпаны дескрипторы */
+        else if(result != -ECANCELED && !op->armed)
+            op->closed = 1;
+    }
+    else if(op->type == ENGINE_OP_POLL || op->type == ENGINE_OP_TIMER)
+    {
+        /* Однократная операция, владелец перевзводит ее сам,
+            в том числе из обработчика; истекший срок тоже
+            завершает ожидание, отличить его владелец может
+            только по состоянию сокета, у таймера срок - и есть
+            его событие */
+        op->closed = 1;
+        if(!op->cancelled)
+            op->on_call(op->ctx, op->arg, op->socket);
+    }
+    else if(op->type == ENGINE_OP_WAKE)
+    {
+        /* Забираем весь ящик разом и выполняем вызовы по порядку */
+        pthread_mutex_lock(&engine->maillocker);
+        call = engine->mailhead;
+        engine->mailhead = engine->mailtail = NULL;
+        pthread_mutex_unlock(&engine->maillocker);
+        while(call != NULL)
+        {
+            op = call;
+            call = call->next;
+            op->on_call(op->ctx, op->arg, op->socket);
+            free(op);
+        }
+        op = engine->wakeop;
+    }
+    else
+    {
+        if(result > 0 && !op->cancelled)
+        {
+            bid = flags >> IORING_CQE_BUFFER_SHIFT;
+            op->on_recv(op->ctx, op->arg, op->socket,
+                engine->buffers + bid*ENGINE_BUFSIZE, result);
+        }
+        /* Возвращаем буфер ядру сразу после разбора */
+        if(flags & IORING_CQE_F_BUFFER)
+            engine_provide(engine, flags >> IORING_CQE_BUFFER_SHIFT);
+        /* Конец потока или ошибка соединения */
+        if(!op->cancelled && !op->closed && (result == 0 ||
+            (result < 0 && result != -ENOBUFS && result != -ECANCELED)))
+        {
+            op->closed = 1;
+            op->on_recv(op->ctx, op->arg, op->socket, NULL, 0);
+        }
+    }
+    op->busy = 0;
+    if(!op->armed)
+    {
+        if(op->cancelled)
+            free(op);
+        /* Многоразовая операция прервалась без закрытия (например,
+            кончились буферы) или ядро ее не поддерживает и каждое
+            завершение однократное - перезапускаем */
+        else if(!op->closed)
+            engine_arm(op);
+    }
+}
+
+void engine_on_run(void *ctx, void *arg, int socket)
+{
+    struct engine_run_t *run = (struct engine_run_t *)ctx;
+    (void)arg;
+    (void)socket;
+    run->on_call(run->ctx, run->arg, run->socket);
+    /* После подъема семафора запись на стеке вызвавшей нити
+        может исчезнуть в любой момент */
+    sem_post(&run->done);
+}
+
+#endif /* ifndef ENGINE_C */
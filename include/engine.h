@@ -0,0 +1,305 @@
+/*
+ ============================================================================
+ Name        : engine.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок движка ввода-вывода на io_uring
+ ============================================================================
+ */
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+
+/* Количество и размер буферов, которые ядро выбирает
+    для многоразового приема */
+#define ENGINE_BUFFERS               (256)
+#define ENGINE_BUFSIZE              (2048)
+/* Идентификатор группы буферов */
+#define ENGINE_BGID                    (1)
+/* Предельное количество нитей движка */
+#define ENGINE_MAX_SHARDS             (64)
+
+/* Виды операций движка */
+enum
+{
+    /* Многоразовый прием соединений */
+    ENGINE_OP_ACCEPT,
+    /* Многоразовый прием данных */
+    ENGINE_OP_RECV,
+    /* Однократный вызов функции в нити движка */
+    ENGINE_OP_CALL,
+    /* Чтение eventfd, будит нить движка для разбора почтового ящика */
+    ENGINE_OP_WAKE,
+    /* Однократное ожидание готовности сокета к записи */
+    ENGINE_OP_POLL,
+    /* Однократный срок без сокета */
+    ENGINE_OP_TIMER
+};
+
+struct engine_t;
+struct sim_t;
+
+/* Обработчик принятого соединения */
+typedef void (*engine_accept_t)(void *ctx, int socket);
+
+/* Обработчик порции данных, нулевой размер - соединение закрыто */
+typedef void (*engine_recv_t)(void *ctx, void *arg, int socket,
+    char *data, size_t size);
+
+/* Функция, вызываемая в нити движка по просьбе другой нити */
+typedef void (*engine_call_t)(void *ctx, void *arg, int socket);
+
+/* Операция движка, ее адрес передается ядру как user_data */
+struct engine_op_t
+{
+    int type;
+    int socket;
+    /* Нить движка, которой принадлежит операция */
+    struct engine_t *engine;
+    /* Контекст и аргумент обработчика */
+    void *ctx, *arg;
+    engine_accept_t on_accept;
+    engine_recv_t on_recv;
+    engine_call_t on_call;
+    /* Срок ожидания записи (нулевой - без срока) или таймера */
+    struct __kernel_timespec timeout;
+    /* Операция ждет завершений в ядре */
+    int armed;
+    /* Владелец отказался от операции */
+    int cancelled;
+    /* Обработчику сообщено о закрытии */
+    int closed;
+    /* Идет вызов обработчика */
+    int busy;
+    /* Следующий вызов в почтовом ящике */
+    struct engine_op_t *next;
+};
+
+/* Вызов, завершения которого ждет вызвавшая нить */
+struct engine_run_t
+{
+    engine_call_t on_call;
+    void *ctx, *arg;
+    int socket;
+    /* Поднимается нитью движка после вызова */
+    sem_t done;
+};
+
+/* Нить движка: своя очередь io_uring и своя нить, закрепленная за
+    ядром процессора; клиент целиком обслуживается одной нитью,
+    поэтому его обработчики никогда не выполняются параллельно */
+struct engine_t
+{
+    struct uring_t ring;
+    pthread_t thread;
+    /* Номер нити движка */
+    unsigned int shard;
+    /* Мьютекс очереди отправки, рекурсивный, т.к. обработчики
+        вызываются под ним и сами ставят операции */
+    pthread_mutex_t locker;
+    /* Буферы приема */
+    char *buffers;
+    int running;
+    /* Почтовый ящик вызовов из других нитей; его мьютекс
+        никогда не удерживается при захвате других мьютексов */
+    struct engine_op_t *mailhead, *mailtail;
+    pthread_mutex_t maillocker;
+    /* eventfd пробуждения, буфер и операция его чтения */
+    int wakefd;
+    char wakebuf[8];
+    struct engine_op_t *wakeop;
+    /* Симулятор, которому передаются операции вместо io_uring,
+        или ничего */
+    struct sim_t *sim;
+};
+
+/* Запускает движок из shards нитей (0 - по числу ядер),
+    возвращает 0 при успехе и -1, если io_uring недоступен или ядро
+    не знает нужных операций; без многоразового приема операции
+    перевзводятся после каждого завершения */
+int engine_start
+(
+    unsigned int shards
+);
+
+/* Запускает движок из одной нити без io_uring и собственной нити:
+    операции выполняет симулятор sim, возвращает 0 или -1, если
+    движок уже запущен */
+int engine_simulate
+(
+    struct sim_t *sim
+);
+
+/* Останавливает нити движка и дожидается их завершения, освобождает
+    кольца и буферы; вызывается после уничтожения всех клиентов,
+    после нее движок можно запустить снова */
+void engine_stop
+(
+    void
+);
+
+/* Возвращает 1, если нить движка engine работает в симуляторе */
+int engine_simulated
+(
+    struct engine_t *engine
+);
+
+/* Возвращает 1, если вызов идет из нити движка engine; в симуляторе
+    все обработчики выполняются в одной нити, поэтому всегда 1 */
+int engine_current
+(
+    struct engine_t *engine
+);
+
+/* Возвращает 1, если движок запущен */
+int engine_running
+(
+    void
+);
+
+/* Выбирает по кругу нить движка для нового клиента,
+    возвращает ничего, если движок не запущен */
+struct engine_t *engine_attach
+(
+    void
+);
+
+/* Ставит многоразовый прием соединений на сокет слушателя */
+struct engine_op_t *engine_accept
+(
+    struct engine_t *engine,
+    int socket,
+    engine_accept_t on_accept,
+    void *ctx
+);
+
+/* Ставит многоразовый прием данных на сокет соединения */
+struct engine_op_t *engine_recv
+(
+    struct engine_t *engine,
+    int socket,
+    engine_recv_t on_recv,
+    void *ctx,
+    void *arg
+);
+
+/* Ставит однократное ожидание готовности сокета к записи,
+    операция остается за владельцем до engine_cancel */
+struct engine_op_t *engine_poll
+(
+    struct engine_t *engine,
+    int socket,
+    engine_call_t on_call,
+    void *ctx
+);
+
+/* То же с предельным сроком ожидания в миллисекундах: по его
+    истечении обработчик вызывается, даже если сокет не готов */
+struct engine_op_t *engine_poll_timeout
+(
+    struct engine_t *engine,
+    int socket,
+    engine_call_t on_call,
+    void *ctx,
+    unsigned int timeout
+);
+
+/* Ставит однократный таймер: on_call вызывается в нити движка через
+    timeout миллисекунд, операция остается за владельцем до
+    engine_cancel, отмена до срока вызов снимает */
+struct engine_op_t *engine_timer
+(
+    struct engine_t *engine,
+    engine_call_t on_call,
+    void *ctx,
+    unsigned int timeout
+);
+
+/* Повторно взводит отработавшее ожидание записи или таймер */
+void engine_repoll
+(
+    struct engine_op_t *op
+);
+
+/* Отменяет операцию, после вызова обработчик больше не
+    вызывается, а память операции освобождает движок */
+void engine_cancel
+(
+    struct engine_op_t *op
+);
+
+/* Выполняет on_call в нити движка engine; вызов кладется в почтовый
+    ящик, поэтому его можно делать из обработчика другой нити, не
+    захватывая мьютекс чужой очереди отправки */
+void engine_call
+(
+    struct engine_t *engine,
+    engine_call_t on_call,
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Выполняет on_call в нити движка engine и дожидается его
+    завершения; вызов проходит через почтовый ящик после всех ранее
+    поставленных, а из самой нити движка и в симуляторе выполняется
+    сразу */
+void engine_run
+(
+    struct engine_t *engine,
+    engine_call_t on_call,
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Нить движка: ожидает завершения и вызывает обработчики */
+void *engine_loop
+(
+    void *arg
+);
+
+/* Служебные операции, выполняются под мьютексом движка */
+/* Возвращает запись очереди отправки, при заполнении
+    очереди передает накопленное ядру */
+struct io_uring_sqe *engine_sqe
+(
+    struct engine_t *engine
+);
+
+/* Ставит операцию в очередь отправки */
+void engine_arm
+(
+    struct engine_op_t *op
+);
+
+/* Возвращает ядру буфер приема */
+void engine_provide
+(
+    struct engine_t *engine,
+    unsigned int bid
+);
+
+/* Обрабатывает завершение операции */
+void engine_complete
+(
+    struct engine_op_t *op,
+    int result,
+    unsigned int flags
+);
+
+/* Выполняет вызов engine_run, контекст - его engine_run_t */
+void engine_on_run
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+#endif /* ifndef ENGINE_H */
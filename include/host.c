@@ -0,0 +1,86 @@
+/*
+ ============================================================================
+ Name        : host.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация реестра клиентов, запущенных в одном процессе
+ ============================================================================
+ */
+
+#ifndef HOST_C
+#define HOST_C
+
+#include "client.h"
+
+/* Реестр клиентов процесса */
+static struct host_t host = {{NULL}, NULL, PTHREAD_MUTEX_INITIALIZER};
+
+int host_register(struct client_t *client)
+{
+    int retval = -1;
+    pthread_mutex_lock(&host.locker);
+    if(host.clients[client->portTCP] == NULL)
+    {
+        host.clients[client->portTCP] = client;
+        if(host.dispatcher == NULL && client->dispatcher != NULL)
+            host.dispatcher = client;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&host.locker);
+    return retval;
+}
+
+void host_unregister(struct client_t *client)
+{
+    pthread_mutex_lock(&host.locker);
+    if(host.clients[client->portTCP] == client)
+        host.clients[client->portTCP] = NULL;
+    if(host.dispatcher == client)
+        host.dispatcher = NULL;
+    pthread_mutex_unlock(&host.locker);
+}
+
+void host_promote(struct client_t *client)
+{
+    pthread_mutex_lock(&host.locker);
+    if(host.dispatcher == NULL && host.clients[client->portTCP] == client)
+        host.dispatcher = client;
+    pthread_mutex_unlock(&host.locker);
+}
+
+int host_call(unsigned short port, int dispatcher, engine_call_t on_call,
+    void *arg, int socket)
+{
+    struct client_t *client;
+    int retval = -1;
+    pthread_mutex_lock(&host.locker);
+    client = port ? host.clients[port] : host.dispatcher;
+    if(client != NULL && client->engine != NULL &&
+        (!dispatcher || client == host.dispatcher))
+    {
+        engine_call(client->engine, on_call, client, arg, socket);
+        retval = 0;
+    }
+    pthread_mutex_unlock(&host.locker);
+    return retval;
+}
+
+struct client_t *host_find_client(unsigned short port)
+{
+    struct client_t *client;
+    pthread_mutex_lock(&host.locker);
+    client = host.clients[port];
+    pthread_mutex_unlock(&host.locker);
+    return client;
+}
+
+struct client_t *host_find_dispatcher(void)
+{
+    struct client_t *client;
+    pthread_mutex_lock(&host.locker);
+    client = host.dispatcher;
+    pthread_mutex_unlock(&host.locker);
+    return client;
+}
+
+#endif /* ifndef HOST_C */
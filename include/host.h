@@ -0,0 +1,83 @@
+/*
+ ============================================================================
+ Name        : host.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок реестра клиентов, запущенных в одном процессе
+ ============================================================================
+ */
+
+#ifndef HOST_H
+#define HOST_H
+
+#include <pthread.h>
+
+#include "engine.h"
+
+/* Количество портов: клиенты процесса ищутся по порту слушателя
+    прямым индексом, поэтому их число ограничено только портами */
+#define HOST_PORTS                 (65536)
+
+struct client_t;
+
+/* Клиенты процесса; соседи из одного процесса соединяются
+    парой сокетов в обход стека TCP, а диспетчер процесса
+    находится без широковещательного поиска */
+struct host_t
+{
+    struct client_t *clients[HOST_PORTS];
+    /* Клиент, ведущий диспетчеризацию */
+    struct client_t *dispatcher;
+    /* Мьютекс реестра, под ним захватывается только
+        почтовый ящик движка */
+    pthread_mutex_t locker;
+};
+
+/* Заносит клиент в реестр процесса, возвращает 0 при успехе
+    и -1, если его порт уже занят другим клиентом */
+int host_register
+(
+    struct client_t *client
+);
+
+/* Исключает клиент из реестра процесса */
+void host_unregister
+(
+    struct client_t *client
+);
+
+/* Делает клиент диспетчером процесса, если диспетчера нет */
+void host_promote
+(
+    struct client_t *client
+);
+
+/* Ставит вызов on_call(клиент, arg, socket) в нить движка клиента
+    процесса с портом port (0 - диспетчера процесса), если dispatcher
+    не 0 - только если этот клиент ведет диспетчеризацию; под
+    мьютексом реестра вызов встает в почтовый ящик раньше
+    освобождения клиента, который начал уничтожаться; возвращает -1,
+    если такого клиента на движке нет */
+int host_call
+(
+    unsigned short port,
+    int dispatcher,
+    engine_call_t on_call,
+    void *arg,
+    int socket
+);
+
+/* Ищет клиент процесса по порту слушателя,
+    возвращает ничего, если такого нет */
+struct client_t *host_find_client
+(
+    unsigned short port
+);
+
+/* Ищет клиент процесса, ведущий диспетчеризацию */
+struct client_t *host_find_dispatcher
+(
+    void
+);
+
+#endif /* ifndef HOST_H */
@@ -0,0 +1,375 @@
+/*
+ ============================================================================
+ Name        : log.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация журнала с отложенным форматированием
+ ============================================================================
+ */
+
+#ifndef LOG_C
+#define LOG_C
+
+#include <stdlib.h>
+
+#include "log.h"
+
+/* Журнал процесса */
+static struct log_t journal = {{NULL}, 0, NULL, 0, 0,
+    PTHREAD_COND_INITIALIZER, PTHREAD_ONCE_INIT, 0,
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
+
+/* Кольцо текущей нити */
+static __thread struct log_ring_t *current = NULL;
+
+void log_error(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_write(LOG_LEVEL_ERROR, format, ap);
+    va_end(ap);
+}
+
+void log_warn(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_write(LOG_LEVEL_WARN, format, ap);
+    va_end(ap);
+}
+
+void log_info(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_write(LOG_LEVEL_INFO, format, ap);
+    va_end(ap);
+}
+
+void log_debug(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_write(LOG_LEVEL_DEBUG, format, ap);
+    va_end(ap);
+}
+
+void log_trace(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_write(LOG_LEVEL_TRACE, format, ap);
+    va_end(ap);
+}
+
+void log_flush(void)
+{
+    pthread_mutex_lock(&journal.locker);
+    if(journal.output != NULL)
+        log_drain();
+    pthread_mutex_unlock(&journal.locker);
+}
+
+void log_set_output(FILE *output)
+{
+    /* Нить вывода запускается сразу, иначе ее запуск
+        вернул бы поток по умолчанию */
+    pthread_once(&journal.once, log_init);
+    pthread_mutex_lock(&journal.locker);
+    journal.output = output;
+    pthread_mutex_unlock(&journal.locker);
+}
+
+void log_stop(void)
+{
+    /* Флаг снимается без мьютекса: нить вывода, которая сливает
+        кольца без пауз, держит его подолгу */
+    if(!__atomic_exchange_n(&journal.running, 0, __ATOMIC_ACQ_REL))
+        return;
+    pthread_mutex_lock(&journal.locker);
+    pthread_cond_signal(&journal.wakeup);
+    pthread_mutex_unlock(&journal.locker);
+    pthread_join(journal.thread, NULL);
+    log_flush();
+}
+
+void log_write(int level, const char *format, va_list ap)
+{
+    struct log_ring_t *ring;
+    struct log_record_t *record;
+    union log_arg_t *arg;
+    const char *p, *s;
+    unsigned long head;
+    int islong;
+    /* Колец не хватило - нить пишет мимо журнала */
+    if((ring = log_ring()) == NULL)
+        return;
+    /* Кольцо заполнено - запись теряется, писатель не ждет вывода */
+    head = ring->head;
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS)
+    {
+        ring->lost++;
+        return;
+    }
+    record = ring->records + head % LOG_RING_RECORDS;
+    clock_gettime(CLOCK_MONOTONIC, &record->time);
+    record->format = format;
+    record->level = level;
+    record->count = 0;
+    /* Сохраняем аргументы по типам из строки формата; ширина
+        и точность через '*' не поддерживаются */
+    for(p = format; *p != '\0' && record->count < LOG_MAX_ARGS; p++)
+    {
+        if(*p != '%' || *++p == '%')
+            continue;
+        p += strspn(p, "-+ #0123456789.");
+        for(islong = 0; *p == 'l' || *p == 'h' || *p == 'z'; p++)
+            if(*p != 'h')
+                islong = 1;
+        if(*p == '\0')
+            break;
+        arg = record->args + record->count;
+        switch(*p)
+        {
+            case 'd': case 'i': case 'c':
+                record->types[record->count] = LOG_ARG_LONG;
+                arg->l = islong ? va_arg(ap, long) : va_arg(ap, int);
+                break;
+            case 'u': case 'x': case 'X': case 'o':
+                record->types[record->count] = LOG_ARG_ULONG;
+                arg->u = islong ? va_arg(ap, unsigned long) :
+                    va_arg(ap, unsigned int);
+                break;
+            case 'e': case 'E': case 'f': case 'g': case 'G':
+                record->types[record->count] = LOG_ARG_DOUBLE;
+                arg->d = va_arg(ap, double);
+                break;
+            case 'p':
+                record->types[record->count] = LOG_ARG_POINTER;
+                arg->p = va_arg(ap, void *);
+                break;
+            case 's':
+                /* Строка может быть временной (inet_ntoa), копируем */
+                record->types[record->count] = LOG_ARG_STRING;
+                if((s = va_arg(ap, const char *)) == NULL)
+                    s = "(null)";
+                strncpy(arg->s, s, LOG_MAX_STRING-1);
+                arg->s[LOG_MAX_STRING-1] = '\0';
+                break;
+            default:
+                /* Неизвестное преобразование - дальше не разбираем */
+                p += strlen(p)-1;
+                continue;
+        }
+        record->count++;
+    }
+    /* Публикуем запись для нити вывода */
+    __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+struct log_ring_t *log_ring(void)
+{
+    struct log_ring_t *ring;
+    unsigned int i;
+    if(current != NULL)
+        return current;
+    pthread_once(&journal.once, log_init);
+    ring = NULL;
+    pthread_mutex_lock(&journal.ringlocker);
+    /* Сначала берем выведенное до конца кольцо завершившейся нити */
+    for(i=0; i<journal.count; i++)
+    {
+        if(__atomic_load_n(&journal.rings[i]->released, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&journal.rings[i]->tail, __ATOMIC_ACQUIRE) ==
+                journal.rings[i]->head)
+        {
+            ring = journal.rings[i];
+            __atomic_store_n(&ring->released, 0, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    if(ring == NULL && journal.count < LOG_MAX_RINGS &&
+        (ring = (struct log_ring_t *)calloc(1, sizeof(struct log_ring_t))) != NULL)
+    {
+        journal.rings[journal.count] = ring;
+        __atomic_store_n(&journal.count, journal.count+1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&journal.ringlocker);
+    if(ring != NULL)
+        pthread_setspecific(journal.key, ring);
+    return current = ring;
+}
+
+void log_ring_release(void *ring)
+{
+    __atomic_store_n(&((struct log_ring_t *)ring)->released, 1, __ATOMIC_RELEASE);
+}
+
+void log_init(void)
+{
+    journal.output = stdout;
+    pthread_key_create(&journal.key, log_ring_release);
+    journal.running = 1;
+    if(pthread_create(&journal.thread, NULL, log_thread, NULL) != 0)
+        journal.running = 0;
+    atexit(log_flush);
+}
+
+void log_format(FILE *output, struct log_record_t *record)
+{
+    const char *p, *start;
+    char spec[32];
+    size_t length;
+    unsigned int i = 0;
+    union log_arg_t *arg;
+    for(p = record->format; *p != '\0'; p++)
+    {
+        if(*p != '%')
+        {
+            length = strcspn(p, "%");
+            fwrite(p, 1, length, output);
+            p += length-1;
+            continue;
+        }
+        if(p[1] == '%')
+        {
+            fputc('%', output);
+            p++;
+            continue;
+        }
+        /* Остаток строки без сохраненных аргументов выводим как есть */
+        if(i >= record->count)
+        {
+            fputs(p, output);
+            break;
+        }
+        /* Пересобираем спецификацию под сохраненный тип аргумента:
+            флаги, ширина и точность, длинный модификатор, преобразование */
+        start = p++;
+        length = strspn(p, "-+ #0123456789.");
+        if(length > sizeof(spec)-4)
+            length = sizeof(spec)-4;
+        spec[0] = '%';
+        memcpy(spec+1, p, length);
+        p += length;
+        p += strspn(p, "lhz");
+        arg = record->args + i;
+        switch(record->types[i++])
+        {
+            case LOG_ARG_LONG:
+                if(*p == 'c')
+                {
+                    spec[length+1] = 'c';
+                    spec[length+2] = '\0';
+                    fprintf(output, spec, (int)arg->l);
+                    break;
+                }
+                spec[length+1] = 'l';
+                spec[length+2] = *p;
+                spec[length+3] = '\0';
+                fprintf(output, spec, arg->l);
+                break;
+            case LOG_ARG_ULONG:
+                spec[length+1] = 'l';
+                spec[length+2] = *p;
+                spec[length+3] = '\0';
+                fprintf(output, spec, arg->u);
+                break;
+            case LOG_ARG_DOUBLE:
+                spec[length+1] = *p;
+                spec[length+2] = '\0';
+                fprintf(output, spec, arg->d);
+                break;
+            case LOG_ARG_POINTER:
+                spec[length+1] = 'p';
+                spec[length+2] = '\0';
+                fprintf(output, spec, arg->p);
+                break;
+            case LOG_ARG_STRING:
+                spec[length+1] = 's';
+                spec[length+2] = '\0';
+                fprintf(output, spec, arg->s);
+                break;
+            default:
+                fwrite(start, 1, p+1-start, output);
+        }
+    }
+}
+
+unsigned long log_drain(void)
+{
+    struct log_ring_t *ring, *oldest;
+    struct log_record_t *record, *first;
+    unsigned long total = 0, lost;
+    unsigned int i, count;
+    count = __atomic_load_n(&journal.count, __ATOMIC_ACQUIRE);
+    for(;;)
+    {
+        /* Сливаем кольца нитей, каждый раз выбирая самую раннюю
+            из первых записей, чтобы сохранить общий порядок */
+        oldest = NULL;
+        first = NULL;
+        for(i=0; i<count; i++)
+        {
+            ring = journal.rings[i];
+            if(ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+                continue;
+            record = ring->records + ring->tail % LOG_RING_RECORDS;
+            if(first == NULL || record->time.tv_sec < first->time.tv_sec ||
+                (record->time.tv_sec == first->time.tv_sec &&
+                    record->time.tv_nsec < first->time.tv_nsec))
+            {
+                oldest = ring;
+                first = record;
+            }
+        }
+        if(oldest == NULL)
+            break;
+        log_format(journal.output, first);
+        __atomic_store_n(&oldest->tail, oldest->tail+1, __ATOMIC_RELEASE);
+        total++;
+    }
+    /* Отмечаем потерянные записи */
+    for(i=0; i<count; i++)
+    {
+        ring = journal.rings[i];
+        lost = __atomic_load_n(&ring->lost, __ATOMIC_RELAXED);
+        if(lost != ring->reported)
+        {
+            fprintf(journal.output, "log: lost %lu records\n",
+                lost - ring->reported);
+            ring->reported = lost;
+        }
+    }
+    if(total)
+        fflush(journal.output);
+    return total;
+}
+
+void *log_thread(void *arg)
+{
+    struct timespec deadline;
+    (void)arg;
+    pthread_mutex_lock(&journal.locker);
+    while(__atomic_load_n(&journal.running, __ATOMIC_ACQUIRE))
+    {
+        /* Пустые кольца - пауза, которую прерывает log_stop,
+            мьютекс вывода на ее время отпускается */
+        if(!log_drain())
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += LOG_DRAIN_IDLE*1000L;
+            if(deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&journal.wakeup, &journal.locker,
+                &deadline);
+        }
+    }
+    pthread_mutex_unlock(&journal.locker);
+    return NULL;
+}
+
+#endif /* ifndef LOG_C */
@@ -0,0 +1,248 @@
+/*
+ ============================================================================
+ Name        : log.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок журнала с отложенным форматированием
+ ============================================================================
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Уровни журнала */
+#define LOG_LEVEL_NONE                 (0)
+#define LOG_LEVEL_ERROR                (1)
+#define LOG_LEVEL_WARN                 (2)
+#define LOG_LEVEL_INFO                 (3)
+#define LOG_LEVEL_DEBUG                (4)
+#define LOG_LEVEL_TRACE                (5)
+
+/* Уровень сборки, записи выше него не попадают в код вовсе,
+    вместе с вычислением аргументов; по умолчанию ход протокола
+    не пишется, он включается, например, как
+    bash makefile -DLOG_LEVEL=4 */
+#ifndef LOG_LEVEL
+# define LOG_LEVEL          LOG_LEVEL_INFO
+#endif /* LOG_LEVEL */
+
+/* Записей в кольце одной нити */
+#define LOG_RING_RECORDS            (1024)
+/* Аргументов в одной записи */
+#define LOG_MAX_ARGS                   (8)
+/* Строковый аргумент копируется в запись, длиннее - обрезается */
+#define LOG_MAX_STRING                (16)
+/* Предельное количество колец (нитей, пишущих одновременно) */
+#define LOG_MAX_RINGS                (256)
+/* Пауза нити вывода, когда кольца пусты, в микросекундах */
+#define LOG_DRAIN_IDLE              (1000)
+
+/* Макросы записи, аргументы передаются в двойных скобках
+    (в C90 нет макросов с переменным числом аргументов):
+    LOG_DEBUG(("catch: on_place_ring(%p, %d)\n", ptr, distance)); */
+/* Запись отключенного уровня - мертвая ветвь: компилятор выбрасывает
+    ее вместе с аргументами, но проверяет формат и считает
+    параметры использованными */
+#define LOG_NOTHING(call) do { if(0) call; } while(0)
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+# define LOG_ERROR(args) log_error args
+#else
+# define LOG_ERROR(args) LOG_NOTHING(log_error args)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+# define LOG_WARN(args) log_warn args
+#else
+# define LOG_WARN(args) LOG_NOTHING(log_warn args)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+# define LOG_INFO(args) log_info args
+#else
+# define LOG_INFO(args) LOG_NOTHING(log_info args)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+# define LOG_DEBUG(args) log_debug args
+#else
+# define LOG_DEBUG(args) LOG_NOTHING(log_debug args)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+# define LOG_TRACE(args) log_trace args
+#else
+# define LOG_TRACE(args) LOG_NOTHING(log_trace args)
+#endif
+
+/* Типы аргументов записи, определяются по строке формата */
+enum
+{
+    LOG_ARG_LONG,
+    LOG_ARG_ULONG,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_POINTER,
+    LOG_ARG_STRING
+};
+
+/* Аргумент записи */
+union log_arg_t
+{
+    long l;
+    unsigned long u;
+    double d;
+    const void *p;
+    char s[LOG_MAX_STRING];
+};
+
+/* Запись журнала: строка формата не копируется (это всегда
+    литерал), аргументы сохраняются в двоичном виде и
+    форматируются нитью вывода */
+struct log_record_t
+{
+    struct timespec time;
+    const char *format;
+    unsigned char level;
+    unsigned char count;
+    unsigned char types[LOG_MAX_ARGS];
+    union log_arg_t args[LOG_MAX_ARGS];
+};
+
+/* Кольцо записей одной нити: пишет только владелец, читает
+    только нить вывода, поэтому запись обходится без блокировок */
+struct log_ring_t
+{
+    struct log_record_t records[LOG_RING_RECORDS];
+    /* Счетчики записанных и выведенных записей */
+    unsigned long head, tail;
+    /* Записи, потерянные из-за переполнения кольца,
+        и сколько из них уже отмечено в выводе */
+    unsigned long lost, reported;
+    /* Нить-владелец завершилась, кольцо можно отдать другой */
+    int released;
+};
+
+/* Журнал процесса */
+struct log_t
+{
+    struct log_ring_t *rings[LOG_MAX_RINGS];
+    unsigned int count;
+    FILE *output;
+    pthread_t thread;
+    /* Нить вывода работает, пока не вызвана log_stop */
+    int running;
+    /* Будит нить вывода раньше паузы, ждется под мьютексом вывода */
+    pthread_cond_t wakeup;
+    pthread_once_t once;
+    pthread_key_t key;
+    /* Мьютекс вывода, его держит только читающая сторона */
+    pthread_mutex_t locker;
+    /* Мьютекс раздачи колец, захватывается нитью один раз */
+    pthread_mutex_t ringlocker;
+};
+
+/* Запись уровня ошибки */
+void log_error
+(
+    const char *format,
+    ...
+) __attribute__((format(printf, 1, 2)));
+
+/* Запись уровня предупреждения */
+void log_warn
+(
+    const char *format,
+    ...
+) __attribute__((format(printf, 1, 2)));
+
+/* Запись информационного уровня */
+void log_info
+(
+    const char *format,
+    ...
+) __attribute__((format(printf, 1, 2)));
+
+/* Запись отладочного уровня */
+void log_debug
+(
+    const char *format,
+    ...
+) __attribute__((format(printf, 1, 2)));
+
+/* Запись уровня трассировки */
+void log_trace
+(
+    const char *format,
+    ...
+) __attribute__((format(printf, 1, 2)));
+
+/* Выводит все накопленные записи, вызывается и при выходе */
+void log_flush
+(
+    void
+);
+
+/* Направляет вывод журнала в output (по умолчанию stdout),
+    например в stderr, когда stdout занят отчетом программы */
+void log_set_output
+(
+    FILE *output
+);
+
+/* Останавливает нить вывода, дожидается ее и выводит остаток;
+    записи после остановки выводит только log_flush */
+void log_stop
+(
+    void
+);
+
+/* Служебные процедуры */
+/* Заносит запись в кольцо текущей нити */
+void log_write
+(
+    int level,
+    const char *format,
+    va_list ap
+);
+
+/* Возвращает кольцо текущей нити, заводя его при первой записи */
+struct log_ring_t *log_ring
+(
+    void
+);
+
+/* Отдает кольцо завершившейся нити */
+void log_ring_release
+(
+    void *ring
+);
+
+/* Запускает нить вывода, выполняется однократно */
+void log_init
+(
+    void
+);
+
+/* Форматирует запись в поток вывода */
+void log_format
+(
+    FILE *output,
+    struct log_record_t *record
+);
+
+/* Переносит записи всех колец в поток вывода по порядку
+    времени, возвращает количество выведенных записей;
+    вызывается под мьютексом вывода */
+unsigned long log_drain
+(
+    void
+);
+
+/* Нить вывода */
+void *log_thread
+(
+    void *arg
+);
+
+#endif /* ifndef LOG_H */
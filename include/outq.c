@@ -0,0 +1,649 @@
+/*
+ ============================================================================
+ Name        : outq.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация очередей отправки соединений
+ ============================================================================
+ */
+
+#ifndef OUTQ_C
+#define OUTQ_C
+
+#include "outq.h"
+
+/* Очереди по дескрипторам сокетов, заводятся при первом
+    подключении и не освобождаются, поэтому отправитель из другой
+    нити никогда не обращается к освобожденной памяти */
+static struct outq_t *outqs[OUTQ_MAX_SOCKETS];
+static pthread_mutex_t outqslocker = PTHREAD_MUTEX_INITIALIZER;
+/* Политика и порог переполнения */
+static int outqpolicy = OUTQ_POLICY_DROP;
+static size_t outqhighwater = OUTQ_HIGHWATER;
+static struct outq_stats_t outqstats;
+
+void outq_configure(int policy, size_t highwater)
+{
+    outqpolicy = policy;
+    if(highwater > OUTQ_CAPACITY)
+        highwater = OUTQ_CAPACITY;
+    outqhighwater = highwater;
+}
+
+struct outq_t *outq_get(int socket, int create)
+{
+    struct outq_t *queue;
+    if(socket < 0 || socket >= OUTQ_MAX_SOCKETS)
+        return NULL;
+    queue = __atomic_load_n(outqs+socket, __ATOMIC_ACQUIRE);
+    if(queue != NULL || !create)
+        return queue;
+    pthread_mutex_lock(&outqslocker);
+    queue = outqs[socket];
+    if(queue == NULL)
+    {
+        queue = (struct outq_t *)calloc(1, sizeof(struct outq_t));
+        pthread_mutex_init(&queue->locker, NULL);
+        pthread_mutex_init(&queue->writer, NULL);
+        queue->socket = socket;
+        __atomic_store_n(outqs+socket, queue, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&outqslocker);
+    return queue;
+}
+
+void outq_attach(int socket, int epollfd, void *ptr, struct engine_t *engine)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 1);
+    if(queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->locker);
+    queue->attached = 1;
+    queue->head = queue->size = 0;
+    queue->epollfd = epollfd;
+    queue->ptr = ptr;
+    queue->engine = engine;
+    queue->waiting = queue->inflight = queue->dropped = 0;
+    queue->link = NULL;
+    pthread_mutex_unlock(&queue->locker);
+}
+
+void outq_rebind(int socket, void *ptr)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->locker);
+    queue->ptr = ptr;
+    /* Переустанавливаем событие с новым контекстом */
+    if(queue->attached && queue->engine == NULL && queue->waiting)
+    {
+        queue->waiting = 0;
+        outq_watch(queue, 1);
+    }
+    pthread_mutex_unlock(&queue->locker);
+}
+
+void outq_detach(int socket)
+{
+    struct outq_t *queue;
+    struct engine_op_t *pollop;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->locker);
+    __atomic_sub_fetch(&outqstats.queued, queue->size, __ATOMIC_RELAXED);
+    queue->attached = 0;
+    queue->head = queue->size = queue->capacity = 0;
+    free(queue->data);
+    queue->data = NULL;
+    queue->waiting = 0;
+    queue->link = NULL;
+    pollop = queue->pollop;
+    queue->pollop = NULL;
+    pthread_mutex_unlock(&queue->locker);
+    /* Отмена захватывает мьютекс движка, поэтому вне мьютекса очереди */
+    engine_cancel(pollop);
+}
+
+int outq_send(int socket, const char *msg, size_t size)
+{
+    struct outq_t *queue;
+    ssize_t check;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return -1;
+    pthread_mutex_lock(&queue->locker);
+    if(!queue->attached)
+    {
+        pthread_mutex_unlock(&queue->locker);
+        return -1;
+    }
+    /* Пока очередь пуста, пишем напрямую без блокировки */
+    if(!queue->size && !queue->inflight && !queue->dropped)
+    {
+        do
+            check = outq_write(queue, msg, size);
+        while(check < 0 && errno == EINTR);
+        if(check > 0)
+        {
+            msg += check;
+            size -= check;
+        }
+        /* Разрыв соединения обработает нить чтения */
+        else if(check < 0 && errno != EAGAIN)
+            size = 0;
+    }
+    /* Остаток склеивается с ранее накопленным и уйдет одной записью */
+    if(size && outq_push(queue, msg, size, 0) == 0 && !queue->inflight)
+        outq_watch(queue, 1);
+    pthread_mutex_unlock(&queue->locker);
+    return 0;
+}
+
+int outq_relayable(int socket)
+{
+    struct outq_t *queue;
+    int retval = 1;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return 1;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->dropped || (outqpolicy == OUTQ_POLICY_SKIP &&
+        queue->size >= outqhighwater))
+    {
+        __atomic_add_fetch(&outqstats.skipped, 1, __ATOMIC_RELAXED);
+        retval = 0;
+    }
+    pthread_mutex_unlock(&queue->locker);
+    return retval;
+}
+
+int outq_claim(int socket)
+{
+    struct outq_t *queue;
+    int retval = 0;
+    /* Без очереди (в том числе для дескрипторов за пределами
+        таблицы) остаток частичной отправки негде сохранить,
+        поэтому такое соединение пишется обычной отправкой */
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return 0;
+    pthread_mutex_lock(&queue->locker);
+    if(!queue->attached)
+        retval = 0;
+    /* Кольцо общей памяти пишется только через очередь */
+    else if(queue->link != NULL)
+        retval = 0;
+    else if(!queue->size && !queue->inflight && !queue->dropped)
+    {
+        /* Пока идет отправка мимо очереди, остальные
+            сообщения соединения копятся в очереди */
+        queue->inflight = 1;
+        retval = 1;
+    }
+    pthread_mutex_unlock(&queue->locker);
+    return retval;
+}
+
+void outq_release(int socket, const char *rest, size_t size)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->attached && queue->inflight)
+    {
+        queue->inflight = 0;
+        /* Остаток должен уйти раньше того, что накопилось за время
+            отправки, поэтому ставится в начало */
+        if(size)
+            outq_push(queue, rest, size, 1);
+        if(queue->size)
+        {
+            outq_flush(queue);
+            outq_watch(queue, queue->size != 0);
+        }
+    }
+    pthread_mutex_unlock(&queue->locker);
+}
+
+void outq_on_writable(int socket)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->attached && !queue->inflight)
+    {
+        outq_flush(queue);
+        outq_watch(queue, queue->size != 0);
+    }
+    pthread_mutex_unlock(&queue->locker);
+}
+
+int outq_hold(int socket)
+{
+    struct outq_t *queue;
+    int retval = -1;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return -1;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->attached && !queue->closing)
+    {
+        queue->holders++;
+        retval = 0;
+    }
+    pthread_mutex_unlock(&queue->locker);
+    return retval;
+}
+
+void outq_unhold(int socket)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->locker);
+    if(!--queue->holders && queue->closing)
+    {
+        queue->closing = 0;
+        close(socket);
+    }
+    pthread_mutex_unlock(&queue->locker);
+}
+
+void outq_close(int socket)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+    {
+        close(socket);
+        return;
+    }
+    /* Отправитель еще пишет в сокет: закрытый дескриптор мог бы
+        достаться новому соединению, и данные ушли бы не тому */
+    pthread_mutex_lock(&queue->locker);
+    if(queue->holders)
+        queue->closing = 1;
+    else
+        close(socket);
+    pthread_mutex_unlock(&queue->locker);
+}
+
+int outq_stream_begin(int socket)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return -1;
+    pthread_mutex_lock(&queue->writer);
+    return 0;
+}
+
+int outq_stream_write(int socket, struct iovec *iov, int iovcnt)
+{
+    struct outq_t *queue;
+    struct shm_link_t *link;
+    struct msghdr msg;
+    struct pollfd pfd;
+    ssize_t check;
+    unsigned int round = 0;
+    int retval = 0;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return -1;
+    pfd.fd = socket;
+    pfd.events = POLLOUT;
+    /* Накопленное раньше должно уйти первым - ждем, пока очередь
+        не дошлет реактор или движок, и захватываем соединение */
+    while(1)
+    {
+        pthread_mutex_lock(&queue->locker);
+        if(!queue->attached || queue->dropped)
+        {
+            pthread_mutex_unlock(&queue->locker);
+            return -1;
+        }
+        if(!queue->size && !queue->inflight)
+        {
+            queue->inflight = 1;
+            link = queue->link;
+            pthread_mutex_unlock(&queue->locker);
+            break;
+        }
+        link = queue->link;
+        pthread_mutex_unlock(&queue->locker);
+        /* Очередь кольца досылает звонок соседа, а сокет
+            всегда готов к записи */
+        if(link != NULL)
+            shm_link_nap(round++);
+        else
+            poll(&pfd, 1, OUTQ_STREAM_WAIT);
+    }
+    round = 0;
+    memset(&msg, 0, sizeof(struct msghdr));
+    while(iovcnt)
+    {
+        /* Кольцо общей памяти не принимает iov, поэтому пишем
+            элементы по одному; пока читатель не освободил место,
+            уступаем процессор, а потом засыпаем ненадолго */
+        if(link != NULL)
+        {
+            check = shm_link_write(link, (const char *)iov->iov_base,
+                iov->iov_len);
+            if(check && shm_link_wake(link))
+                send(socket, "", 1, MSG_DONTWAIT|MSG_NOSIGNAL);
+            if(!check && iov->iov_len)
+            {
+                if(!outq_alive(queue))
+                {
+                    retval = -1;
+                    break;
+                }
+                shm_link_nap(round++);
+                continue;
+            }
+            round = 0;
+        }
+        else
+        {
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            check = sendmsg(socket, &msg, MSG_DONTWAIT|MSG_NOSIGNAL);
+        }
+        if(check < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            /* Сосед не успевает принимать - ждем его, а не копим
+                данные в памяти, пока соединение живо */
+            if(errno == EAGAIN && outq_alive(queue))
+            {
+                poll(&pfd, 1, OUTQ_STREAM_WAIT);
+                continue;
+            }
+            retval = -1;
+            break;
+        }
+        /* Пропускаем отправленные элементы целиком и
+            сдвигаем начало недоотправленного */
+        while(iovcnt && (size_t)check >= iov->iov_len)
+        {
+            check -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt)
+        {
+            iov->iov_base = (char *)iov->iov_base + check;
+            iov->iov_len -= check;
+        }
+    }
+    /* Досылаем то, что накопилось за время записи */
+    outq_release(socket, NULL, 0);
+    return retval;
+}
+
+void outq_stream_end(int socket)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue != NULL)
+        pthread_mutex_unlock(&queue->writer);
+}
+
+int outq_switch(int socket, struct shm_link_t *link, const char *marker,
+    size_t size)
+{
+    struct outq_t *queue;
+    ssize_t check;
+    int retval = -1;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return -1;
+    /* Посреди потокового сообщения переключаться нельзя: его кадр
+        может продолжиться следующей записью */
+    if(pthread_mutex_trylock(&queue->writer) != 0)
+        return -1;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->attached && !queue->size && !queue->inflight &&
+        !queue->dropped && queue->link == NULL)
+    {
+        do
+            check = send(socket, marker, size, MSG_DONTWAIT|MSG_NOSIGNAL);
+        while(check < 0 && errno == EINTR);
+        if(check == (ssize_t)size)
+        {
+            queue->link = link;
+            outq_watch(queue, 0);
+            retval = 0;
+        }
+        /* Часть метки ушла, а остаток нельзя ни дописать кольцом,
+            ни поставить в очередь - соединение сбрасывается */
+        else if(check > 0)
+        {
+            queue->dropped = 1;
+            shutdown(socket, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&queue->locker);
+    pthread_mutex_unlock(&queue->writer);
+    return retval;
+}
+
+void outq_ring(int socket)
+{
+    struct outq_t *queue;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->attached && queue->link != NULL)
+        send(socket, "", 1, MSG_DONTWAIT|MSG_NOSIGNAL);
+    pthread_mutex_unlock(&queue->locker);
+}
+
+size_t outq_depth(int socket)
+{
+    struct outq_t *queue;
+    size_t depth = 0;
+    queue = outq_get(socket, 0);
+    if(queue == NULL)
+        return 0;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->attached)
+        depth = queue->size;
+    pthread_mutex_unlock(&queue->locker);
+    return depth;
+}
+
+void outq_get_stats(struct outq_stats_t *stats)
+{
+    stats->queued = __atomic_load_n(&outqstats.queued, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&outqstats.peak, __ATOMIC_RELAXED);
+    stats->overflows = __atomic_load_n(&outqstats.overflows, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&outqstats.dropped, __ATOMIC_RELAXED);
+    stats->skipped = __atomic_load_n(&outqstats.skipped, __ATOMIC_RELAXED);
+}
+
+int outq_push(struct outq_t *queue, const char *msg, size_t size, int front)
+{
+    size_t capacity;
+    unsigned long peak;
+    char *data;
+    if(queue->dropped)
+        return -1;
+    /* Переход порога: по политике сброса или сверх жесткого
+        предела соединение закрывается, читающая нить освободит его */
+    if(queue->size + size > outqhighwater && queue->size <= outqhighwater)
+        __atomic_add_fetch(&outqstats.overflows, 1, __ATOMIC_RELAXED);
+    if(queue->size + size > OUTQ_CAPACITY ||
+        (outqpolicy == OUTQ_POLICY_DROP && queue->size + size > outqhighwater))
+    {
+        __atomic_add_fetch(&outqstats.dropped, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&outqstats.queued, queue->size, __ATOMIC_RELAXED);
+        queue->dropped = 1;
+        queue->head = queue->size = 0;
+        outq_watch(queue, 0);
+        shutdown(queue->socket, SHUT_RDWR);
+        return -1;
+    }
+    /* Сдвигаем данные в начало буфера или расширяем его */
+    if(queue->head + queue->size + size > queue->capacity)
+    {
+        if(queue->size + size > queue->capacity)
+        {
+            capacity = queue->capacity ? queue->capacity : OUTQ_CHUNK;
+            while(capacity < queue->size + size)
+                capacity *= 2;
+            data = (char *)malloc(capacity);
+            memcpy(data, queue->data + queue->head, queue->size);
+            free(queue->data);
+            queue->data = data;
+            queue->capacity = capacity;
+        }
+        else
+            memmove(queue->data, queue->data + queue->head, queue->size);
+        queue->head = 0;
+    }
+    if(front)
+    {
+        /* Освобождаем место перед накопленным */
+        memmove(queue->data + queue->head + size, queue->data + queue->head,
+            queue->size);
+        memcpy(queue->data + queue->head, msg, size);
+    }
+    else
+        memcpy(queue->data + queue->head + queue->size, msg, size);
+    queue->size += size;
+    __atomic_add_fetch(&outqstats.queued, size, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&outqstats.peak, __ATOMIC_RELAXED);
+    while(queue->size > peak && !__atomic_compare_exchange_n(&outqstats.peak,
+        &peak, queue->size, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 0;
+}
+
+int outq_alive(struct outq_t *queue)
+{
+    int alive;
+    pthread_mutex_lock(&queue->locker);
+    alive = queue->attached && !queue->dropped;
+    pthread_mutex_unlock(&queue->locker);
+    return alive;
+}
+
+void outq_flush(struct outq_t *queue)
+{
+    ssize_t check;
+    while(queue->size)
+    {
+        check = outq_write(queue, queue->data + queue->head, queue->size);
+        if(check > 0)
+        {
+            queue->head += check;
+            queue->size -= check;
+            __atomic_sub_fetch(&outqstats.queued, check, __ATOMIC_RELAXED);
+        }
+        else if(check < 0 && errno == EINTR)
+            continue;
+        else
+        {
+            /* Разрыв соединения - очередь больше не нужна,
+                соединение освободит нить чтения */
+            if(check == 0 || errno != EAGAIN)
+            {
+                __atomic_sub_fetch(&outqstats.queued, queue->size,
+                    __ATOMIC_RELAXED);
+                queue->size = 0;
+            }
+            break;
+        }
+    }
+    if(!queue->size)
+        queue->head = 0;
+}
+
+ssize_t outq_write(struct outq_t *queue, const char *data, size_t size)
+{
+    size_t check;
+    if(queue->link == NULL)
+        return send(queue->socket, data, size, MSG_DONTWAIT|MSG_NOSIGNAL);
+    /* Полное кольцо для очереди - то же, что полный буфер сокета,
+        только досылать ее будет звонок соседа, а не реактор */
+    check = shm_link_write(queue->link, data, size);
+    if(check && shm_link_wake(queue->link))
+        send(queue->socket, "", 1, MSG_DONTWAIT|MSG_NOSIGNAL);
+    if(!check && size)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return check;
+}
+
+void outq_watch(struct outq_t *queue, int waiting)
+{
+    struct epoll_event ev;
+    /* Готовность сокета к записи кольцу не нужна */
+    if(queue->link != NULL)
+        waiting = 0;
+    if(queue->engine != NULL)
+    {
+        /* Операцию ожидания ставит нить движка через почтовый ящик,
+            чтобы не захватывать мьютекс движка под мьютексом очереди */
+        if(waiting && !queue->waiting)
+            engine_call(queue->engine, outq_engine_arm, queue, NULL,
+                queue->socket);
+        queue->waiting = waiting;
+        return;
+    }
+    if(waiting == queue->waiting)
+        return;
+    queue->waiting = waiting;
+    /* Реактор работает по фронту: при добавлении EPOLLOUT
+        событие придет сразу, если сокет уже готов к записи */
+    ev.events = EPOLLIN | EPOLLET | (waiting ? EPOLLOUT : 0);
+    ev.data.ptr = queue->ptr;
+    epoll_ctl(queue->epollfd, EPOLL_CTL_MOD, queue->socket, &ev);
+}
+
+void outq_engine_arm(void *ctx, void *arg, int socket)
+{
+    struct outq_t *queue = (struct outq_t *)ctx;
+    (void)arg;
+    pthread_mutex_lock(&queue->locker);
+    if(queue->attached && queue->waiting && queue->socket == socket)
+    {
+        if(queue->pollop == NULL)
+            queue->pollop = engine_poll(queue->engine, socket,
+                outq_engine_on_writable, queue);
+        else
+            engine_repoll(queue->pollop);
+    }
+    pthread_mutex_unlock(&queue->locker);
+}
+
+void outq_engine_on_writable(void *ctx, void *arg, int socket)
+{
+    struct outq_t *queue = (struct outq_t *)ctx;
+    (void)arg;
+    pthread_mutex_lock(&queue->locker);
+    /* Однократное ожидание отработало, при отправке мимо
+        очереди ее дошлет и перевзведет завершение этой отправки */
+    queue->waiting = 0;
+    if(queue->attached && !queue->inflight && queue->socket == socket)
+    {
+        outq_flush(queue);
+        outq_watch(queue, queue->size != 0);
+    }
+    pthread_mutex_unlock(&queue->locker);
+}
+
+#endif /* ifndef OUTQ_C */
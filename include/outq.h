@@ -0,0 +1,313 @@
+/*
+ ============================================================================
+ Name        : outq.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок очередей отправки соединений
+ ============================================================================
+ */
+
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+
+#include "engine.h"
+#include "shm.h"
+
+/* Наибольший дескриптор сокета, которому заводится очередь */
+#define OUTQ_MAX_SOCKETS          (262144)
+/* Начальный размер буфера очереди */
+#define OUTQ_CHUNK                  (1024)
+/* Жесткий предел очереди, сверх него соединение сбрасывается
+    при любой политике */
+#define OUTQ_CAPACITY              (65536)
+/* Порог переполнения по умолчанию */
+#define OUTQ_HIGHWATER             (16384)
+/* Сколько миллисекунд потоковая запись ждет готовности сокета
+    между проверками, не сброшено ли соединение */
+#define OUTQ_STREAM_WAIT             (100)
+
+/* Политики при переходе порога переполнения */
+enum
+{
+    /* Сбросить соединение с соседом */
+    OUTQ_POLICY_DROP,
+    /* Перестать пересылать соседу рассылки, сообщения
+        протокола копятся до жесткого предела */
+    OUTQ_POLICY_SKIP
+};
+
+/* Очередь отправки соединения; отправка идет мимо очереди,
+    пока она пуста, остаток копится и досылается по готовности
+    сокета к записи одним вызовом send */
+struct outq_t
+{
+    pthread_mutex_t locker;
+    /* Потоковая запись держит соединение на все сообщение,
+        чтобы кадры разных сообщений не перемешались */
+    pthread_mutex_t writer;
+    int socket;
+    int attached;
+    /* Неотправленные данные занимают [head, head+size) */
+    char *data;
+    size_t head, size, capacity;
+    /* Реактор epoll и контекст события соединения */
+    int epollfd;
+    void *ptr;
+    /* Или нить движка и операция ожидания записи */
+    struct engine_t *engine;
+    struct engine_op_t *pollop;
+    /* Ожидается готовность к записи */
+    int waiting;
+    /* Идет отправка рассылкой io_uring мимо очереди */
+    int inflight;
+    /* Соединение сброшено по переполнению */
+    int dropped;
+    /* Отправители, удерживающие сокет на время потоковой записи,
+        и отложенное до их ухода закрытие сокета */
+    int holders;
+    int closing;
+    /* Связь через общую память: после переключения данные пишутся
+        в ее кольцо, а в сокет уходят только звонки соседу, очередь
+        копит то, что не поместилось в кольцо */
+    struct shm_link_t *link;
+};
+
+/* Показатели очередей процесса */
+struct outq_stats_t
+{
+    /* Байт во всех очередях сейчас */
+    unsigned long queued;
+    /* Наибольшая глубина одной очереди */
+    unsigned long peak;
+    /* Переходы порога переполнения */
+    unsigned long overflows;
+    /* Соединения, сброшенные по переполнению */
+    unsigned long dropped;
+    /* Рассылки, пропущенные по переполнению */
+    unsigned long skipped;
+};
+
+/* Задает политику и порог переполнения */
+void outq_configure
+(
+    int policy,
+    size_t highwater
+);
+
+/* Заводит очередь соединению, обслуживаемому реактором epollfd
+    с контекстом события ptr, либо нитью движка engine */
+void outq_attach
+(
+    int socket,
+    int epollfd,
+    void *ptr,
+    struct engine_t *engine
+);
+
+/* Переносит контекст события реактора, когда соединение
+    перемещается (например, при обмене слотов) */
+void outq_rebind
+(
+    int socket,
+    void *ptr
+);
+
+/* Отбрасывает очередь, вызывается до закрытия сокета */
+void outq_detach
+(
+    int socket
+);
+
+/* Отправляет без блокировки или ставит в очередь, возвращает 0,
+    либо -1, если у сокета нет очереди и отправлять надо самому */
+int outq_send
+(
+    int socket,
+    const char *msg,
+    size_t size
+);
+
+/* Возвращает 0, если рассылки соседу приостановлены переполнением */
+int outq_relayable
+(
+    int socket
+);
+
+/* Захватывает соединение для отправки мимо очереди, возвращает 1,
+    если очередь пуста и данные можно передать ядру напрямую, и 0,
+    если очередь не пуста или ее нет - тогда остаток частичной
+    отправки сохранить негде и писать надо через msg_send */
+int outq_claim
+(
+    int socket
+);
+
+/* Завершает отправку мимо очереди, недоотправленный остаток
+    ставится в начало очереди */
+void outq_release
+(
+    int socket,
+    const char *rest,
+    size_t size
+);
+
+/* Досылает очередь, вызывается по готовности сокета к записи */
+void outq_on_writable
+(
+    int socket
+);
+
+/* Удерживает сокет соединения, чтобы его дескриптор не закрылся
+    и не достался другому соединению, пока идет отправка мимо
+    очереди; возвращает -1, если очереди нет или она отсоединена */
+int outq_hold
+(
+    int socket
+);
+
+/* Отпускает сокет, удержанный outq_hold, последний отправитель
+    закрывает его, если закрытие было отложено */
+void outq_unhold
+(
+    int socket
+);
+
+/* Закрывает сокет отсоединенной очереди сразу или, если его
+    удерживают отправители, после ухода последнего из них */
+void outq_close
+(
+    int socket
+);
+
+/* Начинает потоковую запись сообщения в соединение, ждет
+    окончания чужой, возвращает -1, если у сокета нет очереди */
+int outq_stream_begin
+(
+    int socket
+);
+
+/* Передает ядру iov целиком мимо очереди без копирования: ждет,
+    пока очередь не опустеет, и блокируется, пока сокет не примет
+    все данные, сообщения протокола тем временем копятся в очереди;
+    iov сдвигается по мере отправки, возвращает 0 или -1, если
+    соединение сброшено или закрыто; очередь досылает нить реактора
+    или движка, поэтому из нее вызывать нельзя, а сокет на время
+    записи удерживается outq_hold */
+int outq_stream_write
+(
+    int socket,
+    struct iovec *iov,
+    int iovcnt
+);
+
+/* Завершает потоковую запись сообщения */
+void outq_stream_end
+(
+    int socket
+);
+
+/* Переключает запись соединения на общую память: если очередь
+    пуста и никто не пишет сообщение, отправляет сокетом marker,
+    после которого сосед читает кольцо связи, и возвращает 0,
+    иначе -1 - переключение можно повторить позже */
+int outq_switch
+(
+    int socket,
+    struct shm_link_t *link,
+    const char *marker,
+    size_t size
+);
+
+/* Звонит соседу, ждущему места в кольце, если запись
+    соединения уже переключена на общую память */
+void outq_ring
+(
+    int socket
+);
+
+/* Возвращает 1, пока соединение очереди не отсоединено
+    и не сброшено */
+int outq_alive
+(
+    struct outq_t *queue
+);
+
+/* Возвращает глубину очереди соединения в байтах */
+size_t outq_depth
+(
+    int socket
+);
+
+/* Заполняет показатели очередей процесса */
+void outq_get_stats
+(
+    struct outq_stats_t *stats
+);
+
+/* Служебные процедуры, выполняются под мьютексом очереди */
+/* Возвращает очередь сокета, при create заводит ее */
+struct outq_t *outq_get
+(
+    int socket,
+    int create
+);
+
+/* Добавляет данные в конец или, при front, в начало очереди,
+    возвращает -1, если очередь сброшена по переполнению */
+int outq_push
+(
+    struct outq_t *queue,
+    const char *msg,
+    size_t size,
+    int front
+);
+
+/* Отправляет накопленное, пока сокет принимает данные */
+void outq_flush
+(
+    struct outq_t *queue
+);
+
+/* Пишет в сокет или в кольцо общей памяти без блокировки,
+    как send, будит соседа звонком */
+ssize_t outq_write
+(
+    struct outq_t *queue,
+    const char *data,
+    size_t size
+);
+
+/* Включает или снимает ожидание готовности к записи */
+void outq_watch
+(
+    struct outq_t *queue,
+    int waiting
+);
+
+/* Взводит ожидание записи в нити движка */
+void outq_engine_arm
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+/* Готовность к записи из движка */
+void outq_engine_on_writable
+(
+    void *ctx,
+    void *arg,
+    int socket
+);
+
+#endif /* ifndef OUTQ_H */
@@ -0,0 +1,130 @@
+/*
+ ============================================================================
+ Name        : place.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация файлового кэша места клиента в распределении
+ ============================================================================
+ */
+
+#ifndef PLACE_C
+#define PLACE_C
+
+#include "place.h"
+
+int place_file_path(char *path, size_t size, const char *name)
+{
+    const char *dir;
+    int length;
+    /* Личный каталог сеанса недоступен другим пользователям */
+    dir = getenv("XDG_RUNTIME_DIR");
+    if(dir == NULL || dir[0] != '/')
+        dir = PLACE_CACHE_DIR;
+    length = snprintf(path, size, "%s/%s", dir, name);
+    return length < 0 || (size_t)length >= size ? -1 : 0;
+}
+
+int place_file_open(const char *path, int flags)
+{
+    struct stat st;
+    int fd;
+    if((fd = open(path, flags|O_NOFOLLOW|O_CLOEXEC, 0600)) < 0)
+        return -1;
+    if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid())
+    {
+        close(fd);
+        errno = EPERM;
+        return -1;
+    }
+    return fd;
+}
+
+struct place_cache_t *place_cache_open(int *fd)
+{
+    char path[PLACE_PATH_SIZE], name[32];
+    unsigned int i;
+    struct place_cache_t *cache;
+    for(i=0; i<PLACE_CACHE_FILES; i++)
+    {
+        sprintf(name, PLACE_CACHE_NAME, i);
+        if(place_file_path(path, sizeof(path), name) < 0)
+            break;
+        /* Чужой файл или подложенную ссылку пропускаем */
+        if((*fd = place_file_open(path, O_RDWR|O_CREAT)) < 0)
+            continue;
+        /* Файл держит живой клиент - пробуем следующий,
+            блокировка снимается сама при завершении процесса */
+        if(flock(*fd, LOCK_EX|LOCK_NB) < 0)
+        {
+            close(*fd);
+            continue;
+        }
+        if(ftruncate(*fd, sizeof(struct place_cache_t)) < 0 ||
+            (cache = (struct place_cache_t *)mmap(NULL,
+                sizeof(struct place_cache_t), PROT_READ|PROT_WRITE,
+                MAP_SHARED, *fd, 0)) == MAP_FAILED)
+        {
+            close(*fd);
+            return NULL;
+        }
+        /* Новый или чужого формата файл начинаем с чистого листа */
+        if(cache->magic != PLACE_CACHE_MAGIC ||
+            cache->version != PLACE_CACHE_VERSION)
+        {
+            memset(cache, 0, sizeof(struct place_cache_t));
+            cache->magic = PLACE_CACHE_MAGIC;
+            cache->version = PLACE_CACHE_VERSION;
+        }
+        return cache;
+    }
+    *fd = -1;
+    return NULL;
+}
+
+void place_cache_close(struct place_cache_t *cache, int fd)
+{
+    if(cache == NULL)
+        return;
+    munmap(cache, sizeof(struct place_cache_t));
+    close(fd);
+}
+
+int place_cache_valid(struct place_cache_t *cache, in_addr_t dispatcher)
+{
+    unsigned int i;
+    /* Диспетчеру и клиенту без места возвращать нечего */
+    if(cache == NULL || cache->distance == 0 ||
+        cache->distance == 0xFFFFFFFF || cache->dispatcher != dispatcher ||
+        time(NULL) - cache->updated > PLACE_CACHE_TTL)
+            return 0;
+    for(i=0; i<PLACE_CACHE_SLOTS; i++)
+        if(cache->slots[i].used)
+            return 1;
+    return 0;
+}
+
+void place_cache_touch(struct place_cache_t *cache)
+{
+    cache->updated = time(NULL);
+}
+
+void place_cache_purge(void)
+{
+    char path[PLACE_PATH_SIZE], name[32];
+    unsigned int i;
+    int fd;
+    for(i=0; i<PLACE_CACHE_FILES; i++)
+    {
+        sprintf(name, PLACE_CACHE_NAME, i);
+        if(place_file_path(path, sizeof(path), name) < 0 ||
+            (fd = place_file_open(path, O_RDWR)) < 0)
+                continue;
+        /* Файл живого клиента не трогаем */
+        if(flock(fd, LOCK_EX|LOCK_NB) == 0)
+            unlink(path);
+        close(fd);
+    }
+}
+
+#endif /* ifndef PLACE_C */
@@ -0,0 +1,126 @@
+/*
+ ============================================================================
+ Name        : place.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок файлового кэша места клиента в распределении
+ ============================================================================
+ */
+
+#ifndef PLACE_H
+#define PLACE_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+
+/* Каталог файлов кэша, если не задан личный каталог сеанса
+    XDG_RUNTIME_DIR, и предельная длина пути */
+#define PLACE_CACHE_DIR "/tmp"
+#define PLACE_PATH_SIZE              (256)
+/* Шаблон имени файлов кэша, у каждого клиента процесса свой файл */
+#define PLACE_CACHE_NAME "psmd.place.%u"
+/* Предельное количество файлов кэша на компьютере */
+#define PLACE_CACHE_FILES           (1024)
+/* Метка и версия формата файла */
+#define PLACE_CACHE_MAGIC     (0x43414C50) /*PLAC*/
+#define PLACE_CACHE_VERSION            (2)
+/* Сколько секунд после остановки клиента его место
+    имеет смысл возвращать напрямую */
+#define PLACE_CACHE_TTL               (60)
+/* Слотов в кэше, совпадает с NUMBER_SLOTS */
+#define PLACE_CACHE_SLOTS              (8)
+
+/* Сосед в кэше, адрес и порт слушателя в обычном порядке */
+struct place_neighbor_t
+{
+    in_addr_t ipaddr;
+    unsigned short port;
+    unsigned char used;
+};
+
+/* Содержимое файла кэша, отображается в память и
+    обновляется прямо по ходу протокола */
+struct place_cache_t
+{
+    unsigned int magic;
+    unsigned int version;
+    /* Время последнего обновления, секунды эпохи */
+    long updated;
+    /* Диспетчер, при котором было получено место,
+        0 - диспетчер на этом компьютере */
+    in_addr_t dispatcher;
+    /* Удаление от диспетчера, порт слушателя клиента и позиция
+        якоря, от которой зависят слоты, где клиент дает места */
+    unsigned int distance;
+    unsigned short port;
+    unsigned int anchor;
+    /* Соседи по позициям слотов */
+    struct place_neighbor_t slots[PLACE_CACHE_SLOTS];
+};
+
+/* Составляет путь файла name в каталоге кэша, возвращает -1,
+    если путь не помещается в size байт */
+int place_file_path
+(
+    char *path,
+    size_t size,
+    const char *name
+);
+
+/* Открывает файл кэша с флагами flags (O_CREAT создает его с правами
+    0600), не следуя символической ссылке; файл, который не является
+    обычным или принадлежит другому пользователю, не открывается:
+    через него можно было бы подменить соседей или диспетчер;
+    возвращает дескриптор или -1 */
+int place_file_open
+(
+    const char *path,
+    int flags
+);
+
+/* Открывает первый не занятый другим клиентом файл кэша и
+    отображает его в память, по fd возвращает дескриптор
+    с удерживаемой блокировкой, при ошибке возвращает NULL */
+struct place_cache_t *place_cache_open
+(
+    int *fd
+);
+
+/* Снимает отображение и отпускает файл другим клиентам */
+void place_cache_close
+(
+    struct place_cache_t *cache,
+    int fd
+);
+
+/* Возвращает 1, если в кэше есть свежее место при диспетчере
+    dispatcher, которое можно вернуть напрямую у соседей */
+int place_cache_valid
+(
+    struct place_cache_t *cache,
+    in_addr_t dispatcher
+);
+
+/* Отмечает время обновления кэша */
+void place_cache_touch
+(
+    struct place_cache_t *cache
+);
+
+/* Удаляет файлы кэша, которые не держит ни один клиент, чтобы
+    следующие клиенты проходили протокол с чистого листа */
+void place_cache_purge
+(
+    void
+);
+
+#endif /* ifndef PLACE_H */
@@ -12,80 +12,465 @@
 
 #include "protocol.h"
 
+/* Каждый код сообщения считается в показателях отдельно: новый код
+    за пределом STATS_CODES молча пропал бы из отчета, поэтому
+    такая сборка не проходит */
+typedef char msg_codes_counted_t[MSG_CODES <= STATS_CODES ? 1 : -1];
+
 /* Вспомогательные функции */
 /* Общая процедура отправки датаграммы */
 void dg_send(int sock, in_addr_t broadaddr, dg_code_t code)
 {
     struct sockaddr_in sa;
-    struct in_addr dbg; /* для PROTO_PRINT */
-    dbg.s_addr = broadaddr; /* для PROTO_PRINT */
-    PROTO_PRINT("basic: dg_send(sock=%d, broadaddr=[%s], code=%d)\n",
-        sock, inet_ntoa(dbg), code);
+    char dg[sizeof(dg_code_t)];
+    /* Адрес разбирается по байтам в самой записи, чтобы при
+        отключенной трассировке не тратить время на inet_ntoa */
+    LOG_TRACE(("basic: dg_send(sock=%d, broadaddr=[%d.%d.%d.%d], code=%d)\n",
+        sock, ((unsigned char *)&broadaddr)[0], ((unsigned char *)&broadaddr)[1],
+        ((unsigned char *)&broadaddr)[2], ((unsigned char *)&broadaddr)[3], code));
     /* Заполняем структуру адреса */
     sa.sin_family = PF_INET;
     sa.sin_addr.s_addr = broadaddr;
     sa.sin_port = htons(DISPATCHER_PORT);
-    /* Отправляем сообщение по указанному адресу */
-    sendto(sock, &code, sizeof(dg_code_t), 0, (struct sockaddr *)&sa,
+    /* Отправляем сообщение по указанному адресу, код
+        в одинаковом для всех архитектур порядке */
+    msg_put(dg, code, sizeof(dg_code_t));
+    sendto(sock, dg, sizeof(dg_code_t), 0, (struct sockaddr *)&sa,
         sizeof(struct sockaddr_in));
 }
 
+void msg_put(char *buffer, unsigned long value, size_t width)
+{
+    size_t i;
+    for(i=0; i<width; i++, value >>= 8)
+        buffer[i] = (char)(value & 0xFF);
+}
+
+unsigned long msg_get(const char *buffer, size_t width)
+{
+    unsigned long value = 0;
+    while(width--)
+        value = (value << 8) | (unsigned char)buffer[width];
+    return value;
+}
+
+size_t msg_header(char *buffer, msg_code_t code)
+{
+    size_t length = 0;
+    MSG_SERIALIZE(MSG_VERSION, unsigned char, buffer, length);
+    MSG_SERIALIZE(code, unsigned char, buffer, length);
+    MSG_SERIALIZE(size_of_msg_tcp_data(code), unsigned short, buffer, length);
+    return length;
+}
+
+/* Размеры данных сообщений по кодам */
+#define MSG_SIZE_BEGIN(code, name, unit, dialog, slot) 0
+#define MSG_SIZE_FIELD(name, field, type) + sizeof(type)
+#define MSG_SIZE_END(name) ,
+static const size_t msg_sizes[MSG_CODES] =
+{
+    MSG_TABLE(MSG_SIZE_BEGIN, MSG_SIZE_FIELD, MSG_SIZE_END)
+};
+
+/* Кодеры сообщений */
+#define MSG_ENCODER_BEGIN(id, name, unit, dialog, slot) \
+    size_t msg_encode_##name(char *msg, const struct msg_##name##_t *data) \
+    { \
+        size_t msgsize; \
+        MSG_HEADER(id, msg, msgsize);
+#define MSG_ENCODER_FIELD(name, field, type) \
+        MSG_SERIALIZE(data->field, type, msg, msgsize);
+#define MSG_ENCODER_END(name) \
+        (void)data; \
+        return msgsize; \
+    }
+MSG_TABLE(MSG_ENCODER_BEGIN, MSG_ENCODER_FIELD, MSG_ENCODER_END)
+
+/* Декодеры сообщений, данные уже проверены на длину */
+#define MSG_DECODER_BEGIN(id, name, unit, dialog, slot) \
+    static void msg_decode_##name(const char *msg, union msg_data_t *data) \
+    { \
+        size_t msgsize = 0; \
+        data->name.code = id;
+#define MSG_DECODER_FIELD(name, field, type) \
+        MSG_DESERIALIZE(data->name.field, type, msg, msgsize);
+#define MSG_DECODER_END(name) \
+        (void)msg; \
+        (void)msgsize; \
+    }
+MSG_TABLE(MSG_DECODER_BEGIN, MSG_DECODER_FIELD, MSG_DECODER_END)
+
+/* Кодеры по объединению данных для таблицы кодеров */
+#define MSG_UNION_ENCODER(id, name, unit, dialog, slot) \
+    static size_t msg_encode_union_##name(char *msg, union msg_data_t *data) \
+    { \
+        return msg_encode_##name(msg, &data->name); \
+    }
+MSG_TABLE(MSG_UNION_ENCODER, MSG_NO_FIELD, MSG_NO_END)
+
+/* Таблицы кодеров, декодеров и обработчиков по кодам */
+#define MSG_ENCODER_ENTRY(code, name, unit, dialog, slot) msg_encode_union_##name,
+static size_t (*const msg_encoders[MSG_CODES])(char *msg,
+    union msg_data_t *data) =
+{
+    MSG_TABLE(MSG_ENCODER_ENTRY, MSG_NO_FIELD, MSG_NO_END)
+};
+
+#define MSG_DECODER_ENTRY(code, name, unit, dialog, slot) msg_decode_##name,
+static void (*const msg_decoders[MSG_CODES])(const char *msg,
+    union msg_data_t *data) =
+{
+    MSG_TABLE(MSG_DECODER_ENTRY, MSG_NO_FIELD, MSG_NO_END)
+};
+
+#define MSG_UNIT_ENTRY(code, name, unit, dialog, slot) unit,
+static const msg_unit_handler_t msg_unit_handlers[MSG_CODES] =
+{
+    MSG_TABLE(MSG_UNIT_ENTRY, MSG_NO_FIELD, MSG_NO_END)
+};
+
+#define MSG_DIALOG_ENTRY(code, name, unit, dialog, slot) dialog,
+static const msg_dialog_handler_t msg_dialog_handlers[MSG_CODES] =
+{
+    MSG_TABLE(MSG_DIALOG_ENTRY, MSG_NO_FIELD, MSG_NO_END)
+};
+
+#define MSG_SLOT_ENTRY(code, name, unit, dialog, slot) slot,
+static const msg_slot_handler_t msg_slot_handlers[MSG_CODES] =
+{
+    MSG_TABLE(MSG_SLOT_ENTRY, MSG_NO_FIELD, MSG_NO_END)
+};
+
 /* Функция вовращает размер данных сообщения,
-    отправляемого по TCP (без кода сообщения) */
+    отправляемого по TCP (без заголовка) */
 size_t size_of_msg_tcp_data(msg_code_t code)
 {
-    PROTO_PRINT("basic: size_of_msg_tcp_data(%d)\n", code);
-    switch(code)
-    {
-        case DISPATCHER_CONFIRM:
-            return sizeof(in_addr_t);
-        case PLACE_DISCOVER:
-            return sizeof(in_addr_t) +
-                sizeof(unsigned short) +
-                sizeof(unsigned int);
-        case CONNECTION_READY:
-        case PLACE_CONFIRM:
-        case PLACE_REFUSE:
-            return 0;
-        case PLACE_ANCHOR:
-            return sizeof(unsigned char) +
-                sizeof(unsigned int);
-        case CONNECTION_HANDSNAKE:
-            return sizeof(unsigned char);
-        case CONNECTION_BORDER:
-            return sizeof(unsigned char);
-        case CONNECTION_NEIGHBOR:
-            return sizeof(unsigned int) +
-                sizeof(unsigned short) +
-                sizeof(unsigned char);
-        case CONNECTION_DISTANCE:
-            return sizeof(unsigned int);
-    }
+    LOG_TRACE(("basic: size_of_msg_tcp_data(%d)\n", code));
+    return code < MSG_CODES ? msg_sizes[code] : 0;
+}
+
+size_t msg_encode(msg_code_t code, char *msg, union msg_data_t *data)
+{
+    if(code >= MSG_CODES)
+        return 0;
+    return msg_encoders[code](msg, data);
+}
+
+int msg_decode(msg_code_t code, const char *msg, size_t length,
+    union msg_data_t *data)
+{
+    /* Лишние данные допустимы - их добавит более новая версия
+        сообщения, недостающие - нет */
+    if(code >= MSG_CODES || length < msg_sizes[code])
+        return -1;
+    msg_decoders[code](msg, data);
     return 0;
 }
 
+size_t pack_stream(char *msg, msg_code_t code, union msg_data_t *data,
+    size_t rest, size_t size)
+{ /* Сериализация */
+    size_t msgsize;
+    data->stream.rest = rest;
+    msgsize = msg_encode(code, msg, data);
+    /* Длина в заголовке включает тело, идущее следом */
+    msg_put(msg+2, msgsize - MSG_HEADER_SIZE + size, sizeof(unsigned short));
+    return msgsize;
+}
+
 /* Общая процедура отправки сообщения в поток TCP */
 void msg_send(int socket, char *msg, size_t msgsize)
 {
-    /* В Linux блокирующие сокеты отправляют все данные целиком,
+    /* Соседи и участники диспетчеризации пишутся через очередь
+        соединения без блокировки, напрямую - только сокеты без
+        очереди (диалог с диспетчером и еще не занятые слоты).
+        В Linux блокирующие сокеты отправляют все данные целиком,
         однако, для поддержки Unix необходимо проверять все ли было
         отправлено, и отправлять остатки, если нужно */
-    size_t bytes = 0, check;
+    size_t bytes = 0;
+    ssize_t check;
+    msg_code_t code;
+    code = MSG_CODE(msg);
+    stats_sent(code, 1);
+    if(outq_send(socket, msg, msgsize) == 0)
+        return;
     do 
     {
-        /* Отправляем данные по соединению */
-        check = send(socket, msg+bytes, msgsize-bytes, 0);
+        /* Отправляем данные по соединению; закрытый с той стороны
+            диалог (например, остановленный диспетчер) дает ошибку,
+            а не SIGPIPE */
+        check = send(socket, msg+bytes, msgsize-bytes, MSG_NOSIGNAL);
         /* Проверяем все ли в порядке */
-        if(check == 0)
+        if(check <= 0)
             /* Если нет - уходим */
             break;
         /* Наращиваем общее кол-во байт отправленным только что */
         bytes += check;
-        PROTO_PRINT("tcp: send(bytes=%ld, check=%ld, msgsize=%ld)\n", bytes, check, msgsize);
+        LOG_TRACE(("tcp: send(bytes=%ld, check=%ld, msgsize=%ld)\n", bytes, check, msgsize));
     } /* Отправка продолжается, пока не отправим все */
     while(bytes < msgsize);
 }
 
+/* Выделяет очередной целый кадр из порции данных потока TCP */
+int msg_stream_next(struct stream_t *stream, char **data, size_t *size,
+    msg_code_t *code, char **msg, size_t *length)
+{
+    size_t need, take, fields;
+    char *header, *frame;
+    while(1)
+    {
+        /* Дочищаем пропускаемый кадр */
+        if(stream->skip)
+        {
+            take = stream->skip < *size ? stream->skip : *size;
+            stream->skip -= take;
+            *data += take;
+            *size -= take;
+            if(stream->skip)
+                return 0;
+        }
+        /* Выдаем пришедшую часть тела потокового кадра на месте */
+        if(stream->body)
+        {
+            if(!*size)
+                return 0;
+            take = stream->body < *size ? stream->body : *size;
+            stream->body -= take;
+            *code = stream->code;
+            *msg = *data;
+            *length = take;
+            *data += take;
+            *size -= take;
+            return 1;
+        }
+        /* Заголовок берем из порции или из уже накопленного */
+        header = stream->size ? stream->data : *data;
+        if((stream->size ? stream->size : *size) >= MSG_HEADER_SIZE)
+        {
+            *code = MSG_CODE(header);
+            *length = msg_get(header+2, sizeof(unsigned short));
+            need = MSG_HEADER_SIZE + *length;
+            /* Чужая версия, неизвестный код, данных меньше, чем нужно
+                коду, или кадр больше буфера - пропускаем кадр целиком,
+                у потокового кадра собираются только поля */
+            if((unsigned char)header[0] != MSG_VERSION ||
+                *code >= MSG_CODES || *length < msg_sizes[*code] ||
+                (need > STREAM_SIZE && !MSG_STREAMED(*code)))
+            {
+                LOG_DEBUG(("tcp: skip frame(version=%d, code=%d, length=%lu)\n",
+                    (unsigned char)header[0], *code, (unsigned long)*length));
+                if(stream->size)
+                {
+                    stream->skip = need - stream->size;
+                    stream->size = 0;
+                }
+                else
+                    stream->skip = need;
+                continue;
+            }
+            fields = MSG_HEADER_SIZE + msg_sizes[*code];
+            if(MSG_STREAMED(*code))
+                need = fields;
+            frame = NULL;
+            /* Если ничего не накоплено и кадр целиком в порции -
+                разбираем его на месте без копирования */
+            if(!stream->size && *size >= need)
+            {
+                frame = *data;
+                *data += need;
+                *size -= need;
+            }
+            /* Кадр собран в буфере */
+            else if(stream->size == need)
+            {
+                frame = stream->data;
+                stream->size = 0;
+            }
+            if(frame != NULL && !MSG_STREAMED(*code))
+            {
+                *msg = frame + MSG_HEADER_SIZE;
+                return 1;
+            }
+            /* Поля потокового кадра разобраны, дальше идет тело,
+                сами поля хранятся до конца кадра */
+            if(frame != NULL)
+            {
+                if(frame != stream->data)
+                    memcpy(stream->data, frame, fields);
+                stream->code = *code;
+                stream->body = *length - msg_sizes[*code];
+                stream->rest = msg_get(frame + MSG_HEADER_SIZE,
+                    sizeof(unsigned int));
+                if(stream->body)
+                    continue;
+                /* Пустое тело выдаем сразу, иначе его не заметят */
+                *msg = frame + fields;
+                *length = 0;
+                return 1;
+            }
+        }
+        else
+            need = MSG_HEADER_SIZE;
+        /* Иначе докладываем порцию в буфер кадра */
+        if(!*size)
+            return 0;
+        take = need - stream->size;
+        if(take > *size)
+            take = *size;
+        memcpy(stream->data + stream->size, *data, take);
+        stream->size += take;
+        *data += take;
+        *size -= take;
+    }
+}
+
+/* Общая процедура рассылки одного сообщения в несколько потоков TCP */
+void msg_fanout(struct client_t *client, int *sockets, unsigned int count,
+    char *msg, size_t msgsize)
+{
+    struct uring_t *ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned int i, idx, batch, pending;
+    int result;
+    msg_code_t code;
+    if(!count)
+        return;
+    code = MSG_CODE(msg);
+    LOG_TRACE(("basic: msg_fanout(%p, count=%d, msgsize=%ld)\n",
+        (void *)client, count, msgsize));
+    /* Без io_uring рассылаем по одному через очереди соединений */
+    if(client->dispatcher == NULL || client->dispatcher->fanout.fd < 0)
+    {
+        for(i=0; i<count; i++)
+            if(outq_relayable(sockets[i]))
+                msg_send(sockets[i], msg, msgsize);
+        return;
+    }
+    ring = &client->dispatcher->fanout;
+    pthread_mutex_lock(&client->dispatcher->fanoutlock);
+    while(count)
+    {
+        batch = count < FANOUT_BATCH ? count : FANOUT_BATCH;
+        /* Заполняем очередь отправки всей пачкой; адресаты с непустой
+            очередью соединения получают сообщение в ее конец, а
+            переполненные при политике пропуска не получают вовсе */
+        pending = 0;
+        for(i=0; i<batch; i++)
+        {
+            if(!outq_relayable(sockets[i]))
+                continue;
+            if(!outq_claim(sockets[i]))
+            {
+                msg_send(sockets[i], msg, msgsize);
+                continue;
+            }
+            sqe = uring_get_sqe(ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = sockets[i];
+            sqe->addr = (unsigned long)msg;
+            sqe->len = msgsize;
+            sqe->msg_flags = MSG_NOSIGNAL|MSG_DONTWAIT;
+            sqe->user_data = i;
+            pending++;
+        }
+        /* Одним системным вызовом передаем пачку и ждем ее завершения,
+            отправки не блокируются, поэтому ожидание не зависит
+            от медленных адресатов */
+        /* Остальных адресатов пачки посчитал msg_send */
+        stats_sent(code, pending);
+        /* Записи, которые ядро не приняло из-за ошибки вызова или
+            нехватки ресурсов, завершений не дадут - забираем их
+            обратно, и сообщение уходит через очереди соединений */
+        if(pending && uring_submit(ring, pending) < (int)pending)
+            while((sqe = uring_unget_sqe(ring)) != NULL)
+            {
+                outq_release(sockets[sqe->user_data], msg, msgsize);
+                pending--;
+            }
+        while(pending)
+        {
+            while((cqe = uring_peek_cqe(ring)) != NULL)
+            {
+                idx = cqe->user_data;
+                result = cqe->res;
+                uring_cqe_seen(ring);
+                pending--;
+                /* Ядро не знает IORING_OP_SEND или буфер сокета полон -
+                    весь остаток уходит в очередь соединения; ошибки
+                    отдельных адресатов не мешают остальным, разрыв
+                    соединения обработает нить чтения */
+                if(result == -EINVAL || result == -EOPNOTSUPP ||
+                    result == -EAGAIN)
+                        result = 0;
+                else if(result < 0)
+                    result = msgsize;
+                outq_release(sockets[idx], msg+result, msgsize-result);
+            }
+            if(pending)
+                uring_submit(ring, 1);
+        }
+        sockets += batch;
+        count -= batch;
+    }
+    pthread_mutex_unlock(&client->dispatcher->fanoutlock);
+}
+
+void msg_fanout_units(struct client_t *client, msg_units_next_t next,
+    const void *arg, char *msg, size_t msgsize)
+{
+    struct unit_t *unit;
+    unsigned int epoch, count = 0;
+    int sockets[FANOUT_BATCH];
+    /* Записи ушедших участников доступны до конца эпохи чтения */
+    epoch = registry_read_lock(&client->dispatcher->units);
+    for(unit = next(client, NULL, arg); unit != NULL;
+        unit = next(client, unit, arg))
+    {
+        sockets[count++] = unit->socket;
+        if(count == FANOUT_BATCH)
+        {
+            msg_fanout(client, sockets, count, msg, msgsize);
+            count = 0;
+        }
+    }
+    registry_read_unlock(&client->dispatcher->units, epoch);
+    msg_fanout(client, sockets, count, msg, msgsize);
+}
+
+/* Адресаты рассылок: все участники реестра */
+static struct unit_t *fanout_units(struct client_t *client,
+    struct unit_t *unit, const void *arg)
+{
+    (void)arg;
+    return registry_next(&client->dispatcher->units, unit);
+}
+
+/* Участники кольца с удалением *arg, дальние кольца
+    не ведутся, поэтому обходим реестр */
+static struct unit_t *fanout_ring(struct client_t *client,
+    struct unit_t *unit, const void *arg)
+{
+    unsigned int distance = *(const unsigned int *)arg;
+    do
+        unit = registry_next(&client->dispatcher->units, unit);
+    while(unit != NULL && unit->distance != distance);
+    return unit;
+}
+
+/* Зеркала реестра ведут все участники кольца 1, кроме самого
+    диспетчера, если он наследовал место в этом кольце */
+static struct unit_t *fanout_mirrors(struct client_t *client,
+    struct unit_t *unit, const void *arg)
+{
+    (void)arg;
+    unit = unit == NULL ? client->dispatcher->rings[1].units :
+        unit->ringnext;
+    while(unit != NULL && client_dispatcher_is_self(client, unit))
+        unit = unit->ringnext;
+    return unit;
+}
+
 /* Функция определяет идентификаторы общих соседей
     этого клиента и его соседа с идентификтором slotid */
 unsigned int get_neighbors_by_slot(struct client_t *client,
@@ -170,17 +555,18 @@ unsigned int get_neighbors_by_slot(struct client_t *client,
 
 /* Часть прикладного протокола, надстроенная над UDP */
 /* Широковещательный поиск диспетчера в сети */
-void dg_dispatcher_discover(struct client_t *client)
+void dg_dispatcher_discover(struct client_t *client, addr_data_t broadaddr)
 { /* Отправка */
     dg_code_t code;
-    PROTO_PRINT("call: dg_dispatcher_discover(%p)\n", (void *)client);
+    LOG_DEBUG(("call: dg_dispatcher_discover(%p, %u)\n", (void *)client, broadaddr));
     code = DISPATCHER_DISCOVER;
-    dg_send(client->sockUDP, client->netsdata[0].broadaddr, code);
+    /* Адреса сетей хранятся в обычном порядке, dg_send ждет сетевой */
+    dg_send(client->sockUDP, htonl(broadaddr), code);
 }
 
 void on_dispatcher_discover(struct client_t *client, in_addr_t ipaddr)
 { /* Прием */
-    PROTO_PRINT("catch: on_dispatcher_discover(%p, %d)\n", (void *)client, ipaddr);
+    LOG_DEBUG(("catch: on_dispatcher_discover(%p, %d)\n", (void *)client, ipaddr));
     /* Только диспетчер обрабатывает UDP постоянно в данном протоколе */
     /* Отвечаем на DISPATCHER_DISCOVER сообщением DISPATCHER_IM */
     dg_dispatcher_im(client, ipaddr);
@@ -191,31 +577,36 @@ void on_dispatcher_discover(struct client_t *client, in_addr_t ipaddr)
 void dg_dispatcher_im(struct client_t *client, in_addr_t ipaddr)
 { /* Отправка */
     dg_code_t code;
-    PROTO_PRINT("call: dg_dispatcher_im(%p)\n", (void *)client);
+    LOG_DEBUG(("call: dg_dispatcher_im(%p)\n", (void *)client));
     code = DISPATCHER_IM;
     dg_send(client->dispatcher->socketUDP, ipaddr, code);
 }
 
 /* Часть прикладного протокола, надстроенная над TCP */
 /* Сообщение о готовности диспетчера */
+size_t pack_dispatcher_confirm(char *msg, in_addr_t netaddr)
+{ /* Сериализация */
+    struct msg_dispatcher_confirm_t data;
+    data.netaddr = netaddr;
+    return msg_encode_dispatcher_confirm(msg, &data);
+}
+
 void msg_dispatcher_confirm(struct client_t *client, int socket)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = DISPATCHER_CONFIRM;
-    PROTO_PRINT("call: msg_dispatcher_confirm(%p, %d)\n", (void *)client, socket);
+    size_t msgsize;
+    LOG_DEBUG(("call: msg_dispatcher_confirm(%p, %d)\n", (void *)client, socket));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
-    MSG_SERIALIZE(client->dispatcher->netaddr, in_addr_t, msg, msgsize);
+    msgsize = pack_dispatcher_confirm(msg, client->dispatcher->netaddr);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
-void on_dispatcher_confirm(struct client_t *client, char *msg, size_t msgsize)
+void on_dispatcher_confirm(struct client_t *client,
+    const union msg_data_t *data)
 { /* Прием */
-    in_addr_t netaddr;
-    MSG_DESERIALIZE(netaddr, in_addr_t, msg, msgsize);
-    PROTO_PRINT("catch: on_dispatcher_confirm(%p, %d)\n", (void *)client, netaddr);
+    in_addr_t netaddr = data->dispatcher_confirm.netaddr;
+    LOG_DEBUG(("catch: on_dispatcher_confirm(%p, %d)\n", (void *)client, netaddr));
     /* На основе адреса внешней сети, в пределах которой будут выполнятся
         соединения между компьютерами, выбираем и запоминаем адрес нашего
         клиента в этой сети */
@@ -225,124 +616,244 @@ void on_dispatcher_confirm(struct client_t *client, char *msg, size_t msgsize)
         посылаем ему сообщение PLACE_DISCOVER */
     if(client->state.state == PROTOCOL_STARTED && client->distance)
     {
-        client->state.state = WAIT_PLACE;
-        PROTO_PRINT("call: msg_place_discover(%p)\n", (void *)client);
+        /* Сначала пробуем вернуть прежнее место напрямую у соседей */
+        if(client_reclaim_place(client))
+            return;
+        client_set_state(client, WAIT_PLACE);
+        LOG_DEBUG(("call: msg_place_discover(%p)\n", (void *)client));
         msg_place_discover(client, client->sockTCP, client->ipaddr,
-            client->portTCP, 0);
+            client->portTCP, client->ring);
     }
 }
 
 /* Поиск незанятого слота */
+size_t pack_place_discover(char *msg, in_addr_t ipaddr,
+    unsigned short port, unsigned int distance)
+{ /* Сериализация */
+    struct msg_place_discover_t data;
+    data.ipaddr = ipaddr;
+    data.port = port;
+    data.distance = distance;
+    return msg_encode_place_discover(msg, &data);
+}
+
 void msg_place_discover(struct client_t *client, int socket,
     in_addr_t ipaddr, unsigned short port, unsigned int distance)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = PLACE_DISCOVER;
-    PROTO_PRINT("call: msg_place_discover(%p, %d, %d, %d)\n", (void *)client, ipaddr, port, distance);
+    size_t msgsize;
+    LOG_DEBUG(("call: msg_place_discover(%p, %d, %d, %d)\n", (void *)client, ipaddr, port, distance));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
-    MSG_SERIALIZE(ipaddr, in_addr_t, msg, msgsize);
-    MSG_SERIALIZE(port, unsigned short, msg, msgsize);
-    MSG_SERIALIZE(distance, unsigned int, msg, msgsize);
+    msgsize = pack_place_discover(msg, ipaddr, port, distance);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
-void relay_place_discover(struct client_t *client, char *msg, size_t msgsize)
+int relay_place_reserved(struct client_t *client, struct unit_t *joiner)
+{ /* Отправка:Диспетчер */
+    struct unit_t *anchor;
+    char relay[TCP_MSG_SIZE];
+    size_t relaysize;
+    /* Оговариваем место у одного участника, поэтому одновременные
+        новые клиенты сразу расходятся по разным участникам, а не
+        соревнуются за каждый свободный слот */
+    anchor = client_dispatcher_reserve(client, joiner, joiner->joinring);
+    if(anchor == NULL)
+        return 0;
+    LOG_DEBUG(("\treserve: socket=[%d], distance=[%d], free=[%d], reserved=[%d]\n",
+        anchor->socket, anchor->distance, anchor->free, anchor->reserved));
+    /* Поиск уходит с удалением участника, даже если
+        место нашлось не в запрошенном кольце */
+    relaysize = pack_place_discover(relay, joiner->joinaddr,
+        joiner->joinport, anchor->distance);
+    msg_send(anchor->socket, relay, relaysize);
+    return 1;
+}
+
+void relay_place_discover(struct client_t *client, struct unit_t *sender,
+    const union msg_data_t *data)
 { /* Прием:Диспетчер */
-    struct unit_node_t *ptr;
+    struct unit_t *joiner;
     in_addr_t ipaddr;
     unsigned short port;
     unsigned int distance;
-    PROTO_PRINT("catch: relay_place_discover(%p)\n", (void *)client);
+    char relay[TCP_MSG_SIZE];
+    size_t relaysize;
+    LOG_DEBUG(("catch: relay_place_discover(%p)\n", (void *)client));
     /* Дополнительная проверка на то, вызвана ли процедура
         после инициализации диспетчера */
     if(client != NULL && client->dispatcher != NULL)
     {
         /* Забираем значение дистанции из сообщения */
-        MSG_DESERIALIZE(ipaddr, in_addr_t, msg, msgsize);
-        MSG_DESERIALIZE(port, unsigned short, msg, msgsize);
-        MSG_DESERIALIZE(distance, unsigned int, msg, msgsize);
-        /* Диспетчер пересылает сообщение всем клиентам, чье расстояние
-            соответствует указанному в сообщении. */
-        ptr = client->dispatcher->units;
-        while(ptr!=NULL)
+        ipaddr = data->place_discover.ipaddr;
+        port = data->place_discover.port;
+        distance = data->place_discover.distance;
+        /* Кольца ближе DISPATCHER_RINGS ведутся диспетчером вместе со
+            свободными слотами участников, поэтому место оговаривается */
+        if(distance < DISPATCHER_RINGS)
         {
-            if(ptr->unit.distance == distance)
-                msg_place_discover(client, ptr->unit.socket, ipaddr, port, 0);
-            ptr = ptr->next;
+            /* Поиск вернул участник кольца, у которого не оказалось
+                свободного слота, - переоговариваем место его клиента */
+            joiner = sender;
+            if(sender->distance == distance &&
+                (joiner = client_dispatcher_find_joiner(client, sender,
+                    ipaddr, port)) == NULL)
+                        return;
+            joiner->joinaddr = ipaddr;
+            joiner->joinport = port;
+            joiner->joinring = distance;
+            /* Свободных слотов нет ни у кого - клиент ждет, пока
+                участники не сообщат о них */
+            if(!relay_place_reserved(client, joiner))
+                client_dispatcher_wait(client, joiner);
+            return;
         }
+        /* Сообщение одинаково для всех адресатов - сериализуем один раз */
+        relaysize = pack_place_discover(relay, ipaddr, port, distance);
+        msg_fanout_units(client, fanout_ring, &distance, relay, relaysize);
     }
 }
 
-void on_place_discover(struct client_t *client, char *msg, size_t msgsize)
+void on_place_discover(struct client_t *client,
+    const union msg_data_t *data)
 { /* Прием:Клиент */
     unsigned int slotid;
-    in_addr_t ipaddr;
-    unsigned short port;
-    unsigned int distance;
-    PROTO_PRINT("catch: on_place_discover(%p)\n", (void *)client);
-    MSG_DESERIALIZE(ipaddr, in_addr_t, msg, msgsize);
-    MSG_DESERIALIZE(port, unsigned short, msg, msgsize);
-    MSG_DESERIALIZE(distance, unsigned int, msg, msgsize);
-    if(client->distance == distance &&
-        (slotid = client_has_free_slot(client)) != INVALID_SLOT)
-        client_connect_to_client(client, slotid, ipaddr, port);
+    in_addr_t ipaddr = data->place_discover.ipaddr;
+    unsigned short port = data->place_discover.port;
+    unsigned int distance = data->place_discover.distance;
+    LOG_DEBUG(("catch: on_place_discover(%p)\n", (void *)client));
+    if(client->distance != distance)
+        return;
+    /* Место дается только в своей клетке следующего кольца */
+    if((slotid = client_has_place_slot(client)) != INVALID_SLOT)
+    {
+        client_connect_to_client(client, slotid, ipaddr, port,
+            NO_HANDSHAKE);
+        return;
+    }
+    /* Слоты заняли в обход оговорок диспетчера (рукопожатия общих
+        соседей) - сообщаем ему об этом и возвращаем поиск */
+    msg_connection_distance(client, client->distance);
+    msg_place_discover(client, client->sockTCP, ipaddr, port, distance);
+}
+
+/* Диспетчер сообщает новому клиенту кольцо для поиска слота */
+void msg_place_ring(struct client_t *client, int socket,
+    unsigned int distance)
+{ /* Отправка */
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    struct msg_place_ring_t data;
+    LOG_DEBUG(("call: msg_place_ring(%p, %d, %d)\n", (void *)client, socket, distance));
+    /* Формируем сообщение */
+    data.distance = distance;
+    msgsize = msg_encode_place_ring(msg, &data);
+    /* Посылаем сообщение */
+    msg_send(socket, msg, msgsize);
+}
+
+void on_place_ring(struct client_t *client, const union msg_data_t *data)
+{ /* Прием */
+    unsigned int distance = data->place_ring.distance;
+    LOG_DEBUG(("catch: on_place_ring(%p, %d)\n", (void *)client, distance));
+    /* Запоминаем кольцо, в котором будем искать слот */
+    client->ring = distance;
 }
 
 /* Сообщение параметров места в распределении новому клиенту */
+size_t pack_place_anchor(char *msg, unsigned char position,
+    unsigned int distance, unsigned short port)
+{ /* Сериализация */
+    struct msg_place_anchor_t data;
+    data.position = position;
+    data.distance = distance;
+    data.port = port;
+    return msg_encode_place_anchor(msg, &data);
+}
+
 void msg_place_anchor(struct client_t *client, int socket,
     unsigned char position, unsigned int distance)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = PLACE_ANCHOR;
-    PROTO_PRINT("call: msg_place_anchor(%p, %d, %d, %d)\n", (void *)client, socket, position, distance);
-    /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
-    MSG_SERIALIZE(position, unsigned char, msg, msgsize);
-    MSG_SERIALIZE(distance, unsigned int, msg, msgsize);
+    size_t msgsize;
+    LOG_DEBUG(("call: msg_place_anchor(%p, %d, %d, %d)\n", (void *)client, socket, position, distance));
+    /* Формируем сообщение, новый клиент видит у соединения только
+        временный порт, а соседям он передает порт слушателя */
+    msgsize = pack_place_anchor(msg, position, distance, client->portTCP);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
 void on_place_anchor(struct client_t *client, unsigned int slotid,
-    char *msg, size_t msgsize)
+    const union msg_data_t *data)
 { /* Прием */
-    unsigned char newslotid;
-    unsigned int distance;
-    PROTO_PRINT("catch: on_place_anchor(%p, slotid:%d, %p, %ld)\n", (void *)client, slotid, (void *)msg, msgsize);
-    MSG_DESERIALIZE(newslotid, unsigned char, msg, msgsize);
-    MSG_DESERIALIZE(distance, unsigned int, msg, msgsize);
-    PROTO_PRINT("\tattr: newslotid=[%d], distance=[%d]\n", newslotid, distance);
+    unsigned char newslotid = data->place_anchor.position;
+    unsigned int distance = data->place_anchor.distance;
+    unsigned short port = data->place_anchor.port;
+    LOG_DEBUG(("catch: on_place_anchor(%p, slotid:%d)\n", (void *)client, slotid));
+    LOG_DEBUG(("\tattr: newslotid=[%d], distance=[%d], port=[%d]\n",
+        newslotid, distance, port));
     client->distance = distance;
+    client->anchor = newslotid;
+    client->slots[slotid].port = port;
     client_slots_swap(client, slotid, newslotid);
 }
 
+void msg_place_bundle(struct client_t *client, unsigned int slotid)
+{ /* Отправка */
+    char msg[TCP_BUNDLE_SIZE];
+    size_t msgsize;
+    unsigned int i;
+    unsigned int count;
+    /* Сюда записываем соседей с точки зрения этой стороны */
+    unsigned int slotids[NUMBER_SLOTS];
+    /* Здесь соседи с точки зрения той стороны соединения */
+    unsigned int actslotids[NUMBER_SLOTS];
+    struct slot_t *neighbor;
+    LOG_DEBUG(("call: msg_place_bundle(%p, slotid:%d)\n", (void *)client, slotid));
+    count = get_neighbors_by_slot(client, slotid, slotids, actslotids);
+    /* Позиция нового клиента относительно принявшего и его удаление,
+        на единицу большее, чем у принявшего клиента */
+    msgsize = pack_place_anchor(msg, OPPOSITE_POSITION(slotid),
+        client->distance+1, client->portTCP);
+    /* Количество соседей (исключая себя) */
+    msgsize += pack_connection_border(msg+msgsize, count);
+    /* Реквизиты соседей нового клиента в распределении, каждая
+        запись журнала - целая строка, иначе строки разных нитей
+        перемешаются при выводе */
+    for(i=0; i<count; i++)
+    {
+        neighbor = client->slots+slotids[i];
+        LOG_DEBUG(("\t neighbor: [%d]\n", slotids[i]));
+        msgsize += pack_connection_neighbor(msg+msgsize,
+            neighbor->ipaddr, neighbor->port, actslotids[i]);
+    }
+    /* Все сообщения пакета уходят одной записью и одним сегментом,
+        msg_send учтет только первое из них */
+    stats_sent(CONNECTION_BORDER, 1);
+    stats_sent(CONNECTION_NEIGHBOR, count);
+    msg_send(client->slots[slotid].socket, msg, msgsize);
+}
+
 /* Подтверждение получения места в распределении */
 void msg_place_confirm(struct client_t *client, int socket)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = PLACE_CONFIRM;
-    PROTO_PRINT("call: msg_place_confirm(%p, socket:%d)\n", (void *)client, socket);
+    size_t msgsize;
+    struct msg_place_confirm_t data;
+    LOG_DEBUG(("call: msg_place_confirm(%p, socket:%d)\n", (void *)client, socket));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
+    data.code = PLACE_CONFIRM;
+    msgsize = msg_encode_place_confirm(msg, &data);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
-void on_place_confirm(struct client_t *client, unsigned int slotid)
+void on_place_confirm(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data)
 { /* Прием */
-    unsigned int i;
-    unsigned int count;
-    /* Сюда записываем соседей с точки зрения этой стороны */
-    unsigned int slotids[NUMBER_SLOTS];
-    /* Здесь соседи с точки зрения той стороны соединения */
-    unsigned int actslotids[NUMBER_SLOTS];
-    struct slot_t *slot, *neighbor;
-    PROTO_PRINT("catch: on_place_confirm(%p, slotid:%d)\n", (void *)client, slotid);
+    (void)data;
+    LOG_DEBUG(("catch: on_place_confirm(%p, slotid:%d)\n", (void *)client, slotid));
     /* Если протокол ждет подключения всех соседей */
     if(client->state.state == WAIT_ALL_NEIGHBOR)
     {
@@ -351,22 +862,7 @@ void on_place_confirm(struct client_t *client, unsigned int slotid)
         /* Если этот сосед последний */
         if(!client->state.attr)
         {
-            /* Переключаем состояние протокола в последнюю фазу
-                соединение со всеми необходимыми участниками
-                установлено, новые участники будут приниматься
-                через обработчик новых соединений или через
-                on_place_discover в зависимости от ситуации */
-            client->state.state = IN_PROCESS;
-            /* Ставим указатель на первый слот */
-            slot = client->slots;
-            for(i=0; i<NUMBER_SLOTS; i++, slot++)
-            {
-                if(slot->status == SLOT_STATUS_PREPARE)
-                {
-                    client_slot_ready(client, i);
-                    msg_connection_ready(client, slot->socket);
-                }
-            }
+            on_place_complete(client);
             /* С этого момента клиент готов работать
                 с полезной нагрузкой */
             return;
@@ -375,150 +871,259 @@ void on_place_confirm(struct client_t *client, unsigned int slotid)
     /* Если протокол не в состоянии IN_PROCESS - уходим */
     if(client->state.state != IN_PROCESS)
         return;
+    /* Подключение с рукопожатием - знакомство с соседом,
+        места ему не выдается */
+    if(client->slots[slotid].handshake != NO_HANDSHAKE)
+    {
+        client_slot_ready(client, slotid);
+        msg_connection_ready(client, client->slots[slotid].socket);
+        msg_connection_introduce(client, slotid);
+        return;
+    }
+    /* Отправляем новому клиенту его позицию, удаление и реквизиты
+        общих соседей одним пакетом, чтобы не тратить на каждое
+        сообщение отдельный сегмент */
+    msg_place_bundle(client, slotid);
+}
 
-    /* Смещаемся на указатель конкретного слота */
-    slot = client->slots+slotid;
-    /* Ассоциируем слот с портом отправителя (из сообщения) */
-    /* Отправляем новому клиенту его позицию относительно принявшего,
-        а также сообщаем ему, что его удаление на единицу больше,
-        чем у принявшего клиента */
-    msg_place_anchor(client, slot->socket,
-        OPPOSITE_POSITION(slotid), client->distance+1);
-    /* Отправляем характеристики границ отображения (холста),
-        также отправляем количество соседей (исключая себя) */
-    msg_connection_border(client, slot->socket,
-        count = get_neighbors_by_slot(client, slotid, slotids, actslotids));
-    PROTO_PRINT("\t neighbors:");
-    for(i=0; i<count; i++)
-        PROTO_PRINT(" [%d]", slotids[i]);
-    PROTO_PRINT("\n");
-    /* Сообщаем отправителю реквизиты его соседей в распределении */
-    for(i=0; i<count; i++)
+void on_place_complete(struct client_t *client)
+{
+    unsigned int i;
+    struct slot_t *slot;
+    /* Переключаем состояние протокола в последнюю фазу
+        соединение со всеми необходимыми участниками
+        установлено, новые участники будут приниматься
+        через обработчик новых соединений или через
+        on_place_discover в зависимости от ситуации */
+    client_set_state(client, IN_PROCESS);
+    __atomic_store_n(&client->reclaiming, 0, __ATOMIC_RELEASE);
+    /* Ставим указатель на первый слот */
+    slot = client->slots;
+    for(i=0; i<NUMBER_SLOTS; i++, slot++)
     {
-        /* Смещаемся на указатель i-того соседа */
-        neighbor = client->slots+slotids[i];
-        /* Передаем его реквизиты отправителю */
-        msg_connection_neighbor(client, slot->socket,
-            neighbor->ipaddr, neighbor->port, actslotids[i]);
+        if(slot->status == SLOT_STATUS_PREPARE)
+        {
+            client_slot_ready(client, i);
+            msg_connection_ready(client, slot->socket);
+            msg_connection_introduce(client, i);
+        }
     }
+    /* Сообщаем диспетчеру свое кольцо */
+    msg_connection_distance(client, client->distance);
 }
 
 /* Отказ от получения места в распределении */
 void msg_place_refuse(struct client_t *client, int socket)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = PLACE_REFUSE;
-    PROTO_PRINT("call: msg_place_refuse(%p, socket:%d)\n", (void *)client, socket);
+    size_t msgsize;
+    struct msg_place_refuse_t data;
+    LOG_DEBUG(("call: msg_place_refuse(%p, socket:%d)\n", (void *)client, socket));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
+    data.code = PLACE_REFUSE;
+    msgsize = msg_encode_place_refuse(msg, &data);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
-void on_place_refuse(struct client_t *client, unsigned int slotid)
+void on_place_refuse(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data)
 { /* Прием */
-    PROTO_PRINT("catch: on_place_refuse(%p, slotid:%d)\n", (void *)client, slotid);
+    (void)data;
+    LOG_DEBUG(("catch: on_place_refuse(%p, slotid:%d)\n", (void *)client, slotid));
     client_release_slot(client, slotid);
+    if(client->state.state != WAIT_ALL_NEIGHBOR)
+        return;
+    /* Прежний сосед, не вернувший место, прерывает возврат */
+    if(__atomic_load_n(&client->reclaiming, __ATOMIC_ACQUIRE))
+    {
+        client_reclaim_abort(client);
+        return;
+    }
+    /* Общий сосед отказывает, когда его позицию напротив нас уже
+        занимает другой: якорь выдал неверное место, поэтому слоты
+        освобождаются и место ищется заново */
+    client_place_restart(client);
 }
 
 /* Рукопожатие с новыми соседями с целью
     совместить границы рамок матрицы распределения */
-void msg_connection_handsnake(struct client_t *client, unsigned char position)
+void msg_connection_handsnake(struct client_t *client, int socket,
+    unsigned char position)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = CONNECTION_HANDSNAKE;
-    PROTO_PRINT("call: msg_connection_handsnake(%p, %d)\n", (void *)client, position);
+    size_t msgsize;
+    struct msg_connection_handsnake_t data;
+    LOG_DEBUG(("call: msg_connection_handsnake(%p, %d)\n", (void *)client, position));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
-    MSG_SERIALIZE(position, unsigned char, msg, msgsize);
+    data.position = position;
+    data.port = client->portTCP;
+    msgsize = msg_encode_connection_handsnake(msg, &data);
     /* Посылаем сообщение */
-    msg_send(client->sockTCP, msg, msgsize);
+    msg_send(socket, msg, msgsize);
 }
 
-void on_connection_handsnake(struct client_t *client, unsigned int slotid, unsigned char position)
+void on_connection_handsnake(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data)
 { /* Прием */
-    PROTO_PRINT("catch: on_connection_handsnake(%p, %d, %d)\n", (void *)client, slotid, position);
+    unsigned char position = data->connection_handsnake.position;
+    unsigned short port = data->connection_handsnake.port;
+    LOG_DEBUG(("catch: on_connection_handsnake(%p, %d, %d, %d)\n",
+        (void *)client, slotid, position, port));
+    /* Соединение, принятое в ожидании места, открыл не якорь, а
+        прежний сосед того, кто раньше слушал этот порт: места он
+        не даст, поэтому отказываем ему */
+    if(client->state.state == PLACE_SELECTED)
+    {
+        msg_place_refuse(client, client->slots[slotid].socket);
+        on_place_lost(client, slotid);
+        return;
+    }
+    /* Запоминаем порт слушателя вместо временного порта соединения */
+    client->slots[slotid].port = port;
+    client->slots[slotid].parked = 0;
+    /* Позицию из рукопожатия уже занимает другой сосед: подключившийся
+        считает своим чужое место, отказываем ему до подтверждения;
+        соединение, само ждущее рукопожатия, просто меняется слотами */
+    if(position >= NUMBER_SLOTS || (position != slotid &&
+        client->slots[position].status != SLOT_STATUS_FREE &&
+        !client->slots[position].parked))
+    {
+        msg_place_refuse(client, client->slots[slotid].socket);
+        client_release_slot(client, slotid);
+        return;
+    }
     /* Перемещаем слот согласно указаниям из рукопожатия */
-    client_slots_swap(client, slotid, position);
+    if(position != slotid)
+        client_slots_swap(client, slotid, position);
+    msg_place_confirm(client, client->slots[position].socket);
 }
 
 /* Функция передает кол-во соседей, перед отправкой их данных */
+size_t pack_connection_border(char *msg, unsigned char neighborcount)
+{ /* Сериализация */
+    struct msg_connection_border_t data;
+    data.neighborcount = neighborcount;
+    return msg_encode_connection_border(msg, &data);
+}
+
 void msg_connection_border(struct client_t *client, int socket,
     unsigned char neighborcount)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = CONNECTION_BORDER;
-    PROTO_PRINT("call: msg_connection_border(%p, %d)\n", (void *)client, neighborcount);
+    size_t msgsize;
+    LOG_DEBUG(("call: msg_connection_border(%p, %d)\n", (void *)client, neighborcount));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
-    MSG_SERIALIZE(neighborcount, unsigned char, msg, msgsize);
+    msgsize = pack_connection_border(msg, neighborcount);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
 void on_connection_border(struct client_t *client, unsigned int slotid,
-    char *msg, size_t msgsize)
+    const union msg_data_t *data)
 { /* Прием */
-    unsigned char neighborcount;
+    unsigned char neighborcount = data->connection_border.neighborcount;
     struct slot_t *slot;
     /* Смещаемся на указатель конкретного слота */
     slot = client->slots+slotid;
-    MSG_DESERIALIZE(neighborcount, unsigned char, msg, msgsize);
-    PROTO_PRINT("catch: on_connection_border(%p, slotid:%d, neighborcount:%d)\n",
-        (void *)client, slotid, neighborcount);
+    LOG_DEBUG(("catch: on_connection_border(%p, slotid:%d, neighborcount:%d)\n",
+        (void *)client, slotid, neighborcount));
     if(client->state.state == PLACE_SELECTED)
     {
         if(neighborcount > 0)
         {
-            client->state.state = WAIT_ALL_NEIGHBOR;
+            client_set_state(client, WAIT_ALL_NEIGHBOR);
             client->state.attr = neighborcount;
         }
         else
         {
-            client->state.state = IN_PROCESS;
+            client_set_state(client, IN_PROCESS);
             client_slot_ready(client, slotid);
             msg_connection_ready(client, slot->socket);
+            /* Сообщаем диспетчеру свое кольцо */
+            msg_connection_distance(client, client->distance);
         }
     }
 }
 
 /* Пересылка данных о общем соседе */
+size_t pack_connection_neighbor(char *msg, in_addr_t ipaddr,
+    unsigned short port, unsigned char position)
+{ /* Сериализация */
+    struct msg_connection_neighbor_t data;
+    data.ipaddr = ipaddr;
+    data.port = port;
+    data.position = position;
+    return msg_encode_connection_neighbor(msg, &data);
+}
+
 void msg_connection_neighbor(struct client_t *client, int socket,
     in_addr_t ipaddr, unsigned short port, unsigned char position)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = CONNECTION_NEIGHBOR;
-    PROTO_PRINT("call: msg_connection_neighbor(%p, %d, %d, %d)\n", (void *)client, ipaddr, port, position);
+    size_t msgsize;
+    LOG_DEBUG(("call: msg_connection_neighbor(%p, %d, %d, %d)\n", (void *)client, ipaddr, port, position));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
-    MSG_SERIALIZE(ipaddr, in_addr_t, msg, msgsize);
-    MSG_SERIALIZE(port, unsigned short, msg, msgsize);
-    MSG_SERIALIZE(position, unsigned char, msg, msgsize);
+    msgsize = pack_connection_neighbor(msg, ipaddr, port, position);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
 void on_connection_neighbor(struct client_t *client, unsigned int slotid,
-    char *msg, size_t msgsize)
+    const union msg_data_t *data)
 { /* Прием */
-    in_addr_t ipaddr;
-    unsigned short port;
-    unsigned char position;
-    PROTO_PRINT("catch: on_connection_neighbor(%p, slotid:%d)\n", (void *)client, slotid);
     /* Получаем атрибуты сообщения */
-    MSG_DESERIALIZE(ipaddr, in_addr_t, msg, msgsize);
-    MSG_DESERIALIZE(port, unsigned short, msg, msgsize);
-    MSG_DESERIALIZE(position, unsigned char, msg, msgsize);
-    PROTO_PRINT("\t attr: ipaddr=%d, port=%d, position=%d\n", ipaddr, port, position);
-    /* Выполняем подключение */
-    client_connect_to_client(client, position, ipaddr, port);
-    /* Отправляем рукопожатие с целью передать позицию себя относительно
-        адресата (т.е. оппозицию) */
-    msg_connection_handsnake(client, OPPOSITE_POSITION(position));
+    in_addr_t ipaddr = data->connection_neighbor.ipaddr;
+    unsigned short port = data->connection_neighbor.port;
+    unsigned char position = data->connection_neighbor.position;
+    LOG_DEBUG(("catch: on_connection_neighbor(%p, slotid:%d)\n", (void *)client, slotid));
+    LOG_DEBUG(("\t attr: ipaddr=%d, port=%d, position=%d\n", ipaddr, port, position));
+    /* Знакомство с соседом, уже занявшим свое место: позиция,
+        где сосед уже есть, пропускается */
+    if(client->state.state == IN_PROCESS && (position >= NUMBER_SLOTS ||
+        !client_slot_unpark(client, position)))
+            return;
+    /* Начинаем подключение, не дожидаясь его: по завершении соседу
+        уйдет рукопожатие с позицией себя относительно адресата
+        (т.е. оппозицией), поэтому соединения со всеми общими
+        соседями устанавливаются одновременно */
+    if(client_connect_to_client(client, position, ipaddr, port,
+        OPPOSITE_POSITION(position)) < 0)
+            on_connection_failed(client);
+}
+
+/* Порядок соседей при знакомстве: подключается меньший */
+static int peer_before(const struct slot_t *slot, const struct slot_t *other)
+{
+    if(slot->port != other->port)
+        return slot->port < other->port;
+    return slot->ipaddr < other->ipaddr;
+}
+
+void msg_connection_introduce(struct client_t *client, unsigned int slotid)
+{ /* Отправка */
+    unsigned int slotids[NUMBER_SLOTS], actslotids[NUMBER_SLOTS];
+    unsigned int backids[NUMBER_SLOTS], actbackids[NUMBER_SLOTS];
+    unsigned int i, j, count, back;
+    struct slot_t *slot = client->slots+slotid, *neighbor;
+    LOG_DEBUG(("call: msg_connection_introduce(%p, slotid:%d)\n", (void *)client, slotid));
+    count = get_neighbors_by_slot(client, slotid, slotids, actslotids);
+    for(i=0; i<count; i++)
+    {
+        neighbor = client->slots+slotids[i];
+        if(peer_before(slot, neighbor))
+        {
+            msg_connection_neighbor(client, slot->socket, neighbor->ipaddr,
+                neighbor->port, actslotids[i]);
+            continue;
+        }
+        /* Позиция нового соседа с точки зрения общего */
+        back = get_neighbors_by_slot(client, slotids[i], backids, actbackids);
+        for(j=0; j<back; j++)
+            if(backids[j] == slotid)
+                msg_connection_neighbor(client, neighbor->socket,
+                    slot->ipaddr, slot->port, actbackids[j]);
+    }
 }
 
 /* Сообщение о готовности принимать
@@ -526,19 +1131,36 @@ void on_connection_neighbor(struct client_t *client, unsigned int slotid,
 void msg_connection_ready(struct client_t *client, int socket)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = CONNECTION_READY;
-    PROTO_PRINT("call: msg_connection_ready(%p)\n", (void *)client);
+    size_t msgsize;
+    struct msg_connection_ready_t data;
+    LOG_DEBUG(("call: msg_connection_ready(%p)\n", (void *)client));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
+    data.code = CONNECTION_READY;
+    msgsize = msg_encode_connection_ready(msg, &data);
     /* Посылаем сообщение */
     msg_send(socket, msg, msgsize);
 }
 
-void on_connection_ready(struct client_t *client, unsigned int slotid)
+void on_connection_ready(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data)
 { /* Прием */
-    PROTO_PRINT("catch: on_connection_ready(%p, %d)\n", (void *)client, slotid);
+    (void)data;
+    LOG_DEBUG(("catch: on_connection_ready(%p, %d)\n", (void *)client, slotid));
     client_slot_ready(client, slotid);
+    /* Диспетчер оговаривает места по свободным слотам участников,
+        поэтому занятый слот сообщается, только когда сосед его
+        подтвердил: неудавшееся подключение освободит слот раньше;
+        слоты, где клиент места не дает, в счет не входят */
+    if(client->state.state == IN_PROCESS)
+    {
+        if(client_slot_owned(client, slotid))
+            msg_connection_distance(client, client->distance);
+        msg_connection_introduce(client, slotid);
+    }
+    /* Готовность присылает только новый сосед, поэтому переход
+        на общую память предлагает ровно одна сторона соединения */
+    if(client_is_host_link(client, slotid))
+        msg_link_offer(client, slotid);
 }
 
 /* Сообщение о готовности обслуживать поиск слотов  */
@@ -546,81 +1168,392 @@ void msg_connection_distance(struct client_t *client,
     unsigned int distance)
 { /* Отправка */
     char msg[TCP_MSG_SIZE];
-    size_t msgsize = 0;
-    msg_code_t code = CONNECTION_DISTANCE;
-    PROTO_PRINT("call: msg_connection_distance(%p, %d)\n", (void *)client, distance);
+    size_t msgsize;
+    struct msg_connection_distance_t data;
+    unsigned char free;
+    /* Количество свободных слотов, под которые
+        диспетчер оговаривает места новым клиентам */
+    free = client_place_slots(client);
+    LOG_DEBUG(("call: msg_connection_distance(%p, %d, %d)\n", (void *)client, distance, free));
     /* Формируем сообщение */
-    MSG_SERIALIZE(code, msg_code_t, msg, msgsize);
-    MSG_SERIALIZE(distance, unsigned int, msg, msgsize);
+    data.distance = distance;
+    data.free = free;
+    /* По слушателю участника узнают зеркала и наследник */
+    data.ipaddr = client->ipaddr;
+    data.port = client->portTCP;
+    msgsize = msg_encode_connection_distance(msg, &data);
     /* Если перед нами диспетчер распределения, то он уже готов к работе */
     if(!distance)
-        client->state.state = IN_PROCESS;
+        client_set_state(client, IN_PROCESS);
     /* Посылаем сообщение */
     msg_send(client->sockTCP, msg, msgsize);
 }
 
 void on_connection_distance(struct client_t *client, struct unit_t *unit,
-    char *msg, size_t msgsize)
+    const union msg_data_t *data)
 { /* Прием */
-    unsigned int distance;
-    PROTO_PRINT("catch: on_connection_distance(%p, %p)\n", (void *)client, (void *)unit);
-    MSG_DESERIALIZE(distance, unsigned int, msg, msgsize);
-    PROTO_PRINT("\tattr: distance=[%d]\n", distance);
-    unit->distance = distance;
+    struct unit_t *joiner;
+    struct standby_t *mirror;
+    unsigned int distance = data->connection_distance.distance;
+    unsigned char free = data->connection_distance.free;
+    in_addr_t ipaddr = data->connection_distance.ipaddr;
+    unsigned short port = data->connection_distance.port;
+    unsigned int previous = unit->distance;
+    LOG_DEBUG(("catch: on_connection_distance(%p, %p)\n", (void *)client, (void *)unit));
+    LOG_DEBUG(("\tattr: distance=[%d], free=[%d], port=[%d]\n", distance, free, port));
+    /* Новый клиент занял место - оговорка у его участника снята,
+        а сам участник занял слот и сообщит об этом отдельно */
+    client_dispatcher_unreserve(client, unit);
+    unit->free = free;
+    /* Участник узнал сеть диспетчеризации и сменил адрес:
+        прежняя запись в зеркалах уходит */
+    if(unit->port && (unit->ipaddr != ipaddr || unit->port != port) &&
+        !client_dispatcher_is_self(client, unit))
+            msg_standby_unit(client, unit->ipaddr, unit->port,
+                STANDBY_GONE, 0);
+    unit->ipaddr = ipaddr;
+    unit->port = port;
+    /* Переносим участника в кольцо его удаления */
+    if(unit->distance != distance)
+        client_dispatcher_set_distance(client, unit, distance);
+    client_dispatcher_replicate(client, unit, previous);
+    /* Наследник отмечает вернувшихся участников прежнего диспетчера */
+    mirror = client->dispatcher->mirror;
+    if(mirror != NULL)
+    {
+        standby_update(mirror, ipaddr, port, STANDBY_GONE, 0);
+        if(!mirror->count)
+        {
+            LOG_DEBUG(("\tattr: all units returned to %p\n",
+                (void *)client));
+            standby_destroy(mirror);
+            client->dispatcher->mirror = NULL;
+        }
+    }
+    /* Освободившиеся слоты сразу оговариваем ждущим клиентам */
+    while((joiner = client->dispatcher->waiting) != NULL &&
+        relay_place_reserved(client, joiner))
+            client_dispatcher_unwait(client, joiner);
+}
+
+/* Потоковые сообщения между соседями */
+void msg_tcp_stream(struct client_t *client, unsigned int slotid,
+    struct stream_t *stream, const char *data, size_t size)
+{
+    union msg_data_t fields;
+    size_t remain;
+    /* Поля кадра уже проверены на длину при его разборе */
+    msg_decode(stream->code, stream->data + MSG_HEADER_SIZE,
+        msg_sizes[stream->code], &fields);
+    remain = stream->body + stream->rest;
+    if(stream->code == PAYLOAD)
+        on_payload(client, slotid, data, size, remain);
+    else if(stream->code == COLLECTIVE)
+        on_collective(client, slotid, &fields, data, size, remain);
+}
+
+/* Полезная нагрузка между готовыми соседями */
+void on_payload(struct client_t *client, unsigned int slotid,
+    const char *data, size_t size, size_t remain)
+{ /* Прием */
+    LOG_TRACE(("catch: on_payload(%p, slotid:%d, size:%ld, remain:%ld)\n",
+        (void *)client, slotid, size, remain));
+    /* До готовности соседа нагрузку не принимаем */
+    if(client->slots[slotid].status != SLOT_STATUS_READY ||
+        client->receiver == NULL)
+            return;
+    client->receiver(client->receiverctx, client, slotid, data, size,
+        remain);
+}
+
+/* Коллективные операции между готовыми соседями */
+void on_collective(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data, const char *body, size_t size,
+    size_t remain)
+{ /* Прием */
+    LOG_TRACE(("catch: on_collective(%p, slotid:%d, kind:%d, seq:%d, size:%ld)\n",
+        (void *)client, slotid, data->collective.kind, data->collective.seq,
+        size));
+    if(client->slots[slotid].status != SLOT_STATUS_READY)
+        return;
+    collective_on_data(client->collective, slotid, data->collective.kind,
+        data->collective.seq, body, size, remain);
+}
+
+/* Переход соседей на одном компьютере на общую память */
+void msg_link_offer(struct client_t *client, unsigned int slotid)
+{ /* Отправка */
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    struct msg_link_offer_t data;
+    struct shm_link_t *link;
+    LOG_DEBUG(("call: msg_link_offer(%p, slotid:%d)\n", (void *)client, slotid));
+    /* Без общей памяти соединение просто остается на TCP */
+    if((link = shm_link_create()) == NULL)
+        return;
+    client->slots[slotid].link = link;
+    /* Формируем сообщение */
+    data.pid = link->pid;
+    data.id = link->id;
+    msgsize = msg_encode_link_offer(msg, &data);
+    /* Посылаем сообщение */
+    msg_send(client->slots[slotid].socket, msg, msgsize);
+}
+
+void on_link_offer(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data)
+{ /* Прием */
+    struct slot_t *slot = client->slots + slotid;
+    LOG_DEBUG(("catch: on_link_offer(%p, slotid:%d, pid:%d, id:%d)\n",
+        (void *)client, slotid, data->link_offer.pid, data->link_offer.id));
+    /* Общую память предлагает только сосед с этого же компьютера,
+        иначе файл по названному имени подложил бы кто угодно */
+    if(!client_is_host_link(client, slotid))
+    {
+        msg_link_refuse(client, slot->socket);
+        return;
+    }
+    if(slot->link == NULL)
+        slot->link = shm_link_attach(data->link_offer.pid,
+            data->link_offer.id);
+    /* Файл не открылся или соединение занято отправкой - остаемся
+        на TCP, предложивший сосед удалит файл по отказу */
+    if(slot->link == NULL || slot->link->named ||
+        msg_link_switch(client, slotid) < 0)
+    {
+        if(slot->link != NULL && !slot->link->named)
+        {
+            shm_link_close(slot->link);
+            slot->link = NULL;
+        }
+        msg_link_refuse(client, slot->socket);
+    }
+}
+
+void msg_link_refuse(struct client_t *client, int socket)
+{ /* Отправка */
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    struct msg_link_refuse_t data;
+    LOG_DEBUG(("call: msg_link_refuse(%p, socket:%d)\n", (void *)client, socket));
+    /* Формируем сообщение */
+    data.code = LINK_REFUSE;
+    msgsize = msg_encode_link_refuse(msg, &data);
+    /* Посылаем сообщение */
+    msg_send(socket, msg, msgsize);
+}
+
+void on_link_refuse(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data)
+{ /* Прием */
+    struct slot_t *slot = client->slots + slotid;
+    (void)data;
+    LOG_DEBUG(("catch: on_link_refuse(%p, slotid:%d)\n", (void *)client, slotid));
+    /* Сосед не переключался, поэтому кольца никто не читает */
+    if(slot->link != NULL && !slot->link->reading)
+    {
+        shm_link_close(slot->link);
+        slot->link = NULL;
+    }
+}
+
+int msg_link_switch(struct client_t *client, unsigned int slotid)
+{ /* Отправка */
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    struct msg_link_switch_t data;
+    struct slot_t *slot = client->slots + slotid;
+    LOG_DEBUG(("call: msg_link_switch(%p, slotid:%d)\n", (void *)client, slotid));
+    /* Формируем сообщение */
+    data.code = LINK_SWITCH;
+    msgsize = msg_encode_link_switch(msg, &data);
+    /* Метку отправляет сама очередь, после нее запись идет в кольцо */
+    if(outq_switch(slot->socket, slot->link, msg, msgsize) < 0)
+        return -1;
+    stats_sent(LINK_SWITCH, 1);
+    slot->link->writing = 1;
+    return 0;
+}
+
+void on_link_switch(struct client_t *client, unsigned int slotid,
+    const union msg_data_t *data)
+{ /* Прием */
+    struct slot_t *slot = client->slots + slotid;
+    (void)data;
+    LOG_DEBUG(("catch: on_link_switch(%p, slotid:%d)\n", (void *)client, slotid));
+    /* Сосед пишет в кольцо, которого у нас нет - читать
+        соединение дальше нечем */
+    if(slot->link == NULL)
+    {
+        client_release_slot(client, slotid);
+        return;
+    }
+    /* Дальше сокет приносит только звонки, данные читаются
+        из кольца; обе стороны отобразили файл, он больше не нужен */
+    slot->link->reading = 1;
+    shm_link_unlink(slot->link);
+    /* Если соединение занято, переход повторится при чтении кольца */
+    if(!slot->link->writing)
+        msg_link_switch(client, slotid);
+}
+
+/* Резерв диспетчера */
+/* Наследник диспетчера */
+size_t pack_standby_heir(char *msg, in_addr_t ipaddr, unsigned short port,
+    in_addr_t netaddr)
+{ /* Сериализация */
+    struct msg_standby_heir_t data;
+    data.ipaddr = ipaddr;
+    data.port = port;
+    data.netaddr = netaddr;
+    return msg_encode_standby_heir(msg, &data);
+}
+
+void msg_standby_heir(struct client_t *client, int socket)
+{ /* Отправка */
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    LOG_DEBUG(("call: msg_standby_heir(%p, %d)\n", (void *)client, socket));
+    /* Формируем сообщение */
+    msgsize = pack_standby_heir(msg, client->dispatcher->heiraddr,
+        client->dispatcher->heirport, client->dispatcher->netaddr);
+    /* Посылаем сообщение */
+    msg_send(socket, msg, msgsize);
+}
+
+void on_standby_heir(struct client_t *client, const union msg_data_t *data)
+{ /* Прием */
+    LOG_DEBUG(("catch: on_standby_heir(%p, port:%d)\n", (void *)client,
+        data->standby_heir.port));
+    /* Запоминаем, к кому переходить, если диспетчер пропадет */
+    client->heiraddr = data->standby_heir.ipaddr;
+    client->heirport = data->standby_heir.port;
+    client->heirnet = data->standby_heir.netaddr;
+}
+
+/* Изменение реестра диспетчера для зеркал */
+size_t pack_standby_unit(char *msg, in_addr_t ipaddr, unsigned short port,
+    unsigned int distance, unsigned char free)
+{ /* Сериализация */
+    struct msg_standby_unit_t data;
+    data.ipaddr = ipaddr;
+    data.port = port;
+    data.distance = distance;
+    data.free = free;
+    return msg_encode_standby_unit(msg, &data);
+}
+
+void msg_standby_unit(struct client_t *client, in_addr_t ipaddr,
+    unsigned short port, unsigned int distance, unsigned char free)
+{ /* Отправка */
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    LOG_TRACE(("call: msg_standby_unit(%p, port:%d, distance:%d)\n",
+        (void *)client, port, distance));
+    msgsize = pack_standby_unit(msg, ipaddr, port, distance, free);
+    msg_fanout_units(client, fanout_mirrors, NULL, msg, msgsize);
+}
+
+void on_standby_unit(struct client_t *client, const union msg_data_t *data)
+{ /* Прием */
+    LOG_TRACE(("catch: on_standby_unit(%p, port:%d, distance:%d)\n",
+        (void *)client, data->standby_unit.port,
+        data->standby_unit.distance));
+    if(client->standby == NULL &&
+        (client->standby = standby_create()) == NULL)
+            return;
+    /* Снимок реестра начинается с очистки зеркала */
+    if(!data->standby_unit.port)
+        standby_clear(client->standby);
+    else
+        standby_update(client->standby, data->standby_unit.ipaddr,
+            data->standby_unit.port, data->standby_unit.distance,
+            data->standby_unit.free);
+}
+
+void msg_standby_snapshot(struct client_t *client, struct unit_t *standby)
+{ /* Отправка */
+    struct unit_t *unit;
+    unsigned int epoch;
+    char msg[TCP_BUNDLE_SIZE];
+    size_t msgsize;
+    LOG_DEBUG(("call: msg_standby_snapshot(%p, %d)\n", (void *)client,
+        standby->socket));
+    msgsize = pack_standby_unit(msg, 0, 0, STANDBY_GONE, 0);
+    /* Записи копятся связкой, полная связка уходит одной отправкой */
+    epoch = registry_read_lock(&client->dispatcher->units);
+    unit = registry_next(&client->dispatcher->units, NULL);
+    while(unit != NULL)
+    {
+        if(unit->port && unit->distance != INVALID_DISTANCE &&
+            !client_dispatcher_is_self(client, unit))
+        {
+            if(msgsize + TCP_MSG_SIZE > TCP_BUNDLE_SIZE)
+            {
+                msg_send(standby->socket, msg, msgsize);
+                msgsize = 0;
+            }
+            msgsize += pack_standby_unit(msg+msgsize, unit->ipaddr,
+                unit->port, unit->distance, unit->free);
+        }
+        unit = registry_next(&client->dispatcher->units, unit);
+    }
+    registry_read_unlock(&client->dispatcher->units, epoch);
+    msg_send(standby->socket, msg, msgsize);
 }
 
 /* Обработка UDP сообщений от клиентов к диспетчеру */
 void dg_dispatcher_udp_handler(struct client_t *client, in_addr_t ipaddr,
     dg_code_t code)
 {
-    PROTO_PRINT("catch: dg_dispatcher_udp_handler(%p, %d)\n",
-        (void *)client, code);
-    if(code == DISPATCHER_IM)
+    LOG_DEBUG(("catch: dg_dispatcher_udp_handler(%p, %d)\n",
+        (void *)client, code));
+    if(code == DISPATCHER_DISCOVER)
         on_dispatcher_discover(client, ipaddr);
 }
 
 /* Обработка подключений клиентов к диспетчеру */
 void msg_dispatcher_tcp_acceptor(struct client_t *client, int socket)
 {
-    PROTO_PRINT("catch: msg_dispatcher_tcp_acceptor(%p, socket:%d)\n",
-        (void *)client, socket);
+    LOG_DEBUG(("catch: msg_dispatcher_tcp_acceptor(%p, socket:%d)\n",
+        (void *)client, socket));
+    /* Подсказываем кольцо до подтверждения, чтобы клиент
+        сразу искал слот там, где он есть */
+    msg_place_ring(client, socket, client_dispatcher_pick_ring(client));
     msg_dispatcher_confirm(client, socket);
+    /* Наследник нужен участнику раньше, чем диспетчер пропадет */
+    if(client->dispatcher->heirport)
+        msg_standby_heir(client, socket);
 }
 
 /* Обработка TCP сообщений от клиентов к диспетчеру */
 void msg_dispatcher_tcp_handler(struct client_t *client,
-    struct unit_t *unit, msg_code_t code, char *msg, size_t msgsize)
+    struct unit_t *unit, msg_code_t code, char *msg, size_t length)
 {
-    PROTO_PRINT("catch: msg_dispatcher_tcp_handler(%p, code:%d, %p, size:%ld)\n",
-        (void *)client, code, msg, msgsize);
-    switch(code)
-    {
-        case PLACE_DISCOVER:
-            /* Это сообщение получил диспетчер - рассылаем его клиентам */
-            relay_place_discover(client, msg, msgsize);
-            break;
-        case CONNECTION_DISTANCE:
-            on_connection_distance(client, unit, msg, msgsize);
-            break;
-    }
+    union msg_data_t data;
+    LOG_DEBUG(("catch: msg_dispatcher_tcp_handler(%p, code:%d, %p, size:%ld)\n",
+        (void *)client, code, msg, length));
+    stats_received(&client->stats, code);
+    /* Код проверяется при разборе, поэтому таблица не выходит
+        за границы; сообщения, которых диспетчер не ждет, пропускаем */
+    if(msg_decode(code, msg, length, &data) < 0 ||
+        msg_unit_handlers[code] == 0)
+            return;
+    msg_unit_handlers[code](client, unit, &data);
 }
 
 /* Обработка TCP сообщений от диспетчера к клиенту */
 void msg_tcp_dialog(struct client_t *client, msg_code_t code,
-    char *msg, size_t msgsize)
+    char *msg, size_t length)
 {
-    PROTO_PRINT("catch: msg_tcp_dialog(%p, code:%d, %p, size:%ld)\n",
-        (void *)client, code, msg, msgsize);
-    switch(code)
-    {
-        case DISPATCHER_CONFIRM:
-            on_dispatcher_confirm(client, msg, msgsize);
-            break;
-        case PLACE_DISCOVER:
-            /* Это сообщение получил клиент */
-            on_place_discover(client, msg, msgsize);
-            break;
-    }
+    union msg_data_t data;
+    LOG_DEBUG(("catch: msg_tcp_dialog(%p, code:%d, %p, size:%ld)\n",
+        (void *)client, code, msg, length));
+    stats_received(&client->stats, code);
+    if(msg_decode(code, msg, length, &data) < 0 ||
+        msg_dialog_handlers[code] == 0)
+            return;
+    msg_dialog_handlers[code](client, &data);
 }
 
 /* Обработка подключений клиентов к клиенту, возвращает
@@ -630,8 +1563,8 @@ void msg_tcp_dialog(struct client_t *client, msg_code_t code,
 int msg_tcp_acceptor(struct client_t *client, int socket)
 {
     unsigned int slotid = INVALID_SLOT;
-    PROTO_PRINT("catch: msg_tcp_acceptor(%p, socket:%d)\n",
-        (void *)client, socket);
+    LOG_DEBUG(("catch: msg_tcp_acceptor(%p, socket:%d)\n",
+        (void *)client, socket));
     /* Принимаем соединения только если протокол находится
         в состоянии сборки распределения клиент-клиент (WAIT_#) или
         в состоянии готовности */
@@ -641,7 +1574,7 @@ int msg_tcp_acceptor(struct client_t *client, int socket)
             slotid = client_has_free_slot(client);
     /* Если у нас состояние WAIT_PLACE - переходим в состояние PLACE_SELECTED */
     if(client->state.state == WAIT_PLACE)
-        client->state.state = PLACE_SELECTED;
+        client_set_state(client, PLACE_SELECTED);
     /* В любых других состояниях поиск свободных слотов не производится,
         а в переменной slotid останется идентификатор некорректного слота,
         показывая тем самым, что мы не готовы к соединению,
@@ -651,8 +1584,12 @@ int msg_tcp_acceptor(struct client_t *client, int socket)
         соглашаемся на соединение */
     if(slotid == INVALID_SLOT)
         msg_place_refuse(client, socket);
-    else
+    /* Соседу, который уже занял место, подтверждение уходит после
+        рукопожатия: названная в нем позиция может оказаться занятой */
+    else if(client->state.state == PLACE_SELECTED)
         msg_place_confirm(client, socket);
+    else
+        client->slots[slotid].parked = 1;
     /* Возвращаем в обработчик клиента идентификатор слота, для операций
         по занятию слота и добавлению идентификатора во множество */
     return slotid;
@@ -660,54 +1597,85 @@ int msg_tcp_acceptor(struct client_t *client, int socket)
 
 /* Обработчик TCP сообщений от клиентов к клиенту */
 void msg_tcp_handler(struct client_t *client, unsigned int slotid,
-    msg_code_t code, char *msg, size_t msgsize)
+    msg_code_t code, char *msg, size_t length)
+{
+    union msg_data_t data;
+    LOG_DEBUG(("catch: msg_tcp_handler(%p, slotid:%d, code:%d, %p, size:%ld)\n",
+        (void *)client, slotid, code, msg, length));
+    stats_received(&client->stats, code);
+    if(msg_decode(code, msg, length, &data) < 0 ||
+        msg_slot_handlers[code] == 0)
+            return;
+    msg_slot_handlers[code](client, slotid, &data);
+}
+
+/* Специальные события */
+void on_connection_failed(struct client_t *client)
 {
-    PROTO_PRINT("catch: msg_tcp_handler(%p, slotid:%d, code:%d, %p, size:%ld)\n",
-        (void *)client, slotid, code, msg, msgsize);
-    switch(code)
+    LOG_DEBUG(("catch: on_connection_failed(%p)\n", (void *)client));
+    if(client->state.state != WAIT_ALL_NEIGHBOR)
+        return;
+    /* Прежний сосед недоступен - место целиком не вернуть */
+    if(__atomic_load_n(&client->reclaiming, __ATOMIC_ACQUIRE))
     {
-        case PLACE_CONFIRM:
-            on_place_confirm(client, slotid);
-            break;
-        case PLACE_REFUSE:
-            on_place_refuse(client, slotid);
-            break;
-        case PLACE_ANCHOR:
-            on_place_anchor(client, slotid, msg, msgsize);
-            break;
-        case CONNECTION_BORDER:
-            on_connection_border(client, slotid, msg, msgsize);
-            break;
-        case CONNECTION_NEIGHBOR:
-            on_connection_neighbor(client, slotid, msg, msgsize);
-            break;
-        case CONNECTION_READY:
-            on_connection_ready(client, slotid);
-            break;
+        client_reclaim_abort(client);
+        return;
     }
+    /* Недоступный общий сосед не подтвердит подключение, поэтому
+        не ждем его, иначе клиент не войдет в распределение */
+    if(!--client->state.attr)
+        on_place_complete(client);
+}
+
+void on_place_lost(struct client_t *client, unsigned int slotid)
+{
+    LOG_DEBUG(("catch: on_place_lost(%p, slotid:%d)\n", (void *)client, slotid));
+    client_release_slot(client, slotid);
+    /* Настоящий якорь за это время мог получить отказ, поэтому
+        место ищется заново; лишний якорь получит отказ сам */
+    client_set_state(client, WAIT_PLACE);
+    msg_place_discover(client, client->sockTCP, client->ipaddr,
+        client->portTCP, client->ring);
 }
 
-/* Специальные события */
 /* Сообщает всем ранее подсоединившимся клиентам адрес сети,
     полученный от клиента вне локальной сети */
 void on_netaddr_setup(struct client_t *client)
 {
-    struct unit_node_t *ptr;
-    PROTO_PRINT("catch: on_netaddr_setup(%p)\n", (void *)client);
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    LOG_DEBUG(("catch: on_netaddr_setup(%p)\n", (void *)client));
     /* Дополнительная проверка на то, вызвана ли процедура
         после инициализации диспетчера */
     if(client != NULL && client->dispatcher != NULL)
     {
         /* Всем, кто был подключен до определения адреса сети,
             передаем только что определенный адрес сети */
-        ptr = client->dispatcher->units;
-        while(ptr!=NULL)
-        {
-            PROTO_PRINT("\titer: %p->%d\n", (void *)ptr, ptr->unit.socket);
-            msg_dispatcher_confirm(client, ptr->unit.socket);
-            ptr = ptr->next;
-        }
+        msgsize = pack_dispatcher_confirm(msg, client->dispatcher->netaddr);
+        msg_fanout_units(client, fanout_units, NULL, msg, msgsize);
     }
 }
 
+/* Сообщает всем участникам нового наследника диспетчера */
+void on_heir_changed(struct client_t *client)
+{
+    char msg[TCP_MSG_SIZE];
+    size_t msgsize;
+    LOG_DEBUG(("catch: on_heir_changed(%p, port:%d)\n", (void *)client,
+        client->dispatcher->heirport));
+    msgsize = pack_standby_heir(msg, client->dispatcher->heiraddr,
+        client->dispatcher->heirport, client->dispatcher->netaddr);
+    msg_fanout_units(client, fanout_units, NULL, msg, msgsize);
+}
+
+/* Диалог с диспетчером закрылся */
+void on_dispatcher_lost(struct client_t *client)
+{
+    LOG_DEBUG(("catch: on_dispatcher_lost(%p)\n", (void *)client));
+    /* Без наследника клиент остается со своим местом, но новых
+        соседей ему уже никто не назначит */
+    if(client_failover(client) < 0)
+        LOG_DEBUG(("\tattr: no heir, dialog stopped\n"));
+}
+
 #endif /* ifndef PROTOCOL_C */
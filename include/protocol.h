@@ -18,15 +18,45 @@
 
 /* Размер буфера отправки и приема */
 #define TCP_MSG_SIZE                       (32)
-
-/* Сериализация данных для передачи */
+/* Размер пакета сообщений о месте: привязка, рамка и соседи */
+#define TCP_BUNDLE_SIZE  (TCP_MSG_SIZE*(NUMBER_SLOTS+2))
+/* Количество адресатов, рассылаемых за один системный вызов */
+#define FANOUT_BATCH            (URING_ENTRIES)
+
+/* Формат кадра TCP: заголовок из версии формата (u8), кода
+    сообщения (u8) и длины данных (u16), за ним данные; кадры
+    чужой версии, неизвестных кодов и слишком короткие для своего
+    кода пропускаются по длине, не нарушая разбор потока */
+#define MSG_VERSION                        (1)
+#define MSG_HEADER_SIZE                    (4)
+/* Код сообщения из заголовка кадра */
+#define MSG_CODE(buffer) ((msg_code_t)((unsigned char *)(buffer))[1])
+/* Потоковые сообщения: кадр несет тело сверх полей из описания,
+    собираются только поля, тело выдается порциями; первое поле
+    таких сообщений - остаток сообщения после кадра */
+#define MSG_STREAMED(code) ((code) == PAYLOAD || (code) == COLLECTIVE)
+
+/* Наибольшее тело кадра полезной нагрузки, длинные
+    сообщения делятся на кадры такого размера */
+#define PAYLOAD_CHUNK                  (32768)
+/* Заголовок кадра полезной нагрузки вместе с полем остатка */
+#define PAYLOAD_HEADER_SIZE (MSG_HEADER_SIZE+sizeof(unsigned int))
+/* Наибольшее сообщение полезной нагрузки, остаток - u32bit */
+#define PAYLOAD_MAX            (0xFFFFFFFFUL)
+
+/* Сериализация данных для передачи: поля фиксированной ширины
+    (1, 2 или 4 байта по размеру типа) в порядке little-endian,
+    одинаковом на всех архитектурах */
 #ifndef MSG_SERIALIZE
 # define MSG_SERIALIZE(var, type, buffer, length) \
-    memcpy(buffer+length, &var, sizeof(type)); \
+    msg_put((buffer)+(length), (unsigned long)(var), sizeof(type)); \
     length += sizeof(type)
 # define MSG_DESERIALIZE(var, type, buffer, length) \
-    memcpy(&var, buffer+length, sizeof(type)); \
+    var = (type)msg_get((buffer)+(length), sizeof(type)); \
     length += sizeof(type)
+/* Начинает кадр сообщения code заголовком */
+# define MSG_HEADER(code, buffer, length) \
+    length = msg_header(buffer, code)
 #endif /* MSG_SERIALIZE */
 
 /* Установка соответствия для противоположных позиций */
@@ -66,28 +96,160 @@ enum
     IN_PROCESS
 };
 
-/* Коды сообщений TCP с типами параметров */
+/* Описание сообщений TCP, единственное место, где записан их
+    состав: сообщения идут по порядку кодов, у каждого - код, имя,
+    обработчики у диспетчера, в диалоге с диспетчером и в слоте
+    соседа (0 - там сообщение не принимается) и поля по порядку
+    передачи с типами; из описания строятся коды, размеры данных,
+    структуры, кодеры, декодеры и таблицы обработчиков */
+#define MSG_TABLE(MESSAGE, FIELD, END) \
+    /* Ответ на подключение к диспетчеру */ \
+    MESSAGE(DISPATCHER_CONFIRM, dispatcher_confirm, \
+        0, on_dispatcher_confirm, 0) \
+        FIELD(dispatcher_confirm, netaddr, in_addr_t) \
+    END(dispatcher_confirm) \
+    /* Поиск слота */ \
+    MESSAGE(PLACE_DISCOVER, place_discover, \
+        relay_place_discover, on_place_discover, 0) \
+        FIELD(place_discover, ipaddr, in_addr_t) \
+        FIELD(place_discover, port, unsigned short) \
+        FIELD(place_discover, distance, unsigned int) \
+    END(place_discover) \
+    MESSAGE(PLACE_CONFIRM, place_confirm, 0, 0, on_place_confirm) \
+    END(place_confirm) \
+    MESSAGE(PLACE_REFUSE, place_refuse, 0, 0, on_place_refuse) \
+    END(place_refuse) \
+    MESSAGE(PLACE_ANCHOR, place_anchor, 0, 0, on_place_anchor) \
+        FIELD(place_anchor, position, unsigned char) \
+        FIELD(place_anchor, distance, unsigned int) \
+        FIELD(place_anchor, port, unsigned short) \
+    END(place_anchor) \
+    /* Подключение */ \
+    MESSAGE(CONNECTION_HANDSNAKE, connection_handsnake, \
+        0, 0, on_connection_handsnake) \
+        FIELD(connection_handsnake, position, unsigned char) \
+        FIELD(connection_handsnake, port, unsigned short) \
+    END(connection_handsnake) \
+    MESSAGE(CONNECTION_BORDER, connection_border, \
+        0, 0, on_connection_border) \
+        FIELD(connection_border, neighborcount, unsigned char) \
+    END(connection_border) \
+    MESSAGE(CONNECTION_NEIGHBOR, connection_neighbor, \
+        0, 0, on_connection_neighbor) \
+        FIELD(connection_neighbor, ipaddr, in_addr_t) \
+        FIELD(connection_neighbor, port, unsigned short) \
+        FIELD(connection_neighbor, position, unsigned char) \
+    END(connection_neighbor) \
+    MESSAGE(CONNECTION_READY, connection_ready, \
+        0, 0, on_connection_ready) \
+    END(connection_ready) \
+    MESSAGE(CONNECTION_DISTANCE, connection_distance, \
+        on_connection_distance, 0, 0) \
+        FIELD(connection_distance, distance, unsigned int) \
+        FIELD(connection_distance, free, unsigned char) \
+        FIELD(connection_distance, ipaddr, in_addr_t) \
+        FIELD(connection_distance, port, unsigned short) \
+    END(connection_distance) \
+    /* Подсказка кольца для поиска слота */ \
+    MESSAGE(PLACE_RING, place_ring, 0, on_place_ring, 0) \
+        FIELD(place_ring, distance, unsigned int) \
+    END(place_ring) \
+    /* Полезная нагрузка между готовыми соседями: поле - сколько байт \
+        сообщения идет после этого кадра, за ним тело кадра; тело \
+        выдается получателю по мере прихода, минуя обработчики */ \
+    MESSAGE(PAYLOAD, payload, 0, 0, 0) \
+        FIELD(payload, rest, unsigned int) \
+    END(payload) \
+    /* Коллективные операции матрицы, тело - данные операции */ \
+    MESSAGE(COLLECTIVE, collective, 0, 0, 0) \
+        FIELD(collective, rest, unsigned int) \
+        FIELD(collective, kind, unsigned char) \
+        FIELD(collective, seq, unsigned int) \
+    END(collective) \
+    /* Переход соседей на одном компьютере на общую память: \
+        предложение с именем файла связи, отказ от него и метка, \
+        после которой отправитель пишет в кольцо связи */ \
+    MESSAGE(LINK_OFFER, link_offer, 0, 0, on_link_offer) \
+        FIELD(link_offer, pid, unsigned int) \
+        FIELD(link_offer, id, unsigned int) \
+    END(link_offer) \
+    MESSAGE(LINK_REFUSE, link_refuse, 0, 0, on_link_refuse) \
+    END(link_refuse) \
+    MESSAGE(LINK_SWITCH, link_switch, 0, 0, on_link_switch) \
+    END(link_switch) \
+    /* Резерв диспетчера: наследник, к которому переподключается \
+        диалог, и изменение реестра для зеркал участников кольца 1 */ \
+    MESSAGE(STANDBY_HEIR, standby_heir, 0, on_standby_heir, 0) \
+        FIELD(standby_heir, ipaddr, in_addr_t) \
+        FIELD(standby_heir, port, unsigned short) \
+        FIELD(standby_heir, netaddr, in_addr_t) \
+    END(standby_heir) \
+    MESSAGE(STANDBY_UNIT, standby_unit, 0, on_standby_unit, 0) \
+        FIELD(standby_unit, ipaddr, in_addr_t) \
+        FIELD(standby_unit, port, unsigned short) \
+        FIELD(standby_unit, distance, unsigned int) \
+        FIELD(standby_unit, free, unsigned char) \
+    END(standby_unit)
+
+/* Развертки описания, которым часть его элементов не нужна */
+#define MSG_NO_MESSAGE(code, name, unit, dialog, slot)
+#define MSG_NO_FIELD(name, field, type)
+#define MSG_NO_END(name)
+
+/* Коды сообщений TCP */
+#define MSG_ENUM(code, name, unit, dialog, slot) code,
 enum
 {
-    /* Ответ на подключение к диспетчеру */
-    DISPATCHER_CONFIRM, /* u32bit */
-    /* Поиск слота */
-    PLACE_DISCOVER, /* u32bit, u16bit, u32bit */
-    PLACE_CONFIRM, /* без параметров */
-    PLACE_REFUSE, /* без параметров */
-    PLACE_ANCHOR, /* u8bit, u32bit */
-    /* Подключение */
-    CONNECTION_HANDSNAKE, /* u8bit */
-    CONNECTION_BORDER, /* u8bit */
-    CONNECTION_NEIGHBOR, /* u32bit, u16bit, u8bit */
-    CONNECTION_READY, /* без параметров */
-    CONNECTION_DISTANCE /* u32bit */
+    MSG_TABLE(MSG_ENUM, MSG_NO_FIELD, MSG_NO_END)
+    /* Количество известных кодов */
+    MSG_CODES
 };
 
-/* Задаем тип кода сообщения для TCP */
+/* Задаем тип кода сообщения для TCP, в кадре он занимает байт */
 typedef unsigned int msg_code_t;
 
-/* Датаграмма UDP состоит только из 4-х байтного кода */
+/* Разобранные данные сообщений, у каждого своя структура
+    struct msg_<имя>_t, первым полем всегда идет код */
+#define MSG_STRUCT_BEGIN(id, name, unit, dialog, slot) \
+    struct msg_##name##_t { msg_code_t code;
+#define MSG_STRUCT_FIELD(name, field, type) type field;
+#define MSG_STRUCT_END(name) };
+MSG_TABLE(MSG_STRUCT_BEGIN, MSG_STRUCT_FIELD, MSG_STRUCT_END)
+
+/* Общее начало потоковых сообщений */
+struct msg_stream_t
+{
+    msg_code_t code;
+    unsigned int rest;
+};
+
+/* Данные любого сообщения, код общий для всех структур */
+#define MSG_UNION_MEMBER(code, name, unit, dialog, slot) \
+    struct msg_##name##_t name;
+union msg_data_t
+{
+    msg_code_t code;
+    struct msg_stream_t stream;
+    MSG_TABLE(MSG_UNION_MEMBER, MSG_NO_FIELD, MSG_NO_END)
+};
+
+/* Обработчики разобранных сообщений у диспетчера, в диалоге
+    с диспетчером и в слоте соседа */
+typedef void (*msg_unit_handler_t)(struct client_t *client,
+    struct unit_t *unit, const union msg_data_t *data);
+typedef void (*msg_dialog_handler_t)(struct client_t *client,
+    const union msg_data_t *data);
+typedef void (*msg_slot_handler_t)(struct client_t *client,
+    unsigned int slotid, const union msg_data_t *data);
+
+/* Кодеры сообщений: msg_encode_<имя> пишет в msg кадр
+    с заголовком и возвращает его размер */
+#define MSG_ENCODER_DECLARE(code, name, unit, dialog, slot) \
+    size_t msg_encode_##name(char *msg, const struct msg_##name##_t *data);
+MSG_TABLE(MSG_ENCODER_DECLARE, MSG_NO_FIELD, MSG_NO_END)
+
+/* Датаграмма UDP состоит только из 4-х байтного кода,
+    передается в порядке little-endian */
 typedef unsigned int dg_code_t; 
 
 /* Вспомогательные функции */
@@ -99,13 +261,46 @@ void dg_send
     dg_code_t code
 );
 
+/* Пишет в buffer поле шириной width байт в порядке little-endian */
+void msg_put
+(
+    char *buffer,
+    unsigned long value,
+    size_t width
+);
+
+/* Читает из buffer поле шириной width байт в порядке little-endian */
+unsigned long msg_get
+(
+    const char *buffer,
+    size_t width
+);
+
+/* Пишет заголовок кадра сообщения code с длиной данных
+    по его коду, возвращает размер заголовка */
+size_t msg_header
+(
+    char *buffer,
+    msg_code_t code
+);
+
 /* Функция вовращает размер данных сообщения,
-    отправляемого по TCP (без кода сообщения) */
+    отправляемого по TCP (без заголовка), из таблицы размеров */
 size_t size_of_msg_tcp_data
 (
     msg_code_t code
 );
 
+/* Разбирает данные msg длиной length сообщения code в data,
+    возвращает -1 для неизвестного кода или нехватки данных */
+int msg_decode
+(
+    msg_code_t code,
+    const char *msg,
+    size_t length,
+    union msg_data_t *data
+);
+
 /* Общая процедура отправки сообщения в поток TCP */
 void msg_send
 (
@@ -114,6 +309,71 @@ void msg_send
     size_t msgsize
 );
 
+/* Общая процедура рассылки одного сообщения в несколько потоков
+    TCP, сообщение сериализуется один раз, отправки передаются ядру
+    пачками через io_uring с дозаписью недоотправленных остатков */
+void msg_fanout
+(
+    struct client_t *client,
+    int *sockets,
+    unsigned int count,
+    char *msg,
+    size_t msgsize
+);
+
+/* Обход адресатов рассылки диспетчера: участник, следующий за unit
+    (NULL - первый), или NULL, когда адресаты кончились */
+typedef struct unit_t *(*msg_units_next_t)(struct client_t *client,
+    struct unit_t *unit, const void *arg);
+
+/* Рассылает сообщение участникам, которых перечисляет next с
+    параметром arg, пачками по FANOUT_BATCH внутри эпохи чтения реестра */
+void msg_fanout_units
+(
+    struct client_t *client,
+    msg_units_next_t next,
+    const void *arg,
+    char *msg,
+    size_t msgsize
+);
+
+/* Выделяет очередной целый кадр из порции данных потока TCP,
+    части кадра, разорванного между порциями, накапливаются в stream;
+    возвращает 1, код, указатель на данные кадра и их длину, сдвигая
+    порцию, или 0, если порция исчерпана; тело потокового кадра
+    выдается без копирования порциями по мере прихода, пустое тело -
+    одной пустой порцией, поля кадра и остаток сообщения хранит stream */
+int msg_stream_next
+(
+    struct stream_t *stream,
+    char **data,
+    size_t *size,
+    msg_code_t *code,
+    char **msg,
+    size_t *length
+);
+
+/* Пишет в msg кадр сообщения code с полями из data, возвращает
+    его размер или 0 для неизвестного кода */
+size_t msg_encode
+(
+    msg_code_t code,
+    char *msg,
+    union msg_data_t *data
+);
+
+/* Пишет в msg заголовок и поля кадра потокового сообщения code
+    с телом size байт, за которым у сообщения остается еще rest
+    байт, возвращает их размер, тело передается отдельно */
+size_t pack_stream
+(
+    char *msg,
+    msg_code_t code,
+    union msg_data_t *data,
+    size_t rest,
+    size_t size
+);
+
 /* Функция определяет идентификаторы слотов соседей переданного
     слота, и возвращает в аргумент массив идентификаторов,
     возвращает количество соседей - как результат функции */
@@ -127,10 +387,12 @@ unsigned int get_neighbors_by_slot
 
 /* Часть прикладного протокола, надстроенная над UDP */
 /* Широковещательный поиск диспетчера в сети
-    (DISPATCHER_DISCOVER) */
+    (DISPATCHER_DISCOVER), broadaddr - широковещательный
+    адрес сети или адрес известного диспетчера */
 void dg_dispatcher_discover
 ( /* Отправка */
-    struct client_t *client
+    struct client_t *client,
+    addr_data_t broadaddr
 );
 
 void on_dispatcher_discover
@@ -150,7 +412,13 @@ void dg_dispatcher_im
 
 /* Часть прикладного протокола, надстроенная над TCP */
 /* Сообщение о готовности диспетчера
-    (DISPATCHER_CONFIRM) */
+    (DISPATCHER_CONFIRM, адрес сети) */
+size_t pack_dispatcher_confirm
+( /* Сериализация, возвращает размер сообщения */
+    char *msg,
+    in_addr_t netaddr
+);
+
 void msg_dispatcher_confirm
 ( /* Отправка */
     struct client_t *client,
@@ -160,12 +428,19 @@ void msg_dispatcher_confirm
 void on_dispatcher_confirm
 ( /* Прием */
     struct client_t *client,
-    char *msg,
-    size_t msgsize
+    const union msg_data_t *data
 );
 
 /* Поиск незанятого слота
     (PLACE_DISCOVER, адрес, порт, удаление от диспетчера) */
+size_t pack_place_discover
+( /* Сериализация, возвращает размер сообщения */
+    char *msg,
+    in_addr_t ipaddr,
+    unsigned short port,
+    unsigned int distance
+);
+
 void msg_place_discover
 ( /* Отправка */
     struct client_t *client,
@@ -175,23 +450,60 @@ void msg_place_discover
     unsigned int distance
 );
 
+/* Оговаривает новому клиенту joiner место по его поиску слота
+    и пересылает поиск только выбранному участнику, возвращает 0,
+    если свободных слотов нет */
+int relay_place_reserved
+( /* Отправка:Диспетчер */
+    struct client_t *client,
+    struct unit_t *joiner
+);
+
+/* Диспетчер оговаривает новому клиенту место у одного участника
+    и пересылает поиск только ему, поиск, возвращенный участником
+    без свободных слотов, оговаривается заново; если оговорить
+    нечего, клиент ждет освобождения слотов; дальним кольцам,
+    которые диспетчер не ведет, поиск рассылается целиком */
 void relay_place_discover
 ( /* Прием:Диспетчер */
     struct client_t *client,
-    char *msg,
-    size_t msgsize
+    struct unit_t *sender,
+    const union msg_data_t *data
 );
 
 void on_place_discover
 ( /* Прием:Клиент */
     struct client_t *client,
-    char *msg,
-    size_t msgsize
+    const union msg_data_t *data
+);
+
+/* Диспетчер сообщает новому клиенту кольцо, у участников
+    которого есть свободные слоты (PLACE_RING, удаление) */
+void msg_place_ring
+( /* Отправка */
+    struct client_t *client,
+    int socket,
+    unsigned int distance
+);
+
+void on_place_ring
+( /* Прием */
+    struct client_t *client,
+    const union msg_data_t *data
 );
 
 /* Сообщение параметров места в распределении новому клиенту
     (CONNECTION_ANCHOR, расположение передающего
-        относительно получателя, удаление от диспетчера) */
+        относительно получателя, удаление от диспетчера,
+        порт слушателя передающего) */
+size_t pack_place_anchor
+( /* Сериализация, возвращает размер сообщения */
+    char *msg,
+    unsigned char position,
+    unsigned int distance,
+    unsigned short port
+);
+
 void msg_place_anchor
 ( /* Отправка */
     struct client_t *client,
@@ -204,8 +516,16 @@ void on_place_anchor
 ( /* Прием */
     struct client_t *client,
     unsigned int slotid,
-    char *msg,
-    size_t msgsize
+    const union msg_data_t *data
+);
+
+/* Пакет сообщений новому клиенту в слоте slotid: привязка, рамка и
+    все общие соседи одним буфером и одной записью в сокет, получатель
+    разбирает их за один проход по принятой порции */
+void msg_place_bundle
+( /* Отправка */
+    struct client_t *client,
+    unsigned int slotid
 );
 
 /* Подтверждение получения места в распределении
@@ -219,7 +539,15 @@ void msg_place_confirm
 void on_place_confirm
 ( /* Прием */
     struct client_t *client,
-    unsigned int slotid
+    unsigned int slotid,
+    const union msg_data_t *data
+);
+
+/* Все ожидаемые соседи подтвердили подключение или недоступны,
+    клиент входит в распределение */
+void on_place_complete
+(
+    struct client_t *client
 );
 
 /* Отказ от получения места в распределении
@@ -233,14 +561,17 @@ void msg_place_refuse
 void on_place_refuse
 ( /* Прием */
     struct client_t *client,
-    unsigned int slotid
+    unsigned int slotid,
+    const union msg_data_t *data
 );
 
 /* Рукопожатие с новыми соседями с целью совместить границы рамок
-    (CONNECTION_HANDSNAKE, расположение передающего относительно получателя) */
+    (CONNECTION_HANDSNAKE, расположение передающего относительно получателя,
+        порт слушателя передающего), отправляется в сокет соседа */
 void msg_connection_handsnake
 ( /* Отправка */
     struct client_t *client,
+    int socket,
     unsigned char position
 );
 
@@ -248,12 +579,18 @@ void on_connection_handsnake
 ( /* Прием */
     struct client_t *client,
     unsigned int slotid,
-    unsigned char position
+    const union msg_data_t *data
 );
 
 /* Информация о величине рамки, чтобы у всех была одинаковая
     рамка, так же передает кол-во соседей, перед отправкой их данных
     (CONNECTION_BORDER, высота, ширина, количество активных соседей) */
+size_t pack_connection_border
+( /* Сериализация, возвращает размер сообщения */
+    char *msg,
+    unsigned char neighborcount
+);
+
 void msg_connection_border
 ( /* Отправка */
     struct client_t *client,
@@ -265,13 +602,20 @@ void on_connection_border
 ( /* Прием */
     struct client_t *client,
     unsigned int slotid,
-    char *msg,
-    size_t msgsize
+    const union msg_data_t *data
 );
 
 /* Пересылка данных о общем соседе
     (CONNECTION_NEIGHBOR, адрес, порт,
         расположение соседа относительно получателя) */
+size_t pack_connection_neighbor
+( /* Сериализация, возвращает размер сообщения */
+    char *msg,
+    in_addr_t ipaddr,
+    unsigned short port,
+    unsigned char position
+);
+
 void msg_connection_neighbor
 ( /* Отправка */
     struct client_t *client,
@@ -285,8 +629,18 @@ void on_connection_neighbor
 ( /* Прием */
     struct client_t *client,
     unsigned int slotid,
-    char *msg,
-    size_t msgsize
+    const union msg_data_t *data
+);
+
+/* Знакомит соседа в слоте slotid, который только что стал готовым, с
+    готовыми общими соседями: места, занятые одновременно, не попадают
+    в пакеты друг друга; из каждой пары подключается сосед с меньшим
+    портом, поэтому знакомые через разных соседей не подключаются
+    навстречу друг другу */
+void msg_connection_introduce
+( /* Отправка */
+    struct client_t *client,
+    unsigned int slotid
 );
 
 /* Сообщение о готовности принимать сообщения полезной нагрузки
@@ -300,11 +654,14 @@ void msg_connection_ready
 void on_connection_ready
 ( /* Прием */
     struct client_t *client,
-    unsigned int slotid
+    unsigned int slotid,
+    const union msg_data_t *data
 );
 
-/* Сообщение о готовности обслуживать поиск слотов
-    (CONNECTION_DISTANCE, удаление от диспетчера) */
+/* Сообщение о готовности обслуживать поиск слотов, повторяется
+    при каждом изменении количества свободных слотов
+    (CONNECTION_DISTANCE, удаление от диспетчера, свободные слоты,
+    адрес и порт слушателя, по которым участника узнает наследник) */
 void msg_connection_distance
 ( /* Отправка */
     struct client_t *client,
@@ -315,8 +672,143 @@ void on_connection_distance
 ( /* Прием */
     struct client_t *client,
     struct unit_t *unit,
+    const union msg_data_t *data
+);
+
+/* Порция тела потокового кадра от соседа в слоте slotid: поля
+    кадра разбираются из stream и порция передается обработчику кода */
+void msg_tcp_stream
+(
+    struct client_t *client,
+    unsigned int slotid,
+    struct stream_t *stream,
+    const char *data,
+    size_t size
+);
+
+/* Порция тела полезной нагрузки от соседа в слоте slotid, за ней
+    у сообщения осталось еще remain байт, 0 - сообщение закончено;
+    передается получателю клиента, если сосед готов */
+void on_payload
+( /* Прием */
+    struct client_t *client,
+    unsigned int slotid,
+    const char *data,
+    size_t size,
+    size_t remain
+);
+
+/* Порция коллективной операции от соседа в слоте slotid,
+    передается модулю коллективных операций клиента */
+void on_collective
+( /* Прием */
+    struct client_t *client,
+    unsigned int slotid,
+    const union msg_data_t *data,
+    const char *body,
+    size_t size,
+    size_t remain
+);
+
+/* Предложение соседу на этом же компьютере перейти на общую
+    память (LINK_OFFER), файл связи создает предлагающий */
+void msg_link_offer
+( /* Отправка */
+    struct client_t *client,
+    unsigned int slotid
+);
+
+void on_link_offer
+( /* Прием */
+    struct client_t *client,
+    unsigned int slotid,
+    const union msg_data_t *data
+);
+
+/* Отказ от общей памяти (LINK_REFUSE), соединение остается на TCP */
+void msg_link_refuse
+( /* Отправка */
+    struct client_t *client,
+    int socket
+);
+
+void on_link_refuse
+( /* Прием */
+    struct client_t *client,
+    unsigned int slotid,
+    const union msg_data_t *data
+);
+
+/* Метка перехода записи на кольцо связи (LINK_SWITCH), возвращает
+    -1, если соединение занято и переход надо повторить позже */
+int msg_link_switch
+( /* Отправка */
+    struct client_t *client,
+    unsigned int slotid
+);
+
+void on_link_switch
+( /* Прием */
+    struct client_t *client,
+    unsigned int slotid,
+    const union msg_data_t *data
+);
+
+/* Наследник диспетчера (STANDBY_HEIR, адрес и порт его слушателя,
+    0 - наследника нет, и сеть диспетчеризации) */
+size_t pack_standby_heir
+( /* Сериализация, возвращает размер сообщения */
     char *msg,
-    size_t msgsize
+    in_addr_t ipaddr,
+    unsigned short port,
+    in_addr_t netaddr
+);
+
+void msg_standby_heir
+( /* Отправка */
+    struct client_t *client,
+    int socket
+);
+
+void on_standby_heir
+( /* Прием */
+    struct client_t *client,
+    const union msg_data_t *data
+);
+
+/* Изменение участника в реестре диспетчера для зеркал участников
+    кольца 1 (STANDBY_UNIT, адрес и порт слушателя, удаление,
+    STANDBY_GONE - ушел, и свободные слоты); нулевой порт
+    велит зеркалу забыть всех участников */
+size_t pack_standby_unit
+( /* Сериализация, возвращает размер сообщения */
+    char *msg,
+    in_addr_t ipaddr,
+    unsigned short port,
+    unsigned int distance,
+    unsigned char free
+);
+
+void msg_standby_unit
+( /* Отправка */
+    struct client_t *client,
+    in_addr_t ipaddr,
+    unsigned short port,
+    unsigned int distance,
+    unsigned char free
+);
+
+void on_standby_unit
+( /* Прием */
+    struct client_t *client,
+    const union msg_data_t *data
+);
+
+/* Весь реестр диспетчера новому участнику кольца 1 standby */
+void msg_standby_snapshot
+( /* Отправка */
+    struct client_t *client,
+    struct unit_t *standby
 );
 
 /* Обработчики протокола */
@@ -335,14 +827,15 @@ void msg_dispatcher_tcp_acceptor
     int sock
 );
 
-/* Обработка TCP сообщений от клиентов к диспетчеру */
+/* Обработка TCP сообщений от клиентов к диспетчеру, данные
+    разбираются по таблице и передаются обработчику кода */
 void msg_dispatcher_tcp_handler
 (
     struct client_t *client,
     struct unit_t *unit,
     msg_code_t code,
-    char *buffer,
-    size_t msgsize
+    char *msg,
+    size_t length
 );
 
 /* Обработка TCP сообщений от диспетчера к клиенту */
@@ -350,8 +843,8 @@ void msg_tcp_dialog
 (
     struct client_t *client,
     msg_code_t code,
-    char *buffer,
-    size_t msgsize
+    char *msg,
+    size_t length
 );
 
 /* Обработка подключений клиентов к клиенту, возвращает
@@ -370,11 +863,26 @@ void msg_tcp_handler
     struct client_t *client,
     unsigned int slotid,
     msg_code_t code,
-    char *buffer,
-    size_t msgsize
+    char *msg,
+    size_t length
 );
 
 /* Специальные события */
+/* Соседу, к которому клиент подключался с рукопожатием,
+    подключиться не удалось */
+void on_connection_failed
+(
+    struct client_t *client
+);
+
+/* Соединение, принятое в ожидании места, закрылось или оказалось
+    не от якоря: слот освобождается, а место ищется заново */
+void on_place_lost
+(
+    struct client_t *client,
+    unsigned int slotid
+);
+
 /* Сообщает всем ранее подсоединившимся клиентам адрес сети,
     полученный от клиента вне локальной сети */
 void on_netaddr_setup
@@ -382,4 +890,17 @@ void on_netaddr_setup
     struct client_t *client
 );
 
+/* Наследник диспетчера сменился: сообщает его всем участникам */
+void on_heir_changed
+(
+    struct client_t *client
+);
+
+/* Диалог с диспетчером закрылся: клиент переходит к наследнику,
+    если тот назначен */
+void on_dispatcher_lost
+(
+    struct client_t *client
+);
+
 #endif /* ifndef PROTOCOL_H */
@@ -0,0 +1,234 @@
+/*
+ ============================================================================
+ Name        : registry.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация реестра участников диспетчеризации
+ ============================================================================
+ */
+
+#ifndef REGISTRY_C
+#define REGISTRY_C
+
+#include "client.h"
+
+/* Надгробие удаленной ячейки хеш-таблицы, продолжает цепочку проб */
+static struct unit_t registry_tombstone;
+
+/* Хеш дескриптора сокета, Фибоначчиево хеширование */
+#define REGISTRY_HASH(socket, capacity) \
+    (((unsigned int)(socket) * 2654435761U) & ((capacity) - 1))
+
+void registry_init(struct unit_registry_t *registry)
+{
+    memset(registry, 0, sizeof(struct unit_registry_t));
+    registry->capacity = REGISTRY_TABLE_SIZE;
+    registry->table = (struct unit_t **)calloc(registry->capacity,
+        sizeof(struct unit_t *));
+    pthread_mutex_init(&registry->writelock, NULL);
+}
+
+void registry_destroy(struct unit_registry_t *registry)
+{
+    unsigned int i;
+    for(i=0; i<REGISTRY_MAX_PAGES; i++)
+        free(registry->pages[i]);
+    free(registry->table);
+    pthread_mutex_destroy(&registry->writelock);
+}
+
+struct unit_t *registry_add(struct unit_registry_t *registry, int socket)
+{
+    struct unit_t *unit;
+    unsigned int page, idx;
+    pthread_mutex_lock(&registry->writelock);
+    /* Пробуем вернуть в оборот ранее выведенные записи */
+    registry_reclaim(registry);
+    /* Держим заполнение таблицы не выше 3/4 */
+    if((registry->used+1)*4 > registry->capacity*3)
+        registry_rehash(registry, registry->count*2 < registry->capacity ?
+            registry->capacity : registry->capacity*2);
+    if(registry->freelist != NULL)
+    {
+        /* Берем свободную запись */
+        unit = registry->freelist;
+        registry->freelist = unit->next;
+    }
+    else
+    {
+        /* Выдаем новую запись слаба, при необходимости - новую страницу */
+        page = registry->records / REGISTRY_PAGE_SIZE;
+        if(page >= REGISTRY_MAX_PAGES)
+        {
+            pthread_mutex_unlock(&registry->writelock);
+            return NULL;
+        }
+        if(registry->pages[page] == NULL)
+            registry->pages[page] = (struct unit_t *)calloc(REGISTRY_PAGE_SIZE,
+                sizeof(struct unit_t));
+        unit = registry->pages[page] + registry->records % REGISTRY_PAGE_SIZE;
+        unit->index = registry->records;
+        /* Читатели увидят запись только после ее заполнения */
+        __atomic_store_n(&registry->records, registry->records+1,
+            __ATOMIC_RELEASE);
+    }
+    unit->socket = socket;
+    unit->epoch++;
+    /* Указываем, что у нас нет данных о удалении клиента от диспетчера */
+    unit->distance = INVALID_DISTANCE;
+    unit->next = NULL;
+    unit->ringprev = unit->ringnext = NULL;
+    /* Пока участник не сообщил о слотах, места у него не оговариваются */
+    unit->free = unit->reserved = 0;
+    unit->ipaddr = 0;
+    unit->port = 0;
+    unit->anchor = NULL;
+    unit->waiting = 0;
+    unit->waitnext = NULL;
+    STREAM_RESET(&unit->stream);
+    unit->op = NULL;
+    /* Публикуем запись для читателей */
+    __atomic_store_n(&unit->alive, 1, __ATOMIC_RELEASE);
+    /* Вставляем в таблицу линейным пробированием */
+    idx = REGISTRY_HASH(socket, registry->capacity);
+    while(registry->table[idx] != NULL &&
+        registry->table[idx] != &registry_tombstone)
+            idx = (idx+1) & (registry->capacity-1);
+    if(registry->table[idx] == NULL)
+        registry->used++;
+    registry->table[idx] = unit;
+    registry->count++;
+    pthread_mutex_unlock(&registry->writelock);
+    return unit;
+}
+
+int registry_remove(struct unit_registry_t *registry, int socket)
+{
+    struct unit_t *unit;
+    unsigned int idx;
+    pthread_mutex_lock(&registry->writelock);
+    idx = REGISTRY_HASH(socket, registry->capacity);
+    while((unit = registry->table[idx]) != NULL)
+    {
+        if(unit != &registry_tombstone && unit->socket == socket)
+            break;
+        idx = (idx+1) & (registry->capacity-1);
+    }
+    if(unit == NULL)
+    {
+        pthread_mutex_unlock(&registry->writelock);
+        return 0;
+    }
+    /* Оставляем надгробие, чтобы не разорвать цепочки проб */
+    registry->table[idx] = &registry_tombstone;
+    registry->count--;
+    /* Снимаем запись с публикации, но память остается доступной
+        читателям, которые могли получить на нее указатель */
+    __atomic_store_n(&unit->alive, 0, __ATOMIC_RELEASE);
+    unit->next = registry->retired;
+    registry->retired = unit;
+    registry_reclaim(registry);
+    pthread_mutex_unlock(&registry->writelock);
+    return 1;
+}
+
+struct unit_t *registry_find(struct unit_registry_t *registry, int socket)
+{
+    struct unit_t *unit;
+    unsigned int idx;
+    pthread_mutex_lock(&registry->writelock);
+    idx = REGISTRY_HASH(socket, registry->capacity);
+    while((unit = registry->table[idx]) != NULL)
+    {
+        if(unit != &registry_tombstone && unit->socket == socket)
+            break;
+        idx = (idx+1) & (registry->capacity-1);
+    }
+    pthread_mutex_unlock(&registry->writelock);
+    return unit;
+}
+
+unsigned int registry_read_lock(struct unit_registry_t *registry)
+{
+    unsigned int epoch;
+    while(1)
+    {
+        epoch = __atomic_load_n(&registry->epoch, __ATOMIC_ACQUIRE);
+        __atomic_add_fetch(&registry->readers[epoch&1], 1, __ATOMIC_SEQ_CST);
+        /* Если эпоха сменилась, пока мы регистрировались,
+            писатель мог не увидеть нас - повторяем */
+        if(__atomic_load_n(&registry->epoch, __ATOMIC_SEQ_CST) == epoch)
+            return epoch;
+        __atomic_sub_fetch(&registry->readers[epoch&1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void registry_read_unlock(struct unit_registry_t *registry, unsigned int epoch)
+{
+    __atomic_sub_fetch(&registry->readers[epoch&1], 1, __ATOMIC_RELEASE);
+}
+
+struct unit_t *registry_next(struct unit_registry_t *registry,
+    struct unit_t *unit)
+{
+    unsigned int i, records;
+    struct unit_t *ptr;
+    records = __atomic_load_n(&registry->records, __ATOMIC_ACQUIRE);
+    for(i = unit == NULL ? 0 : unit->index+1; i<records; i++)
+    {
+        ptr = registry->pages[i / REGISTRY_PAGE_SIZE] + i % REGISTRY_PAGE_SIZE;
+        if(__atomic_load_n(&ptr->alive, __ATOMIC_ACQUIRE))
+            return ptr;
+    }
+    return NULL;
+}
+
+void registry_rehash(struct unit_registry_t *registry, unsigned int capacity)
+{
+    struct unit_t **table;
+    unsigned int i, idx;
+    table = (struct unit_t **)calloc(capacity, sizeof(struct unit_t *));
+    for(i=0; i<registry->capacity; i++)
+    {
+        if(registry->table[i] == NULL ||
+            registry->table[i] == &registry_tombstone)
+                continue;
+        idx = REGISTRY_HASH(registry->table[i]->socket, capacity);
+        while(table[idx] != NULL)
+            idx = (idx+1) & (capacity-1);
+        table[idx] = registry->table[i];
+    }
+    free(registry->table);
+    registry->table = table;
+    registry->capacity = capacity;
+    registry->used = registry->count;
+}
+
+void registry_reclaim(struct unit_registry_t *registry)
+{
+    struct unit_t *unit;
+    /* Записи предыдущей эпохи освобождаются, когда
+        все ее читатели вышли из секции чтения */
+    if(registry->retiredold != NULL &&
+        !__atomic_load_n(&registry->readers[registry->retiredparity],
+            __ATOMIC_SEQ_CST))
+    {
+        while((unit = registry->retiredold) != NULL)
+        {
+            registry->retiredold = unit->next;
+            unit->next = registry->freelist;
+            registry->freelist = unit;
+        }
+    }
+    /* Закрываем текущую эпоху, если в ней есть выведенные записи,
+        новые читатели будут учитываться уже в следующей */
+    if(registry->retiredold == NULL && registry->retired != NULL)
+    {
+        registry->retiredold = registry->retired;
+        registry->retired = NULL;
+        registry->retiredparity = registry->epoch&1;
+        __atomic_add_fetch(&registry->epoch, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+#endif /* ifndef REGISTRY_C */
@@ -0,0 +1,174 @@
+/*
+ ============================================================================
+ Name        : registry.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок реестра участников диспетчеризации
+ ============================================================================
+ */
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "stream.h"
+
+/* Количество записей на странице слаба */
+#define REGISTRY_PAGE_SIZE           (256)
+/* Предельное количество страниц слаба */
+#define REGISTRY_MAX_PAGES           (256)
+/* Начальная емкость хеш-таблицы, всегда степень двойки */
+#define REGISTRY_TABLE_SIZE           (64)
+
+/* Участник диспетчеризации, записи хранятся в слабе
+    и не перемещаются до уничтожения реестра, поэтому
+    указатель на запись можно хранить в контексте реактора */
+struct unit_t
+{
+    int socket;
+    unsigned int distance;
+    /* Признак действующей записи, читается без блокировки */
+    int alive;
+    /* Порядковый номер записи в слабе и номер ее выдачи: он растет
+        при каждом повторном использовании записи, поэтому ссылка
+        на запись отличает прежнего участника от нового */
+    unsigned int index;
+    unsigned int epoch;
+    /* Следующая запись в списке свободных или выведенных */
+    struct unit_t *next;
+    /* Соседи по кольцу удаления, ведутся диспетчером */
+    struct unit_t *ringprev, *ringnext;
+    /* Оговорки мест: свободные слоты, о которых участник сообщил
+        последним, и выданные под них поиски, еще не завершенные */
+    unsigned int free, reserved;
+    /* Адрес и порт слушателя из сообщения удаления участника,
+        по ним его узнают зеркала и наследник, 0 - еще не сообщал */
+    unsigned int ipaddr;
+    unsigned short port;
+    /* Для нового клиента: адрес, порт и кольцо из его поиска слота,
+        запись участника, у которого ему оговорен слот, с номером ее
+        выдачи (ничего - оговорки нет; сокет ушедшего участника мог
+        достаться новому), и очередь клиентов, ждущих освобождения
+        слотов */
+    unsigned int joinaddr;
+    unsigned short joinport;
+    unsigned int joinring;
+    struct unit_t *anchor;
+    unsigned int anchorepoch;
+    int waiting;
+    struct unit_t *waitnext;
+    /* Сборка кадров и операция приема движка io_uring */
+    struct stream_t stream;
+    struct engine_op_t *op;
+};
+
+/* Реестр участников: слаб записей, хеш-таблица с открытой
+    адресацией по дескриптору сокета и эпохи читателей.
+    Писатели (добавление и удаление) сериализуются мьютексом,
+    читатели обходят слаб без блокировок внутри секции чтения */
+struct unit_registry_t
+{
+    /* Страницы слаба */
+    struct unit_t *pages[REGISTRY_MAX_PAGES];
+    /* Количество выданных записей слаба */
+    unsigned int records;
+    /* Таблица: сокет -> запись, только для писателей */
+    struct unit_t **table;
+    unsigned int capacity;
+    /* Занятые ячейки таблицы с учетом надгробий */
+    unsigned int used;
+    /* Количество действующих записей */
+    unsigned int count;
+    /* Свободные записи, готовые к повторному использованию */
+    struct unit_t *freelist;
+    /* Записи, выведенные в текущей эпохе, и записи,
+        ждущие выхода читателей предыдущей эпохи */
+    struct unit_t *retired;
+    struct unit_t *retiredold;
+    unsigned int retiredparity;
+    /* Текущая эпоха и счетчики читателей по четности эпохи */
+    unsigned int epoch;
+    unsigned int readers[2];
+    /* Мьютекс писателей */
+    pthread_mutex_t writelock;
+};
+
+/* Инициализирует пустой реестр */
+void registry_init
+(
+    struct unit_registry_t *registry
+);
+
+/* Освобождает все страницы и таблицу реестра,
+    читателей к этому моменту быть не должно */
+void registry_destroy
+(
+    struct unit_registry_t *registry
+);
+
+/* Добавляет участника с указанным сокетом,
+    возвращает его запись или ничего при переполнении */
+struct unit_t *registry_add
+(
+    struct unit_registry_t *registry,
+    int socket
+);
+
+/* Удаляет участника по сокету за O(1), запись
+    возвращается в оборот только после выхода всех
+    читателей, которые могли ее видеть; возвращает 1,
+    если участник был найден */
+int registry_remove
+(
+    struct unit_registry_t *registry,
+    int socket
+);
+
+/* Ищет запись участника по сокету за O(1) */
+struct unit_t *registry_find
+(
+    struct unit_registry_t *registry,
+    int socket
+);
+
+/* Вход в секцию чтения, никогда не блокируется,
+    возвращает метку эпохи для выхода */
+unsigned int registry_read_lock
+(
+    struct unit_registry_t *registry
+);
+
+/* Выход из секции чтения */
+void registry_read_unlock
+(
+    struct unit_registry_t *registry,
+    unsigned int epoch
+);
+
+/* Возвращает следующую действующую запись после unit, или
+    первую, если unit равен нулю, вызывается в секции чтения */
+struct unit_t *registry_next
+(
+    struct unit_registry_t *registry,
+    struct unit_t *unit
+);
+
+/* Служебные операции, выполняются под мьютексом писателей */
+/* Перестраивает таблицу под новую емкость, убирая надгробия */
+void registry_rehash
+(
+    struct unit_registry_t *registry,
+    unsigned int capacity
+);
+
+/* Возвращает в оборот выведенные записи, если читатели
+    их эпохи завершились, и открывает новую эпоху */
+void registry_reclaim
+(
+    struct unit_registry_t *registry
+);
+
+#endif /* ifndef REGISTRY_H */
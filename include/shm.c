@@ -0,0 +1,206 @@
+/*
+ ============================================================================
+ Name        : shm.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация связи соседей на одном компьютере через общую память
+ ============================================================================
+ */
+
+#ifndef SHM_C
+#define SHM_C
+
+#include "shm.h"
+
+/* Номер очередной связи процесса */
+static unsigned int shmcounter;
+
+/* Отображает файл связи и раскладывает кольца: первое пишет
+    создатель файла, второе - сосед, который его открыл */
+static struct shm_link_t *shm_link_map(int fd, unsigned int pid,
+    unsigned int id, int owner)
+{
+    struct shm_link_t *link;
+    size_t stride = sizeof(struct shm_ring_t) + SHM_RING;
+    struct shm_ring_t *first, *second;
+    void *base;
+    base = mmap(NULL, 2*stride, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+        return NULL;
+    link = (struct shm_link_t *)calloc(1, sizeof(struct shm_link_t));
+    if(link == NULL)
+    {
+        munmap(base, 2*stride);
+        return NULL;
+    }
+    link->base = (char *)base;
+    link->mapsize = 2*stride;
+    first = (struct shm_ring_t *)link->base;
+    second = (struct shm_ring_t *)(link->base + stride);
+    link->out = owner ? first : second;
+    link->in = owner ? second : first;
+    link->outdata = (char *)(link->out + 1);
+    link->indata = (char *)(link->in + 1);
+    link->pid = pid;
+    link->id = id;
+    link->named = owner;
+    return link;
+}
+
+struct shm_link_t *shm_link_create(void)
+{
+    char path[64];
+    unsigned int pid = getpid(), id;
+    struct shm_link_t *link;
+    int fd;
+    id = __atomic_add_fetch(&shmcounter, 1, __ATOMIC_RELAXED);
+    sprintf(path, SHM_PATH, pid, id);
+    if((fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0600)) < 0)
+        return NULL;
+    /* Новый файл заполнен нулями: кольца пусты, остается
+        отметить, что читатели ждут звонка о первых данных */
+    if(ftruncate(fd, 2*(sizeof(struct shm_ring_t) + SHM_RING)) < 0)
+    {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+    if((link = shm_link_map(fd, pid, id, 1)) == NULL)
+    {
+        unlink(path);
+        return NULL;
+    }
+    link->in->sleeping = link->out->sleeping = 1;
+    return link;
+}
+
+struct shm_link_t *shm_link_attach(unsigned int pid, unsigned int id)
+{
+    char path[64];
+    struct stat st;
+    int fd;
+    sprintf(path, SHM_PATH, pid, id);
+    /* Имя файла назвал сосед, поэтому подложенная ссылка или
+        чужой файл вместо файла связи не открываются */
+    if((fd = place_file_open(path, O_RDWR)) < 0)
+        return NULL;
+    /* Размер колец задан при сборке - у соседа он должен совпадать */
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size !=
+        2*(sizeof(struct shm_ring_t) + SHM_RING))
+    {
+        close(fd);
+        return NULL;
+    }
+    return shm_link_map(fd, pid, id, 0);
+}
+
+void shm_link_unlink(struct shm_link_t *link)
+{
+    char path[64];
+    if(link == NULL || !link->named)
+        return;
+    sprintf(path, SHM_PATH, link->pid, link->id);
+    unlink(path);
+    link->named = 0;
+}
+
+void shm_link_close(struct shm_link_t *link)
+{
+    if(link == NULL)
+        return;
+    shm_link_unlink(link);
+    munmap(link->base, link->mapsize);
+    free(link);
+}
+
+size_t shm_link_write(struct shm_link_t *link, const char *data, size_t size)
+{
+    struct shm_ring_t *ring = link->out;
+    unsigned long head, tail;
+    size_t total = 0, take, offset, part;
+    /* Позицию записи меняет только этот писатель */
+    head = ring->head;
+    while(size)
+    {
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+        take = SHM_RING - (head - tail);
+        if(!take)
+        {
+            /* Места нет: отмечаем ожидание и проверяем еще раз,
+                читатель мог освободить место до отметки */
+            if(__atomic_load_n(&ring->wanted, __ATOMIC_RELAXED))
+                break;
+            __atomic_store_n(&ring->wanted, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if(take > size)
+            take = size;
+        /* Кусок может переходить через конец кольца */
+        offset = head & (SHM_RING - 1);
+        part = SHM_RING - offset < take ? SHM_RING - offset : take;
+        memcpy(link->outdata + offset, data, part);
+        memcpy(link->outdata, data + part, take - part);
+        head += take;
+        data += take;
+        size -= take;
+        total += take;
+        __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    }
+    return total;
+}
+
+int shm_link_wake(struct shm_link_t *link)
+{
+    return __atomic_exchange_n(&link->out->sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+char *shm_link_peek(struct shm_link_t *link, size_t *size)
+{
+    struct shm_ring_t *ring = link->in;
+    unsigned long head, tail, offset;
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    tail = ring->tail;
+    offset = tail & (SHM_RING - 1);
+    /* Отдаем только до конца кольца, остальное - следующим куском */
+    *size = head - tail;
+    if(*size > SHM_RING - offset)
+        *size = SHM_RING - offset;
+    return link->indata + offset;
+}
+
+int shm_link_consume(struct shm_link_t *link, size_t size)
+{
+    struct shm_ring_t *ring = link->in;
+    __atomic_store_n(&ring->tail, ring->tail + size, __ATOMIC_SEQ_CST);
+    return __atomic_exchange_n(&ring->wanted, 0, __ATOMIC_SEQ_CST);
+}
+
+int shm_link_idle(struct shm_link_t *link)
+{
+    struct shm_ring_t *ring = link->in;
+    /* Отметка сна и проверка кольца идут в обратном порядке
+        к записи и проверке отметки у писателя, поэтому звонок
+        не теряется: либо писатель увидит отметку, либо читатель -
+        новые данные */
+    __atomic_store_n(&ring->sleeping, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail)
+        return 1;
+    __atomic_store_n(&ring->sleeping, 0, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+void shm_link_nap(unsigned int round)
+{
+    struct timespec nap;
+    if(round < SHM_SPIN)
+    {
+        sched_yield();
+        return;
+    }
+    nap.tv_sec = 0;
+    nap.tv_nsec = SHM_NAP;
+    nanosleep(&nap, NULL);
+}
+
+#endif /* ifndef SHM_C */
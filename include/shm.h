@@ -0,0 +1,140 @@
+/*
+ ============================================================================
+ Name        : shm.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок связи соседей на одном компьютере через общую память
+ ============================================================================
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "place.h"
+
+/* Шаблон пути файла связи: процесс, который его создал,
+    и номер связи в этом процессе */
+#define SHM_PATH "/dev/shm/psmd.link.%u.%u"
+/* Размер кольца одного направления, степень двойки */
+#define SHM_RING                 (1UL<<20)
+/* Строка кэша процессора: позиции писателя и читателя
+    лежат в разных строках, чтобы не мешать друг другу */
+#define SHM_LINE                      (64)
+/* Сколько раз писатель уступает процессор, ожидая места
+    в кольце, прежде чем засыпать на SHM_NAP наносекунд */
+#define SHM_SPIN                      (64)
+#define SHM_NAP                    (20000)
+
+/* Кольцо одного направления в общей памяти, данные идут
+    сразу за ним; позиции только растут, индекс в кольце -
+    позиция по модулю SHM_RING */
+struct shm_ring_t
+{
+    /* Записано писателем */
+    unsigned long head;
+    char headpad[SHM_LINE - sizeof(unsigned long)];
+    /* Прочитано читателем */
+    unsigned long tail;
+    char tailpad[SHM_LINE - sizeof(unsigned long)];
+    /* Читатель уснул и ждет звонка, писатель ждет места */
+    int sleeping;
+    int wanted;
+    char flagpad[SHM_LINE - 2*sizeof(int)];
+};
+
+/* Связь с соседом через пару колец: одно на запись, другое
+    на чтение; звонки и обрыв связи идут прежним соединением TCP */
+struct shm_link_t
+{
+    char *base;
+    size_t mapsize;
+    struct shm_ring_t *in, *out;
+    char *indata, *outdata;
+    /* Имя файла связи, пока файл не удален */
+    unsigned int pid, id;
+    int named;
+    /* Направления переключены на общую память */
+    int reading, writing;
+};
+
+/* Создает файл связи и отображает его, возвращает ничего,
+    если общая память недоступна */
+struct shm_link_t *shm_link_create(void);
+
+/* Отображает файл связи, созданный соседом; файл открывается, как
+    кэш места: ссылка, не обычный файл и файл другого пользователя
+    не открываются */
+struct shm_link_t *shm_link_attach
+(
+    unsigned int pid,
+    unsigned int id
+);
+
+/* Удаляет файл связи, когда обе стороны его отобразили */
+void shm_link_unlink
+(
+    struct shm_link_t *link
+);
+
+/* Освобождает связь, удаляя файл, если он еще есть */
+void shm_link_close
+(
+    struct shm_link_t *link
+);
+
+/* Пишет в кольцо сколько поместится из size байт data, возвращает
+    записанное; если места не хватило, отмечает, что писатель
+    ждет, и соседу надо позвонить, когда место освободится */
+size_t shm_link_write
+(
+    struct shm_link_t *link,
+    const char *data,
+    size_t size
+);
+
+/* Возвращает 1, если читатель спит и ему надо позвонить
+    после записи, звонок достается одному писателю */
+int shm_link_wake
+(
+    struct shm_link_t *link
+);
+
+/* Возвращает непрерывный кусок принятых данных и его размер */
+char *shm_link_peek
+(
+    struct shm_link_t *link,
+    size_t *size
+);
+
+/* Освобождает прочитанные size байт, возвращает 1, если писатель
+    ждет места и ему надо позвонить */
+int shm_link_consume
+(
+    struct shm_link_t *link,
+    size_t size
+);
+
+/* Засыпает до звонка, если кольцо пусто: возвращает 1, иначе
+    данные пришли между проверками и читать надо дальше */
+int shm_link_idle
+(
+    struct shm_link_t *link
+);
+
+/* Ждет, пока читатель освободит место в кольце */
+void shm_link_nap
+(
+    unsigned int round
+);
+
+#endif /* ifndef SHM_H */
@@ -0,0 +1,451 @@
+/*
+ ============================================================================
+ Name        : sim.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация детерминированного симулятора сети на виртуальных часах
+ ============================================================================
+ */
+
+#ifndef SIM_C
+#define SIM_C
+
+#include "sim.h"
+#include "stats.h"
+
+/* Предел дескрипторов, под который заводится таблица сокетов */
+#define SIM_MAX_SOCKETS          (1 << 22)
+
+/* Симулятор процесса, его время показывают часы показателей */
+static struct sim_t *simcurrent;
+
+/* Порядок сокетов, готовых одновременно */
+static int sim_socket_order(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/* Событие несет данные или вызов, а не ждет срока */
+static int sim_carries(struct sim_event_t *event)
+{
+    return event->type == SIM_EVENT_RECV ||
+        (event->type == SIM_EVENT_CALL && event->op->type == ENGINE_OP_CALL);
+}
+
+/* Событие a наступает раньше b */
+static int sim_before(struct sim_event_t *a, struct sim_event_t *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+struct sim_t *sim_create(struct sim_config_t *config)
+{
+    struct sim_t *sim;
+    struct rlimit limit;
+    /* Клиент держит около десятка дескрипторов: слоты соседей и
+        пару сокетов диалога с диспетчером, поэтому поднимаем
+        предел до разрешенного системой */
+    if(getrlimit(RLIMIT_NOFILE, &limit) < 0)
+        return NULL;
+    if(limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        getrlimit(RLIMIT_NOFILE, &limit);
+    }
+    sim = (struct sim_t *)calloc(1, sizeof(struct sim_t));
+    if(sim == NULL)
+        return NULL;
+    memcpy(&sim->config, config, sizeof(struct sim_config_t));
+    /* Генератор xorshift не выходит из нуля */
+    sim->random = config->seed ? config->seed : 1;
+    sim->maxsockets = limit.rlim_cur == RLIM_INFINITY ||
+        limit.rlim_cur > SIM_MAX_SOCKETS ? SIM_MAX_SOCKETS : limit.rlim_cur;
+    sim->sockets = (struct sim_socket_t *)calloc(sim->maxsockets,
+        sizeof(struct sim_socket_t));
+    sim->capacity = SIM_HEAP_SIZE;
+    sim->heap = (struct sim_event_t *)malloc(sim->capacity*
+        sizeof(struct sim_event_t));
+    sim->epollfd = epoll_create1(0);
+    sim->nextport = SIM_FIRST_PORT;
+    if(sim->sockets == NULL || sim->heap == NULL || sim->epollfd < 0 ||
+        engine_simulate(sim) < 0)
+    {
+        if(sim->epollfd >= 0)
+            close(sim->epollfd);
+        free(sim->sockets);
+        free(sim->heap);
+        free(sim);
+        return NULL;
+    }
+    simcurrent = sim;
+    stats_set_clock(sim_clock);
+    return sim;
+}
+
+void sim_destroy(struct sim_t *sim)
+{
+    size_t i;
+    if(sim == NULL)
+        return;
+    /* Операции приема и ожидания принадлежат клиентам,
+        освобождаем только порции и вызовы */
+    for(i=0; i<sim->count; i++)
+    {
+        free(sim->heap[i].data);
+        if(sim->heap[i].type == SIM_EVENT_CALL)
+            free(sim->heap[i].op);
+    }
+    stats_set_clock(NULL);
+    simcurrent = NULL;
+    close(sim->epollfd);
+    free(sim->sockets);
+    free(sim->heap);
+    free(sim);
+}
+
+int sim_step(struct sim_t *sim)
+{
+    struct sim_event_t event;
+    if(!sim->count || sim->failed)
+        return 0;
+    sim_pop(sim, &event);
+    sim->now = event.time;
+    sim->events++;
+    sim_dispatch(sim, &event);
+    sim_pump(sim);
+    return 1;
+}
+
+void sim_at(struct sim_t *sim, unsigned long delay, engine_call_t on_call,
+    void *ctx, void *arg)
+{
+    struct sim_event_t event;
+    memset(&event, 0, sizeof(struct sim_event_t));
+    event.op = (struct engine_op_t *)calloc(1, sizeof(struct engine_op_t));
+    if(event.op == NULL)
+    {
+        sim->failed = 1;
+        return;
+    }
+    event.op->type = ENGINE_OP_CALL;
+    event.op->socket = -1;
+    event.op->ctx = ctx;
+    event.op->arg = arg;
+    event.op->on_call = on_call;
+    event.type = SIM_EVENT_CALL;
+    event.time = sim->now + delay;
+    if(sim_push(sim, &event) < 0)
+        free(event.op);
+}
+
+unsigned short sim_port(struct sim_t *sim)
+{
+    /* Портов больше нет - клиент недоступен соседям */
+    if(sim->nextport > 0xFFFF)
+        return 0;
+    return (unsigned short)sim->nextport++;
+}
+
+void sim_watch(struct sim_t *sim, void *ctx)
+{
+    sim->watched = ctx;
+    sim->inflight = sim->peakinflight = 0;
+}
+
+unsigned long sim_random(struct sim_t *sim, unsigned long range)
+{
+    unsigned long x = sim->random;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sim->random = x;
+    return range ? x % range : x;
+}
+
+void sim_arm(struct sim_t *sim, struct engine_op_t *op)
+{
+    struct sim_event_t event;
+    struct sim_socket_t *sock;
+    struct epoll_event ev;
+    if(op->type == ENGINE_OP_ACCEPT)
+    {
+        /* Слушателя нет, соседи приходят вызовами engine_call */
+        op->armed++;
+        return;
+    }
+    if(op->type == ENGINE_OP_RECV)
+    {
+        if(op->socket < 0 || (unsigned int)op->socket >= sim->maxsockets)
+            return;
+        sock = sim->sockets + op->socket;
+        /* Прием, брошенный без отмены на закрытом сокете,
+            вытесняется новым на том же дескрипторе */
+        if(sock->op != NULL)
+        {
+            if(sock->watched)
+                epoll_ctl(sim->epollfd, EPOLL_CTL_DEL, op->socket, NULL);
+            sock->op->armed--;
+        }
+        sock->op = op;
+        sock->last = sim->now;
+        sock->watched = 1;
+        op->armed++;
+        ev.events = EPOLLIN;
+        ev.data.fd = op->socket;
+        epoll_ctl(sim->epollfd, EPOLL_CTL_ADD, op->socket, &ev);
+        return;
+    }
+    memset(&event, 0, sizeof(struct sim_event_t));
+    event.op = op;
+    event.time = sim->now;
+    if(op->type == ENGINE_OP_POLL)
+    {
+        event.type = SIM_EVENT_POLL;
+        if(op->timeout.tv_sec || op->timeout.tv_nsec)
+            event.deadline = sim->now + op->timeout.tv_sec*1000000UL +
+                op->timeout.tv_nsec/1000;
+        op->armed++;
+    }
+    else if(op->type == ENGINE_OP_TIMER)
+    {
+        /* Таймер - ожидание без сокета, которое наступает
+            прямо в свой срок */
+        event.type = SIM_EVENT_POLL;
+        event.deadline = event.time = sim->now +
+            op->timeout.tv_sec*1000000UL + op->timeout.tv_nsec/1000;
+        op->armed++;
+    }
+    else
+        event.type = SIM_EVENT_CALL;
+    sim_push(sim, &event);
+}
+
+void sim_cancel(struct sim_t *sim, struct engine_op_t *op)
+{
+    struct sim_socket_t *sock;
+    op->cancelled = 1;
+    if(op->type == ENGINE_OP_ACCEPT)
+        op->armed--;
+    else if(op->type == ENGINE_OP_RECV && op->socket >= 0 &&
+        (unsigned int)op->socket < sim->maxsockets &&
+        (sock = sim->sockets + op->socket)->op == op)
+    {
+        if(sock->watched)
+            epoll_ctl(sim->epollfd, EPOLL_CTL_DEL, op->socket, NULL);
+        sock->watched = 0;
+        sock->op = NULL;
+        op->armed--;
+    }
+    /* Порции в пути освободят операцию, когда подойдет их время */
+    sim_release(op);
+}
+
+int sim_push(struct sim_t *sim, struct sim_event_t *event)
+{
+    struct sim_event_t *heap;
+    size_t i, parent;
+    if(sim->count == sim->capacity)
+    {
+        heap = (struct sim_event_t *)realloc(sim->heap,
+            2*sim->capacity*sizeof(struct sim_event_t));
+        /* Потерянное событие молча изменило бы исход прогона */
+        if(heap == NULL)
+        {
+            sim->failed = 1;
+            return -1;
+        }
+        sim->heap = heap;
+        sim->capacity *= 2;
+    }
+    event->seq = sim->seq++;
+    sim->pending += sim_carries(event);
+    /* Просеиваем вверх */
+    for(i = sim->count++; i; i = parent)
+    {
+        parent = (i - 1)/2;
+        if(!sim_before(event, sim->heap + parent))
+            break;
+        sim->heap[i] = sim->heap[parent];
+    }
+    sim->heap[i] = *event;
+    return 0;
+}
+
+void sim_pop(struct sim_t *sim, struct sim_event_t *event)
+{
+    struct sim_event_t *last;
+    size_t i, child;
+    *event = sim->heap[0];
+    sim->pending -= sim_carries(event);
+    last = sim->heap + --sim->count;
+    /* Просеиваем последнее событие вниз от корня */
+    for(i = 0; (child = 2*i + 1) < sim->count; i = child)
+    {
+        if(child + 1 < sim->count &&
+            sim_before(sim->heap + child + 1, sim->heap + child))
+                child++;
+        if(!sim_before(sim->heap + child, last))
+            break;
+        sim->heap[i] = sim->heap[child];
+    }
+    sim->heap[i] = *last;
+}
+
+void sim_dispatch(struct sim_t *sim, struct sim_event_t *event)
+{
+    struct engine_op_t *op = event->op;
+    struct pollfd pfd;
+    if(event->type == SIM_EVENT_CALL)
+    {
+        op->on_call(op->ctx, op->arg, op->socket);
+        free(op);
+        return;
+    }
+    op->armed--;
+    if(event->type == SIM_EVENT_RECV)
+    {
+        if(sim->watched != NULL && op->ctx == sim->watched)
+            sim->inflight--;
+        if(!op->cancelled)
+        {
+            op->busy = 1;
+            if(event->size)
+            {
+                sim->delivered++;
+                sim->bytes += event->size;
+                op->on_recv(op->ctx, op->arg, op->socket, event->data,
+                    event->size);
+            }
+            else if(!op->closed)
+            {
+                op->closed = 1;
+                op->on_recv(op->ctx, op->arg, op->socket, NULL, 0);
+            }
+            op->busy = 0;
+        }
+        free(event->data);
+    }
+    else if(!op->cancelled)
+    {
+        pfd.fd = op->socket;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        /* Сосед еще не прочитал свое: проверяем снова через
+            задержку сети, но не позже срока ожидания */
+        if(op->type == ENGINE_OP_POLL && poll(&pfd, 1, 0) == 0 &&
+            (!event->deadline || sim->now < event->deadline))
+        {
+            event->time = sim->now + (sim->config.latency ?
+                sim->config.latency : 1);
+            if(event->deadline && event->time > event->deadline)
+                event->time = event->deadline;
+            op->armed++;
+            sim_push(sim, event);
+            return;
+        }
+        op->closed = 1;
+        op->busy = 1;
+        op->on_call(op->ctx, op->arg, op->socket);
+        op->busy = 0;
+    }
+    sim_release(op);
+}
+
+void sim_pump(struct sim_t *sim)
+{
+    struct epoll_event events[SIM_EVENTS];
+    int sockets[SIM_EVENTS];
+    int count, i;
+    do
+    {
+        count = epoll_wait(sim->epollfd, events, SIM_EVENTS, 0);
+        if(count <= 0)
+            break;
+        /* Порядок готовности заменяем порядком дескрипторов,
+            чтобы доставки не зависели от ядра */
+        for(i=0; i<count; i++)
+            sockets[i] = events[i].data.fd;
+        qsort(sockets, count, sizeof(int), sim_socket_order);
+        for(i=0; i<count; i++)
+            sim_drain(sim, sockets[i]);
+    }
+    while(count == SIM_EVENTS);
+}
+
+void sim_drain(struct sim_t *sim, int socket)
+{
+    struct sim_socket_t *sock = sim->sockets + socket;
+    struct sim_event_t event;
+    char chunk[ENGINE_BUFSIZE];
+    ssize_t size;
+    while(sock->watched)
+    {
+        size = recv(socket, chunk, ENGINE_BUFSIZE, MSG_DONTWAIT);
+        if(size < 0 && errno == EINTR)
+            continue;
+        if(size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        memset(&event, 0, sizeof(struct sim_event_t));
+        event.type = SIM_EVENT_RECV;
+        event.op = sock->op;
+        event.time = sim_delivery(sim, socket);
+        if(size > 0 && (event.data = (char *)malloc(size)) != NULL)
+        {
+            memcpy(event.data, chunk, size);
+            event.size = size;
+        }
+        else
+        {
+            /* Конец потока или разрыв: сокет больше не отслеживаем,
+                обработчик узнает о закрытии после всех данных */
+            epoll_ctl(sim->epollfd, EPOLL_CTL_DEL, socket, NULL);
+            sock->watched = 0;
+        }
+        sock->op->armed++;
+        if(sim->watched != NULL && sock->op->ctx == sim->watched &&
+            ++sim->inflight > sim->peakinflight)
+                sim->peakinflight = sim->inflight;
+        if(sim_push(sim, &event) < 0)
+        {
+            free(event.data);
+            break;
+        }
+    }
+}
+
+unsigned long sim_delivery(struct sim_t *sim, int socket)
+{
+    struct sim_socket_t *sock = sim->sockets + socket;
+    unsigned long time, rto;
+    time = sim->now + sim->config.latency;
+    if(sim->config.jitter)
+        time += sim_random(sim, sim->config.jitter + 1);
+    /* Каждая потеря откладывает порцию до повторной передачи */
+    for(rto = sim->config.rto; sim->config.loss &&
+        sim_random(sim, 1000000) < sim->config.loss; rto *= 2)
+    {
+        time += rto;
+        sim->lost++;
+    }
+    /* Поток TCP не переупорядочивает данные: порция, обогнавшая
+        предыдущую, ждет ее */
+    if(time < sock->last)
+        time = sock->last;
+    sock->last = time;
+    return time;
+}
+
+void sim_release(struct engine_op_t *op)
+{
+    if(op->cancelled && !op->armed && !op->busy)
+        free(op);
+}
+
+void sim_clock(struct timespec *now)
+{
+    now->tv_sec = simcurrent->now/1000000;
+    now->tv_nsec = (simcurrent->now%1000000)*1000;
+}
+
+#endif /* ifndef SIM_C */
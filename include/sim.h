@@ -0,0 +1,246 @@
+/*
+ ============================================================================
+ Name        : sim.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок детерминированного симулятора сети на виртуальных часах
+ ============================================================================
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include "engine.h"
+
+/* Событий готовности, забираемых из epoll за один вызов */
+#define SIM_EVENTS                   (256)
+/* Первый порт, выдаваемый клиентам вместо слушателя TCP */
+#define SIM_FIRST_PORT             (10000)
+/* Начальная вместимость очереди событий */
+#define SIM_HEAP_SIZE               (4096)
+
+/* Виды событий симулятора */
+enum
+{
+    /* Доставка порции данных обработчику приема */
+    SIM_EVENT_RECV,
+    /* Вызов функции: engine_call или таймер */
+    SIM_EVENT_CALL,
+    /* Проверка готовности сокета к записи или срок engine_timer */
+    SIM_EVENT_POLL
+};
+
+/* Параметры моделируемой сети, времена в микросекундах */
+struct sim_config_t
+{
+    /* Задержка доставки в одну сторону и ее случайная добавка */
+    unsigned long latency;
+    unsigned long jitter;
+    /* Вероятность потери порции в миллионных долях: потерянная
+        порция приходит повторно через rto, каждая следующая
+        потеря вдвое позже, как у TCP */
+    unsigned long loss;
+    unsigned long rto;
+    /* Начальное значение генератора случайных чисел */
+    unsigned long seed;
+};
+
+/* Событие на виртуальной шкале времени, события одного момента
+    выполняются в порядке постановки */
+struct sim_event_t
+{
+    unsigned long time;
+    unsigned long seq;
+    int type;
+    struct engine_op_t *op;
+    /* Порция для доставки, нулевой размер - соединение закрыто */
+    char *data;
+    size_t size;
+    /* Предельный срок ожидания записи, 0 - без срока */
+    unsigned long deadline;
+};
+
+/* Сокет, на котором стоит прием */
+struct sim_socket_t
+{
+    struct engine_op_t *op;
+    /* Сокет отслеживается epoll, т.е. конец потока еще не прочитан */
+    int watched;
+    /* Момент последней доставки: порции одного потока
+        не обгоняют друг друга */
+    unsigned long last;
+};
+
+/* Симулятор: операции движка не уходят в ядро, а становятся
+    событиями виртуальной шкалы; данные по-настоящему идут через
+    пары сокетов, но обработчик получает их только в момент,
+    вычисленный по модели сети, поэтому исход прогона зависит
+    только от параметров и начального значения генератора */
+struct sim_t
+{
+    struct sim_config_t config;
+    /* Виртуальное время в микросекундах и номер очередного события */
+    unsigned long now;
+    unsigned long seq;
+    /* Состояние генератора xorshift */
+    unsigned long random;
+    /* Очередь событий - двоичная куча по (time, seq) */
+    struct sim_event_t *heap;
+    size_t count, capacity;
+    /* Сокеты приема по дескриптору и epoll для поиска
+        сокетов, в которые пришли данные */
+    struct sim_socket_t *sockets;
+    unsigned int maxsockets;
+    int epollfd;
+    /* Очередной порт клиента */
+    unsigned int nextport;
+    /* Контекст, доставки которому считаются отдельно: сколько
+        порций сейчас в пути к нему и наибольшее их количество */
+    void *watched;
+    unsigned long inflight, peakinflight;
+    /* Выполнено событий, доставлено порций и байт, потеряно порций */
+    unsigned long events, delivered, bytes, lost;
+    /* Событий в очереди, которые несут данные или вызовы между
+        клиентами, без таймеров и ожиданий записи */
+    unsigned long pending;
+    /* Событие не поместилось в очередь: прогон уже не соответствует
+        протоколу, поэтому останавливается */
+    int failed;
+};
+
+/* Создает симулятор и подключает его к движку вместо io_uring:
+    все клиенты, созданные после этого, работают на виртуальных
+    часах; возвращает ничего, если движок уже запущен */
+struct sim_t *sim_create
+(
+    struct sim_config_t *config
+);
+
+/* Освобождает симулятор вместе с невыполненными событиями */
+void sim_destroy
+(
+    struct sim_t *sim
+);
+
+/* Выполняет очередное событие и переносит в очередь данные,
+    записанные его обработчиком; возвращает 0, если событий нет
+    или прогон прерван нехваткой памяти (failed) */
+int sim_step
+(
+    struct sim_t *sim
+);
+
+/* Вызывает on_call через delay микросекунд виртуального времени */
+void sim_at
+(
+    struct sim_t *sim,
+    unsigned long delay,
+    engine_call_t on_call,
+    void *ctx,
+    void *arg
+);
+
+/* Выдает клиенту порт, уникальный в симуляторе */
+unsigned short sim_port
+(
+    struct sim_t *sim
+);
+
+/* Считает доставки обработчикам с контекстом ctx */
+void sim_watch
+(
+    struct sim_t *sim,
+    void *ctx
+);
+
+/* Возвращает случайное число от 0 до range-1 */
+unsigned long sim_random
+(
+    struct sim_t *sim,
+    unsigned long range
+);
+
+/* Операции движка, вызываются из engine.c */
+/* Ставит операцию: прием данных отслеживается, вызов и ожидание
+    записи становятся событиями */
+void sim_arm
+(
+    struct sim_t *sim,
+    struct engine_op_t *op
+);
+
+/* Отменяет операцию, память освобождается с последним ее событием */
+void sim_cancel
+(
+    struct sim_t *sim,
+    struct engine_op_t *op
+);
+
+/* Служебные процедуры */
+/* Ставит событие в очередь, возвращает 0 или -1, если памяти
+    на очередь не хватило - тогда прогон помечается прерванным,
+    а данные и вызов события освобождает вызвавший */
+int sim_push
+(
+    struct sim_t *sim,
+    struct sim_event_t *event
+);
+
+/* Забирает из очереди ближайшее событие */
+void sim_pop
+(
+    struct sim_t *sim,
+    struct sim_event_t *event
+);
+
+/* Выполняет событие */
+void sim_dispatch
+(
+    struct sim_t *sim,
+    struct sim_event_t *event
+);
+
+/* Забирает данные из сокетов, в которые они пришли, и ставит
+    их доставку по модели сети */
+void sim_pump
+(
+    struct sim_t *sim
+);
+
+/* Читает все пришедшее в сокет порциями движка */
+void sim_drain
+(
+    struct sim_t *sim,
+    int socket
+);
+
+/* Момент доставки очередной порции по сокету */
+unsigned long sim_delivery
+(
+    struct sim_t *sim,
+    int socket
+);
+
+/* Освобождает отмененную операцию без событий */
+void sim_release
+(
+    struct engine_op_t *op
+);
+
+/* Часы показателей: текущее виртуальное время */
+void sim_clock
+(
+    struct timespec *now
+);
+
+#endif /* ifndef SIM_H */
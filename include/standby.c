@@ -0,0 +1,131 @@
+/*
+ ============================================================================
+ Name        : standby.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация зеркала реестра диспетчера у резервных участников
+ ============================================================================
+ */
+
+#ifndef STANDBY_C
+#define STANDBY_C
+
+#include "standby.h"
+
+/* Позиция пробирования для адреса и порта */
+#define STANDBY_HASH(ipaddr, port, capacity) \
+    ((((ipaddr)*2654435761U) ^ ((port)*40503U)) & ((capacity)-1))
+
+/* Возвращает запись участника или свободную запись,
+    на которой его поиск остановился */
+static struct standby_entry_t *standby_probe(struct standby_t *standby,
+    in_addr_t ipaddr, unsigned short port)
+{
+    struct standby_entry_t *entry;
+    unsigned int idx;
+    idx = STANDBY_HASH(ipaddr, port, standby->capacity);
+    while(1)
+    {
+        entry = standby->table + idx;
+        if(!entry->port || (entry->ipaddr == ipaddr && entry->port == port))
+            return entry;
+        idx = (idx+1) & (standby->capacity-1);
+    }
+}
+
+/* Переносит записи в таблицу вдвое большей вместимости */
+static void standby_grow(struct standby_t *standby)
+{
+    struct standby_entry_t *table, *entry;
+    unsigned int i, capacity;
+    table = standby->table;
+    capacity = standby->capacity;
+    standby->table = (struct standby_entry_t *)calloc(capacity*2,
+        sizeof(struct standby_entry_t));
+    if(standby->table == NULL)
+    {
+        standby->table = table;
+        return;
+    }
+    standby->capacity = capacity*2;
+    for(i=0; i<capacity; i++)
+        if(table[i].port)
+        {
+            entry = standby_probe(standby, table[i].ipaddr, table[i].port);
+            *entry = table[i];
+        }
+    free(table);
+}
+
+struct standby_t *standby_create(void)
+{
+    struct standby_t *standby;
+    standby = (struct standby_t *)calloc(1, sizeof(struct standby_t));
+    if(standby == NULL)
+        return NULL;
+    standby->table = (struct standby_entry_t *)calloc(STANDBY_CAPACITY,
+        sizeof(struct standby_entry_t));
+    if(standby->table == NULL)
+    {
+        free(standby);
+        return NULL;
+    }
+    standby->capacity = STANDBY_CAPACITY;
+    return standby;
+}
+
+void standby_destroy(struct standby_t *standby)
+{
+    if(standby == NULL)
+        return;
+    free(standby->table);
+    free(standby);
+}
+
+void standby_update(struct standby_t *standby, in_addr_t ipaddr,
+    unsigned short port, unsigned int distance, unsigned char free)
+{
+    struct standby_entry_t *entry;
+    /* Порт 0 отмечает свободную запись, такого слушателя нет */
+    if(!port)
+        return;
+    /* Держим заполнение таблицы не выше 1/2 */
+    if((standby->used+1)*2 > standby->capacity)
+        standby_grow(standby);
+    entry = standby_probe(standby, ipaddr, port);
+    if(!entry->port)
+    {
+        /* Об ушедшем участнике, которого не видели, помнить нечего */
+        if(distance == STANDBY_GONE)
+            return;
+        entry->ipaddr = ipaddr;
+        entry->port = port;
+        entry->distance = STANDBY_GONE;
+        standby->used++;
+    }
+    if(entry->distance == STANDBY_GONE && distance != STANDBY_GONE)
+        standby->count++;
+    else if(entry->distance != STANDBY_GONE && distance == STANDBY_GONE)
+        standby->count--;
+    entry->distance = distance;
+    entry->free = free;
+}
+
+struct standby_entry_t *standby_find(struct standby_t *standby,
+    in_addr_t ipaddr, unsigned short port)
+{
+    struct standby_entry_t *entry;
+    entry = standby_probe(standby, ipaddr, port);
+    if(!entry->port || entry->distance == STANDBY_GONE)
+        return NULL;
+    return entry;
+}
+
+void standby_clear(struct standby_t *standby)
+{
+    memset(standby->table, 0,
+        standby->capacity*sizeof(struct standby_entry_t));
+    standby->used = standby->count = 0;
+}
+
+#endif /* ifndef STANDBY_C */
@@ -0,0 +1,85 @@
+/*
+ ============================================================================
+ Name        : standby.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок зеркала реестра диспетчера у резервных участников
+ ============================================================================
+ */
+
+#ifndef STANDBY_H
+#define STANDBY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+
+/* Начальная вместимость таблицы зеркала, степень двойки */
+#define STANDBY_CAPACITY             (256)
+/* Удаление ушедшего участника, совпадает с INVALID_DISTANCE */
+#define STANDBY_GONE          (0xFFFFFFFF)
+
+/* Участник в зеркале: адрес и порт слушателя в обычном порядке,
+    удаление от диспетчера и свободные слоты из его последнего
+    сообщения; ушедший участник остается в таблице с удалением
+    STANDBY_GONE и возвращается в оборот, если придет снова */
+struct standby_entry_t
+{
+    in_addr_t ipaddr;
+    unsigned short port;
+    unsigned int distance;
+    unsigned char free;
+};
+
+/* Зеркало реестра диспетчера: хеш-таблица с открытой адресацией
+    по адресу и порту слушателя, записи не удаляются, поэтому
+    цепочки проб не рвутся и надгробия не нужны */
+struct standby_t
+{
+    struct standby_entry_t *table;
+    unsigned int capacity;
+    /* Занятые записи таблицы и участники, которые не ушли */
+    unsigned int used;
+    unsigned int count;
+};
+
+/* Создает пустое зеркало */
+struct standby_t *standby_create
+(
+    void
+);
+
+/* Освобождает зеркало */
+void standby_destroy
+(
+    struct standby_t *standby
+);
+
+/* Применяет изменение реестра диспетчера: участник ipaddr:port
+    теперь на удалении distance (STANDBY_GONE - ушел) и
+    имеет free свободных слотов */
+void standby_update
+(
+    struct standby_t *standby,
+    in_addr_t ipaddr,
+    unsigned short port,
+    unsigned int distance,
+    unsigned char free
+);
+
+/* Ищет участника по адресу и порту слушателя,
+    возвращает ничего, если его нет или он ушел */
+struct standby_entry_t *standby_find
+(
+    struct standby_t *standby,
+    in_addr_t ipaddr,
+    unsigned short port
+);
+
+/* Забывает всех участников */
+void standby_clear
+(
+    struct standby_t *standby
+);
+
+#endif /* ifndef STANDBY_H */
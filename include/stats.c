@@ -0,0 +1,238 @@
+/*
+ ============================================================================
+ Name        : stats.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация показателей рукопожатия и сообщений протокола
+ ============================================================================
+ */
+
+#ifndef STATS_C
+#define STATS_C
+
+#include "stats.h"
+#include "outq.h"
+
+/* Показатели процесса, счетчики меняются атомарно */
+static struct stats_process_t process;
+/* Часы показателей, ничего - CLOCK_MONOTONIC */
+static stats_clock_t clocksource;
+
+/* Имена состояний для отчета */
+static const char *states[STATS_STATES] =
+{
+    "PROTOCOL_STARTED", "WAIT_PLACE", "PLACE_SELECTED",
+    "WAIT_ALL_NEIGHBOR", "IN_PROCESS"
+};
+
+void stats_set_clock(stats_clock_t clock)
+{
+    clocksource = clock;
+}
+
+void stats_now(struct timespec *now)
+{
+    if(clocksource != NULL)
+        clocksource(now);
+    else
+        clock_gettime(CLOCK_MONOTONIC, now);
+}
+
+void stats_init(struct stats_t *stats)
+{
+    memset(stats, 0, sizeof(struct stats_t));
+    stats_now(&stats->created);
+    __atomic_fetch_add(&process.reached[0], 1, __ATOMIC_RELAXED);
+}
+
+void stats_transition(struct stats_t *stats, unsigned int state)
+{
+    unsigned long now;
+    if(state >= STATS_STATES || state == stats->state)
+        return;
+    now = stats_elapsed(&stats->created);
+    /* Время в прошлом состоянии относим к его фазе */
+    stats_histogram_add(process.phases + stats->state,
+        now - stats->entered[stats->state]);
+    stats->entered[state] = now;
+    stats->state = state;
+    __atomic_fetch_add(&process.reached[state], 1, __ATOMIC_RELAXED);
+    if(state == STATS_STATES-1)
+        stats_histogram_add(&process.total, now);
+}
+
+void stats_received(struct stats_t *stats, unsigned int code)
+{
+    if(code >= STATS_CODES)
+        return;
+    __atomic_fetch_add(&stats->received[code], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&process.received[code], 1, __ATOMIC_RELAXED);
+}
+
+void stats_sent(unsigned int code, unsigned int count)
+{
+    if(code < STATS_CODES)
+        __atomic_fetch_add(&process.sent[code], count, __ATOMIC_RELAXED);
+}
+
+unsigned long stats_reached(unsigned int state)
+{
+    if(state >= STATS_STATES)
+        return 0;
+    return __atomic_load_n(&process.reached[state], __ATOMIC_RELAXED);
+}
+
+void stats_histogram_add(struct stats_histogram_t *histogram,
+    unsigned long value)
+{
+    unsigned long max;
+    __atomic_fetch_add(&histogram->buckets[stats_bucket(value)], 1,
+        __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+    while(value > max && !__atomic_compare_exchange_n(&histogram->max, &max,
+        value, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+unsigned long stats_histogram_percentile(struct stats_histogram_t *histogram,
+    unsigned int percent)
+{
+    unsigned long target, seen = 0;
+    unsigned int i;
+    if(!histogram->count)
+        return 0;
+    /* Округляем вверх, чтобы 100% указывало на последнее значение */
+    target = (histogram->count*percent + 99)/100;
+    for(i=0; i<STATS_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if(seen >= target)
+            return stats_bucket_floor(i);
+    }
+    return histogram->max;
+}
+
+void stats_get_process(struct stats_process_t *copy)
+{
+    /* Копия без блокировок: отдельные счетчики могут
+        разойтись на единицы, для наблюдения это допустимо */
+    memcpy(copy, &process, sizeof(struct stats_process_t));
+}
+
+size_t stats_report(char *buffer, size_t size)
+{
+    struct stats_process_t copy;
+    struct stats_histogram_t *histogram;
+    struct outq_stats_t queues;
+    size_t length = 0;
+    unsigned int i;
+    stats_get_process(&copy);
+    outq_get_stats(&queues);
+    /* Каждая строка - одна фаза, времена в микросекундах */
+    for(i=0; i<=STATS_STATES && length < size; i++)
+    {
+        histogram = i < STATS_STATES ? copy.phases+i : &copy.total;
+        length += snprintf(buffer+length, size-length,
+            "%s reached=%lu count=%lu avg=%lu p50=%lu p90=%lu p99=%lu max=%lu\n",
+            i < STATS_STATES ? states[i] : "TOTAL",
+            i < STATS_STATES ? copy.reached[i] : copy.reached[STATS_STATES-1],
+            histogram->count,
+            histogram->count ? histogram->sum/histogram->count : 0,
+            stats_histogram_percentile(histogram, 50),
+            stats_histogram_percentile(histogram, 90),
+            stats_histogram_percentile(histogram, 99),
+            histogram->max);
+    }
+    for(i=0; i<STATS_CODES && length < size; i++)
+        if(copy.received[i] || copy.sent[i])
+            length += snprintf(buffer+length, size-length,
+                "code=%u received=%lu sent=%lu\n",
+                i, copy.received[i], copy.sent[i]);
+    if(length < size)
+        length += snprintf(buffer+length, size-length,
+            "outq queued=%lu peak=%lu overflows=%lu dropped=%lu skipped=%lu\n",
+            queues.queued, queues.peak, queues.overflows,
+            queues.dropped, queues.skipped);
+    return length < size ? length : size-1;
+}
+
+int stats_serve(const char *path)
+{
+    struct sockaddr_un sa;
+    pthread_attr_t attr;
+    memset(&sa, 0, sizeof(struct sockaddr_un));
+    sa.sun_family = AF_UNIX;
+    strncpy(sa.sun_path, path, sizeof(sa.sun_path)-1);
+    /* Прошлый запуск мог оставить файл сокета */
+    unlink(path);
+    process.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(process.listener < 0)
+        return -1;
+    if(bind(process.listener, (struct sockaddr *)&sa,
+        sizeof(struct sockaddr_un)) < 0 || listen(process.listener, 4) < 0)
+    {
+        close(process.listener);
+        process.listener = -1;
+        return -1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&process.thread, &attr, stats_thread, NULL);
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+unsigned long stats_elapsed(struct timespec *since)
+{
+    struct timespec now;
+    stats_now(&now);
+    return (now.tv_sec - since->tv_sec)*1000000L +
+        (now.tv_nsec - since->tv_nsec)/1000;
+}
+
+unsigned int stats_bucket(unsigned long value)
+{
+    unsigned int exponent = 0;
+    /* Малые значения ложатся в корзины один к одному */
+    if(value < STATS_SUB_BUCKETS)
+        return value;
+    while(value >> (exponent+1))
+        exponent++;
+    /* Старшая степень задает группу, следующие биты - корзину в ней */
+    exponent = (exponent-STATS_SUB_BITS+1)*STATS_SUB_BUCKETS +
+        ((value >> (exponent-STATS_SUB_BITS)) & (STATS_SUB_BUCKETS-1));
+    return exponent < STATS_BUCKETS ? exponent : STATS_BUCKETS-1;
+}
+
+unsigned long stats_bucket_floor(unsigned int bucket)
+{
+    if(bucket < STATS_SUB_BUCKETS)
+        return bucket;
+    return (unsigned long)(STATS_SUB_BUCKETS + bucket%STATS_SUB_BUCKETS) <<
+        (bucket/STATS_SUB_BUCKETS - 1);
+}
+
+void *stats_thread(void *arg)
+{
+    char buffer[STATS_REPORT_SIZE];
+    size_t length, check;
+    ssize_t sent;
+    int socket;
+    (void)arg;
+    while((socket = accept(process.listener, NULL, NULL)) >= 0 ||
+        errno == EINTR)
+    {
+        if(socket < 0)
+            continue;
+        length = stats_report(buffer, sizeof(buffer));
+        for(check = 0; check < length; check += sent)
+            if((sent = send(socket, buffer+check, length-check,
+                MSG_NOSIGNAL)) <= 0)
+                    break;
+        close(socket);
+    }
+    return NULL;
+}
+
+#endif /* ifndef STATS_C */
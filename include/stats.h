@@ -0,0 +1,186 @@
+/*
+ ============================================================================
+ Name        : stats.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок показателей рукопожатия и сообщений протокола
+ ============================================================================
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Количество состояний протокола (PROTOCOL_STARTED..IN_PROCESS) */
+#define STATS_STATES                   (5)
+/* Предел кодов сообщений TCP, которые считаются отдельно */
+#define STATS_CODES                   (32)
+/* Линейных корзин внутри каждой степени двойки (2^bits) */
+#define STATS_SUB_BITS                 (2)
+#define STATS_SUB_BUCKETS   (1 << STATS_SUB_BITS)
+/* Корзин гистограммы, последняя собирает все, что больше
+    2^32 микросекунд */
+#define STATS_BUCKETS                (128)
+/* Размер текстового отчета сокета показателей */
+#define STATS_REPORT_SIZE           (8192)
+
+/* Источник текущего времени показателей */
+typedef void (*stats_clock_t)(struct timespec *now);
+
+/* Гистограмма задержек в микросекундах: корзины растут по
+    степеням двойки и делятся внутри линейно, поэтому
+    погрешность не превышает четверти значения */
+struct stats_histogram_t
+{
+    unsigned long buckets[STATS_BUCKETS];
+    unsigned long count, sum, max;
+};
+
+/* Показатели рукопожатия одного клиента */
+struct stats_t
+{
+    /* Момент создания клиента */
+    struct timespec created;
+    /* Время входа в каждое состояние от создания клиента
+        в микросекундах, 0 - в состоянии клиент не был */
+    unsigned long entered[STATS_STATES];
+    /* Текущее состояние */
+    unsigned int state;
+    /* Принятые сообщения по кодам */
+    unsigned long received[STATS_CODES];
+};
+
+/* Показатели процесса, накапливаются всеми клиентами */
+struct stats_process_t
+{
+    /* Время, проведенное в каждом состоянии до перехода в
+        следующее, и полное время до IN_PROCESS */
+    struct stats_histogram_t phases[STATS_STATES];
+    struct stats_histogram_t total;
+    /* Сколько раз клиенты входили в каждое состояние */
+    unsigned long reached[STATS_STATES];
+    /* Принятые и отправленные сообщения по кодам */
+    unsigned long received[STATS_CODES];
+    unsigned long sent[STATS_CODES];
+    /* Сокет показателей и его нить */
+    int listener;
+    pthread_t thread;
+};
+
+/* Задает часы показателей, ничего - CLOCK_MONOTONIC; симулятор
+    подставляет свое виртуальное время */
+void stats_set_clock
+(
+    stats_clock_t clock
+);
+
+/* Текущее время по часам показателей */
+void stats_now
+(
+    struct timespec *now
+);
+
+/* Начинает отсчет рукопожатия клиента */
+void stats_init
+(
+    struct stats_t *stats
+);
+
+/* Отмечает переход клиента в состояние state */
+void stats_transition
+(
+    struct stats_t *stats,
+    unsigned int state
+);
+
+/* Считает принятое клиентом сообщение */
+void stats_received
+(
+    struct stats_t *stats,
+    unsigned int code
+);
+
+/* Считает отправленное сообщение (только в процессе,
+    отправка не знает клиента) */
+void stats_sent
+(
+    unsigned int code,
+    unsigned int count
+);
+
+/* Возвращает, сколько раз клиенты процесса входили в состояние state */
+unsigned long stats_reached
+(
+    unsigned int state
+);
+
+/* Добавляет значение в гистограмму */
+void stats_histogram_add
+(
+    struct stats_histogram_t *histogram,
+    unsigned long value
+);
+
+/* Возвращает нижнюю границу корзины, в которую попадает
+    percent процентов значений гистограммы */
+unsigned long stats_histogram_percentile
+(
+    struct stats_histogram_t *histogram,
+    unsigned int percent
+);
+
+/* Копирует показатели процесса */
+void stats_get_process
+(
+    struct stats_process_t *process
+);
+
+/* Пишет текстовый отчет о показателях процесса в buffer,
+    возвращает его длину */
+size_t stats_report
+(
+    char *buffer,
+    size_t size
+);
+
+/* Открывает локальный сокет показателей по пути path, каждое
+    подключение получает отчет, возвращает 0 или -1 при ошибке */
+int stats_serve
+(
+    const char *path
+);
+
+/* Служебные процедуры */
+/* Микросекунды, прошедшие с момента since */
+unsigned long stats_elapsed
+(
+    struct timespec *since
+);
+
+/* Номер корзины для значения */
+unsigned int stats_bucket
+(
+    unsigned long value
+);
+
+/* Нижняя граница корзины */
+unsigned long stats_bucket_floor
+(
+    unsigned int bucket
+);
+
+/* Нить сокета показателей */
+void *stats_thread
+(
+    void *arg
+);
+
+#endif /* ifndef STATS_H */
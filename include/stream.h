@@ -0,0 +1,40 @@
+/*
+ ============================================================================
+ Name        : stream.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок буфера сборки кадров из потока TCP
+ ============================================================================
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stddef.h>
+
+/* Наибольший собираемый кадр: заголовок и данные сообщения,
+    более длинные кадры пропускаются */
+#define STREAM_SIZE                   (64)
+
+/* Сбрасывает сборку кадров нового соединения */
+#define STREAM_RESET(stream) \
+    ((stream)->size = (stream)->skip = (stream)->body = 0)
+
+/* Недособранный кадр соединения, накапливается между
+    порциями данных, которые приходят из потока TCP */
+struct stream_t
+{
+    char data[STREAM_SIZE];
+    size_t size;
+    /* Сколько байт пропускаемого кадра еще не пришло */
+    size_t skip;
+    /* Потоковый кадр (полезная нагрузка) не собирается, а выдается
+        порциями прямо из принятых данных: сколько байт его тела еще
+        не пришло и сколько байт сообщения идет после этого кадра */
+    size_t body;
+    size_t rest;
+    /* Код потокового кадра, его заголовок и поля лежат в data */
+    unsigned int code;
+};
+
+#endif /* ifndef STREAM_H */
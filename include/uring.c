@@ -0,0 +1,184 @@
+/*
+ ============================================================================
+ Name        : uring.c
+ Author      : float.cat
+ Version     : 0.31
+ Description : Реализация минимальной обертки над io_uring без liburing
+ ============================================================================
+ */
+
+#ifndef URING_C
+#define URING_C
+
+#include "uring.h"
+
+int uring_init(struct uring_t *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    char *sq, *cq;
+    memset(ring, 0, sizeof(struct uring_t));
+    memset(&params, 0, sizeof(struct io_uring_params));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if(ring->fd < 0)
+    {
+        /* Ядро без io_uring или запрет политикой безопасности */
+        ring->fd = -1;
+        return -1;
+    }
+    ring->features = params.features;
+    /* Отображаем кольцо отправки, его массив индексов и записи */
+    ring->sqsize = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+    ring->cqsize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    /* При IORING_FEAT_SINGLE_MMAP оба кольца в одной области */
+    if(ring->features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cqsize > ring->sqsize)
+            ring->sqsize = ring->cqsize;
+        ring->cqsize = ring->sqsize;
+    }
+    ring->sqptr = mmap(NULL, ring->sqsize, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sqptr == MAP_FAILED)
+    {
+        close(ring->fd);
+        ring->fd = -1;
+        return -1;
+    }
+    if(ring->features & IORING_FEAT_SINGLE_MMAP)
+        ring->cqptr = ring->sqptr;
+    else
+        ring->cqptr = mmap(NULL, ring->cqsize, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqesize = params.sq_entries*sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqesize,
+        PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->fd,
+        IORING_OFF_SQES);
+    if(ring->cqptr == MAP_FAILED || (void *)ring->sqes == MAP_FAILED)
+    {
+        uring_release(ring);
+        return -1;
+    }
+    sq = (char *)ring->sqptr;
+    cq = (char *)ring->cqptr;
+    ring->sqhead = (unsigned int *)(sq + params.sq_off.head);
+    ring->sqtail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sqmask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sqarray = (unsigned int *)(sq + params.sq_off.array);
+    ring->sqentries = params.sq_entries;
+    ring->sqlocal = *ring->sqtail;
+    ring->cqhead = (unsigned int *)(cq + params.cq_off.head);
+    ring->cqtail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cqmask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+int uring_supported(struct uring_t *ring, const unsigned char *opcodes,
+    unsigned int count)
+{
+    struct io_uring_probe *probe;
+    unsigned int i;
+    int retval = 1;
+    probe = (struct io_uring_probe *)calloc(1, sizeof(struct io_uring_probe) +
+        URING_PROBE_OPS*sizeof(struct io_uring_probe_op));
+    if(probe == NULL)
+        return 0;
+    if(syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+        probe, URING_PROBE_OPS) < 0)
+            retval = 0;
+    for(i=0; retval && i<count; i++)
+        if(opcodes[i] > probe->last_op ||
+            !(probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED))
+                retval = 0;
+    free(probe);
+    return retval;
+}
+
+void uring_release(struct uring_t *ring)
+{
+    if(ring->fd < 0)
+        return;
+    if(ring->sqes != NULL && (void *)ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqesize);
+    if(ring->cqptr != NULL && ring->cqptr != MAP_FAILED &&
+        ring->cqptr != ring->sqptr)
+            munmap(ring->cqptr, ring->cqsize);
+    munmap(ring->sqptr, ring->sqsize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring_t *ring)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int head, idx;
+    head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+    /* Очередь заполнена, пока ядро не заберет записи */
+    if(ring->sqlocal - head >= ring->sqentries)
+        return NULL;
+    idx = ring->sqlocal & *ring->sqmask;
+    sqe = ring->sqes + idx;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqarray[idx] = idx;
+    ring->sqlocal++;
+    ring->tosubmit++;
+    return sqe;
+}
+
+struct io_uring_sqe *uring_unget_sqe(struct uring_t *ring)
+{
+    unsigned int head;
+    head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+    if(ring->sqlocal == head)
+        return NULL;
+    /* Ядро забирает записи только в io_uring_enter и по порядку,
+        поэтому непринятые записи - хвост очереди */
+    ring->sqlocal--;
+    if(ring->tosubmit)
+        ring->tosubmit--;
+    __atomic_store_n(ring->sqtail, ring->sqlocal, __ATOMIC_RELEASE);
+    return ring->sqes + ring->sqarray[ring->sqlocal & *ring->sqmask];
+}
+
+unsigned int uring_flush(struct uring_t *ring)
+{
+    unsigned int submit;
+    submit = ring->tosubmit;
+    /* Публикуем хвост очереди после заполнения записей */
+    __atomic_store_n(ring->sqtail, ring->sqlocal, __ATOMIC_RELEASE);
+    ring->tosubmit = 0;
+    return submit;
+}
+
+int uring_enter(struct uring_t *ring, unsigned int submit, unsigned int waitnr)
+{
+    int result;
+    /* Прерывание сигналом возвращается, только если ядро
+        не забрало ни одной записи, поэтому повторяем вызов целиком */
+    do
+        result = syscall(__NR_io_uring_enter, ring->fd, submit, waitnr,
+            waitnr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    while(result < 0 && errno == EINTR);
+    return result;
+}
+
+int uring_submit(struct uring_t *ring, unsigned int waitnr)
+{
+    return uring_enter(ring, uring_flush(ring), waitnr);
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring_t *ring)
+{
+    unsigned int head;
+    head = *ring->cqhead;
+    if(head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return ring->cqes + (head & *ring->cqmask);
+}
+
+void uring_cqe_seen(struct uring_t *ring)
+{
+    __atomic_store_n(ring->cqhead, *ring->cqhead+1, __ATOMIC_RELEASE);
+}
+
+#endif /* ifndef URING_C */
@@ -0,0 +1,124 @@
+/*
+ ============================================================================
+ Name        : uring.h
+ Author      : float.cat
+ Version     : 0.31
+ Description : Заголовок минимальной обертки над io_uring без liburing
+ ============================================================================
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* Размер очереди отправки по умолчанию */
+#define URING_ENTRIES                (256)
+/* Количество операций в ответе IORING_REGISTER_PROBE */
+#define URING_PROBE_OPS              (256)
+
+/* Кольца отправки и завершения, отображенные из ядра */
+struct uring_t
+{
+    /* Дескриптор io_uring, -1 если ядро не поддерживает */
+    int fd;
+    /* Очередь отправки */
+    unsigned int *sqhead, *sqtail, *sqmask, *sqarray;
+    struct io_uring_sqe *sqes;
+    /* Локальный хвост очереди отправки и количество
+        еще не переданных ядру записей */
+    unsigned int sqlocal, tosubmit;
+    unsigned int sqentries;
+    /* Очередь завершения */
+    unsigned int *cqhead, *cqtail, *cqmask;
+    struct io_uring_cqe *cqes;
+    /* Отображенные области для освобождения */
+    void *sqptr, *cqptr;
+    size_t sqsize, cqsize, sqesize;
+    /* Возможности ядра */
+    unsigned int features;
+};
+
+/* Создает io_uring на заданное количество записей,
+    возвращает 0 при успехе и -1, если io_uring недоступен */
+int uring_init
+(
+    struct uring_t *ring,
+    unsigned int entries
+);
+
+/* Проверяет через IORING_REGISTER_PROBE, что ядро знает все count
+    операций opcodes, возвращает 1, если знает, и 0, если нет или
+    ядро не умеет отвечать на запрос */
+int uring_supported
+(
+    struct uring_t *ring,
+    const unsigned char *opcodes,
+    unsigned int count
+);
+
+/* Освобождает io_uring */
+void uring_release
+(
+    struct uring_t *ring
+);
+
+/* Возвращает обнуленную запись очереди отправки
+    или ничего, если очередь заполнена */
+struct io_uring_sqe *uring_get_sqe
+(
+    struct uring_t *ring
+);
+
+/* Забирает обратно последнюю запись, которую ядро еще не приняло,
+    и возвращает ее или ничего, если ядро приняло все записи */
+struct io_uring_sqe *uring_unget_sqe
+(
+    struct uring_t *ring
+);
+
+/* Публикует накопленные записи для ядра, возвращает их количество,
+    используется, когда вызов io_uring_enter выполняется вне блокировки */
+unsigned int uring_flush
+(
+    struct uring_t *ring
+);
+
+/* Вызывает io_uring_enter для submit опубликованных записей
+    и ожидания не менее waitnr завершений */
+int uring_enter
+(
+    struct uring_t *ring,
+    unsigned int submit,
+    unsigned int waitnr
+);
+
+/* Передает ядру накопленные записи одним системным вызовом
+    и ждет не менее waitnr завершений, возвращает результат
+    io_uring_enter */
+int uring_submit
+(
+    struct uring_t *ring,
+    unsigned int waitnr
+);
+
+/* Возвращает очередное завершение или ничего,
+    если очередь завершения пуста */
+struct io_uring_cqe *uring_peek_cqe
+(
+    struct uring_t *ring
+);
+
+/* Отмечает завершение как обработанное */
+void uring_cqe_seen
+(
+    struct uring_t *ring
+);
+
+#endif /* ifndef URING_H */
@@ -1,12 +1,52 @@
 #include "include/client.h"
 
-int main(void)
+int main(int argc, char *argv[])
 {
-    /* Тестовая главная процедура 
-        ждет 50 секунд перед отключением */
-    struct client_t *client;
-    client = client_create();
+    /* Тестовая главная процедура
+        ждет 50 секунд перед отключением,
+        ключ -u переводит клиент на движок io_uring,
+        ключ -n N запускает в процессе N клиентов (режим хоста),
+        ключ -t N задает количество нитей движка (0 - по числу ядер),
+        ключ -q drop|skip задает политику переполнения очередей
+        отправки (сбросить соседа или перестать пересылать ему),
+        ключ -s путь открывает локальный сокет показателей */
+    struct client_t **clients;
+    int opt, i, count = 1, uring = 0;
+    unsigned int shards = 0;
+    while((opt = getopt(argc, argv, "un:t:q:s:")) != -1)
+    {
+        if(opt == 'u')
+            uring = 1;
+        else if(opt == 'n')
+            count = atoi(optarg);
+        else if(opt == 't')
+            shards = atoi(optarg);
+        else if(opt == 'q')
+            outq_configure(strcmp(optarg, "skip") == 0 ?
+                OUTQ_POLICY_SKIP : OUTQ_POLICY_DROP, OUTQ_HIGHWATER);
+        else if(opt == 's' && stats_serve(optarg) < 0)
+            printf("Сокет показателей %s не открыт\n", optarg);
+    }
+    if(count < 1)
+        count = 1;
+    /* В режиме хоста клиенты делят нити движка, а не заводят
+        по три собственных */
+    if(count > 1)
+        uring = 1;
+    /* Одному клиенту хватает одной нити движка */
+    else if(shards == 0)
+        shards = 1;
+    if(uring && engine_start(shards) < 0)
+        printf("io_uring недоступен, работаем на нитях\n");
+    clients = (struct client_t **)malloc(sizeof(struct client_t *)*count);
+    for(i=0; i<count; i++)
+        clients[i] = client_create();
     sleep(50);
-    client_destroy(client);
+    for(i=0; i<count; i++)
+        client_destroy(clients[i]);
+    free(clients);
+    /* После клиентов останавливаются общие нити процесса */
+    engine_stop();
+    log_stop();
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,323 @@
+#include "include/client.h"
+#include "include/protocol.h"
+
+/* Наибольшее количество замеров в файле сравнения */
+#define MICRO_MAX                     (128)
+/* Длина имени замера */
+#define MICRO_NAME                     (48)
+
+/* Имена сообщений по кодам */
+#define MICRO_MSG_NAME(code, name, unit, dialog, slot) #name,
+static const char *micro_names[MSG_CODES] =
+{
+    MSG_TABLE(MICRO_MSG_NAME, MSG_NO_FIELD, MSG_NO_END)
+};
+
+/* Замер: имя, время операции и байты, обработанные за операцию */
+struct micro_result_t
+{
+    char name[MICRO_NAME];
+    double ns;
+    unsigned long bytes;
+};
+
+/* Параметры прогона, итоги и замеры, с которыми идет сравнение */
+struct micro_t
+{
+    /* Операций в одном повторе и повторов, из которых берется лучший */
+    unsigned long iterations;
+    unsigned int repeats;
+    /* Подстрока имени, только такие замеры выполняются */
+    const char *only;
+    struct micro_result_t results[MICRO_MAX];
+    unsigned int count;
+    struct micro_result_t baseline[MICRO_MAX];
+    unsigned int basecount;
+};
+
+/* Результаты вызовов складываются сюда, чтобы компилятор
+    не выбросил замеряемую работу */
+static volatile unsigned long micro_sink;
+
+static double micro_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec*1e9 + now.tv_nsec;
+}
+
+/* Ищет замер name в сравнении */
+static struct micro_result_t *micro_find(struct micro_t *micro,
+    const char *name)
+{
+    unsigned int i;
+    for(i=0; i<micro->basecount; i++)
+        if(strcmp(micro->baseline[i].name, name) == 0)
+            return micro->baseline + i;
+    return NULL;
+}
+
+/* Печатает замер, при сравнении - вместе с ускорением */
+static void micro_report(struct micro_t *micro, const char *name,
+    double ns, size_t bytes)
+{
+    struct micro_result_t *result, *base;
+    if(micro->count == MICRO_MAX)
+        return;
+    result = micro->results + micro->count++;
+    strncpy(result->name, name, MICRO_NAME-1);
+    result->ns = ns;
+    result->bytes = bytes;
+    printf("%-32s %9.2f ns/op %9.2f Mops/s", name, ns, 1e3/ns);
+    if(bytes)
+        printf(" %9.1f MB/s", bytes*1e3/ns);
+    else
+        printf(" %15s", "");
+    if((base = micro_find(micro, name)) != NULL)
+        printf("  base %9.2f ns/op  x%.2f", base->ns, base->ns/ns);
+    printf("\n");
+}
+
+/* Проверяет, выбран ли замер name */
+static int micro_selected(struct micro_t *micro, const char *name)
+{
+    return micro->only == NULL || strstr(name, micro->only) != NULL;
+}
+
+/* Кодирует сообщение code и возвращает размер кадра */
+static size_t micro_frame(msg_code_t code, char *msg)
+{
+    union msg_data_t data;
+    memset(&data, 0x5A, sizeof(union msg_data_t));
+    return msg_encode(code, msg, &data);
+}
+
+/* Кодирование и декодирование каждого сообщения */
+static void micro_codec(struct micro_t *micro)
+{
+    char msg[TCP_BUNDLE_SIZE], name[MICRO_NAME];
+    union msg_data_t data;
+    unsigned long i, sum;
+    unsigned int r;
+    msg_code_t code;
+    size_t size;
+    double started, best;
+    for(code=0; code<MSG_CODES; code++)
+    {
+        sprintf(name, "encode/%s", micro_names[code]);
+        if(micro_selected(micro, name))
+        {
+            memset(&data, 0x5A, sizeof(union msg_data_t));
+            size = msg_encode(code, msg, &data);
+            best = 0;
+            for(r=0; r<micro->repeats; r++)
+            {
+                sum = 0;
+                started = micro_now();
+                for(i=0; i<micro->iterations; i++)
+                {
+                    data.stream.rest = i;
+                    sum += msg_encode(code, msg, &data);
+                }
+                started = micro_now() - started;
+                micro_sink += sum + msg[size-1];
+                if(!r || started < best)
+                    best = started;
+            }
+            micro_report(micro, name, best/micro->iterations, size);
+        }
+        sprintf(name, "decode/%s", micro_names[code]);
+        if(micro_selected(micro, name))
+        {
+            size = micro_frame(code, msg);
+            best = 0;
+            for(r=0; r<micro->repeats; r++)
+            {
+                sum = 0;
+                started = micro_now();
+                for(i=0; i<micro->iterations; i++)
+                {
+                    msg_decode(code, msg + MSG_HEADER_SIZE,
+                        size - MSG_HEADER_SIZE, &data);
+                    sum += data.code;
+                }
+                started = micro_now() - started;
+                micro_sink += sum;
+                if(!r || started < best)
+                    best = started;
+            }
+            micro_report(micro, name, best/micro->iterations, size);
+        }
+    }
+    if(micro_selected(micro, "size_of_msg_tcp_data"))
+    {
+        best = 0;
+        for(r=0; r<micro->repeats; r++)
+        {
+            sum = 0;
+            started = micro_now();
+            for(i=0; i<micro->iterations; i++)
+                sum += size_of_msg_tcp_data(i % MSG_CODES);
+            started = micro_now() - started;
+            micro_sink += sum;
+            if(!r || started < best)
+                best = started;
+        }
+        micro_report(micro, "size_of_msg_tcp_data",
+            best/micro->iterations, 0);
+    }
+}
+
+/* Поиск общих соседей для каждой позиции у клиента со всеми
+    готовыми слотами - наибольший набор */
+static void micro_neighbors(struct micro_t *micro, struct client_t *client)
+{
+    unsigned int slotids[NUMBER_SLOTS], actslotids[NUMBER_SLOTS];
+    char name[MICRO_NAME];
+    unsigned long i, sum;
+    unsigned int slotid, r;
+    double started, best;
+    for(i=0; i<NUMBER_SLOTS; i++)
+        client->slots[i].status = SLOT_STATUS_READY;
+    for(slotid=0; slotid<NUMBER_SLOTS; slotid++)
+    {
+        sprintf(name, "neighbors/%u", slotid);
+        if(!micro_selected(micro, name))
+            continue;
+        best = 0;
+        for(r=0; r<micro->repeats; r++)
+        {
+            sum = 0;
+            started = micro_now();
+            for(i=0; i<micro->iterations; i++)
+                sum += get_neighbors_by_slot(client, slotid,
+                    slotids, actslotids);
+            started = micro_now() - started;
+            micro_sink += sum + slotids[0] + actslotids[0];
+            if(!r || started < best)
+                best = started;
+        }
+        micro_report(micro, name, best/micro->iterations, 0);
+    }
+}
+
+/* Поиск свободного слота, когда первый свободный - first, и когда
+    свободных нет (first равен NUMBER_SLOTS) */
+static void micro_slots(struct micro_t *micro, struct client_t *client)
+{
+    char name[MICRO_NAME];
+    unsigned long i, sum;
+    unsigned int first, r;
+    double started, best;
+    for(first=0; first<=NUMBER_SLOTS; first++)
+    {
+        if(first < NUMBER_SLOTS)
+            sprintf(name, "free_slot/%u", first);
+        else
+            sprintf(name, "free_slot/none");
+        if(!micro_selected(micro, name))
+            continue;
+        for(i=0; i<NUMBER_SLOTS; i++)
+            client->slots[i].status = i < first ?
+                SLOT_STATUS_READY : SLOT_STATUS_FREE;
+        best = 0;
+        for(r=0; r<micro->repeats; r++)
+        {
+            sum = 0;
+            started = micro_now();
+            for(i=0; i<micro->iterations; i++)
+                sum += client_has_free_slot(client);
+            started = micro_now() - started;
+            micro_sink += sum;
+            if(!r || started < best)
+                best = started;
+        }
+        micro_report(micro, name, best/micro->iterations, 0);
+    }
+}
+
+/* Загружает замеры для сравнения, возвращает -1 при ошибке */
+static int micro_load(struct micro_t *micro, const char *path)
+{
+    struct micro_result_t *base;
+    FILE *file;
+    if((file = fopen(path, "r")) == NULL)
+        return -1;
+    while(micro->basecount < MICRO_MAX)
+    {
+        base = micro->baseline + micro->basecount;
+        if(fscanf(file, "%47s %lf %lu", base->name, &base->ns,
+            &base->bytes) != 3)
+                break;
+        micro->basecount++;
+    }
+    fclose(file);
+    return 0;
+}
+
+/* Сохраняет замеры для будущего сравнения */
+static int micro_save(struct micro_t *micro, const char *path)
+{
+    unsigned int i;
+    FILE *file;
+    if((file = fopen(path, "w")) == NULL)
+        return -1;
+    for(i=0; i<micro->count; i++)
+        fprintf(file, "%s %.3f %lu\n", micro->results[i].name,
+            micro->results[i].ns, micro->results[i].bytes);
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    /* Замеры горячих процедур протокола в наносекундах на операцию:
+        кодирование и декодирование каждого сообщения, размер данных
+        по коду, общие соседи для каждой позиции и поиск свободного
+        слота; ключ -i N задает количество операций в повторе,
+        ключ -r N - количество повторов (берется лучший),
+        ключ -f строка выбирает замеры по подстроке имени,
+        ключ -o файл сохраняет замеры, ключ -c файл сравнивает с
+        сохраненными раньше: ускорение - отношение прежнего времени
+        к нынешнему */
+    static struct micro_t micro;
+    struct client_t *client;
+    const char *save = NULL, *compare = NULL;
+    int opt;
+    micro.iterations = 10000000;
+    micro.repeats = 5;
+    while((opt = getopt(argc, argv, "i:r:f:o:c:")) != -1)
+    {
+        if(opt == 'i')
+            micro.iterations = strtoul(optarg, NULL, 10);
+        else if(opt == 'r')
+            micro.repeats = atoi(optarg);
+        else if(opt == 'f')
+            micro.only = optarg;
+        else if(opt == 'o')
+            save = optarg;
+        else if(opt == 'c')
+            compare = optarg;
+    }
+    if(!micro.iterations)
+        micro.iterations = 1;
+    if(!micro.repeats)
+        micro.repeats = 1;
+    if(compare != NULL && micro_load(&micro, compare) < 0)
+    {
+        printf("Файл сравнения %s не открыт\n", compare);
+        return EXIT_FAILURE;
+    }
+    /* Слоты заполняются самими замерами, клиент в сети не участвует */
+    client = (struct client_t *)calloc(1, sizeof(struct client_t));
+    micro_codec(&micro);
+    micro_neighbors(&micro, client);
+    micro_slots(&micro, client);
+    free(client);
+    if(save != NULL && micro_save(&micro, save) < 0)
+    {
+        printf("Файл замеров %s не записан\n", save);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
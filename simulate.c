@@ -0,0 +1,264 @@
+#include "include/client.h"
+#include "include/protocol.h"
+
+/* Порядок подключения клиентов к диспетчеру */
+enum
+{
+    /* Все сразу */
+    JOIN_BURST,
+    /* Друг за другом через равный промежуток */
+    JOIN_STAGGERED,
+    /* В случайные моменты окна из nodes промежутков */
+    JOIN_RANDOM
+};
+
+/* Прогон симулятора */
+struct run_t
+{
+    struct sim_t *sim;
+    struct client_t **nodes;
+    unsigned int count, joined;
+    /* Клиенты, которым не хватило дескрипторов на пару сокетов
+        с диспетчером: они никогда не займут место */
+    unsigned int orphans;
+    /* Момент подключения последнего клиента и сборки всей матрицы */
+    unsigned long lastjoin, full;
+    /* Готовые слоты без ответного слота у соседа в конце сборки */
+    unsigned int mismatched;
+    /* Отказ диспетчера после сборки матрицы: момент отказа, возврата
+        всех участников к наследнику и места нового клиента */
+    int kill;
+    unsigned long killed, failover, rejoin;
+};
+
+/* Подключает очередного клиента, arg - его номер */
+static void run_join(void *ctx, void *arg, int socket)
+{
+    struct run_t *run = (struct run_t *)ctx;
+    unsigned long i = (unsigned long)arg;
+    (void)socket;
+    run->nodes[i] = client_create();
+    /* Клиент, подключенный после отказа диспетчера, замеряется отдельно */
+    if(i == run->count)
+        return;
+    if(run->nodes[i]->sockTCP < 0)
+        run->orphans++;
+    run->joined++;
+    run->lastjoin = run->sim->now;
+    /* Диспетчер - первый клиент, доставки к нему считаем отдельно */
+    if(i == 0)
+        sim_watch(run->sim, run->nodes[0]);
+}
+
+/* Считает готовые слоты, которым не отвечает готовый слот соседа
+    на противоположной позиции с портом этого клиента */
+static unsigned int run_mismatches(struct run_t *run)
+{
+    struct client_t *node, *peer;
+    struct slot_t *slot, *back;
+    unsigned int i, j, count = 0;
+    for(i=0; i<=run->count; i++)
+    {
+        if((node = run->nodes[i]) == NULL)
+            continue;
+        for(j=0; j<NUMBER_SLOTS; j++)
+        {
+            slot = node->slots + j;
+            if(slot->status != SLOT_STATUS_READY)
+                continue;
+            peer = host_find_client(slot->port);
+            back = peer != NULL ? peer->slots + OPPOSITE_POSITION(j) : NULL;
+            if(back == NULL || back->status != SLOT_STATUS_READY ||
+                back->port != node->portTCP)
+                    count++;
+        }
+    }
+    return count;
+}
+
+/* Проверяет, что все клиенты заняли места, в пути не осталось
+    сообщений, и каждое соединение готово с обеих сторон */
+static int run_complete(struct run_t *run)
+{
+    unsigned int i;
+    if(run->joined < run->count || run->sim->pending ||
+        stats_reached(IN_PROCESS) < (unsigned long)run->count)
+            return 0;
+    for(i=0; i<run->count; i++)
+        if(run->nodes[i]->state.state != IN_PROCESS)
+            return 0;
+    return !run_mismatches(run);
+}
+
+/* Останавливает диспетчера собранной матрицы и ждет, пока все
+    участники вернутся к наследнику, а новый клиент займет место */
+static void run_failover(struct run_t *run, unsigned long limit)
+{
+    struct client_t *heir, *joiner;
+    sim_watch(run->sim, NULL);
+    client_destroy(run->nodes[0]);
+    run->nodes[0] = NULL;
+    run->killed = run->sim->now;
+    /* Сборка закончилась без событий в очереди, поэтому закрытия
+        соединений диспетчера переносим в нее сами */
+    sim_pump(run->sim);
+    while(run->sim->now <= limit && sim_step(run->sim))
+        if((heir = host_find_dispatcher()) != NULL &&
+            heir->dispatcher->mirror == NULL)
+        {
+            run->failover = run->sim->now;
+            break;
+        }
+    if(!run->failover)
+        return;
+    /* Новый клиент находит диспетчера процесса, т.е. наследника */
+    sim_at(run->sim, 0, run_join, run, (void *)(unsigned long)run->count);
+    while(run->sim->now <= limit && sim_step(run->sim))
+        if((joiner = run->nodes[run->count]) != NULL &&
+            joiner->state.state == IN_PROCESS)
+        {
+            run->rejoin = run->sim->now;
+            break;
+        }
+}
+
+int main(int argc, char *argv[])
+{
+    /* Детерминированный прогон протокола на виртуальных часах:
+        ключ -n N задает количество клиентов (первый - диспетчер),
+        ключ -l мкс - задержку доставки в одну сторону,
+        ключ -j мкс - наибольшую случайную добавку к ней,
+        ключ -p процент - потерю порций (повтор через -r мкс,
+        каждый следующий вдвое позже),
+        ключ -o burst|staggered|random - порядок подключения,
+        ключ -i мкс - промежуток между подключениями,
+        ключ -s N - начальное значение генератора,
+        ключ -T с - предел виртуального времени,
+        ключ -k останавливает диспетчера собранной матрицы и
+        замеряет переход к наследнику и подключение нового клиента */
+    struct sim_config_t config;
+    struct run_t run;
+    struct client_t *dispatcher;
+    struct stats_process_t process;
+    struct timespec started, finished;
+    char report[STATS_REPORT_SIZE];
+    unsigned long i, sent = 0, limit = 600, interval = 1000, at;
+    int opt, order = JOIN_BURST;
+    memset(&config, 0, sizeof(struct sim_config_t));
+    memset(&run, 0, sizeof(struct run_t));
+    config.latency = 200;
+    config.jitter = 50;
+    config.rto = 200000;
+    config.seed = 1;
+    run.count = 1000;
+    while((opt = getopt(argc, argv, "n:l:j:p:r:o:i:s:T:k")) != -1)
+    {
+        if(opt == 'n')
+            run.count = atoi(optarg);
+        else if(opt == 'l')
+            config.latency = strtoul(optarg, NULL, 10);
+        else if(opt == 'j')
+            config.jitter = strtoul(optarg, NULL, 10);
+        else if(opt == 'p')
+            config.loss = (unsigned long)(atof(optarg)*10000);
+        else if(opt == 'r')
+            config.rto = strtoul(optarg, NULL, 10);
+        else if(opt == 'o')
+            order = strcmp(optarg, "staggered") == 0 ? JOIN_STAGGERED :
+                strcmp(optarg, "random") == 0 ? JOIN_RANDOM : JOIN_BURST;
+        else if(opt == 'i')
+            interval = strtoul(optarg, NULL, 10);
+        else if(opt == 's')
+            config.seed = strtoul(optarg, NULL, 10);
+        else if(opt == 'T')
+            limit = strtoul(optarg, NULL, 10);
+        else if(opt == 'k')
+            run.kill = 1;
+    }
+    /* Потеря всех порций не дала бы прогону закончиться,
+        а портов на клиентов больше, чем есть, не хватит */
+    if(config.loss >= 1000000)
+        config.loss = 999999;
+    if(run.count < 1)
+        run.count = 1;
+    if(run.count > 0x10000 - SIM_FIRST_PORT)
+        run.count = 0x10000 - SIM_FIRST_PORT;
+    limit *= 1000000;
+    /* Журнал не перемешивается с отчетом в stdout */
+    log_set_output(stderr);
+    if((run.sim = sim_create(&config)) == NULL)
+    {
+        printf("Симулятор не запущен: движок уже работает\n");
+        return EXIT_FAILURE;
+    }
+    /* Место для клиента, который подключится после отказа */
+    run.nodes = (struct client_t **)calloc(run.count + 1,
+        sizeof(struct client_t *));
+    /* Диспетчер подключается первым, остальные - по порядку */
+    for(i=0; i<run.count; i++)
+    {
+        if(i == 0 || order == JOIN_BURST)
+            at = 0;
+        else if(order == JOIN_STAGGERED)
+            at = i*interval;
+        else
+            at = sim_random(run.sim, run.count*interval);
+        sim_at(run.sim, at, run_join, &run, (void *)i);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    while(run.sim->now <= limit && sim_step(run.sim))
+        if(run_complete(&run))
+        {
+            run.full = run.sim->now;
+            break;
+        }
+    run.mismatched = run_mismatches(&run);
+    if(run.full && run.kill)
+        run_failover(&run, limit);
+    log_flush();
+    /* Без потерянного события прогон был бы другим, поэтому
+        его неполный отчет не печатается */
+    if(run.sim->failed)
+    {
+        fprintf(stderr, "Прогон прерван: не хватило памяти на очередь "
+            "событий\n");
+        return EXIT_FAILURE;
+    }
+    stats_get_process(&process);
+    for(i=0; i<STATS_CODES; i++)
+        sent += process.sent[i];
+    printf("nodes=%u joined=%u in_process=%lu seed=%lu\n", run.count,
+        run.joined, stats_reached(IN_PROCESS), config.seed);
+    if(run.orphans)
+        printf("orphans=%u: не хватило дескрипторов, поднимите ulimit -n\n",
+            run.orphans);
+    if(run.full)
+        printf("full_matrix_us=%lu after_last_join_us=%lu\n", run.full,
+            run.full - run.lastjoin);
+    else
+        printf("full_matrix_us=none virtual_us=%lu\n", run.sim->now);
+    printf("mismatched_links=%u\n", run.mismatched);
+    printf("messages=%lu per_join=%.2f\n", sent,
+        run.count > 1 ? (double)sent/(run.count-1) : 0.0);
+    if(run.kill && run.failover)
+        printf("failover_us=%lu rejoin_us=%s%lu\n",
+            run.failover - run.killed, run.rejoin ? "" : "none ",
+            run.rejoin ? run.rejoin - run.failover : run.sim->now);
+    else if(run.kill)
+        printf("failover_us=none virtual_us=%lu\n", run.sim->now);
+    dispatcher = host_find_dispatcher();
+    printf("dispatcher waiting_peak=%u inflight_peak=%lu\n",
+        dispatcher != NULL ? dispatcher->dispatcher->waitingpeak : 0,
+        run.sim->peakinflight);
+    printf("events=%lu delivered=%lu bytes=%lu lost=%lu\n",
+        run.sim->events, run.sim->delivered, run.sim->bytes, run.sim->lost);
+    stats_report(report, sizeof(report));
+    fputs(report, stdout);
+    /* Настоящее время прогона - в поток ошибок, чтобы вывод
+        прогонов с одинаковыми параметрами совпадал */
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    fprintf(stderr, "wall_us=%ld\n",
+        (finished.tv_sec - started.tv_sec)*1000000L +
+        (finished.tv_nsec - started.tv_nsec)/1000);
+    return run.full ? EXIT_SUCCESS : EXIT_FAILURE;
+}